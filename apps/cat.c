@@ -17,13 +17,22 @@
 #include <string.h>
 #include <errno.h>
 #include <sys/stat.h>
+#include <sys/sendfile.h>
 
 #define CHUNK_SIZE 4096
+#define SENDFILE_SIZE 0x10000
 
 static char * _argv_0;
 static char * _file;
 
 void doit(int fd) {
+	/* Have the kernel copy straight to stdout if it can */
+	while (1) {
+		ssize_t r = sendfile(STDOUT_FILENO, fd, NULL, SENDFILE_SIZE);
+		if (!r) return;
+		if (r < 0) break;
+	}
+
 	while (1) {
 		char buf[CHUNK_SIZE];
 		memset(buf, 0, CHUNK_SIZE);
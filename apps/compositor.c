@@ -137,6 +137,116 @@ static int next_buf_id(void) {
 	return _next++;
 }
 
+/**
+ * Message rings shared with a client; see yutani-internal.h.
+ */
+typedef struct {
+	yutani_rings_t * rings;
+	uint32_t bufid;
+	int doorbell_owed;
+	int broken;
+} client_rings_t;
+
+static client_rings_t * client_rings_create(yutani_globals_t * yg) {
+	client_rings_t * cr = malloc(sizeof(client_rings_t));
+	cr->bufid = next_buf_id();
+	cr->doorbell_owed = 0;
+	cr->broken = 0;
+
+	char key[1024];
+	YUTANI_SHMKEY_EXP(yg->server_ident, key, 1024, cr->bufid);
+	size_t size = sizeof(yutani_rings_t);
+	cr->rings = shm_obtain(key, &size);
+	yutani_ring_init(&cr->rings->to_server);
+	yutani_ring_init(&cr->rings->to_client);
+
+	return cr;
+}
+
+static void client_rings_release(yutani_globals_t * yg, uintptr_t client) {
+	client_rings_t * cr = hashmap_get(yg->clients_to_rings, (void *)client);
+	if (!cr) return;
+
+	char key[1024];
+	YUTANI_SHMKEY_EXP(yg->server_ident, key, 1024, cr->bufid);
+	shm_release(key);
+
+	if (cr->doorbell_owed) yg->doorbells_owed--;
+	hashmap_remove(yg->clients_to_rings, (void *)client);
+	free(cr);
+}
+
+static void client_ring_doorbell(yutani_globals_t * yg, uintptr_t client, client_rings_t * cr) {
+	yutani_msg_buildx_ring_doorbell_alloc(m);
+	yutani_msg_buildx_ring_doorbell(m);
+	if (pex_send(yg->server, client, m->size, (char *)m) == sizeof(pex_header_t) + m->size) {
+		cr->doorbell_owed = 0;
+		yg->doorbells_owed--;
+	}
+}
+
+/**
+ * Send a message to a client, through its ring if it has one.
+ * A client whose ring is full misses the message, as it would if
+ * its socket were full. A doorbell that can't be delivered is
+ * owed until retry_doorbells gets it through.
+ */
+static void send_to_client(yutani_globals_t * yg, uintptr_t client, yutani_msg_t * msg) {
+	client_rings_t * cr = hashmap_get(yg->clients_to_rings, (void *)client);
+	if (!cr || cr->broken) {
+		pex_send(yg->server, client, msg->size, (char *)msg);
+		return;
+	}
+
+	if (yutani_ring_write(&cr->rings->to_client, msg) > 0 && !cr->doorbell_owed) {
+		cr->doorbell_owed = 1;
+		yg->doorbells_owed++;
+	}
+
+	if (cr->doorbell_owed) {
+		client_ring_doorbell(yg, client, cr);
+	}
+}
+
+/**
+ * Try again to send any doorbells a full socket turned away. The
+ * client has stopped reading its ring until it gets one, so this
+ * can't wait for the next message to that client.
+ */
+static void retry_doorbells(yutani_globals_t * yg) {
+	if (!yg->doorbells_owed) return;
+	list_t * clients = hashmap_keys(yg->clients_to_rings);
+	foreach(node, clients) {
+		client_rings_t * cr = hashmap_get(yg->clients_to_rings, node->value);
+		if (cr->doorbell_owed) {
+			client_ring_doorbell(yg, (uintptr_t)node->value, cr);
+		}
+	}
+	list_free(clients);
+	free(clients);
+}
+
+/**
+ * Take the next message a client left in its ring, if there
+ * is one before its next doorbell.
+ */
+static pex_packet_t * ring_next_packet(yutani_globals_t * yg, uintptr_t client, int * first, pex_packet_t * packet) {
+	client_rings_t * cr = hashmap_get(yg->clients_to_rings, (void *)client);
+	if (!cr || cr->broken) return NULL;
+
+	int size = yutani_ring_read(&cr->rings->to_server, first, (yutani_msg_t *)packet->data);
+	if (size < 0) {
+		TRACE("Client %p left garbage in its ring; not reading it again.", client);
+		cr->broken = 1;
+		return NULL;
+	}
+	if (!size) return NULL;
+
+	packet->source = client;
+	packet->size = size;
+	return packet;
+}
+
 static int next_wid(void) {
 	static int _next = 1;
 	return _next++;
@@ -318,14 +428,14 @@ static void set_focused_window(yutani_globals_t * yg, yutani_server_window_t * w
 		/* Send focus change to old focused window */
 		yutani_msg_buildx_window_focus_change_alloc(response);
 		yutani_msg_buildx_window_focus_change(response, yg->focused_window->wid, 0);
-		pex_send(yg->server, yg->focused_window->owner, response->size, (char *)response);
+		send_to_client(yg, yg->focused_window->owner, response);
 	}
 	yg->focused_window = w;
 	if (w) {
 		/* Send focus change to new focused window */
 		yutani_msg_buildx_window_focus_change_alloc(response);
 		yutani_msg_buildx_window_focus_change(response, w->wid, 1);
-		pex_send(yg->server, w->owner, response->size, (char *)response);
+		send_to_client(yg, w->owner, response);
 		make_top(yg, w);
 		mark_window(yg, w);
 	} else {
@@ -1347,7 +1457,7 @@ static void yutani_query_result(yutani_globals_t * yg, uintptr_t dest, yutani_se
 	if (win && win->client_length) {
 		yutani_msg_buildx_window_advertise_alloc(response, win->client_length);
 		yutani_msg_buildx_window_advertise(response, win->wid, ad_flags(yg, win), win->client_icon, win->bufid, win->width, win->height, win->client_length, win->client_strings);
-		pex_send(yg->server, dest, response->size, (char *)response);
+		send_to_client(yg, dest, response);
 	}
 }
 
@@ -1366,7 +1476,7 @@ static void notify_subscribers(yutani_globals_t * yg) {
 			}
 			list_insert(remove, node);
 		} else {
-			pex_send(yg->server, subscriber, response->size, (char *)response);
+			send_to_client(yg, subscriber, response);
 		}
 	}
 	if (remove) {
@@ -1387,7 +1497,7 @@ static void window_move(yutani_globals_t * yg, yutani_server_window_t * window,
 
 	yutani_msg_buildx_window_move_alloc(response);
 	yutani_msg_buildx_window_move(response, window->wid, x, y);
-	pex_send(yg->server, window->owner, response->size, (char *)response);
+	send_to_client(yg, window->owner, response);
 }
 
 /**
@@ -1454,7 +1564,7 @@ static void window_tile(yutani_globals_t * yg, yutani_server_window_t * window,
 	window_move(yg, window, _x, _y);
 	yutani_msg_buildx_window_resize_alloc(response);
 	yutani_msg_buildx_window_resize(response, YUTANI_MSG_RESIZE_OFFER, window->wid, w, h, 0, tile);
-	pex_send(yg->server, window->owner, response->size, (char *)response);
+	send_to_client(yg, window->owner, response);
 }
 
 /**
@@ -1465,7 +1575,7 @@ static void window_untile(yutani_globals_t * yg, yutani_server_window_t * window
 
 	yutani_msg_buildx_window_resize_alloc(response);
 	yutani_msg_buildx_window_resize(response,YUTANI_MSG_RESIZE_OFFER, window->wid, window->untiled_width, window->untiled_height, 0, 0);
-	pex_send(yg->server, window->owner, response->size, (char *)response);
+	send_to_client(yg, window->owner, response);
 }
 
 static void window_reveal(yutani_globals_t * yg, yutani_server_window_t * window) {
@@ -1534,7 +1644,7 @@ static void handle_key_event(yutani_globals_t * yg, struct yutani_msg_key_event
 			if (focused->z != YUTANI_ZORDER_BOTTOM && focused->z != YUTANI_ZORDER_TOP) {
 				yutani_msg_buildx_window_close_alloc(response);
 				yutani_msg_buildx_window_close(response, focused->wid);
-				pex_send(yg->server, focused->owner, response->size, (char *)response);
+				send_to_client(yg, focused->owner, response);
 				return;
 			}
 		}
@@ -1641,7 +1751,7 @@ static void handle_key_event(yutani_globals_t * yg, struct yutani_msg_key_event
 
 		yutani_msg_buildx_key_event_alloc(response);
 		yutani_msg_buildx_key_event(response,focused ? focused->wid : UINT32_MAX, &ke->event, &ke->state);
-		pex_send(yg->server, bind->owner, response->size, (char *)response);
+		send_to_client(yg, bind->owner, response);
 
 		if (bind->response == YUTANI_BIND_STEAL) {
 			/* If this keybinding was registered as "steal", we'll stop here. */
@@ -1654,7 +1764,7 @@ static void handle_key_event(yutani_globals_t * yg, struct yutani_msg_key_event
 
 		yutani_msg_buildx_key_event_alloc(response);
 		yutani_msg_buildx_key_event(response,focused->wid, &ke->event, &ke->state);
-		pex_send(yg->server, focused->owner, response->size, (char *)response);
+		send_to_client(yg, focused->owner, response);
 
 	}
 }
@@ -1862,7 +1972,7 @@ static void handle_mouse_event(yutani_globals_t * yg, struct yutani_msg_mouse_ev
 						yutani_msg_buildx_window_mouse_event(response,yg->mouse_window->wid, yg->mouse_click_x, yg->mouse_click_y, -1, -1, me->event.buttons, YUTANI_MOUSE_EVENT_DOWN, yg->active_modifiers);
 						yg->mouse_click_x_orig = yg->mouse_click_x;
 						yg->mouse_click_y_orig = yg->mouse_click_y;
-						pex_send(yg->server, yg->mouse_window->owner, response->size, (char *)response);
+						send_to_client(yg, yg->mouse_window->owner, response);
 					}
 				} else {
 					yg->mouse_window = get_focused(yg);
@@ -1872,7 +1982,7 @@ static void handle_mouse_event(yutani_globals_t * yg, struct yutani_msg_mouse_ev
 						yutani_device_to_window(yg->mouse_window, yg->mouse_x / MOUSE_SCALE, yg->mouse_y / MOUSE_SCALE, &x, &y);
 						yutani_msg_buildx_window_mouse_event_alloc(response);
 						yutani_msg_buildx_window_mouse_event(response,yg->mouse_window->wid, x, y, -1, -1, me->event.buttons, YUTANI_MOUSE_EVENT_MOVE, yg->active_modifiers);
-						pex_send(yg->server, yg->mouse_window->owner, response->size, (char *)response);
+						send_to_client(yg, yg->mouse_window->owner, response);
 					}
 					if (tmp_window) {
 						int32_t x, y;
@@ -1880,18 +1990,18 @@ static void handle_mouse_event(yutani_globals_t * yg, struct yutani_msg_mouse_ev
 						if (tmp_window != yg->old_hover_window) {
 							yutani_device_to_window(tmp_window, yg->mouse_x / MOUSE_SCALE, yg->mouse_y / MOUSE_SCALE, &x, &y);
 							yutani_msg_buildx_window_mouse_event(response, tmp_window->wid, x, y, -1, -1, me->event.buttons, YUTANI_MOUSE_EVENT_ENTER, yg->active_modifiers);
-							pex_send(yg->server, tmp_window->owner, response->size, (char *)response);
+							send_to_client(yg, tmp_window->owner, response);
 							if (yg->old_hover_window) {
 								yutani_device_to_window(yg->old_hover_window, yg->mouse_x / MOUSE_SCALE, yg->mouse_y / MOUSE_SCALE, &x, &y);
 								yutani_msg_buildx_window_mouse_event(response, yg->old_hover_window->wid, x, y, -1, -1, me->event.buttons, YUTANI_MOUSE_EVENT_LEAVE, yg->active_modifiers);
-								pex_send(yg->server, yg->old_hover_window->owner, response->size, (char *)response);
+								send_to_client(yg, yg->old_hover_window->owner, response);
 							}
 							yg->old_hover_window = tmp_window;
 						}
 						if (tmp_window != yg->mouse_window || (me->event.buttons & YUTANI_MOUSE_BUTTON_RIGHT)) {
 							yutani_device_to_window(tmp_window, yg->mouse_x / MOUSE_SCALE, yg->mouse_y / MOUSE_SCALE, &x, &y);
 							yutani_msg_buildx_window_mouse_event(response, tmp_window->wid, x, y, -1, -1, me->event.buttons, YUTANI_MOUSE_EVENT_MOVE, yg->active_modifiers);
-							pex_send(yg->server, tmp_window->owner, response->size, (char *)response);
+							send_to_client(yg, tmp_window->owner, response);
 						}
 					}
 				}
@@ -1975,11 +2085,11 @@ static void handle_mouse_event(yutani_globals_t * yg, struct yutani_msg_mouse_ev
 						if (!yg->mouse_moved) {
 							yutani_msg_buildx_window_mouse_event_alloc(response);
 							yutani_msg_buildx_window_mouse_event(response,yg->mouse_window->wid, yg->mouse_click_x, yg->mouse_click_y, -1, -1, me->event.buttons, YUTANI_MOUSE_EVENT_CLICK, yg->active_modifiers);
-							pex_send(yg->server, yg->mouse_window->owner, response->size, (char *)response);
+							send_to_client(yg, yg->mouse_window->owner, response);
 						} else {
 							yutani_msg_buildx_window_mouse_event_alloc(response);
 							yutani_msg_buildx_window_mouse_event(response,yg->mouse_window->wid, yg->mouse_click_x, yg->mouse_click_y, old_x, old_y, me->event.buttons, YUTANI_MOUSE_EVENT_RAISE, yg->active_modifiers);
-							pex_send(yg->server, yg->mouse_window->owner, response->size, (char *)response);
+							send_to_client(yg, yg->mouse_window->owner, response);
 						}
 					}
 				} else {
@@ -1992,7 +2102,7 @@ static void handle_mouse_event(yutani_globals_t * yg, struct yutani_msg_mouse_ev
 						if (old_x != yg->mouse_click_x || old_y != yg->mouse_click_y) {
 							yutani_msg_buildx_window_mouse_event_alloc(response);
 							yutani_msg_buildx_window_mouse_event(response,yg->mouse_window->wid, yg->mouse_click_x, yg->mouse_click_y, old_x, old_y, me->event.buttons, YUTANI_MOUSE_EVENT_DRAG, yg->active_modifiers);
-							pex_send(yg->server, yg->mouse_window->owner, response->size, (char *)response);
+							send_to_client(yg, yg->mouse_window->owner, response);
 						}
 					}
 				}
@@ -2075,7 +2185,7 @@ static void handle_mouse_event(yutani_globals_t * yg, struct yutani_msg_mouse_ev
 					yg->resize_release_time = yutani_current_time(yg);
 					yutani_msg_buildx_window_resize_alloc(response);
 					yutani_msg_buildx_window_resize(response,YUTANI_MSG_RESIZE_OFFER, yg->resizing_window->wid, yg->resizing_w, yg->resizing_h, 0, yg->resizing_window->tiled);
-					pex_send(yg->server, yg->resizing_window->owner, response->size, (char *)response);
+					send_to_client(yg, yg->resizing_window->owner, response);
 				}
 
 				if (!(me->event.buttons & yg->resizing_button)) {
@@ -2239,6 +2349,7 @@ int main(int argc, char * argv[]) {
 	yg->wids_to_windows = hashmap_create_int(10);
 	yg->key_binds = hashmap_create_int(10);
 	yg->clients_to_windows = hashmap_create_int(10);
+	yg->clients_to_rings = hashmap_create_int(10);
 	yg->mid_zs = list_create();
 	yg->menu_zs = list_create();
 	yg->overlay_zs = list_create();
@@ -2295,7 +2406,27 @@ int main(int argc, char * argv[]) {
 
 	uint64_t last_redraw = 0;
 
+	/*
+	 * Client messages are read in batches, or taken from a client's
+	 * ring after it rings its doorbell, and handled one per loop.
+	 * While some are waiting, input devices are only checked every
+	 * so often.
+	 */
+	pex_batch(server, 1);
+	char * batch = malloc(PACKET_SIZE * 32);
+	size_t batch_size = 0;
+	size_t batch_offset = 0;
+	pex_packet_t * ring_packet = malloc(PACKET_SIZE);
+	uintptr_t ring_source = 0;
+	int ring_first = 0;
+	int burst = 0;
+
 	while (1) {
+		retry_doorbells(yg);
+
+		int pending = ring_source || batch_offset < batch_size;
+		int skip_wait = pending && burst < 32;
+		burst = skip_wait ? burst + 1 : 0;
 
 		unsigned long frameTime = yutani_time_since(yg, last_redraw);
 		if (frameTime > 15) {
@@ -2305,7 +2436,7 @@ int main(int argc, char * argv[]) {
 		}
 
 		if (yutani_options.nested) {
-			int index = fswait2(2, fds, 16 - frameTime);
+			int index = skip_wait ? -1 : fswait2(2, fds, pending ? 0 : 16 - frameTime);
 
 			if (index == 1) {
 				yutani_msg_t * m = yutani_poll(yg->host_context);
@@ -2360,11 +2491,11 @@ int main(int argc, char * argv[]) {
 				}
 				free(m);
 				continue;
-			} else if (index > 0) {
+			} else if (index > 0 && !pending) {
 				continue;
 			}
 		} else {
-			int index = fswait2(amfd == -1 ? 3 : 4, fds, 16 - frameTime);
+			int index = skip_wait ? -1 : fswait2(amfd == -1 ? 3 : 4, fds, pending ? 0 : 16 - frameTime);
 
 			if (index == 2) {
 				unsigned char buf[1];
@@ -2399,13 +2530,31 @@ int main(int argc, char * argv[]) {
 					handle_mouse_event(yg, (struct yutani_msg_mouse_event *)m->data);
 				}
 				continue;
-			} else if (index > 0) {
+			} else if (index > 0 && !pending) {
 				continue;
 			}
 		}
 
-		pex_packet_t * p = calloc(PACKET_SIZE, 1);
-		pex_listen(server, p);
+		pex_packet_t * p;
+		if (ring_source) {
+			p = ring_next_packet(yg, ring_source, &ring_first, ring_packet);
+			if (!p) {
+				ring_source = 0;
+				continue;
+			}
+		} else {
+			if (batch_offset >= batch_size) {
+				batch_size = pex_listen_batch(server, batch, PACKET_SIZE * 32);
+				batch_offset = 0;
+				if (batch_size == (size_t)-1) {
+					batch_size = 0;
+					continue;
+				}
+			}
+
+			p = (pex_packet_t *)(batch + batch_offset);
+			batch_offset = (char *)PEX_NEXT_RECORD(p) - batch;
+		}
 
 		yutani_msg_t * m = (yutani_msg_t *)p->data;
 
@@ -2413,6 +2562,8 @@ int main(int argc, char * argv[]) {
 			/* Connection closed for client */
 			TRACE("Connection closed for client  %x", p->source);
 
+			client_rings_release(yg, p->source);
+
 			list_t * client_list = hashmap_get(yg->clients_to_windows, (void *)p->source);
 			if (client_list) {
 				foreach(node, client_list) {
@@ -2431,13 +2582,11 @@ int main(int argc, char * argv[]) {
 				exit(0);
 			}
 
-			free(p);
 			continue;
 		}
 
 		if (m->magic != YUTANI_MSG__MAGIC) {
 			TRACE("Message has bad magic. (Should eject client, but will instead skip this message.) 0x%x", m->magic);
-			free(p);
 			continue;
 		}
 
@@ -2453,7 +2602,28 @@ int main(int argc, char * argv[]) {
 					}
 					yutani_msg_buildx_welcome_alloc(response);
 					yutani_msg_buildx_welcome(response,yg->width, yg->height);
+					send_to_client(yg, p->source, response);
+				}
+				break;
+			case YUTANI_MSG_RING_REQUEST:
+				{
+					/* The reply has to go over the socket, so set up the rings after sending it. */
+					client_rings_t * cr = NULL;
+					if (!hashmap_has(yg->clients_to_rings, (void *)p->source)) {
+						cr = client_rings_create(yg);
+					}
+					yutani_msg_buildx_ring_init_alloc(response);
+					yutani_msg_buildx_ring_init(response, cr ? cr->bufid : 0, sizeof(yutani_rings_t));
 					pex_send(server, p->source, response->size, (char *)response);
+					if (cr) {
+						hashmap_set(yg->clients_to_rings, (void *)p->source, cr);
+					}
+				}
+				break;
+			case YUTANI_MSG_RING_DOORBELL:
+				if (hashmap_has(yg->clients_to_rings, (void *)p->source)) {
+					ring_source = p->source;
+					ring_first = 1;
 				}
 				break;
 			case YUTANI_MSG_WINDOW_NEW:
@@ -2464,7 +2634,7 @@ int main(int argc, char * argv[]) {
 					yutani_server_window_t * w = server_window_create(yg, wn->width, wn->height, p->source, m->type != YUTANI_MSG_WINDOW_NEW ? wn->flags : 0);
 					yutani_msg_buildx_window_init_alloc(response);
 					yutani_msg_buildx_window_init(response,w->wid, w->width, w->height, w->bufid);
-					pex_send(server, p->source, response->size, (char *)response);
+					send_to_client(yg, p->source, response);
 
 					if (!(w->server_flags & YUTANI_WINDOW_FLAG_NO_STEAL_FOCUS)) {
 						set_focused_window(yg, w);
@@ -2567,7 +2737,7 @@ int main(int argc, char * argv[]) {
 					if (w) {
 						yutani_msg_buildx_window_resize_alloc(response);
 						yutani_msg_buildx_window_resize(response,YUTANI_MSG_RESIZE_OFFER, w->wid, wr->width, wr->height, 0, w->tiled);
-						pex_send(server, p->source, response->size, (char *)response);
+						send_to_client(yg, p->source, response);
 					}
 				}
 				break;
@@ -2578,7 +2748,7 @@ int main(int argc, char * argv[]) {
 					if (w) {
 						yutani_msg_buildx_window_resize_alloc(response);
 						yutani_msg_buildx_window_resize(response,YUTANI_MSG_RESIZE_OFFER, w->wid, wr->width, wr->height, 0, w->tiled);
-						pex_send(server, p->source, response->size, (char *)response);
+						send_to_client(yg, p->source, response);
 					}
 				}
 				break;
@@ -2590,7 +2760,7 @@ int main(int argc, char * argv[]) {
 						uint32_t newbufid = server_window_resize(yg, w, wr->width, wr->height);
 						yutani_msg_buildx_window_resize_alloc(response);
 						yutani_msg_buildx_window_resize(response,YUTANI_MSG_RESIZE_BUFID, w->wid, wr->width, wr->height, newbufid, 0);
-						pex_send(server, p->source, response->size, (char *)response);
+						send_to_client(yg, p->source, response);
 					}
 				}
 				break;
@@ -2613,7 +2783,7 @@ int main(int argc, char * argv[]) {
 					yutani_query_result(yg, p->source, yg->top_z);
 					yutani_msg_buildx_window_advertise_alloc(response, 0);
 					yutani_msg_buildx_window_advertise(response,0, 0, 0, 0, 0, 0, 0, NULL);
-					pex_send(server, p->source, response->size, (char *)response);
+					send_to_client(yg, p->source, response);
 				}
 				break;
 			case YUTANI_MSG_SUBSCRIBE:
@@ -2765,14 +2935,14 @@ int main(int argc, char * argv[]) {
 							if (w) {
 								yutani_msg_buildx_window_close_alloc(response);
 								yutani_msg_buildx_window_close(response, w->wid);
-								pex_send(yg->server, w->owner, response->size, (char *)response);
+								send_to_client(yg, w->owner, response);
 							}
 							break;
 						case YUTANI_SPECIAL_REQUEST_CLIPBOARD:
 							{
 								yutani_msg_buildx_clipboard_alloc(response, yg->clipboard_size);
 								yutani_msg_buildx_clipboard(response, yg->clipboard);
-								pex_send(server, p->source, response->size, (char *)response);
+								send_to_client(yg, p->source, response);
 							}
 							break;
 						default:
@@ -2797,7 +2967,6 @@ int main(int argc, char * argv[]) {
 				}
 				break;
 		}
-		free(p);
 	}
 
 	return 0;
@@ -15,6 +15,7 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/sendfile.h>
 
 #define CHUNK_SIZE 4096
 
@@ -46,10 +47,19 @@ static int copy_file(char * source, char * dest, int mode,int uid, int gid) {
 
 	//fprintf(stderr, "%d bytes to copy\n", length);
 
+	/* Let the kernel move the data if it can... */
+	while (length > 0) {
+		ssize_t r = sendfile(d_fd, s_fd, NULL, length);
+		if (r <= 0) break;
+		length -= r;
+	}
+
+	/* ...and fall back to copying it ourselves if it can't. */
 	char buf[CHUNK_SIZE];
 
 	while (length > 0) {
-		size_t r = read(s_fd, buf, length < CHUNK_SIZE ? length : CHUNK_SIZE);
+		ssize_t r = read(s_fd, buf, length < CHUNK_SIZE ? length : CHUNK_SIZE);
+		if (r <= 0) break;
 		//fprintf(stderr, "copying %d bytes from %s to %s\n", r, source, dest);
 		write(d_fd, buf, r);
 		length -= r;
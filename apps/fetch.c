@@ -14,8 +14,10 @@
 #include <time.h>
 #include <termios.h>
 #include <unistd.h>
+#include <fcntl.h>
 #include <sys/time.h>
 #include <sys/socket.h>
+#include <sys/sendfile.h>
 #include <netinet/in.h>
 #include <netdb.h>
 #include <arpa/inet.h>
@@ -249,6 +251,30 @@ int http_fetch(FILE * f) {
 
 	gettimeofday(&fetch_options.start, NULL);
 
+	/* Whatever stdio already read in past the headers has to go out first... */
+	while (bytes_to_read > 0 && !_fwouldblock(f)) {
+		fputc(fgetc(f), fetch_options.out);
+		fetch_options.size++;
+		bytes_to_read--;
+	}
+	fflush(fetch_options.out);
+
+	/* ...then the rest can be moved straight from the socket by the kernel. */
+	while (bytes_to_read > 0) {
+		ssize_t r = splice(fileno(f), NULL, fileno(fetch_options.out), NULL, bytes_to_read, 0);
+		if (r == 0) {
+			bytes_to_read = 0;
+			break;
+		}
+		if (r < 0) break;
+		fetch_options.size += r;
+		print_progress(0);
+		if (fetch_options.machine_readable && fetch_options.content_length) {
+			fprintf(stdout,"%zu %zu\n",fetch_options.size,fetch_options.content_length);
+		}
+		bytes_to_read -= r;
+	}
+
 	while (bytes_to_read > 0) {
 		char buf[1024];
 		size_t r = fread(buf, 1, bytes_to_read < 1024 ? bytes_to_read : 1024, f);
@@ -412,6 +438,17 @@ int main(int argc, char * argv[]) {
 				"Content-Disposition: form-data; name=\"file\"; filename=\"%s\"\r\n"
 				"Content-Type: application/octet-stream\r\n"
 				"\r\n", boundary_fuzz, fetch_options.upload_file);
+		fflush(f);
+
+		if (!fetch_options.slow_upload) {
+			off_t offset = 0;
+			while (1) {
+				ssize_t r = sendfile(fileno(f), fileno(in_file), &offset, 0x10000);
+				if (r <= 0) break;
+			}
+			/* Anything sendfile didn't get to is picked up below */
+			fseek(in_file, offset, SEEK_SET);
+		}
 
 		while (!feof(in_file)) {
 			char buf[1024];
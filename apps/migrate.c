@@ -1,10 +1,13 @@
 /**
- * @brief migrate - Relocate root filesystem to tmpfs
+ * @brief migrate - Make the root filesystem writable
  *
- * Run as part of system startup to move the ext2 root ramdisk
- * into a flexible in-memory temporary filesystem, which allows
- * file creation and editing and is much faster than the using
- * the ext2 driver against the static in-memory ramdisk.
+ * Run as part of system startup to turn the read-only root ramdisk
+ * into a writable root. The ramdisk is remounted at /dev/base and an
+ * overlay with a tmpfs upper layer is mounted over it at /, so files
+ * are only copied into memory when they are modified.
+ *
+ * If the kernel can't mount an overlay, falls back to copying the
+ * whole ramdisk into a tmpfs and freeing it.
  *
  * Based on the original Python implementation.
  *
@@ -22,6 +25,7 @@
 #include <fcntl.h>
 #include <sys/stat.h>
 #include <sys/ioctl.h>
+#include <sys/mount.h>
 
 #include <toaru/trace.h>
 #include <toaru/hashmap.h>
@@ -228,6 +232,11 @@ int main(int argc, char * argv[]) {
 	sprintf(tmp, "mount %s %s /dev/base", root_type, root);
 	system(tmp);
 
+	TRACE_("Mounting overlay to /");
+	if (mount("/dev/base", "/", "overlay", 0, NULL) == 0) {
+		return 0;
+	}
+
 	TRACE_("Mounting tmpfs to /");
 	system("mount tmpfs x,755 /");
 
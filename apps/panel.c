@@ -551,6 +551,7 @@ static void update_window_list(void) {
 	while (1) {
 		/* We wait for a series of WINDOW_ADVERTISE messsages */
 		yutani_msg_t * m = yutani_wait_for(yctx, YUTANI_MSG_WINDOW_ADVERTISE);
+		if (!m) break;
 		struct yutani_msg_window_advertise * wa = (void*)m->data;
 
 		if (wa->size == 0) {
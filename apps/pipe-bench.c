@@ -0,0 +1,114 @@
+/**
+ * @brief pipe-bench - Measure pipe throughput
+ *
+ * Forks a writer that pushes a fixed amount of data through a pipe
+ * in blocks of a given size, reads it all back in the parent, and
+ * reports how long that took.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2021 K. Lange
+ */
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <getopt.h>
+#include <sys/time.h>
+#include <sys/wait.h>
+
+static void usage(char * argv[]) {
+	fprintf(stderr,
+		"usage: %s [-s MIB] [-b BYTES] [-p BYTES]\n"
+		"\n"
+		" -s MIB    total amount to move (default 64)\n"
+		" -b BYTES  size of each read and write (default 4096)\n"
+		" -p BYTES  pipe buffer size, as with F_SETPIPE_SZ\n",
+		argv[0]);
+}
+
+int main(int argc, char * argv[]) {
+	size_t total = 64 * 1024 * 1024;
+	size_t block = 4096;
+	int pipe_size = 0;
+
+	int opt;
+	while ((opt = getopt(argc, argv, "s:b:p:h")) != -1) {
+		switch (opt) {
+			case 's':
+				total = (size_t)atoi(optarg) * 1024 * 1024;
+				break;
+			case 'b':
+				block = atoi(optarg);
+				break;
+			case 'p':
+				pipe_size = atoi(optarg);
+				break;
+			case 'h':
+			default:
+				usage(argv);
+				return 1;
+		}
+	}
+
+	if (!total || !block) {
+		usage(argv);
+		return 1;
+	}
+
+	int fds[2];
+	if (pipe(fds) < 0) {
+		fprintf(stderr, "%s: pipe: %s\n", argv[0], strerror(errno));
+		return 1;
+	}
+
+	if (pipe_size) {
+		int result = fcntl(fds[1], F_SETPIPE_SZ, pipe_size);
+		if (result < 0) {
+			fprintf(stderr, "%s: F_SETPIPE_SZ: %s\n", argv[0], strerror(errno));
+			return 1;
+		}
+	}
+	int capacity = fcntl(fds[1], F_GETPIPE_SZ);
+
+	char * buf = malloc(block);
+	memset(buf, 'x', block);
+
+	struct timeval start, end;
+	gettimeofday(&start, NULL);
+
+	pid_t child = fork();
+	if (!child) {
+		close(fds[0]);
+		size_t sent = 0;
+		while (sent < total) {
+			size_t count = total - sent < block ? total - sent : block;
+			ssize_t w = write(fds[1], buf, count);
+			if (w <= 0) return 1;
+			sent += w;
+		}
+		return 0;
+	}
+
+	close(fds[1]);
+	size_t received = 0;
+	while (1) {
+		ssize_t r = read(fds[0], buf, block);
+		if (r <= 0) break;
+		received += r;
+	}
+
+	waitpid(child, NULL, 0);
+	gettimeofday(&end, NULL);
+
+	double elapsed = (end.tv_sec - start.tv_sec) + (end.tv_usec - start.tv_usec) / 1000000.0;
+	if (elapsed <= 0) elapsed = 0.000001;
+
+	fprintf(stdout, "%zu bytes in %zu-byte blocks through a %d-byte pipe: %.3f s, %.2f MiB/s\n",
+		received, block, capacity, elapsed, (received / (1024.0 * 1024.0)) / elapsed);
+
+	return received == total ? 0 : 1;
+}
@@ -107,6 +107,20 @@ const char * syscall_names[] = {
 	[SYS_SETGROUPS]    = "setgroups",
 	[SYS_TIMES]        = "times",
 	[SYS_PTRACE]       = "ptrace",
+	[SYS_GETDENTS]     = "getdents",
+	[SYS_FSYNC]        = "fsync",
+	[SYS_FDATASYNC]    = "fdatasync",
+	[SYS_READV]        = "readv",
+	[SYS_WRITEV]       = "writev",
+	[SYS_PREAD]        = "pread",
+	[SYS_PWRITE]       = "pwrite",
+	[SYS_SENDFILE]     = "sendfile",
+	[SYS_SPLICE]       = "splice",
+	[SYS_IORING_SETUP] = "ioring_setup",
+	[SYS_IORING_ENTER] = "ioring_enter",
+	[SYS_EVSET_CREATE] = "evset_create",
+	[SYS_EVSET_CTL] = "evset_ctl",
+	[SYS_EVSET_WAIT] = "evset_wait",
 	[SYS_SOCKET]       = "socket",
 	[SYS_SETSOCKOPT]   = "setsockopt",
 	[SYS_BIND]         = "bind",
@@ -181,6 +195,20 @@ char syscall_mask[] = {
 	[SYS_SETGROUPS]    = 1,
 	[SYS_TIMES]        = 1,
 	[SYS_PTRACE]       = 1,
+	[SYS_GETDENTS]     = 1,
+	[SYS_FSYNC]        = 1,
+	[SYS_FDATASYNC]    = 1,
+	[SYS_READV]        = 1,
+	[SYS_WRITEV]       = 1,
+	[SYS_PREAD]        = 1,
+	[SYS_PWRITE]       = 1,
+	[SYS_SENDFILE]     = 1,
+	[SYS_SPLICE]       = 1,
+	[SYS_IORING_SETUP] = 1,
+	[SYS_IORING_ENTER] = 1,
+	[SYS_EVSET_CREATE] = 1,
+	[SYS_EVSET_CTL] = 1,
+	[SYS_EVSET_WAIT] = 1,
 	[SYS_SOCKET]       = 1,
 	[SYS_SETSOCKOPT]   = 1,
 	[SYS_BIND]         = 1,
@@ -630,6 +658,70 @@ static void handle_syscall(pid_t pid, struct regs * r) {
 			int_arg(syscall_arg2(r)); COMMA;
 			pointer_arg(syscall_arg3(r));
 			break;
+		case SYS_GETDENTS:
+			fd_arg(pid, syscall_arg1(r)); COMMA;
+			pointer_arg(syscall_arg2(r)); COMMA;
+			uint_arg(syscall_arg3(r));
+			break;
+		case SYS_FSYNC:
+		case SYS_FDATASYNC:
+			fd_arg(pid, syscall_arg1(r));
+			break;
+		case SYS_READV:
+		case SYS_WRITEV:
+			fd_arg(pid, syscall_arg1(r)); COMMA;
+			pointer_arg(syscall_arg2(r)); COMMA;
+			int_arg(syscall_arg3(r));
+			break;
+		case SYS_PREAD:
+			fd_arg(pid, syscall_arg1(r)); COMMA;
+			pointer_arg(syscall_arg2(r)); COMMA;
+			uint_arg(syscall_arg3(r)); COMMA;
+			int_arg(syscall_arg4(r));
+			break;
+		case SYS_PWRITE:
+			fd_arg(pid, syscall_arg1(r)); COMMA;
+			buffer_arg(pid, syscall_arg2(r), syscall_arg3(r)); COMMA;
+			uint_arg(syscall_arg3(r)); COMMA;
+			int_arg(syscall_arg4(r));
+			break;
+		case SYS_SENDFILE:
+			fd_arg(pid, syscall_arg1(r)); COMMA;
+			fd_arg(pid, syscall_arg2(r)); COMMA;
+			pointer_arg(syscall_arg3(r)); COMMA;
+			uint_arg(syscall_arg4(r));
+			break;
+		case SYS_IORING_SETUP:
+			pointer_arg(syscall_arg1(r));
+			break;
+		case SYS_IORING_ENTER:
+			fd_arg(pid, syscall_arg1(r)); COMMA;
+			uint_arg(syscall_arg2(r)); COMMA;
+			uint_arg(syscall_arg3(r)); COMMA;
+			uint_arg(syscall_arg4(r));
+			break;
+		case SYS_EVSET_CREATE:
+			int_arg(syscall_arg1(r));
+			break;
+		case SYS_EVSET_CTL:
+			fd_arg(pid, syscall_arg1(r)); COMMA;
+			int_arg(syscall_arg2(r)); COMMA;
+			fd_arg(pid, syscall_arg3(r)); COMMA;
+			pointer_arg(syscall_arg4(r));
+			break;
+		case SYS_EVSET_WAIT:
+			fd_arg(pid, syscall_arg1(r)); COMMA;
+			pointer_arg(syscall_arg2(r)); COMMA;
+			int_arg(syscall_arg3(r)); COMMA;
+			int_arg(syscall_arg4(r));
+			break;
+		case SYS_SPLICE:
+			fd_arg(pid, syscall_arg1(r)); COMMA;
+			pointer_arg(syscall_arg2(r)); COMMA;
+			fd_arg(pid, syscall_arg3(r)); COMMA;
+			pointer_arg(syscall_arg4(r)); COMMA;
+			uint_arg(syscall_arg5(r));
+			break;
 		case SYS_KILL:
 			int_arg(syscall_arg1(r)); COMMA; /* pid_arg? */
 			int_arg(syscall_arg2(r)); /* TODO signal name */
@@ -900,7 +992,9 @@ int main(int argc, char * argv[]) {
 								int syscalls[] = {
 									SYS_OPEN, SYS_READ, SYS_WRITE, SYS_CLOSE, SYS_STAT, SYS_FSWAIT,
 									SYS_FSWAIT2, SYS_FSWAIT3, SYS_SEEK, SYS_IOCTL, SYS_PIPE, SYS_MKPIPE,
-									SYS_DUP2, SYS_READDIR, SYS_OPENPTY,
+									SYS_DUP2, SYS_READDIR, SYS_GETDENTS, SYS_FSYNC, SYS_FDATASYNC, SYS_OPENPTY,
+									SYS_READV, SYS_WRITEV, SYS_PREAD, SYS_PWRITE, SYS_SENDFILE, SYS_SPLICE,
+									SYS_IORING_SETUP, SYS_IORING_ENTER, SYS_EVSET_CREATE, SYS_EVSET_CTL, SYS_EVSET_WAIT,
 									0
 								};
 								for (int *i = syscalls; *i; i++) {
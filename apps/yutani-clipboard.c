@@ -54,9 +54,13 @@ int set_clipboard_from_file(char * file) {
 	return 0;
 }
 
-void get_clipboard(void) {
+int get_clipboard(void) {
 	yutani_special_request(yctx, NULL, YUTANI_SPECIAL_REQUEST_CLIPBOARD);
 	yutani_msg_t * clipboard = yutani_wait_for(yctx, YUTANI_MSG_CLIPBOARD);
+	if (!clipboard) {
+		fprintf(stderr, "yutani-clipboard: lost connection to compositor\n");
+		return 1;
+	}
 	struct yutani_msg_clipboard * cb = (void *)clipboard->data;
 
 	if (*cb->content == '\002') {
@@ -80,6 +84,7 @@ void get_clipboard(void) {
 		}
 	}
 
+	return 0;
 }
 
 int main(int argc, char * argv[]) {
@@ -100,8 +105,7 @@ int main(int argc, char * argv[]) {
 				force_linefeed = 1;
 				break;
 			case 'g':
-				get_clipboard();
-				return 0;
+				return get_clipboard();
 			case '?':
 				show_usage(argc,argv);
 				return 1;
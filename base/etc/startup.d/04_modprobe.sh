@@ -17,3 +17,5 @@ if lspci -q 8086:100e,8086:1004,8086:100f,8086:10ea,8086:10d3 then insmod /mod/e
 
 # Device drivers
 if lspci -q 8086:7111,8086:7010 then insmod /mod/ata.ko
+if lspci -q 1AF4:1001,1AF4:1042 then insmod /mod/virtio-blk.ko
+if lspci -q 1B36:0010 then insmod /mod/nvme.ko
@@ -13,6 +13,9 @@ typedef struct dirent {
 typedef struct DIR {
 	int fd;
 	int cur_entry;
+	int buf_count; /* entries in buf */
+	int buf_pos;   /* next entry to return from buf */
+	struct dirent * buf;
 } DIR;
 
 DIR * opendir (const char * dirname);
@@ -2,6 +2,7 @@
 
 #include <_cheader.h>
 #include <sys/types.h>
+#include <stddef.h>
 
 _Begin_C_Header
 
@@ -29,6 +30,10 @@ _Begin_C_Header
 #define F_SETLK  6
 #define F_SETLKW 7
 
+/* Pipe buffer capacity, in bytes */
+#define F_SETPIPE_SZ 1031
+#define F_GETPIPE_SZ 1032
+
 #define F_RDLCK  0
 #define F_WRLCK  1
 #define F_UNLCK  2
@@ -47,6 +52,7 @@ struct flock {
 extern int open (const char *, int, ...);
 extern int chmod(const char *path, mode_t mode);
 extern int fcntl(int fd, int cmd, ...);
+extern ssize_t splice(int fd_in, off_t * off_in, int fd_out, off_t * off_out, size_t len, unsigned int flags);
 #endif
 
 _End_C_Header
@@ -86,4 +86,8 @@ typedef int (*irq_handler_chain_t) (struct regs *);
 extern void irq_install_handler(size_t irq, irq_handler_chain_t handler, const char * desc);
 extern const char * get_irq_handler(int irq, int chain);
 
+extern int msi_message(int irq, uint64_t * address, uint32_t * data);
+extern int msi_in_service(int irq);
+extern void msi_ack(void);
+
 extern void idt_load(void *);
@@ -0,0 +1,44 @@
+#pragma once
+
+#include <kernel/types.h>
+#include <kernel/vfs.h>
+#include <kernel/mutex.h>
+
+#define BCACHE_VALID      0x01 /* data reflects the device (or newer) */
+#define BCACHE_DIRTY      0x02 /* data must be written back */
+#define BCACHE_REFERENCED 0x04 /* recently used; CLOCK second chance */
+
+/* Dirty buffers are written back in ascending pass order; see bcache_flush */
+#define BCACHE_PASSES     8
+
+struct bcache_buf {
+	fs_node_t * dev;
+	uint64_t block;
+	size_t size;
+	uint8_t * data;
+	size_t data_size;
+	volatile int refcount;
+	volatile int flags;
+	int pass;
+	uint64_t dirtied; /* when it last went from clean to dirty, in milliseconds */
+	sched_mutex_t * lock;
+	struct bcache_buf * hash_next;
+};
+
+extern void bcache_initialize(void);
+
+extern struct bcache_buf * bcache_get(fs_node_t * dev, uint64_t block, size_t size);
+extern void bcache_release(struct bcache_buf * buf);
+extern void bcache_dirty(struct bcache_buf * buf, int pass);
+
+extern int bcache_read(fs_node_t * dev, uint64_t block, size_t size, uint8_t * out);
+extern int bcache_write(fs_node_t * dev, uint64_t block, size_t size, const uint8_t * in, int pass);
+extern int bcache_update(fs_node_t * dev, uint64_t block, size_t size, size_t offset, size_t len, const uint8_t * in, int pass);
+extern int bcache_read_run(fs_node_t * dev, uint64_t block, size_t count, size_t size, uint8_t * out);
+extern int bcache_prefetch(fs_node_t * dev, uint64_t block, size_t count, size_t size);
+extern int bcache_write_run(fs_node_t * dev, uint64_t block, size_t count, size_t size, const uint8_t * in);
+extern int bcache_sync(fs_node_t * dev);
+extern int bcache_flush(fs_node_t * dev, int max_pass);
+extern int bcache_flush_expired(fs_node_t * dev, unsigned long age);
+extern void bcache_balance(fs_node_t * dev);
+extern void bcache_stats(uint64_t out[4]);
@@ -0,0 +1,118 @@
+#pragma once
+/**
+ * @file kernel/blkdev.h
+ * @brief Block device request queues.
+ *
+ * Disk drivers describe their devices with a @ref blkdev and
+ * are handed requests for whole sectors; the block layer provides
+ * the device node, sorts and merges requests, and decides which
+ * to hand to the driver next.
+ */
+#include <kernel/types.h>
+#include <kernel/vfs.h>
+#include <kernel/list.h>
+#include <kernel/spinlock.h>
+
+#define BLK_QUEUED      1
+#define BLK_DISPATCHED  2
+#define BLK_DONE        3
+
+struct blkdev;
+
+/**
+ * A transfer of whole sectors between a device and a kernel buffer.
+ *
+ * A queued request for sectors adjacent to another in the same
+ * direction is merged with it: the lower one carries the other
+ * on its @c merged chain, in sector order, and the driver is handed
+ * the whole chain as one request.
+ */
+struct blk_request {
+	struct blkdev * dev;
+	uint64_t sector;
+	unsigned int count;
+	int write;
+	uint8_t * buffer;
+
+	/* Managed by the block layer */
+	struct blk_request * next;        /* in the device queue, or a plug */
+	struct blk_request * merged;      /* carried along with this one */
+	struct blk_request * merged_tail;
+	unsigned int span;                /* sectors covered by the whole chain */
+	int pieces;                       /* requests in the whole chain */
+	uint64_t submitted;               /* microseconds */
+	uint64_t deadline;
+	volatile int state;
+	int error;
+};
+
+/**
+ * Requests submitted with a plug are held back until @ref blk_unplug,
+ * so that a batch can be sorted and merged before any of it is
+ * dispatched.
+ */
+struct blk_plug {
+	struct blk_request * head;
+};
+
+struct blkdev_stats {
+	uint64_t reads;
+	uint64_t writes;
+	uint64_t read_sectors;
+	uint64_t write_sectors;
+	uint64_t back_merges;
+	uint64_t front_merges;
+	uint64_t dispatches;
+	uint64_t expired;       /* dispatched out of order as their deadline passed */
+	uint64_t latency_total; /* from submission to completion, in microseconds */
+	uint64_t latency_max;
+};
+
+/**
+ * @brief Carry out a request and everything merged into it.
+ *
+ * Called without the queue lock held, and may sleep. Returns 0 or
+ * a negative error code, which every request in the chain gets.
+ */
+typedef int (*blk_transfer_t)(struct blkdev * dev, struct blk_request * req);
+typedef int (*blk_ioctl_t)(struct blkdev * dev, unsigned long request, void * argp);
+
+struct blkdev {
+	char name[32];
+	fs_node_t * node;
+	void * driver;
+
+	/* Set up by the driver before registering */
+	blk_transfer_t transfer;
+	blk_ioctl_t ioctl;
+	size_t sector_size;
+	uint64_t sectors;
+	unsigned int max_sectors; /* in one request, including merged ones */
+	int max_pieces;           /* requests that may be merged into one */
+	int depth;                /* requests the driver may be working on at once */
+	uintptr_t align;          /* address bits that must be clear in buffers */
+
+	/* Partitions pass their requests on to the whole disk */
+	struct blkdev * parent;
+	uint64_t start;
+
+	spin_lock_t lock;
+	struct blk_request * queue; /* in sector order */
+	int queued;
+	int in_flight;
+	uint64_t position;          /* where the last dispatched request ended */
+	list_t * wait;
+
+	struct blkdev_stats stats;
+};
+
+extern void blkdev_initialize(void);
+extern struct blkdev * blkdev_create(const char * name, size_t sector_size, uint64_t sectors);
+extern fs_node_t * blkdev_register(struct blkdev * dev);
+extern fs_node_t * blkdev_partition(struct blkdev * parent, const char * name, uint64_t start, uint64_t sectors);
+extern struct blkdev * blkdev_get(fs_node_t * node);
+
+extern void blk_submit(struct blk_request * req, struct blk_plug * plug);
+extern void blk_unplug(struct blk_plug * plug);
+extern int blk_wait(struct blk_request * req);
+extern int blk_rw(struct blkdev * dev, uint64_t sector, unsigned int count, uint8_t * buffer, int write);
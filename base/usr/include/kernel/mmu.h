@@ -61,3 +61,7 @@ void * sbrk(size_t);
 
 union PML * mmu_get_page_other(union PML * root, uintptr_t virtAddr);
 int mmu_validate_user_pointer(void * addr, size_t size, int flags);
+
+size_t arch_user_copy(void * dest, const void * src, size_t n);
+size_t arch_user_strnlen(const char * src, size_t max);
+int arch_user_probe(const void * addr, int write);
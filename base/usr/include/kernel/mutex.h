@@ -5,6 +5,8 @@
  * This file is part of ToaruOS and is released under the terms
  * of the NCSA / University of Illinois License - see LICENSE.md
  */
+#pragma once
+
 #include <kernel/list.h>
 #include <kernel/spinlock.h>
 #include <kernel/process.h>
@@ -18,4 +20,5 @@ typedef struct {
 
 extern sched_mutex_t * mutex_init(const char * name);
 extern int mutex_acquire(sched_mutex_t * mutex);
+extern int mutex_try_acquire(sched_mutex_t * mutex);
 extern int mutex_release(sched_mutex_t * mutex);
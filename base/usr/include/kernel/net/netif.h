@@ -39,3 +39,9 @@ void net_sock_alert(sock_t * sock);
 void net_sock_add(sock_t * sock, void * frame, size_t size);
 void * net_sock_get(sock_t * sock);
 sock_t * net_sock_create(void);
+size_t net_iov_length(const struct msghdr * msg);
+size_t net_iov_scatter(const struct msghdr * msg, const void * data, size_t size);
+size_t net_iov_gather(const struct msghdr * msg, size_t offset, void * buf, size_t size);
+int sock_generic_check(fs_node_t *node);
+long net_sock_recv(fs_node_t * node, struct msghdr * msg, int flags);
+long net_sock_send(fs_node_t * node, const struct msghdr * msg, int flags);
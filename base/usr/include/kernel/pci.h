@@ -22,9 +22,16 @@
 #define PCI_BAR4                 0x20 // 4
 #define PCI_BAR5                 0x24 // 4
 
+#define PCI_CAPABILITIES         0x34 // 1
 #define PCI_INTERRUPT_LINE       0x3C // 1
 #define PCI_INTERRUPT_PIN        0x3D
 
+#define PCI_STATUS_CAPABILITIES  (1 << 4)
+#define PCI_COMMAND_INTX_DISABLE (1 << 10)
+
+#define PCI_CAP_MSI              0x05
+#define PCI_CAP_MSIX             0x11
+
 #define PCI_SECONDARY_BUS        0x19 // 1
 
 #define PCI_HEADER_TYPE_DEVICE  0
@@ -68,4 +75,8 @@ void pci_scan_bus(pci_func_t f, int type, int bus, void * extra);
 void pci_scan(pci_func_t f, int type, void * extra);
 void pci_remap(void);
 int pci_get_interrupt(uint32_t device);
+int pci_find_capability(uint32_t device, int id);
+int pci_enable_msi(uint32_t device, uint64_t address, uint32_t data);
+int pci_enable_msix(uint32_t device, int vectors, uint64_t address, uint32_t data);
+int pci_msi_active(uint32_t device);
 
@@ -83,6 +83,8 @@ typedef struct file_descriptors {
 #define PROC_FLAG_TRACE_SYSCALLS     0x40
 #define PROC_FLAG_TRACE_SIGNALS      0x80
 
+#define PROC_FLAG_SLEEP_UNINT 0x100 /* signals don't wake it */
+
 typedef struct process {
 	pid_t id;    /* PID */
 	pid_t group; /* thread group */
@@ -238,7 +240,9 @@ extern int wakeup_queue(list_t * queue);
 extern int wakeup_queue_interrupted(list_t * queue);
 extern int sleep_on(list_t * queue);
 extern int sleep_on_unlocking(list_t * queue, spin_lock_t * release);
+extern void sleep_on_unlocking_uninterruptible(list_t * queue, spin_lock_t * release);
 extern int process_alert_node(process_t * process, void * value);
+extern int process_alert_node_locked(process_t * process, void * value);
 extern void sleep_until(process_t * process, unsigned long seconds, unsigned long subseconds);
 extern void switch_task(uint8_t reschedule);
 extern int process_wait_nodes(process_t * process,fs_node_t * nodes[], int timeout);
@@ -7,16 +7,20 @@
 
 typedef struct {
 	unsigned char * buffer;
-	size_t write_ptr;
-	size_t read_ptr;
+	volatile size_t write_ptr;
+	volatile size_t read_ptr;
 	size_t size;
-	spin_lock_t lock;
+	spin_lock_t lock;        /* Sleeping and waking; see ringbuffer.c */
 	list_t * wait_queue_readers;
 	list_t * wait_queue_writers;
 	int internal_stop;
 	list_t * alert_waiters;
 	int discard;
 	int soft_stop;
+	spin_lock_t read_lock;   /* Orders readers among themselves */
+	spin_lock_t write_lock;  /* Orders writers among themselves */
+	volatile int readers_waiting;
+	volatile int writers_waiting;
 } ring_buffer_t;
 
 size_t ring_buffer_unread(ring_buffer_t * ring_buffer);
@@ -30,5 +34,12 @@ void ring_buffer_destroy(ring_buffer_t * ring_buffer);
 void ring_buffer_interrupt(ring_buffer_t * ring_buffer);
 void ring_buffer_alert_waiters(ring_buffer_t * ring_buffer);
 void ring_buffer_select_wait(ring_buffer_t * ring_buffer, void * process);
+void ring_buffer_select_unwait(ring_buffer_t * ring_buffer, void * process);
 void ring_buffer_eof(ring_buffer_t * ring_buffer);
+int ring_buffer_resize(ring_buffer_t * ring_buffer, size_t size);
+
+size_t ring_buffer_peek(ring_buffer_t * ring_buffer, uint8_t ** data);
+void ring_buffer_commit_read(ring_buffer_t * ring_buffer, size_t count);
+size_t ring_buffer_reserve(ring_buffer_t * ring_buffer, uint8_t ** data);
+void ring_buffer_commit_write(ring_buffer_t * ring_buffer, size_t count);
 
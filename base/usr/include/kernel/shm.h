@@ -2,6 +2,7 @@
 
 #include <stddef.h>
 #include <stdint.h>
+#include <sys/types.h>
 #include <kernel/types.h>
 
 #define SHM_PATH_SEPARATOR "."
@@ -13,6 +14,7 @@ typedef struct {
 	struct shm_node * parent;
 	volatile uint8_t lock;
 	ssize_t ref_count;
+	pid_t owner;    /* If set, the only process that may obtain this chunk by name */
 	size_t num_frames;
 	uintptr_t *frames;
 } shm_chunk_t;
@@ -31,9 +33,12 @@ typedef struct {
 
 /* Syscalls */
 extern void * shm_obtain(char * path, size_t * size);
+extern void * shm_obtain_private(char * path, size_t * size);
 extern int    shm_release(char * path);
 
 /* Other exposed functions */
 extern void shm_install(void);
 extern void shm_release_all(process_t * proc);
+extern shm_chunk_t * shm_chunk_retain(char * path);
+extern void shm_chunk_release(shm_chunk_t * chunk);
 
@@ -19,6 +19,13 @@
 	do { if (ptr_validate((void *)(PTR), __func__)) return -EINVAL; } while (0)
 extern int ptr_validate(void * ptr, const char * syscall);
 
+extern long copy_from_user(void * dest, const void * src, size_t n);
+extern long copy_to_user(void * dest, const void * src, size_t n);
+extern long strnlen_user(const char * src, size_t max);
+extern long user_probe(void * ptr, size_t n, int flags);
+struct iovec;
+extern long iovec_from_user(const struct iovec * uiov, int iovcnt, int flags, struct iovec ** out);
+
 extern long arch_syscall_number(struct regs * r);
 extern long arch_syscall_arg0(struct regs * r);
 extern long arch_syscall_arg1(struct regs * r);
@@ -4,7 +4,7 @@
 #include <kernel/spinlock.h>
 #include <sys/types.h>
 
-fs_node_t * tmpfs_create(char * name);
+fs_node_t * tmpfs_create(const char * name);
 
 struct tmpfs_file {
 	spin_lock_t lock;
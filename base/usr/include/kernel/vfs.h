@@ -4,6 +4,7 @@
 #include <stddef.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <sys/uio.h>
 #include <bits/dirent.h>
 
 #define PATH_SEPARATOR '/'
@@ -20,6 +21,7 @@
 #define FS_PIPE        0x10
 #define FS_SYMLINK     0x20
 #define FS_MOUNTPOINT  0x40
+#define FS_DCACHE      0x80 /* finddir results may be cached */
 
 #define _IFMT       0170000 /* type of file */
 #define     _IFDIR  0040000 /* directory */
@@ -48,8 +50,14 @@ typedef int (*symlink_type_t) (struct fs_node *, char * name, char * value);
 typedef ssize_t (*readlink_type_t) (struct fs_node *, char * buf, size_t size);
 typedef int (*selectcheck_type_t) (struct fs_node *);
 typedef int (*selectwait_type_t) (struct fs_node *, void * process);
+typedef void (*selectunwait_type_t) (struct fs_node *, void * process);
 typedef int (*chown_type_t) (struct fs_node *, uid_t, gid_t);
 typedef int (*truncate_type_t) (struct fs_node *);
+typedef ssize_t (*getdents_type_t) (struct fs_node *, uint64_t * cursor, struct dirent * out, size_t count);
+typedef int (*fsync_type_t) (struct fs_node *, int datasync);
+typedef void (*readahead_type_t) (struct fs_node *, off_t offset, size_t size);
+typedef ssize_t (*readv_type_t) (struct fs_node *, off_t, const struct iovec *, int);
+typedef ssize_t (*writev_type_t) (struct fs_node *, off_t, const struct iovec *, int);
 
 typedef struct fs_node {
 	char name[256];         /* The filename. */
@@ -91,8 +99,21 @@ typedef struct fs_node {
 
 	selectcheck_type_t selectcheck;
 	selectwait_type_t selectwait;
+	selectunwait_type_t selectunwait; /* Undo selectwait for a waiter that is going away */
 
 	chown_type_t chown;
+	getdents_type_t getdents;
+	fsync_type_t fsync;
+
+	/* Readahead; see readahead_fs */
+	readahead_type_t readahead;
+	uint64_t ra_next;   /* Where the next read would start if access is sequential */
+	uint64_t ra_window; /* How far ahead to read, or 0 when access isn't sequential */
+	uint64_t ra_end;    /* How far readahead has been started */
+
+	/* Vectored I/O; optional, see readv_fs */
+	readv_type_t readv;
+	writev_type_t writev;
 } fs_node_t;
 
 struct vfs_entry {
@@ -108,9 +129,13 @@ extern int pty_create(void *size, fs_node_t ** fs_master, fs_node_t ** fs_slave)
 int has_permission(fs_node_t *node, int permission_bit);
 ssize_t read_fs(fs_node_t *node,  off_t offset, size_t size, uint8_t *buffer);
 ssize_t write_fs(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer);
+ssize_t readv_fs(fs_node_t *node, off_t offset, const struct iovec * iov, int iovcnt);
+ssize_t writev_fs(fs_node_t *node, off_t offset, const struct iovec * iov, int iovcnt);
+ssize_t splice_fs(fs_node_t * in, off_t * in_offset, fs_node_t * out, off_t * out_offset, size_t len);
 void open_fs(fs_node_t *node, unsigned int flags);
 void close_fs(fs_node_t *node);
 struct dirent *readdir_fs(fs_node_t *node, unsigned long index);
+ssize_t getdents_fs(fs_node_t *node, uint64_t * cursor, struct dirent * out, size_t count);
 fs_node_t *finddir_fs(fs_node_t *node, char *name);
 int mkdir_fs(char *name, mode_t permission);
 int create_file_fs(char *name, mode_t permission);
@@ -125,7 +150,10 @@ int symlink_fs(char * value, char * name);
 ssize_t readlink_fs(fs_node_t * node, char * buf, size_t size);
 int selectcheck_fs(fs_node_t * node);
 int selectwait_fs(fs_node_t * node, void * process);
+void selectunwait_fs(fs_node_t * node, void * process);
 int truncate_fs(fs_node_t * node);
+int fsync_fs(fs_node_t * node, int datasync);
+void readahead_fs(fs_node_t * node, off_t offset, size_t size);
 
 void vfs_install(void);
 void * vfs_mount(const char * path, fs_node_t * local_root);
@@ -134,6 +162,10 @@ int vfs_register(const char * name, vfs_mount_callback callback);
 int vfs_mount_type(const char * type, const char * arg, const char * mountpoint);
 void vfs_lock(fs_node_t * node);
 
+fs_node_t * dcache_finddir(fs_node_t * parent, char * name, int leaf);
+void dcache_invalidate(fs_node_t * parent, char * name);
+void dcache_purge(void);
+
 /* Debug purposes only, please */
 void debug_print_vfs_tree(void);
 
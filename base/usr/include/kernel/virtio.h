@@ -0,0 +1,96 @@
+#pragma once
+/**
+ * @file kernel/virtio.h
+ * @brief Structures shared by virtio PCI drivers.
+ *
+ * Register layouts for the virtio 1.0 PCI transport, and the
+ * split virtqueue format.
+ */
+#include <stdint.h>
+
+/* Device status bits */
+#define VIRTIO_STATUS_ACKNOWLEDGE  1
+#define VIRTIO_STATUS_DRIVER       2
+#define VIRTIO_STATUS_DRIVER_OK    4
+#define VIRTIO_STATUS_FEATURES_OK  8
+#define VIRTIO_STATUS_FAILED       128
+
+/* Feature bits that aren't specific to a device type */
+#define VIRTIO_F_RING_INDIRECT_DESC 28
+#define VIRTIO_F_RING_EVENT_IDX     29
+#define VIRTIO_F_VERSION_1          32
+
+/* Vendor-specific PCI capabilities describing where each region is */
+#define VIRTIO_PCI_CAP_COMMON_CFG  1
+#define VIRTIO_PCI_CAP_NOTIFY_CFG  2
+#define VIRTIO_PCI_CAP_ISR_CFG     3
+#define VIRTIO_PCI_CAP_DEVICE_CFG  4
+
+#define VIRTIO_PCI_CAP_BAR         4  /* offsets into the capability */
+#define VIRTIO_PCI_CAP_OFFSET      8
+#define VIRTIO_PCI_CAP_LENGTH      12
+#define VIRTIO_PCI_CAP_NOTIFY_MULT 16
+
+struct virtio_common_cfg {
+	volatile uint32_t dev_feature_select;
+	volatile uint32_t dev_feature;
+	volatile uint32_t guest_feature_select;
+	volatile uint32_t guest_feature;
+	volatile uint16_t msix;
+	volatile uint16_t queues;
+	volatile uint8_t  device_status;
+	volatile uint8_t  config_generation;
+
+	volatile uint16_t queue_select;
+	volatile uint16_t queue_size;
+	volatile uint16_t queue_msix_vector;
+	volatile uint16_t queue_enable;
+	volatile uint16_t queue_notify_off;
+	/* queue stuff */
+
+	volatile uint64_t queue_desc;
+	volatile uint64_t queue_avail;
+	volatile uint64_t queue_used;
+};
+
+/* Split virtqueues */
+#define VIRTQ_DESC_F_NEXT      1
+#define VIRTQ_DESC_F_WRITE     2
+#define VIRTQ_DESC_F_INDIRECT  4
+
+#define VIRTQ_AVAIL_F_NO_INTERRUPT 1
+#define VIRTQ_USED_F_NO_NOTIFY     1
+
+struct virtq_desc {
+	uint64_t addr;
+	uint32_t len;
+	uint16_t flags;
+	uint16_t next;
+};
+
+/* With VIRTIO_F_RING_EVENT_IDX, ring[size] is used_event */
+struct virtq_avail {
+	uint16_t flags;
+	volatile uint16_t idx;
+	volatile uint16_t ring[];
+};
+
+struct virtq_used_elem {
+	uint32_t id;
+	uint32_t len;
+};
+
+/* With VIRTIO_F_RING_EVENT_IDX, the uint16_t after ring[size] is avail_event */
+struct virtq_used {
+	uint16_t flags;
+	volatile uint16_t idx;
+	volatile struct virtq_used_elem ring[];
+};
+
+/**
+ * Whether moving an index from @p old to @p new passed @p event,
+ * meaning the other side asked to be told about it.
+ */
+static inline int virtq_need_event(uint16_t event, uint16_t new, uint16_t old) {
+	return (uint16_t)(new - event - 1) < (uint16_t)(new - old);
+}
@@ -0,0 +1,33 @@
+#pragma once
+
+#include <_cheader.h>
+#include <stdint.h>
+
+_Begin_C_Header
+
+#define EVSET_ADD 1
+#define EVSET_DEL 2
+#define EVSET_MOD 3
+
+#define EVSET_IN   0x0001 /* readable, in the sense fswait uses */
+#define EVSET_EDGE 0x8000 /* report when the descriptor becomes ready, not while it is */
+
+#define EVSET_MAX_EVENTS 1024
+
+/**
+ * Interest in, and readiness of, one descriptor. @c data is not
+ * looked at by the kernel; it is handed back with each event.
+ */
+struct evset_event {
+	uint32_t events;
+	uint32_t _reserved;
+	uint64_t data;
+};
+
+#ifndef _KERNEL_
+extern int evset_create(int flags);
+extern int evset_ctl(int set, int op, int fd, struct evset_event * event);
+extern int evset_wait(int set, struct evset_event * events, int maxevents, int timeout);
+#endif
+
+_End_C_Header
@@ -13,5 +13,9 @@
 #define IOCTLSYNC     0x4F03
 
 #define IOCTL_PACKETFS_QUEUED 0x5050
+#define IOCTL_PACKETFS_BATCH  0x5051
+
+#define IOCTL_PIPE_GETSZ 0x5060
+#define IOCTL_PIPE_SETSZ 0x5061
 
 
@@ -0,0 +1,83 @@
+#pragma once
+
+#include <_cheader.h>
+#include <stdint.h>
+#include <stddef.h>
+
+_Begin_C_Header
+
+#define IORING_OP_NOP     0
+#define IORING_OP_READ    1  /* fd, off, addr = buffer, len */
+#define IORING_OP_WRITE   2  /* fd, off, addr = buffer, len */
+#define IORING_OP_READV   3  /* fd, off, addr = struct iovec[], len = count */
+#define IORING_OP_WRITEV  4  /* fd, off, addr = struct iovec[], len = count */
+#define IORING_OP_FSYNC   5  /* fd, op_flags = IORING_FSYNC_DATASYNC */
+#define IORING_OP_ACCEPT  6  /* fd, addr = struct sockaddr, addr2 = socklen_t */
+#define IORING_OP_RECV    7  /* fd, addr = struct msghdr, op_flags = msg flags */
+#define IORING_OP_SEND    8  /* fd, addr = struct msghdr, op_flags = msg flags */
+#define IORING_OP_TIMEOUT 9  /* off = microseconds; completes with -ETIME */
+
+#define IORING_FSYNC_DATASYNC 1
+
+#define IORING_MAX_ENTRIES 4096
+
+/**
+ * Submission entry. Reads and writes are always positional, like
+ * pread/pwrite; the descriptor's own position is neither used nor
+ * moved, and @c off is ignored for pipes, sockets and devices.
+ */
+struct ioring_sqe {
+	uint8_t  opcode;
+	uint8_t  flags;     /* reserved, must be 0 */
+	uint16_t _reserved;
+	int32_t  fd;
+	uint64_t off;
+	uint64_t addr;
+	uint32_t len;
+	uint32_t op_flags;
+	uint64_t user_data; /* copied to the completion */
+	uint64_t addr2;
+	uint64_t _pad[2];
+};
+
+struct ioring_cqe {
+	uint64_t user_data;
+	int64_t  res;       /* what the equivalent system call would return, errors as -errno */
+};
+
+/**
+ * Start of the shared ring. Userspace fills submission entries and
+ * moves sq_tail, and consumes completions by moving cq_head; the
+ * kernel moves the other two. All four only ever increase, and are
+ * masked to find the slot.
+ */
+struct ioring_header {
+	volatile uint32_t sq_head;
+	volatile uint32_t sq_tail;
+	volatile uint32_t cq_head;
+	volatile uint32_t cq_tail;
+	uint32_t sq_mask;
+	uint32_t cq_mask;
+	uint32_t sq_offset; /* of the ioring_sqe array, from the start of the ring */
+	uint32_t cq_offset; /* of the ioring_cqe array */
+	volatile uint32_t cq_overflow; /* completions held by the kernel until there is room */
+};
+
+#define IORING_SQES(h) ((struct ioring_sqe *)((char *)(h) + (h)->sq_offset))
+#define IORING_CQES(h) ((struct ioring_cqe *)((char *)(h) + (h)->cq_offset))
+
+struct ioring_params {
+	uint32_t sq_entries; /* in: rounded up to a power of two; out: actual */
+	uint32_t cq_entries; /* in: 0 for twice sq_entries; out: actual */
+	uint32_t flags;      /* reserved, must be 0 */
+	uint32_t _reserved;
+	void *   ring;       /* out: the shared ring, starting with an ioring_header */
+	size_t   ring_size;  /* out */
+};
+
+#ifndef _KERNEL_
+extern int ioring_setup(struct ioring_params * params);
+extern int ioring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags);
+#endif
+
+_End_C_Header
@@ -0,0 +1,12 @@
+#pragma once
+
+#include <_cheader.h>
+#include <sys/types.h>
+
+_Begin_C_Header
+
+#ifndef _KERNEL_
+extern ssize_t sendfile(int out_fd, int in_fd, off_t * offset, size_t count);
+#endif
+
+_End_C_Header
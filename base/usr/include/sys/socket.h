@@ -3,6 +3,7 @@
 #include <_cheader.h>
 #include <stdint.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 
 _Begin_C_Header
 
@@ -42,11 +43,6 @@ struct addrinfo {
 	struct addrinfo *ai_next;
 };
 
-struct iovec {                    /* Scatter/gather array items */
-	void  *iov_base;              /* Starting address */
-	size_t iov_len;               /* Number of bytes to transfer */
-};
-
 struct msghdr {
 	void         *msg_name;       /* optional address */
 	socklen_t     msg_namelen;    /* size of address */
@@ -29,8 +29,9 @@ typedef int pid_t;
 
 #define FD_SETSIZE 64 /* compatibility with newlib */
 typedef unsigned int fd_mask;
+#define NFDBITS (8 * sizeof(fd_mask))
 typedef struct _fd_set {
-    fd_mask fds_bits[1]; /* should be 64 bits */
+    fd_mask fds_bits[FD_SETSIZE / NFDBITS];
 } fd_set;
 
 _End_C_Header
@@ -222,6 +222,20 @@ DECL_SYSCALL2(setgroups, int, const int*);
 DECL_SYSCALL1(times, struct tms*);
 DECL_SYSCALL4(ptrace, int, int, void*, void*);
 DECL_SYSCALL2(settimeofday, void *, void *);
+DECL_SYSCALL3(getdents, int, void *, size_t);
+DECL_SYSCALL1(fsync, int);
+DECL_SYSCALL1(fdatasync, int);
+DECL_SYSCALL3(readv, int, const void *, int);
+DECL_SYSCALL3(writev, int, const void *, int);
+DECL_SYSCALL4(pread, int, char *, size_t, long);
+DECL_SYSCALL4(pwrite, int, char *, size_t, long);
+DECL_SYSCALL4(sendfile, int, int, long *, size_t);
+DECL_SYSCALL5(splice, int, long *, int, long *, size_t);
+DECL_SYSCALL1(ioring_setup, void *);
+DECL_SYSCALL4(ioring_enter, int, unsigned int, unsigned int, unsigned int);
+DECL_SYSCALL1(evset_create, int);
+DECL_SYSCALL4(evset_ctl, int, int, int, void *);
+DECL_SYSCALL4(evset_wait, int, void *, int, int);
 
 _End_C_Header
 
@@ -73,3 +73,17 @@
 #define SYS_SETGROUPS 70
 #define SYS_TIMES 71
 #define SYS_SETTIMEOFDAY 72
+#define SYS_GETDENTS 73
+#define SYS_FSYNC 74
+#define SYS_FDATASYNC 75
+#define SYS_READV 76
+#define SYS_WRITEV 77
+#define SYS_PREAD 78
+#define SYS_PWRITE 79
+#define SYS_SENDFILE 80
+#define SYS_SPLICE 81
+#define SYS_IORING_SETUP 82
+#define SYS_IORING_ENTER 83
+#define SYS_EVSET_CREATE 84
+#define SYS_EVSET_CTL 85
+#define SYS_EVSET_WAIT 86
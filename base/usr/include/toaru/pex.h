@@ -3,6 +3,7 @@
 #include <_cheader.h>
 #include <stdint.h>
 #include <stdio.h>
+#include <sys/uio.h>
 
 _Begin_C_Header
 
@@ -14,6 +15,13 @@ typedef struct pex_packet {
 #define MAX_PACKET_SIZE 1024
 #define PACKET_SIZE (sizeof(pex_packet_t) + MAX_PACKET_SIZE)
 
+/*
+ * In batch mode, each read returns packets back to back as
+ * pex_packet_t records, each starting on a word boundary.
+ */
+#define PEX_RECORD_SIZE(size) ((sizeof(pex_packet_t) + (size) + sizeof(uintptr_t) - 1) & ~(sizeof(uintptr_t) - 1))
+#define PEX_NEXT_RECORD(packet) ((pex_packet_t *)((char *)(packet) + PEX_RECORD_SIZE((packet)->size)))
+
 typedef struct pex_header {
 	uintptr_t target;
 	uint8_t data[];
@@ -27,6 +35,10 @@ extern size_t pex_reply(FILE * sock, size_t size, char * blob);
 extern size_t pex_recv(FILE * sock, char * blob);
 extern size_t pex_query(FILE * sock);
 
+extern int pex_batch(FILE * sock, int enable);
+extern size_t pex_listen_batch(FILE * sock, void * buffer, size_t size);
+extern size_t pex_send_batch(FILE * sock, struct iovec * packets, int count);
+
 extern FILE * pex_bind(char * target);
 extern FILE * pex_connect(char * target);
 
@@ -38,6 +38,9 @@ _Begin_C_Header
 #define yutani_msg_buildx_window_show_mouse_alloc(out) char _yutani_tmp_ ## LINE [sizeof(struct yutani_message) + sizeof(struct yutani_msg_window_show_mouse)]; yutani_msg_t * out = (void *)&_yutani_tmp_ ## LINE;
 #define yutani_msg_buildx_window_resize_start_alloc(out) char _yutani_tmp_ ## LINE [sizeof(struct yutani_message) + sizeof(struct yutani_msg_window_resize_start)]; yutani_msg_t * out = (void *)&_yutani_tmp_ ## LINE;
 #define yutani_msg_buildx_special_request_alloc(out) char _yutani_tmp_ ## LINE [sizeof(struct yutani_message) + sizeof(struct yutani_msg_special_request)]; yutani_msg_t * out = (void *)&_yutani_tmp_ ## LINE;
+#define yutani_msg_buildx_ring_request_alloc(out) char _yutani_tmp_ ## LINE [sizeof(struct yutani_message)]; yutani_msg_t * out = (void *)&_yutani_tmp_ ## LINE;
+#define yutani_msg_buildx_ring_init_alloc(out) char _yutani_tmp_ ## LINE [sizeof(struct yutani_message) + sizeof(struct yutani_msg_ring_init)]; yutani_msg_t * out = (void *)&_yutani_tmp_ ## LINE;
+#define yutani_msg_buildx_ring_doorbell_alloc(out) char _yutani_tmp_ ## LINE [sizeof(struct yutani_message)]; yutani_msg_t * out = (void *)&_yutani_tmp_ ## LINE;
 #define yutani_msg_buildx_clipboard_alloc(out, length) char _yutani_tmp_ ## LINE [sizeof(struct yutani_message) + sizeof(struct yutani_msg_clipboard)+length]; yutani_msg_t * out = (void *)&_yutani_tmp_ ## LINE;
 
 extern void yutani_msg_buildx_hello(yutani_msg_t * msg);
@@ -71,5 +74,51 @@ extern void yutani_msg_buildx_window_show_mouse(yutani_msg_t * msg, yutani_wid_t
 extern void yutani_msg_buildx_window_resize_start(yutani_msg_t * msg, yutani_wid_t wid, yutani_scale_direction_t direction);
 extern void yutani_msg_buildx_special_request(yutani_msg_t * msg, yutani_wid_t wid, uint32_t request);
 extern void yutani_msg_buildx_clipboard(yutani_msg_t * msg, char * content);
+extern void yutani_msg_buildx_ring_request(yutani_msg_t * msg);
+extern void yutani_msg_buildx_ring_init(yutani_msg_t * msg, uint32_t bufid, uint32_t size);
+extern void yutani_msg_buildx_ring_doorbell(yutani_msg_t * msg);
+
+/*
+ * Message rings
+ *
+ * A client and the server can share a pair of single-producer,
+ * single-consumer rings, so that most messages are passed without
+ * a system call. The reader of a ring marks it idle when it finds
+ * it empty; the next writer to claim that flag sends a
+ * YUTANI_MSG_RING_DOORBELL over the socket, which is how the reader
+ * knows to look again. Both sides count the doorbells, sent and
+ * received, and a reader stops when it sees one is still on its
+ * way, so it rarely wakes up to find it has already read what it
+ * was woken for.
+ */
+#define YUTANI_RING_SIZE 0x8000
+
+#define YUTANI_RING_PAD  0x2 /* the rest of the ring is unused; wrap */
+
+typedef struct yutani_ring_record {
+	uint32_t size;
+	uint32_t flags;
+	uint8_t data[];
+} yutani_ring_record_t;
+
+typedef struct yutani_ring {
+	volatile uint32_t head;     /* written by the producer */
+	volatile uint32_t rung;     /* doorbells sent, by the producer */
+	uint32_t _pad0[14];
+	volatile uint32_t tail;     /* written by the consumer */
+	volatile uint32_t idle;     /* set by the consumer, claimed by the producer */
+	volatile uint32_t answered; /* doorbells received, by the consumer */
+	uint32_t _pad1[13];
+	uint8_t data[YUTANI_RING_SIZE];
+} yutani_ring_t;
+
+typedef struct yutani_rings {
+	yutani_ring_t to_server;
+	yutani_ring_t to_client;
+} yutani_rings_t;
+
+extern void yutani_ring_init(yutani_ring_t * ring);
+extern int yutani_ring_write(yutani_ring_t * ring, yutani_msg_t * msg);
+extern int yutani_ring_read(yutani_ring_t * ring, int * first, yutani_msg_t * out);
 
 _End_C_Header
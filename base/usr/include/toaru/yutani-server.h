@@ -282,6 +282,12 @@ typedef struct YutaniGlobals {
 	/* Map of clients to their windows */
 	hashmap_t * clients_to_windows;
 
+	/* Map of clients to their message rings */
+	hashmap_t * clients_to_rings;
+
+	/* How many of those rings are owed a doorbell we couldn't send */
+	int doorbells_owed;
+
 	/* Toggles for debugging window locations */
 	int debug_bounds;
 	int debug_shapes;
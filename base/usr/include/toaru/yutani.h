@@ -43,6 +43,11 @@ typedef struct yutani_context {
 
 	/* server identifier string */
 	char * server_ident;
+
+	/* shared-memory message rings, if the server gave us some */
+	struct yutani_rings * rings;
+	uint32_t rings_bufid;
+	volatile int rings_lock;
 } yutani_t;
 
 typedef struct yutani_window {
@@ -100,6 +105,11 @@ struct yutani_msg_flip {
 	yutani_wid_t wid;
 };
 
+struct yutani_msg_ring_init {
+	uint32_t bufid;
+	uint32_t size;
+};
+
 struct yutani_msg_window_close {
 	yutani_wid_t wid;
 };
@@ -303,6 +313,9 @@ struct yutani_msg_clipboard {
 
 #define YUTANI_MSG_CLIPBOARD           0x00000060
 
+#define YUTANI_MSG_RING_REQUEST        0x00000070
+#define YUTANI_MSG_RING_DOORBELL       0x00000071
+
 #define YUTANI_MSG_GOODBYE             0x000000F0
 
 /* Special request (eg. one-off single-shot requests like "please maximize me" */
@@ -311,6 +324,7 @@ struct yutani_msg_clipboard {
 /* Server responses */
 #define YUTANI_MSG_WELCOME             0x00010001
 #define YUTANI_MSG_WINDOW_INIT         0x00010002
+#define YUTANI_MSG_RING_INIT           0x00010003
 
 /*
  * YUTANI_ZORDER
@@ -44,6 +44,8 @@ extern int tcsetpgrp(int fd, pid_t pgrp);
 
 extern ssize_t write(int fd, const void * buf, size_t count);
 extern ssize_t read(int fd, void * buf, size_t count);
+extern ssize_t pwrite(int fd, const void * buf, size_t count, off_t offset);
+extern ssize_t pread(int fd, void * buf, size_t count, off_t offset);
 
 extern int symlink(const char *target, const char *linkpath);
 extern ssize_t readlink(const char *pathname, char *buf, size_t bufsiz);
@@ -99,6 +101,8 @@ extern unsigned int alarm(unsigned int seconds);
 extern void *sbrk(intptr_t increment);
 
 extern void sync(void);
+extern int fsync(int fd);
+extern int fdatasync(int fd);
 extern int truncate(const char *, off_t);
 
 #define _PC_PATH_MAX 1
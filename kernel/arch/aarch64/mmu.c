@@ -855,6 +855,36 @@ int mmu_validate_user_pointer(void * addr, size_t size, int flags) {
 	return 1;
 }
 
+/**
+ * @brief User memory accessors.
+ *
+ * We don't have an exception table for EL1 faults on this port yet,
+ * so these fall back to walking the page tables before touching
+ * anything. They share the x86-64 calling conventions.
+ */
+size_t arch_user_copy(void * dest, const void * src, size_t n) {
+	if ((uintptr_t)dest < 0x800000000000 && !mmu_validate_user_pointer(dest, n, MMU_PTR_NULL | MMU_PTR_WRITE)) return n;
+	if ((uintptr_t)src < 0x800000000000 && !mmu_validate_user_pointer((void*)src, n, MMU_PTR_NULL)) return n;
+	memcpy(dest, src, n);
+	return 0;
+}
+
+size_t arch_user_strnlen(const char * src, size_t max) {
+	size_t len = 0;
+	while (len < max) {
+		if (!(len & 0xFFF) || !(((uintptr_t)src + len) & 0xFFF)) {
+			if (!mmu_validate_user_pointer((void*)(src + len), 1, 0)) return (size_t)-1;
+		}
+		if (!src[len]) break;
+		len++;
+	}
+	return len;
+}
+
+int arch_user_probe(const void * addr, int write) {
+	return mmu_validate_user_pointer((void*)addr, 1, write ? MMU_PTR_WRITE : 0) ? 0 : -1;
+}
+
 static uintptr_t k2p(void * x) {
 	return ((uintptr_t)x - MODULE_BASE_START) + aarch64_kernel_phys_base;
 }
@@ -17,6 +17,7 @@
 #include <kernel/video.h>
 #include <kernel/mouse.h>
 #include <kernel/time.h>
+#include <kernel/virtio.h>
 
 #include <kernel/arch/aarch64/gic.h>
 
@@ -41,28 +42,6 @@ struct virtio_device_cfg {
 	} data;
 };
 
-struct virtio_common_cfg {
-	volatile uint32_t dev_feature_select;
-	volatile uint32_t dev_feature;
-	volatile uint32_t guest_feature_select;
-	volatile uint32_t guest_feature;
-	volatile uint16_t msix;
-	volatile uint16_t queues;
-	volatile uint8_t  device_status;
-	volatile uint8_t  config_generation;
-
-	volatile uint16_t queue_select;
-	volatile uint16_t queue_size;
-	volatile uint16_t queue_msix_vector;
-	volatile uint16_t queue_enable;
-	volatile uint16_t queue_notify_off;
-	/* queue stuff */
-
-	volatile uint64_t queue_desc;
-	volatile uint64_t queue_avail;
-	volatile uint64_t queue_used;
-};
-
 struct virtio_buffer {
 	uint64_t  addr;
 	uint32_t  length;
@@ -380,6 +380,31 @@ static void map_more_stack(uintptr_t fromAddr) {
 	spin_unlock(proc->image.lock);
 }
 
+struct exception_table_entry {
+	uintptr_t insn;
+	uintptr_t fixup;
+};
+
+extern const struct exception_table_entry __start_ex_table[];
+extern const struct exception_table_entry __stop_ex_table[];
+
+/**
+ * @brief Find the fixup address for a faulting kernel instruction.
+ *
+ * The user memory accessors in @ref usercopy.S register each instruction
+ * that may fault on a user address, so that a bad pointer passed to a
+ * system call becomes an error return instead of a kernel panic.
+ *
+ * @param ip Instruction pointer of the faulting instruction.
+ * @returns The address to resume at, or 0 if @p ip is not a user accessor.
+ */
+static uintptr_t search_exception_table(uintptr_t ip) {
+	for (const struct exception_table_entry * e = __start_ex_table; e < __stop_ex_table; ++e) {
+		if (e->insn == ip) return e->fixup;
+	}
+	return 0;
+}
+
 /**
  * @brief Handle fatal exceptions.
  *
@@ -511,9 +536,24 @@ static void _page_fault(struct regs * r) {
 		if (!mmu_copy_on_write(faulting_address)) return;
 	}
 
-	/* Was this a kernel page fault? Those are always a panic. */
+	/* Was this a kernel page fault? */
 	if (!this_core->current_process || r->cs == 0x08) {
-		panic("Page fault in kernel", r, faulting_address);
+		uintptr_t fixup = this_core->current_process ? search_exception_table(r->rip) : 0;
+
+		/* Faults outside of the user accessors are always a panic. */
+		if (!fixup || faulting_address >= 0x800000000000) {
+			panic("Page fault in kernel", r, faulting_address);
+		}
+
+		/* A user accessor touched the stack region; grow it and retry. */
+		if (faulting_address > 0x700000000000) {
+			map_more_stack(faulting_address & 0xFFFFffffFFFFf000);
+			return;
+		}
+
+		/* Otherwise, resume at the fixup and let the accessor report the fault. */
+		r->rip = fixup;
+		return;
 	}
 
 	/* Page was present but not writable */
@@ -57,6 +57,12 @@ static void irq_remap(void) {
 }
 
 void irq_ack(size_t irq_no) {
+	/* Devices using MSI raise the same vectors, but through the local APIC */
+	if (msi_in_service(irq_no)) {
+		msi_ack();
+		return;
+	}
+
 	if (irq_no >= 8) {
 		outportb(PIC2_COMMAND, PIC_EOI);
 	}
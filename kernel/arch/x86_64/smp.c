@@ -251,6 +251,47 @@ void lapic_send_ipi(int i, uint32_t val) {
 	do { asm volatile ("pause" : : : "memory"); } while (lapic_read(0x300) & (1 << 12));
 }
 
+/**
+ * @brief Build an MSI message that raises a legacy IRQ vector.
+ *
+ * The message is delivered straight to a local APIC, bypassing the
+ * PIC, so it must be acknowledged with msi_ack instead of irq_ack.
+ * The bootstrap processor doesn't enable its local APIC, so messages
+ * are sent to the first AP; without one there is nowhere to send
+ * them, and drivers should stay on their legacy interrupt line.
+ *
+ * @param irq     IRQ number whose handler chain should run.
+ * @param address Filled in with the message address.
+ * @param data    Filled in with the message data.
+ * @return 0 on success, -1 if MSI can't be used.
+ */
+int msi_message(int irq, uint64_t * address, uint32_t * data) {
+	if (!lapic_final || processor_count < 2) return -1;
+	if (irq < 0 || irq >= 16) return -1;
+	*address = 0xFEE00000 | (processor_local_data[1].lapic_id << 12);
+	*data = 32 + irq; /* fixed, edge triggered */
+	return 0;
+}
+
+/**
+ * @brief Check whether an IRQ vector came from an MSI.
+ *
+ * Legacy interrupts on the same line come through the PIC and
+ * never appear in the local APIC's in-service register.
+ */
+int msi_in_service(int irq) {
+	if (!lapic_final) return 0;
+	int vector = 32 + irq;
+	return !!(lapic_read(0x100 + 0x10 * (vector / 32)) & (1 << (vector % 32)));
+}
+
+/**
+ * @brief Acknowledge an interrupt delivered by MSI.
+ */
+void msi_ack(void) {
+	lapic_write(0xB0, 0);
+}
+
 /**
  * @brief Quick dumb hex parser.
  *
@@ -23,6 +23,7 @@
 #include <kernel/list.h>
 #include <kernel/printf.h>
 #include <kernel/spinlock.h>
+#include <kernel/syscall.h>
 
 #include <kernel/mod/snd.h>
 #include <errno.h>
@@ -182,46 +183,53 @@ static snd_device_t * snd_device_by_id(uint32_t device_id) {
 static int snd_mixer_ioctl(fs_node_t * node, unsigned long request, void * argp) {
 	switch (request) {
 		case SND_MIXER_GET_KNOBS: {
-			snd_knob_list_t * list = argp;
-			snd_device_t * device = snd_device_by_id(list->device);
+			snd_knob_list_t list;
+			if (copy_from_user(&list, argp, sizeof(list))) return -EFAULT;
+			snd_device_t * device = snd_device_by_id(list.device);
 			if (!device) {
 				return -EINVAL;
 			}
-			list->num = device->num_knobs;
-			for (uint32_t i = 0; i < device->num_knobs; i++) {
-				list->ids[i] = device->knobs[i].id;
+			list.num = device->num_knobs;
+			if (list.num > SND_MAX_KNOBS) list.num = SND_MAX_KNOBS;
+			for (uint32_t i = 0; i < list.num; i++) {
+				list.ids[i] = device->knobs[i].id;
 			}
-			return 0;
+			return copy_to_user(argp, &list, sizeof(list));
 		}
 		case SND_MIXER_GET_KNOB_INFO: {
-			snd_knob_info_t * info = argp;
-			snd_device_t * device = snd_device_by_id(info->device);
+			snd_knob_info_t info;
+			if (copy_from_user(&info, argp, sizeof(info))) return -EFAULT;
+			snd_device_t * device = snd_device_by_id(info.device);
 			if (!device) {
 				return -EINVAL;
 			}
 			for (uint32_t i = 0; i < device->num_knobs; i++) {
-				if (device->knobs[i].id == info->id) {
-					memcpy(info->name, device->knobs[i].name, sizeof(info->name));
-					return 0;
+				if (device->knobs[i].id == info.id) {
+					memcpy(info.name, device->knobs[i].name, sizeof(info.name));
+					return copy_to_user(argp, &info, sizeof(info));
 				}
 			}
 			return -EINVAL;
 		}
 		case SND_MIXER_READ_KNOB: {
-			snd_knob_value_t * value = argp;
-			snd_device_t * device = snd_device_by_id(value->device);
+			snd_knob_value_t value;
+			if (copy_from_user(&value, argp, sizeof(value))) return -EFAULT;
+			snd_device_t * device = snd_device_by_id(value.device);
 			if (!device) {
 				return -EINVAL;
 			}
-			return device->mixer_read(value->id, &value->val);
+			int result = device->mixer_read(value.id, &value.val);
+			if (result) return result;
+			return copy_to_user(argp, &value, sizeof(value));
 		}
 		case SND_MIXER_WRITE_KNOB: {
-			snd_knob_value_t * value = argp;
-			snd_device_t * device = snd_device_by_id(value->device);
+			snd_knob_value_t value;
+			if (copy_from_user(&value, argp, sizeof(value))) return -EFAULT;
+			snd_device_t * device = snd_device_by_id(value.device);
 			if (!device) {
 				return -EINVAL;
 			}
-			return device->mixer_write(value->id, value->val);
+			return device->mixer_write(value.id, value.val);
 		}
 		default: {
 			return -EINVAL;
@@ -238,8 +246,6 @@ static void snd_mixer_close(fs_node_t * node) {
 }
 
 int snd_request_buf(snd_device_t * device, uint32_t size, uint8_t *buffer) {
-	static int16_t tmp_buf[0x100];
-
 	memset(buffer, 0, size);
 
 	spin_lock(_buffers_lock);
@@ -250,20 +256,20 @@ int snd_request_buf(snd_device_t * device, uint32_t size, uint8_t *buffer) {
 		size_t bytes_left = MIN(ring_buffer_unread(buf) & ~0x3, size);
 		int16_t * adding_ptr = (int16_t *) buffer;
 		while (bytes_left) {
-			size_t this_read_size = MIN(bytes_left, sizeof(tmp_buf));
-			ring_buffer_read(buf, this_read_size, (uint8_t *)tmp_buf);
-			dsp->samples += this_read_size / 4; /* 16 bits, 2 channels */
+			/* The mixer is the only reader, so it can mix straight out of the ring */
+			uint8_t * data;
+			size_t this_read_size = MIN(ring_buffer_peek(buf, &data), bytes_left);
+			int16_t * samples = (int16_t *)data;
 			/*
 			 * Reduce the sample by a half so that multiple sources won't immediately
 			 * cause awful clipping. This is kind of a hack since it would probably be
 			 * better to just use some kind of compressor.
 			 */
-			for (size_t i = 0; i < N_ELEMENTS(tmp_buf); i++) {
-				tmp_buf[i] /= 2;
-			}
 			for (size_t i = 0; i < this_read_size / sizeof(*adding_ptr); i++) {
-				adding_ptr[i] += tmp_buf[i];
+				adding_ptr[i] += samples[i] / 2;
 			}
+			ring_buffer_commit_read(buf, this_read_size);
+			dsp->samples += this_read_size / 4; /* 16 bits, 2 channels */
 			adding_ptr += this_read_size / sizeof(*adding_ptr);
 			bytes_left -= this_read_size;
 		}
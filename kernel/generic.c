@@ -24,6 +24,7 @@
 extern int system(const char * path, int argc, const char ** argv, const char ** envin);
 extern void tarfs_register_init(void);
 extern void tmpfs_register_init(void);
+extern void overlayfs_register_init(void);
 extern void tasking_start(void);
 extern void packetfs_initialize(void);
 extern void zero_initialize(void);
@@ -34,14 +35,23 @@ extern void snd_install(void);
 extern void net_install(void);
 extern void console_initialize(void);
 extern void modules_install(void);
+extern void bcache_initialize(void);
+extern void blkdev_initialize(void);
+extern void dcache_initialize(void);
+extern void readahead_initialize(void);
+extern void ioring_initialize(void);
 
 void generic_startup(void) {
 	args_parse(arch_get_cmdline());
 	initialize_process_tree();
 	shm_install();
 	vfs_install();
+	bcache_initialize();
+	blkdev_initialize();
+	dcache_initialize();
 	tarfs_register_init();
 	tmpfs_register_init();
+	overlayfs_register_init();
 	map_vfs_directory("/dev");
 	console_initialize();
 	packetfs_initialize();
@@ -51,6 +61,8 @@ void generic_startup(void) {
 	snd_install();
 	net_install();
 	tasking_start();
+	readahead_initialize();
+	ioring_initialize();
 	modules_install();
 }
 
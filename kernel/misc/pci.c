@@ -9,7 +9,8 @@
  * This used to have methods for dealing with ISA bridge IRQ remapping,
  * but it has been removed for the moment.
  *
- * TODO: Implement MSI configuration?
+ * MSI can be configured here, but where the messages go is up to
+ * the architecture; see msi_message on x86-64.
  *
  * @copyright
  * This file is part of ToaruOS and is released under the terms
@@ -39,7 +40,17 @@ uintptr_t pcie_ecam_phys = 0x3f000000;
 void pci_write_field(uint32_t device, int field, int size, uint32_t value) {
 #ifdef __x86_64__
 	outportl(PCI_ADDRESS_PORT, pci_get_addr(device, field));
-	outportl(PCI_VALUE_PORT, value);
+
+	/* The address selects a whole dword; narrower fields are written through their own byte lanes */
+	if (size == 4) {
+		outportl(PCI_VALUE_PORT, value);
+	} else if (size == 2) {
+		outports(PCI_VALUE_PORT + (field & 2), value);
+	} else if (size == 1) {
+		outportb(PCI_VALUE_PORT + (field & 3), value);
+	} else {
+		dprintf("rejected invalid field write\n");
+	}
 #else
 
 	/* ECAM space */
@@ -172,3 +183,127 @@ void pci_scan(pci_func_t f, int type, void * extra) {
 int pci_get_interrupt(uint32_t device) {
 	return pci_read_field(device, PCI_INTERRUPT_LINE, 1);
 }
+
+/**
+ * @brief Find a capability in a device's capability list.
+ *
+ * @param device PCI device address
+ * @param id     Capability ID, such as PCI_CAP_MSI
+ * @return Offset of the capability in config space, or 0 if it is absent.
+ */
+int pci_find_capability(uint32_t device, int id) {
+	if (!(pci_read_field(device, PCI_STATUS, 2) & PCI_STATUS_CAPABILITIES)) return 0;
+
+	int offset = pci_read_field(device, PCI_CAPABILITIES, 1) & 0xFC;
+	for (int limit = 48; offset && limit; --limit) {
+		if ((int)pci_read_field(device, offset, 1) == id) return offset;
+		offset = pci_read_field(device, offset + 1, 1) & 0xFC;
+	}
+
+	return 0;
+}
+
+/**
+ * @brief Point a device's MSI capability at a single message.
+ *
+ * Only one vector is used, whatever the device asks for. Legacy
+ * INTx is disabled once MSI is on.
+ *
+ * @return 0 on success, -1 if the device has no MSI capability or
+ *         it wouldn't turn on.
+ */
+int pci_enable_msi(uint32_t device, uint64_t address, uint32_t data) {
+	int cap = pci_find_capability(device, PCI_CAP_MSI);
+	if (!cap) return -1;
+
+	uint16_t control = pci_read_field(device, cap + 2, 2);
+	control &= ~((7 << 4) | 1); /* one message, disabled while we set it up */
+	pci_write_field(device, cap + 2, 2, control);
+
+	pci_write_field(device, cap + 4, 4, address & 0xFFFFFFFF);
+	if (control & (1 << 7)) {
+		/* 64-bit capable */
+		pci_write_field(device, cap + 8, 4, address >> 32);
+		pci_write_field(device, cap + 12, 2, data);
+	} else {
+		pci_write_field(device, cap + 8, 2, data);
+	}
+
+	pci_write_field(device, cap + 2, 2, control | 1);
+	if (!(pci_read_field(device, cap + 2, 2) & 1)) {
+		pci_write_field(device, cap + 2, 2, control);
+		return -1;
+	}
+
+	uint16_t command = pci_read_field(device, PCI_COMMAND, 2);
+	pci_write_field(device, PCI_COMMAND, 2, command | PCI_COMMAND_INTX_DISABLE);
+
+	return 0;
+}
+
+/**
+ * @brief Enable MSI-X, with the first @p vectors table entries all
+ *        sending the same message.
+ *
+ * Drivers can still give each of their queues its own table entry,
+ * so they don't need to change if those are ever pointed at
+ * different places.
+ *
+ * @return The number of entries set up, or -1 if the device has no
+ *         MSI-X capability or it wouldn't turn on.
+ */
+int pci_enable_msix(uint32_t device, int vectors, uint64_t address, uint32_t data) {
+	int cap = pci_find_capability(device, PCI_CAP_MSIX);
+	if (!cap) return -1;
+
+	uint16_t control = pci_read_field(device, cap + 2, 2);
+	int size = (control & 0x7FF) + 1;
+	if (vectors > size) vectors = size;
+
+	uint32_t table = pci_read_field(device, cap + 4, 4);
+	int bir = table & 7;
+	uint64_t bar = pci_read_field(device, PCI_BAR0 + bir * 4, 4);
+	if (bar & 1) return -1;
+	if ((bar & 0x6) == 0x4) bar |= (uint64_t)pci_read_field(device, PCI_BAR0 + bir * 4 + 4, 4) << 32;
+	bar &= ~0xFUL;
+
+	/* Masked as a whole while the table is written */
+	pci_write_field(device, cap + 2, 2, control | (1 << 15) | (1 << 14));
+
+	uint64_t phys = bar + (table & ~7);
+	uint64_t page = phys & ~0xFFFUL;
+	size_t length = ((phys + size * 16 + 0xFFF) & ~0xFFFUL) - page;
+	volatile uint32_t * entries = (volatile uint32_t *)((char *)mmu_map_mmio_region(page, length) + (phys - page));
+
+	for (int i = 0; i < vectors; ++i) {
+		entries[i * 4 + 0] = address & 0xFFFFFFFF;
+		entries[i * 4 + 1] = address >> 32;
+		entries[i * 4 + 2] = data;
+		entries[i * 4 + 3] = 0; /* unmasked */
+	}
+
+	pci_write_field(device, cap + 2, 2, (control | (1 << 15)) & ~(1 << 14));
+	if ((pci_read_field(device, cap + 2, 2) & ((1 << 15) | (1 << 14))) != (1 << 15)) {
+		pci_write_field(device, cap + 2, 2, control & ~((1 << 15) | (1 << 14)));
+		return -1;
+	}
+
+	uint16_t command = pci_read_field(device, PCI_COMMAND, 2);
+	pci_write_field(device, PCI_COMMAND, 2, command | PCI_COMMAND_INTX_DISABLE);
+
+	return vectors;
+}
+
+/**
+ * @brief Find out which kind of message interrupts a device is using.
+ *
+ * @return PCI_CAP_MSIX or PCI_CAP_MSI if that is enabled (and, for
+ *         MSI-X, not masked as a whole), or 0 for neither.
+ */
+int pci_msi_active(uint32_t device) {
+	int cap = pci_find_capability(device, PCI_CAP_MSIX);
+	if (cap && (pci_read_field(device, cap + 2, 2) & ((1 << 15) | (1 << 14))) == (1 << 15)) return PCI_CAP_MSIX;
+	cap = pci_find_capability(device, PCI_CAP_MSI);
+	if (cap && (pci_read_field(device, cap + 2, 2) & 1)) return PCI_CAP_MSI;
+	return 0;
+}
@@ -22,14 +22,34 @@
 #include <kernel/printf.h>
 #include <kernel/mmu.h>
 
+/*
+ * Each side owns one pointer: only readers move read_ptr and only
+ * writers move write_ptr, and each publishes its pointer after the
+ * data it covers. With one reader and one writer the two never wait
+ * on each other; read_lock and write_lock only order several readers,
+ * or several writers, among themselves. The main lock is taken just
+ * to sleep, or to wake a sleeper on the other side, and a side only
+ * does that when the other has said it is waiting.
+ */
+
+static inline size_t ring_buffer_load(volatile size_t * ptr) {
+	return __atomic_load_n(ptr, __ATOMIC_ACQUIRE);
+}
+
+static inline void ring_buffer_publish(volatile size_t * ptr, size_t value) {
+	__atomic_store_n(ptr, value, __ATOMIC_RELEASE);
+}
+
 size_t ring_buffer_unread(ring_buffer_t * ring_buffer) {
-	if (ring_buffer->read_ptr == ring_buffer->write_ptr) {
+	size_t read_ptr = ring_buffer_load(&ring_buffer->read_ptr);
+	size_t write_ptr = ring_buffer_load(&ring_buffer->write_ptr);
+	if (read_ptr == write_ptr) {
 		return 0;
 	}
-	if (ring_buffer->read_ptr > ring_buffer->write_ptr) {
-		return (ring_buffer->size - ring_buffer->read_ptr) + ring_buffer->write_ptr;
+	if (read_ptr > write_ptr) {
+		return (ring_buffer->size - read_ptr) + write_ptr;
 	} else {
-		return (ring_buffer->write_ptr - ring_buffer->read_ptr);
+		return (write_ptr - read_ptr);
 	}
 }
 
@@ -39,28 +59,16 @@ size_t ring_buffer_size(fs_node_t * node) {
 }
 
 size_t ring_buffer_available(ring_buffer_t * ring_buffer) {
-	if (ring_buffer->read_ptr == ring_buffer->write_ptr) {
+	size_t read_ptr = ring_buffer_load(&ring_buffer->read_ptr);
+	size_t write_ptr = ring_buffer_load(&ring_buffer->write_ptr);
+	if (read_ptr == write_ptr) {
 		return ring_buffer->size - 1;
 	}
 
-	if (ring_buffer->read_ptr > ring_buffer->write_ptr) {
-		return ring_buffer->read_ptr - ring_buffer->write_ptr - 1;
+	if (read_ptr > write_ptr) {
+		return read_ptr - write_ptr - 1;
 	} else {
-		return (ring_buffer->size - ring_buffer->write_ptr) + ring_buffer->read_ptr - 1;
-	}
-}
-
-static inline void ring_buffer_increment_read(ring_buffer_t * ring_buffer) {
-	ring_buffer->read_ptr++;
-	if (ring_buffer->read_ptr == ring_buffer->size) {
-		ring_buffer->read_ptr = 0;
-	}
-}
-
-static inline void ring_buffer_increment_write(ring_buffer_t * ring_buffer) {
-	ring_buffer->write_ptr++;
-	if (ring_buffer->write_ptr == ring_buffer->size) {
-		ring_buffer->write_ptr = 0;
+		return (ring_buffer->size - write_ptr) + read_ptr - 1;
 	}
 }
 
@@ -86,82 +94,230 @@ void ring_buffer_select_wait(ring_buffer_t * ring_buffer, void * process) {
 	list_insert(((process_t *)process)->node_waits, ring_buffer);
 }
 
-size_t ring_buffer_read(ring_buffer_t * ring_buffer, size_t size, uint8_t * buffer) {
-	size_t collected = 0;
-	while (collected == 0) {
+void ring_buffer_select_unwait(ring_buffer_t * ring_buffer, void * process) {
+	if (!ring_buffer->alert_waiters) return;
+
+	node_t * node = list_find(ring_buffer->alert_waiters, process);
+	if (node) {
+		list_delete(ring_buffer->alert_waiters, node);
+		free(node);
+	}
+}
+
+/**
+ * @brief Let readers know new data has been published.
+ *
+ * The fence pairs with the one in ring_buffer_wait: either the reader
+ * sees the new write pointer, or we see that it is waiting.
+ */
+static void ring_buffer_wake_readers(ring_buffer_t * ring_buffer) {
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (ring_buffer->readers_waiting || (ring_buffer->alert_waiters && ring_buffer->alert_waiters->head)) {
+		spin_lock(ring_buffer->lock);
+		wakeup_queue(ring_buffer->wait_queue_readers);
+		ring_buffer_alert_waiters(ring_buffer);
+		spin_unlock(ring_buffer->lock);
+	}
+}
+
+static void ring_buffer_wake_writers(ring_buffer_t * ring_buffer) {
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (ring_buffer->writers_waiting) {
 		spin_lock(ring_buffer->lock);
-		while (ring_buffer_unread(ring_buffer) > 0 && collected < size) {
-			buffer[collected] = ring_buffer->buffer[ring_buffer->read_ptr];
-			ring_buffer_increment_read(ring_buffer);
-			collected++;
-		}
 		wakeup_queue(ring_buffer->wait_queue_writers);
-		if (collected == 0) {
-			if (ring_buffer->internal_stop || ring_buffer->soft_stop) {
-				ring_buffer->soft_stop = 0;
-				spin_unlock(ring_buffer->lock);
-				return 0;
-			}
-			if (sleep_on_unlocking(ring_buffer->wait_queue_readers, &ring_buffer->lock)) {
-				return -ERESTARTSYS;
-			}
-		} else {
-			spin_unlock(ring_buffer->lock);
+		spin_unlock(ring_buffer->lock);
+	}
+}
+
+static int ring_buffer_can_read(ring_buffer_t * ring_buffer) {
+	return ring_buffer_unread(ring_buffer) || ring_buffer->internal_stop || ring_buffer->soft_stop;
+}
+
+static int ring_buffer_can_write(ring_buffer_t * ring_buffer) {
+	return ring_buffer_available(ring_buffer) || ring_buffer->internal_stop;
+}
+
+/**
+ * @brief Sleep until @p ready says there is something to do.
+ *
+ * Called with @p side_lock held, which is dropped while sleeping and
+ * taken again before returning.
+ *
+ * @returns 1 if interrupted by a signal, in which case @p side_lock
+ *          is not held, or 0.
+ */
+static int ring_buffer_wait(ring_buffer_t * ring_buffer, list_t * queue, volatile int * waiting,
+		int (*ready)(ring_buffer_t *), spin_lock_t * side_lock) {
+	spin_lock(ring_buffer->lock);
+	(*waiting)++;
+	__atomic_thread_fence(__ATOMIC_SEQ_CST);
+	if (ready(ring_buffer)) {
+		(*waiting)--;
+		spin_unlock(ring_buffer->lock);
+		return 0;
+	}
+	spin_unlock(*side_lock);
+	int interrupted = sleep_on_unlocking(queue, &ring_buffer->lock);
+	spin_lock(ring_buffer->lock);
+	(*waiting)--;
+	spin_unlock(ring_buffer->lock);
+	if (interrupted) return 1;
+	spin_lock(*side_lock);
+	return 0;
+}
+
+/**
+ * @brief Find the unread data that can be reached without wrapping.
+ *
+ * Together with ring_buffer_commit_read this lets a consumer use data
+ * in place. Neither takes a lock, so the caller must be the buffer's
+ * only reader, or otherwise keep readers apart.
+ *
+ * @param data Set to the start of the unread data.
+ * @returns the number of bytes readable at @p data; there may be more
+ *          at the start of the buffer.
+ */
+size_t ring_buffer_peek(ring_buffer_t * ring_buffer, uint8_t ** data) {
+	size_t read_ptr = ring_buffer->read_ptr;
+	size_t write_ptr = ring_buffer_load(&ring_buffer->write_ptr);
+	*data = ring_buffer->buffer + read_ptr;
+	return (write_ptr >= read_ptr) ? write_ptr - read_ptr : ring_buffer->size - read_ptr;
+}
+
+/**
+ * @brief Mark @p count bytes returned by ring_buffer_peek as consumed.
+ */
+void ring_buffer_commit_read(ring_buffer_t * ring_buffer, size_t count) {
+	ring_buffer_publish(&ring_buffer->read_ptr, (ring_buffer->read_ptr + count) % ring_buffer->size);
+	ring_buffer_wake_writers(ring_buffer);
+}
+
+/**
+ * @brief Find the free space that can be reached without wrapping.
+ *
+ * The producer-side counterpart to ring_buffer_peek; the same rule
+ * about a single caller applies.
+ */
+size_t ring_buffer_reserve(ring_buffer_t * ring_buffer, uint8_t ** data) {
+	size_t write_ptr = ring_buffer->write_ptr;
+	size_t read_ptr = ring_buffer_load(&ring_buffer->read_ptr);
+	*data = ring_buffer->buffer + write_ptr;
+	if (read_ptr > write_ptr) return read_ptr - write_ptr - 1;
+	return ring_buffer->size - write_ptr - (read_ptr == 0 ? 1 : 0);
+}
+
+/**
+ * @brief Publish @p count bytes written into space from ring_buffer_reserve.
+ */
+void ring_buffer_commit_write(ring_buffer_t * ring_buffer, size_t count) {
+	ring_buffer_publish(&ring_buffer->write_ptr, (ring_buffer->write_ptr + count) % ring_buffer->size);
+	ring_buffer_wake_readers(ring_buffer);
+}
+
+/**
+ * @brief Copy @p count unread bytes out, which must be available.
+ *
+ * Unread data is at most two contiguous spans, so this is at most two
+ * copies and a single move of the read pointer.
+ */
+static void ring_buffer_copy_out(ring_buffer_t * ring_buffer, uint8_t * buffer, size_t count) {
+	size_t read_ptr = ring_buffer->read_ptr;
+	size_t first = ring_buffer->size - read_ptr;
+	if (first > count) first = count;
+	memcpy(buffer, ring_buffer->buffer + read_ptr, first);
+	if (count > first) memcpy(buffer + first, ring_buffer->buffer, count - first);
+	ring_buffer_publish(&ring_buffer->read_ptr, (read_ptr + count) % ring_buffer->size);
+}
+
+static void ring_buffer_copy_in(ring_buffer_t * ring_buffer, const uint8_t * buffer, size_t count) {
+	size_t write_ptr = ring_buffer->write_ptr;
+	size_t first = ring_buffer->size - write_ptr;
+	if (first > count) first = count;
+	memcpy(ring_buffer->buffer + write_ptr, buffer, first);
+	if (count > first) memcpy(ring_buffer->buffer, buffer + first, count - first);
+	ring_buffer_publish(&ring_buffer->write_ptr, (write_ptr + count) % ring_buffer->size);
+}
+
+size_t ring_buffer_read(ring_buffer_t * ring_buffer, size_t size, uint8_t * buffer) {
+	spin_lock(ring_buffer->read_lock);
+	size_t collected;
+	while (1) {
+		collected = ring_buffer_unread(ring_buffer);
+		if (collected > size) collected = size;
+		if (collected) break;
+
+		if (ring_buffer->internal_stop || ring_buffer->soft_stop) {
+			ring_buffer->soft_stop = 0;
+			spin_unlock(ring_buffer->read_lock);
+			return 0;
+		}
+		if (ring_buffer_wait(ring_buffer, ring_buffer->wait_queue_readers,
+				&ring_buffer->readers_waiting, ring_buffer_can_read, &ring_buffer->read_lock)) {
+			return -ERESTARTSYS;
 		}
 	}
-	wakeup_queue(ring_buffer->wait_queue_writers);
+
+	ring_buffer_copy_out(ring_buffer, buffer, collected);
+	spin_unlock(ring_buffer->read_lock);
+
+	ring_buffer_wake_writers(ring_buffer);
 	return collected;
 }
 
 size_t ring_buffer_write(ring_buffer_t * ring_buffer, size_t size, uint8_t * buffer) {
 	size_t written = 0;
+	spin_lock(ring_buffer->write_lock);
 	while (written < size) {
-		spin_lock(ring_buffer->lock);
-
-		while (ring_buffer_available(ring_buffer) > 0 && written < size) {
-			ring_buffer->buffer[ring_buffer->write_ptr] = buffer[written];
-			ring_buffer_increment_write(ring_buffer);
-			written++;
+		size_t count = ring_buffer_available(ring_buffer);
+		if (count > size - written) count = size - written;
+		if (count) {
+			ring_buffer_copy_in(ring_buffer, buffer + written, count);
+			written += count;
+			ring_buffer_wake_readers(ring_buffer);
+			continue;
 		}
 
-		wakeup_queue(ring_buffer->wait_queue_readers);
-		ring_buffer_alert_waiters(ring_buffer);
-		if (written < size) {
-			if (ring_buffer->discard) {
-				spin_unlock(ring_buffer->lock);
-				break;
-			}
-			if (sleep_on_unlocking(ring_buffer->wait_queue_writers, &ring_buffer->lock)) {
-				if (!written) return -ERESTARTSYS;
-				break;
-			}
-			if (ring_buffer->internal_stop) {
-				break;
-			}
-		} else {
-			spin_unlock(ring_buffer->lock);
+		if (ring_buffer->discard || ring_buffer->internal_stop) break;
+		if (ring_buffer_wait(ring_buffer, ring_buffer->wait_queue_writers,
+				&ring_buffer->writers_waiting, ring_buffer_can_write, &ring_buffer->write_lock)) {
+			return written ? written : (size_t)-ERESTARTSYS;
 		}
 	}
+	spin_unlock(ring_buffer->write_lock);
 
-	wakeup_queue(ring_buffer->wait_queue_readers);
-	ring_buffer_alert_waiters(ring_buffer);
 	return written;
 }
 
-ring_buffer_t * ring_buffer_create(size_t size) {
-	ring_buffer_t * out = malloc(sizeof(ring_buffer_t));
+static unsigned char * ring_buffer_storage(size_t size) {
+	if (size == 4096) {
+		return mmu_map_from_physical(mmu_allocate_a_frame() << 12);
+	} else {
+		return malloc(size);
+	}
+}
 
+static void ring_buffer_storage_free(unsigned char * buffer, size_t size) {
 	if (size == 4096) {
-		out->buffer = mmu_map_from_physical(mmu_allocate_a_frame() << 12);
+		mmu_frame_release((uintptr_t)buffer & 0xFFFFFFFFF);
 	} else {
-		out->buffer     = malloc(size);
+		free(buffer);
 	}
+}
+
+ring_buffer_t * ring_buffer_create(size_t size) {
+	ring_buffer_t * out = malloc(sizeof(ring_buffer_t));
+
+	out->buffer     = ring_buffer_storage(size);
 	out->write_ptr  = 0;
 	out->read_ptr   = 0;
 	out->size       = size;
 	out->alert_waiters = NULL;
 
 	spin_init(out->lock);
+	spin_init(out->read_lock);
+	spin_init(out->write_lock);
+	out->readers_waiting = 0;
+	out->writers_waiting = 0;
 
 	out->internal_stop = 0;
 	out->discard = 0;
@@ -173,13 +329,42 @@ ring_buffer_t * ring_buffer_create(size_t size) {
 	return out;
 }
 
-void ring_buffer_destroy(ring_buffer_t * ring_buffer) {
-	if (ring_buffer->size == 4096) {
-		mmu_frame_release((uintptr_t)ring_buffer->buffer & 0xFFFFFFFFF);
-	} else {
-		free(ring_buffer->buffer);
+/**
+ * @brief Change the capacity of a ring buffer, keeping what is unread.
+ *
+ * @returns 0 on success, or -EBUSY if more than @p size bytes are
+ *          waiting to be read.
+ */
+int ring_buffer_resize(ring_buffer_t * ring_buffer, size_t size) {
+	unsigned char * buffer = ring_buffer_storage(size);
+
+	spin_lock(ring_buffer->read_lock);
+	spin_lock(ring_buffer->write_lock);
+	size_t unread = ring_buffer_unread(ring_buffer);
+	if (unread >= size) {
+		spin_unlock(ring_buffer->write_lock);
+		spin_unlock(ring_buffer->read_lock);
+		ring_buffer_storage_free(buffer, size);
+		return -EBUSY;
 	}
 
+	ring_buffer_copy_out(ring_buffer, buffer, unread);
+	ring_buffer_storage_free(ring_buffer->buffer, ring_buffer->size);
+	ring_buffer->buffer = buffer;
+	ring_buffer->size = size;
+	ring_buffer->read_ptr = 0;
+	ring_buffer->write_ptr = unread;
+	spin_unlock(ring_buffer->write_lock);
+	spin_unlock(ring_buffer->read_lock);
+
+	/* Writers may have room now */
+	ring_buffer_wake_writers(ring_buffer);
+	return 0;
+}
+
+void ring_buffer_destroy(ring_buffer_t * ring_buffer) {
+	ring_buffer_storage_free(ring_buffer->buffer, ring_buffer->size);
+
 	wakeup_queue(ring_buffer->wait_queue_writers);
 	wakeup_queue(ring_buffer->wait_queue_readers);
 	ring_buffer_alert_waiters(ring_buffer);
@@ -203,8 +388,10 @@ void ring_buffer_interrupt(ring_buffer_t * ring_buffer) {
 }
 
 void ring_buffer_eof(ring_buffer_t * ring_buffer) {
+	spin_lock(ring_buffer->lock);
 	ring_buffer->soft_stop = 1;
 	wakeup_queue(ring_buffer->wait_queue_readers);
 	wakeup_queue(ring_buffer->wait_queue_writers);
+	spin_unlock(ring_buffer->lock);
 }
 
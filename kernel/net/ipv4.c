@@ -202,9 +202,6 @@ static void sock_icmp_close(sock_t * sock) {
 }
 
 static long sock_icmp_recv(sock_t * sock, struct msghdr * msg, int flags) {
-	if (msg->msg_iovlen > 1) {
-		return -ENOTSUP;
-	}
 	if (msg->msg_iovlen == 0) return 0;
 
 	char * packet = net_sock_get(sock);
@@ -213,9 +210,8 @@ static long sock_icmp_recv(sock_t * sock, struct msghdr * msg, int flags) {
 
 	struct ipv4_packet * src = (struct ipv4_packet*)(packet + sizeof(size_t));
 
-	if (packet_size > msg->msg_iov[0].iov_len) {
+	if (packet_size > net_iov_length(msg)) {
 		dprintf("ICMP recv too big for vector\n");
-		packet_size = msg->msg_iov[0].iov_len;
 	}
 
 	if (msg->msg_namelen == sizeof(struct sockaddr_in)) {
@@ -227,15 +223,12 @@ static long sock_icmp_recv(sock_t * sock, struct msghdr * msg, int flags) {
 		}
 	}
 
-	memcpy(msg->msg_iov[0].iov_base, src->payload, packet_size);
+	packet_size = net_iov_scatter(msg, src->payload, packet_size);
 	free(packet);
 	return packet_size;
 }
 
 static long sock_icmp_send(sock_t * sock, const struct msghdr *msg, int flags) {
-	if (msg->msg_iovlen > 1) {
-		return -ENOTSUP;
-	}
 	if (msg->msg_iovlen == 0) return 0;
 	if (msg->msg_namelen != sizeof(struct sockaddr_in)) {
 		return -EINVAL;
@@ -244,7 +237,8 @@ static long sock_icmp_send(sock_t * sock, const struct msghdr *msg, int flags) {
 	struct sockaddr_in * name = msg->msg_name;
 	fs_node_t * nic = net_if_route(name->sin_addr.s_addr);
 	if (!nic) return -ENONET;
-	size_t total_length = sizeof(struct ipv4_packet) + msg->msg_iov[0].iov_len;
+	size_t payload_length = net_iov_length(msg);
+	size_t total_length = sizeof(struct ipv4_packet) + payload_length;
 
 	struct ipv4_packet * response = malloc(total_length);
 	response->length = htons(total_length);
@@ -259,7 +253,7 @@ static long sock_icmp_send(sock_t * sock, const struct msghdr *msg, int flags) {
 	response->checksum = 0;
 	response->checksum = htons(calculate_ipv4_checksum(response));
 
-	memcpy(response->payload, msg->msg_iov[0].iov_base, msg->msg_iov[0].iov_len);
+	net_iov_gather(msg, 0, response->payload, payload_length);
 	net_ipv4_send(response,nic);
 	free(response);
 
@@ -469,10 +463,6 @@ static int udp_get_port(sock_t * sock) {
 
 static long sock_udp_send(sock_t * sock, const struct msghdr *msg, int flags) {
 	printf("udp: send called\n");
-	if (msg->msg_iovlen > 1) {
-		printf("net: todo: can't send multiple iovs\n");
-		return -ENOTSUP;
-	}
 	if (msg->msg_iovlen == 0) return 0;
 	if (msg->msg_namelen != sizeof(struct sockaddr_in)) {
 		printf("udp: invalid destination address size %ld\n", msg->msg_namelen);
@@ -494,7 +484,8 @@ static long sock_udp_send(sock_t * sock, const struct msghdr *msg, int flags) {
 	fs_node_t * nic = net_if_route(name->sin_addr.s_addr);
 	if (!nic) return 0;
 
-	size_t total_length = sizeof(struct ipv4_packet) + msg->msg_iov[0].iov_len + sizeof(struct udp_packet);
+	size_t payload_length = net_iov_length(msg);
+	size_t total_length = sizeof(struct ipv4_packet) + payload_length + sizeof(struct udp_packet);
 
 	struct ipv4_packet * response = malloc(total_length);
 	response->length = htons(total_length);
@@ -513,14 +504,14 @@ static long sock_udp_send(sock_t * sock, const struct msghdr *msg, int flags) {
 	struct udp_packet * udp_packet = (struct udp_packet*)&response->payload;
 	udp_packet->source_port = htons(sock->priv[0]);
 	udp_packet->destination_port = name->sin_port;
-	udp_packet->length = htons(sizeof(struct udp_packet) + msg->msg_iov[0].iov_len);
+	udp_packet->length = htons(sizeof(struct udp_packet) + payload_length);
 	udp_packet->checksum = 0;
 
-	memcpy(response->payload + sizeof(struct udp_packet), msg->msg_iov[0].iov_base, msg->msg_iov[0].iov_len);
+	net_iov_gather(msg, 0, response->payload + sizeof(struct udp_packet), payload_length);
 	net_ipv4_send(response,nic);
 	free(response);
 
-	return msg->msg_iov[0].iov_len;
+	return payload_length;
 }
 
 static long sock_udp_recv(sock_t * sock, struct msghdr * msg, int flags) {
@@ -530,10 +521,6 @@ static long sock_udp_recv(sock_t * sock, struct msghdr * msg, int flags) {
 		return -EINVAL;
 	}
 
-	if (msg->msg_iovlen > 1) {
-		printf("net: todo: can't recv multiple iovs\n");
-		return -ENOTSUP;
-	}
 	if (msg->msg_iovlen == 0) return 0;
 
 	char * packet = net_sock_get(sock);
@@ -543,7 +530,7 @@ static long sock_udp_recv(sock_t * sock, struct msghdr * msg, int flags) {
 
 	printf("udp: got response, size is %u - sizeof(ipv4) - sizeof(udp) = %lu\n",
 		ntohs(data->length), ntohs(data->length) - sizeof(struct ipv4_packet) - sizeof(struct udp_packet));
-	memcpy(msg->msg_iov[0].iov_base, udp_packet->payload, ntohs(data->length) - sizeof(struct ipv4_packet) - sizeof(struct udp_packet));
+	long resp = net_iov_scatter(msg, udp_packet->payload, ntohs(data->length) - sizeof(struct ipv4_packet) - sizeof(struct udp_packet));
 
 	if (msg->msg_namelen == sizeof(struct sockaddr_in)) {
 		if (msg->msg_name) {
@@ -553,9 +540,6 @@ static long sock_udp_recv(sock_t * sock, struct msghdr * msg, int flags) {
 		}
 	}
 
-	printf("udp: data copied to iov 0, return length?\n");
-
-	long resp = ntohs(data->length) - sizeof(struct ipv4_packet) - sizeof(struct udp_packet);
 	free(packet);
 	return resp;
 }
@@ -668,30 +652,22 @@ static long sock_tcp_recv(sock_t * sock, struct msghdr * msg, int flags) {
 		return -EINVAL;
 	}
 
-	if (msg->msg_iovlen > 1) {
-		printf("net: todo: can't recv multiple iovs\n");
-		return -ENOTSUP;
-	}
 	if (msg->msg_iovlen == 0) return 0;
 
 	if (sock->unread) {
-		if (sock->unread > msg->msg_iov[0].iov_len) {
-			unsigned long out = msg->msg_iov[0].iov_len;
+		unsigned long out = net_iov_scatter(msg, sock->buf, sock->unread);
+		if (sock->unread > out) {
 			sock->unread -= out;
-			memcpy(msg->msg_iov[0].iov_base, sock->buf, out);
 			char * x = malloc(sock->unread);
 			memcpy(x, sock->buf + out, sock->unread);
 			free(sock->buf);
 			sock->buf = x;
-			return out;
 		} else {
-			unsigned long out = sock->unread;
 			sock->unread = 0;
-			memcpy(msg->msg_iov[0].iov_base, sock->buf, out);
 			free(sock->buf);
 			sock->buf = NULL;
-			return out;
 		}
+		return out;
 	}
 
 	if (!sock->rx_queue->length && sock->priv[1] == 3) {
@@ -720,20 +696,16 @@ static long sock_tcp_recv(sock_t * sock, struct msghdr * msg, int flags) {
 
 	resp -=  sizeof(struct ipv4_packet) + sizeof(struct tcp_header);
 
-	if (resp > (unsigned long)msg->msg_iov[0].iov_len) {
-		memcpy(msg->msg_iov[0].iov_base, data->payload + sizeof(struct tcp_header),msg->msg_iov[0].iov_len);
-		resp -= msg->msg_iov[0].iov_len;
-		if (resp == 0xFFFFffffFFFFffff) printf("what\n");
-		sock->unread = resp;
-		sock->buf = malloc(resp);
-		memcpy(sock->buf, data->payload + sizeof(struct tcp_header) + msg->msg_iov[0].iov_len, resp);
-		free(packet);
-		return msg->msg_iov[0].iov_len;
+	unsigned long out = net_iov_scatter(msg, data->payload + sizeof(struct tcp_header), resp);
+	if (resp > out) {
+		/* Keep what didn't fit for the next read */
+		sock->unread = resp - out;
+		sock->buf = malloc(sock->unread);
+		memcpy(sock->buf, data->payload + sizeof(struct tcp_header) + out, sock->unread);
 	}
 
-	memcpy(msg->msg_iov[0].iov_base, data->payload + sizeof(struct tcp_header), resp);
 	free(packet);
-	return resp;
+	return out;
 }
 
 extern uint32_t rand(void);
@@ -868,14 +840,10 @@ static void delay_yield(size_t subticks) {
 
 static long sock_tcp_send(sock_t * sock, const struct msghdr *msg, int flags) {
 	printf("tcp: send called\n");
-	if (msg->msg_iovlen > 1) {
-		printf("net: todo: can't send multiple iovs\n");
-		return -ENOTSUP;
-	}
 	if (msg->msg_iovlen == 0) return 0;
 
 	size_t size_into = 0;
-	size_t size_remaining = msg->msg_iov[0].iov_len;
+	size_t size_remaining = net_iov_length(msg);
 
 	size_t last = arch_perf_timer();
 	while (size_remaining) {
@@ -921,7 +889,7 @@ static long sock_tcp_send(sock_t * sock, const struct msghdr *msg, int flags) {
 			.tcp_len = htons(sizeof(struct tcp_header) + size_to_send),
 		};
 
-		memcpy(tcp_header->payload, (char*)msg->msg_iov[0].iov_base + size_into, size_to_send);
+		net_iov_gather(msg, size_into, tcp_header->payload, size_to_send);
 		tcp_header->checksum = htons(calculate_tcp_checksum(&check_hd, tcp_header, tcp_header->payload, size_to_send));
 		net_ipv4_send(response,nic);
 		free(response);
@@ -16,6 +16,7 @@
 #include <kernel/list.h>
 #include <kernel/syscall.h>
 #include <kernel/vfs.h>
+#include <kernel/mmu.h>
 
 #include <kernel/net/netif.h>
 
@@ -92,6 +93,18 @@ int sock_generic_wait(fs_node_t *node, void * process) {
 	return 0;
 }
 
+void sock_generic_unwait(fs_node_t *node, void * process) {
+	sock_t * sock = (sock_t*)node;
+
+	spin_lock(sock->alert_lock);
+	node_t * waiter = list_find(sock->alert_wait, process);
+	if (waiter) {
+		list_delete(sock->alert_wait, waiter);
+		free(waiter);
+	}
+	spin_unlock(sock->alert_lock);
+}
+
 void sock_generic_close(fs_node_t *node) {
 	sock_t * sock = (sock_t*)node;
 	sock->sock_close(sock);
@@ -103,6 +116,93 @@ void sock_generic_close(fs_node_t *node) {
 	printf("net: socket closed\n");
 }
 
+/**
+ * @brief Total number of bytes described by a message's iovecs.
+ */
+size_t net_iov_length(const struct msghdr * msg) {
+	size_t total = 0;
+	for (size_t i = 0; i < msg->msg_iovlen; ++i) {
+		total += msg->msg_iov[i].iov_len;
+	}
+	return total;
+}
+
+/**
+ * @brief Copy received data out across a message's iovecs.
+ *
+ * @param msg  Message whose buffers should be filled
+ * @param data Data to copy
+ * @param size Size of @p data
+ * @returns How much of @p data fit in the buffers.
+ */
+size_t net_iov_scatter(const struct msghdr * msg, const void * data, size_t size) {
+	size_t copied = 0;
+	for (size_t i = 0; i < msg->msg_iovlen && copied < size; ++i) {
+		size_t chunk = msg->msg_iov[i].iov_len;
+		if (chunk > size - copied) chunk = size - copied;
+		memcpy(msg->msg_iov[i].iov_base, (const char*)data + copied, chunk);
+		copied += chunk;
+	}
+	return copied;
+}
+
+/**
+ * @brief Collect data to send from a message's iovecs.
+ *
+ * Treats the iovecs as one contiguous stream, so large sends can be
+ * split into packets without flattening the whole message first.
+ *
+ * @param msg    Message to collect from
+ * @param offset Where in the message to start
+ * @param buf    Buffer to fill
+ * @param size   How much to collect
+ * @returns How much was collected, which is less than @p size at the end of the message.
+ */
+size_t net_iov_gather(const struct msghdr * msg, size_t offset, void * buf, size_t size) {
+	size_t copied = 0;
+	for (size_t i = 0; i < msg->msg_iovlen && copied < size; ++i) {
+		size_t len = msg->msg_iov[i].iov_len;
+		if (offset >= len) {
+			offset -= len;
+			continue;
+		}
+		size_t chunk = len - offset;
+		if (chunk > size - copied) chunk = size - copied;
+		memcpy((char*)buf + copied, (const char*)msg->msg_iov[i].iov_base + offset, chunk);
+		copied += chunk;
+		offset = 0;
+	}
+	return copied;
+}
+
+static ssize_t sock_generic_readv(fs_node_t * node, off_t offset, const struct iovec * iov, int iovcnt) {
+	sock_t * sock = (sock_t*)node;
+	struct msghdr _header = {
+		.msg_name = NULL,
+		.msg_namelen = 0,
+		.msg_iov = (struct iovec *)iov,
+		.msg_iovlen = iovcnt,
+		.msg_control = NULL,
+		.msg_controllen = 0,
+		.msg_flags = 0,
+	};
+	return sock->sock_recv(sock, &_header, 0);
+}
+
+static ssize_t sock_generic_writev(fs_node_t * node, off_t offset, const struct iovec * iov, int iovcnt) {
+	sock_t * sock = (sock_t*)node;
+	struct msghdr _header = {
+		.msg_name = NULL,
+		.msg_namelen = 0,
+		.msg_iov = (struct iovec *)iov,
+		.msg_iovlen = iovcnt,
+		.msg_control = NULL,
+		.msg_controllen = 0,
+		.msg_flags = 0,
+	};
+	return sock->sock_send(sock, &_header, 0);
+}
+
 sock_t * net_sock_create(void) {
 	sock_t * sock = calloc(sizeof(struct SockData),1);
 	sock->_fnode.flags = FS_PIPE; /* uh, FS_SOCKET? */
@@ -110,7 +210,10 @@ sock_t * net_sock_create(void) {
 	sock->_fnode.device = NULL;
 	sock->_fnode.selectcheck = sock_generic_check;
 	sock->_fnode.selectwait = sock_generic_wait;
+	sock->_fnode.selectunwait = sock_generic_unwait;
 	sock->_fnode.close = sock_generic_close;
+	sock->_fnode.readv = sock_generic_readv;
+	sock->_fnode.writev = sock_generic_writev;
 	sock->alert_wait = list_create("socket alert wait", sock);
 	sock->rx_wait    = list_create("socket rx wait", sock);
 	sock->rx_queue   = list_create("socket rx queue", sock);
@@ -123,28 +226,32 @@ list_t * net_raw_sockets_list = NULL;
 
 static long sock_raw_recv(sock_t * sock, struct msghdr * msg, int flags) {
 	if (!sock->_fnode.device) return -EINVAL;
-	if (msg->msg_iovlen > 1) {
-		printf("net: todo: can't recv multiple iovs\n");
-		return -ENOTSUP;
-	}
 	if (msg->msg_iovlen == 0) return 0;
 	char * data = net_sock_get(sock);
 	if (!data) return -EINTR;
 	size_t packet_size = *(size_t*)data;
-	if (msg->msg_iov[0].iov_len < packet_size) return -EINVAL;
-	memcpy(msg->msg_iov[0].iov_base, data + sizeof(size_t), packet_size);
+	if (net_iov_length(msg) < packet_size) {
+		free(data);
+		return -EINVAL;
+	}
+	net_iov_scatter(msg, data + sizeof(size_t), packet_size);
 	free(data);
 	return 4096;
 }
 
 static long sock_raw_send(sock_t * sock, const struct msghdr *msg, int flags) {
 	if (!sock->_fnode.device) return -EINVAL;
-	if (msg->msg_iovlen > 1) {
-		printf("net: todo: can't send multiple iovs\n");
-		return -ENOTSUP;
-	}
 	if (msg->msg_iovlen == 0) return 0;
-	return write_fs(sock->_fnode.device, 0, msg->msg_iov[0].iov_len, msg->msg_iov[0].iov_base);
+	if (msg->msg_iovlen == 1) {
+		return write_fs(sock->_fnode.device, 0, msg->msg_iov[0].iov_len, msg->msg_iov[0].iov_base);
+	}
+	/* The device takes one frame per write, so it needs to be in one piece */
+	size_t size = net_iov_length(msg);
+	uint8_t * frame = malloc(size);
+	net_iov_gather(msg, 0, frame, size);
+	long out = write_fs(sock->_fnode.device, 0, size, frame);
+	free(frame);
+	return out;
 }
 
 static void sock_raw_close(sock_t * sock) {
@@ -202,11 +309,15 @@ long net_so_socket(struct SockData * sock, int optname, const void *optval, sock
 
 long net_setsockopt(int sockfd, int level, int optname, const void *optval, socklen_t optlen) {
 	if (!FD_CHECK(sockfd)) return -EBADF;
-	PTR_VALIDATE(optval);
+	if (optlen > 256) return -EINVAL;
 	sock_t * node = (sock_t*)FD_ENTRY(sockfd);
+
+	char kopt[256];
+	if (optlen && copy_from_user(kopt, optval, optlen)) return -EFAULT;
+
 	switch (level) {
 		case SOL_SOCKET:
-			return net_so_socket(node,optname,optval,optlen);
+			return net_so_socket(node,optname,kopt,optlen);
 		default:
 			return -ENOPROTOOPT;
 	}
@@ -242,18 +353,57 @@ long net_connect(int sockfd, const struct sockaddr *addr, socklen_t addrlen) {
 	return node->sock_connect(node,addr,addrlen);
 }
 
-long net_recv(int sockfd, struct msghdr * msg, int flags) {
+/**
+ * @brief Bring in a message header and its iovec array for recvmsg/sendmsg.
+ *
+ * The header and iovecs are copied; the buffers and name they point
+ * to are left in place, but checked to be writable (for receiving) or
+ * readable (for sending) user memory first.
+ */
+static long net_msg(int sockfd, struct msghdr * umsg, int flags, int send) {
 	if (!FD_CHECK(sockfd)) return -EBADF;
-	PTR_VALIDATE(msg);
-	sock_t * node = (sock_t*)FD_ENTRY(sockfd);
-	return node->sock_recv(node,msg,flags);
+
+	struct msghdr msg;
+	if (copy_from_user(&msg, umsg, sizeof(struct msghdr))) return -EFAULT;
+	if (msg.msg_iovlen > IOV_MAX) return -EINVAL;
+	if (msg.msg_name && user_probe(msg.msg_name, msg.msg_namelen, send ? 0 : MMU_PTR_WRITE)) return -EFAULT;
+	msg.msg_control = NULL;
+	msg.msg_controllen = 0;
+
+	struct iovec * kiov;
+	long status = iovec_from_user(msg.msg_iov, msg.msg_iovlen, send ? 0 : MMU_PTR_WRITE, &kiov);
+	if (status) return status;
+	msg.msg_iov = kiov;
+
+	long out = send ? net_sock_send(FD_ENTRY(sockfd), &msg, flags) : net_sock_recv(FD_ENTRY(sockfd), &msg, flags);
+	if (kiov) free(kiov);
+	return out;
+}
+
+long net_recv(int sockfd, struct msghdr * msg, int flags) {
+	return net_msg(sockfd, msg, flags, 0);
 }
 
 long net_send(int sockfd, const struct msghdr * msg, int flags) {
-	if (!FD_CHECK(sockfd)) return -EBADF;
-	PTR_VALIDATE(msg);
-	sock_t * node = (sock_t*)FD_ENTRY(sockfd);
-	return node->sock_send(node,msg,flags);
+	return net_msg(sockfd, (struct msghdr *)msg, flags, 1);
+}
+
+/**
+ * @brief recvmsg on a node that may not be a socket.
+ */
+long net_sock_recv(fs_node_t * node, struct msghdr * msg, int flags) {
+	if (node->selectcheck != sock_generic_check) return -ENOTSOCK;
+	sock_t * sock = (sock_t*)node;
+	return sock->sock_recv(sock, msg, flags);
+}
+
+/**
+ * @brief sendmsg on a node that may not be a socket.
+ */
+long net_sock_send(fs_node_t * node, const struct msghdr * msg, int flags) {
+	if (node->selectcheck != sock_generic_check) return -ENOTSOCK;
+	sock_t * sock = (sock_t*)node;
+	return sock->sock_send(sock, msg, flags);
 }
 
 long net_shutdown(int sockfd, int how) {
@@ -0,0 +1,442 @@
+/**
+ * @file  kernel/sys/evset.c
+ * @brief Persistent readiness sets.
+ *
+ * fswait registers the caller with every node it is given, and checks
+ * each of them, on every call; a process watching many descriptors
+ * pays for all of them every time it waits. An event set instead keeps
+ * its interest list between calls. Each descriptor is registered with
+ * its driver once, when it is added, and again only after its driver
+ * has alerted, so a wait costs time in the number of descriptors that
+ * are ready rather than the number being watched.
+ *
+ * Drivers alert a list of processes, and forget each one once they
+ * have alerted it. An event set registers with drivers through a
+ * stand-in process, its watcher, which never runs: alerts sent to a
+ * watcher are intercepted by process_alert_node and delivered here
+ * instead, where they move the matching entries onto the ready list
+ * and wake anyone waiting on the set.
+ *
+ * Entries are level-triggered by default: an entry stays on the ready
+ * list, and is reported by every wait, for as long as its node reports
+ * it is ready. Edge-triggered entries are reported once per alert.
+ *
+ * Entries hold a reference to their node, so a descriptor should be
+ * removed from a set before it is closed. When a set is closed, its
+ * watcher is taken back off the alert list of every node it watched.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2021 K. Lange
+ */
+#include <stdint.h>
+#include <errno.h>
+#include <kernel/types.h>
+#include <kernel/string.h>
+#include <kernel/printf.h>
+#include <kernel/vfs.h>
+#include <kernel/process.h>
+#include <kernel/spinlock.h>
+#include <kernel/list.h>
+#include <kernel/hashmap.h>
+#include <kernel/time.h>
+#include <kernel/mmu.h>
+#include <kernel/syscall.h>
+
+#include <sys/evset.h>
+
+struct evset;
+
+struct evset_entry {
+	int fd;
+	fs_node_t * node;
+	void * key;         /* What the node's driver alerts with */
+	uint32_t events;
+	uint64_t data;
+	int ready;          /* On the ready list */
+	node_t ready_node;
+};
+
+struct evset {
+	spin_lock_t lock;
+	process_t * watcher;
+	hashmap_t * by_fd;    /* fd -> entry */
+	hashmap_t * by_key;   /* driver key -> list of entries */
+	list_t * ready;
+	list_t * alert_waiters;
+};
+
+/* Watchers of live sets; alerts to anything else that looks like a watcher are stale */
+static hashmap_t * watchers = NULL;
+static spin_lock_t watchers_lock = { 0 };
+
+static int evset_check(fs_node_t * node);
+static int evset_select_wait(fs_node_t * node, void * process);
+
+/**
+ * @brief Register an entry with its node's driver.
+ *
+ * The driver adds the key it will alert with to the watcher's wait
+ * list, just as it would for a process in fswait; that is the only
+ * place to learn it, so it is taken from there and the list cleared.
+ */
+static void * evset_arm(struct evset * set, struct evset_entry * entry) {
+	selectwait_fs(entry->node, set->watcher);
+	void * key = set->watcher->node_waits->tail ? set->watcher->node_waits->tail->value : NULL;
+	while (set->watcher->node_waits->head) {
+		free(list_dequeue(set->watcher->node_waits));
+	}
+	return key;
+}
+
+static void evset_make_ready(struct evset * set, struct evset_entry * entry) {
+	if (entry->ready) return;
+	entry->ready = 1;
+	entry->ready_node.value = entry;
+	list_append(set->ready, &entry->ready_node);
+}
+
+/**
+ * @brief Deliver a driver's alert to a watcher.
+ *
+ * Called by process_alert_node_locked for every alert, before it
+ * looks at the process it was given.
+ *
+ * @returns 1 if @p watcher belongs to an event set, 0 if it should be
+ *          treated as an ordinary process.
+ */
+int evset_alert(void * watcher, void * key) {
+	spin_lock(watchers_lock);
+	struct evset * set = watchers ? hashmap_get(watchers, watcher) : NULL;
+	if (!set) {
+		spin_unlock(watchers_lock);
+		return 0;
+	}
+	spin_lock(set->lock);
+	spin_unlock(watchers_lock);
+
+	int became_ready = 0;
+	list_t * matching = hashmap_get(set->by_key, key);
+	if (matching) {
+		foreach(node, matching) {
+			struct evset_entry * entry = node->value;
+			if (!entry->ready) {
+				evset_make_ready(set, entry);
+				became_ready = 1;
+			}
+		}
+	}
+
+	list_t * waiters = NULL;
+	if (became_ready && set->alert_waiters->length) {
+		waiters = set->alert_waiters;
+		set->alert_waiters = list_create("evset alerts", set);
+	}
+	spin_unlock(set->lock);
+
+	if (waiters) {
+		foreach(node, waiters) {
+			process_alert_node_locked(node->value, set);
+		}
+		list_free(waiters);
+		free(waiters);
+	}
+
+	return 1;
+}
+
+/**
+ * @brief Move up to @p max events from the ready list to @p out.
+ *
+ * Each entry on the ready list is looked at no more than once.
+ * Level-triggered entries that are still ready go back on the end of
+ * the list, so a busy descriptor can't starve the others; any that
+ * have been drained since they were queued are armed again and left
+ * off. Edge-triggered entries are armed again as they are reported.
+ */
+static int evset_collect(struct evset * set, struct evset_event * out, int max) {
+	int count = 0;
+	size_t pending = set->ready->length;
+	while (count < max && pending--) {
+		node_t * node = list_dequeue(set->ready);
+		struct evset_entry * entry = node->value;
+		entry->ready = 0;
+
+		if (entry->events & EVSET_EDGE) {
+			evset_arm(set, entry);
+		} else if (selectcheck_fs(entry->node) == 0) {
+			evset_make_ready(set, entry);
+		} else {
+			evset_arm(set, entry);
+			/* It may have become ready again before the driver knew to tell us. */
+			if (selectcheck_fs(entry->node) == 0) evset_make_ready(set, entry);
+			continue;
+		}
+
+		out[count].events = EVSET_IN;
+		out[count]._reserved = 0;
+		out[count].data = entry->data;
+		count++;
+	}
+	return count;
+}
+
+static void evset_forget_key(struct evset * set, struct evset_entry * entry) {
+	list_t * matching = hashmap_get(set->by_key, entry->key);
+	if (!matching) return;
+	node_t * node = list_find(matching, entry);
+	if (node) {
+		list_delete(matching, node);
+		free(node);
+	}
+	if (!matching->length) {
+		hashmap_remove(set->by_key, entry->key);
+		free(matching);
+	}
+}
+
+static void evset_close(fs_node_t * node) {
+	struct evset * set = node->device;
+
+	spin_lock(watchers_lock);
+	hashmap_remove(watchers, set->watcher);
+	spin_unlock(watchers_lock);
+
+	/* Let any alert already holding the set finish with it */
+	spin_lock(set->lock);
+	spin_unlock(set->lock);
+
+	list_t * entries = hashmap_values(set->by_fd);
+	foreach(n, entries) {
+		struct evset_entry * entry = n->value;
+		/* Drivers only forget a waiter once they alert it; don't leave them holding a freed one */
+		selectunwait_fs(entry->node, set->watcher);
+		close_fs(entry->node);
+		free(entry);
+	}
+	list_free(entries);
+	free(entries);
+
+	list_t * keys = hashmap_values(set->by_key);
+	foreach(n, keys) {
+		list_free(n->value);
+		free(n->value);
+	}
+	list_free(keys);
+	free(keys);
+
+	hashmap_free(set->by_fd);
+	free(set->by_fd);
+	hashmap_free(set->by_key);
+	free(set->by_key);
+	free(set->ready);
+	list_free(set->alert_waiters);
+	free(set->alert_waiters);
+	list_free(set->watcher->node_waits);
+	free(set->watcher->node_waits);
+	free(set->watcher);
+	free(set);
+}
+
+static int evset_check(fs_node_t * node) {
+	struct evset * set = node->device;
+	return set->ready->length ? 0 : 1;
+}
+
+static int evset_select_wait(fs_node_t * node, void * process) {
+	struct evset * set = node->device;
+	spin_lock(set->lock);
+	if (!list_find(set->alert_waiters, process)) {
+		list_insert(set->alert_waiters, process);
+	}
+	list_insert(((process_t *)process)->node_waits, set);
+	spin_unlock(set->lock);
+	return 0;
+}
+
+static struct evset * evset_from_fd(int fd, fs_node_t ** node) {
+	if (!FD_CHECK(fd)) return NULL;
+	if (FD_ENTRY(fd)->selectcheck != evset_check) return NULL;
+	*node = FD_ENTRY(fd);
+	return (*node)->device;
+}
+
+long sys_evset_create(int flags) {
+	if (flags) return -EINVAL;
+
+	struct evset * set = calloc(1, sizeof(struct evset));
+	set->watcher = calloc(1, sizeof(process_t));
+	set->watcher->node_waits = list_create("evset watcher", set);
+	set->by_fd = hashmap_create_int(31);
+	set->by_key = hashmap_create_int(31);
+	set->ready = list_create("evset ready", set);
+	set->alert_waiters = list_create("evset alerts", set);
+
+	spin_lock(watchers_lock);
+	if (!watchers) watchers = hashmap_create_int(61);
+	hashmap_set(watchers, set->watcher, set);
+	spin_unlock(watchers_lock);
+
+	fs_node_t * fnode = calloc(1, sizeof(fs_node_t));
+	snprintf(fnode->name, 100, "[evset]");
+	fnode->flags = FS_CHARDEVICE;
+	fnode->mask = 0600;
+	fnode->uid = this_core->current_process->user;
+	fnode->gid = this_core->current_process->user_group;
+	fnode->device = set;
+	fnode->close = evset_close;
+	fnode->selectcheck = evset_check;
+	fnode->selectwait = evset_select_wait;
+	fnode->ctime = fnode->mtime = fnode->atime = now();
+	open_fs(fnode, 0);
+
+	int fd = process_append_fd((process_t *)this_core->current_process, fnode);
+	FD_MODE(fd) = 01;
+	return fd;
+}
+
+long sys_evset_ctl(int setfd, int op, int fd, struct evset_event * uevent) {
+	fs_node_t * set_node;
+	struct evset * set = evset_from_fd(setfd, &set_node);
+	if (!set) return FD_CHECK(setfd) ? -EINVAL : -EBADF;
+
+	struct evset_event event = {0};
+	if (op != EVSET_DEL) {
+		if (copy_from_user(&event, uevent, sizeof(struct evset_event))) return -EFAULT;
+		if (event.events & ~(EVSET_IN | EVSET_EDGE)) return -EINVAL;
+	}
+
+	if (!FD_CHECK(fd)) return -EBADF;
+	fs_node_t * target = FD_ENTRY(fd);
+	/* Sets can't watch sets; a loop of them would alert each other forever */
+	if (target->selectcheck == evset_check) return -EINVAL;
+	if (op == EVSET_ADD && !target->selectwait) return -EPERM;
+
+	fs_node_t * release = NULL;
+	long result = 0;
+
+	spin_lock(set->lock);
+	struct evset_entry * entry = hashmap_get(set->by_fd, (void*)(uintptr_t)fd);
+
+	switch (op) {
+		case EVSET_ADD:
+			if (entry && entry->node == target) {
+				result = -EEXIST;
+				break;
+			}
+			if (entry) {
+				/* The descriptor was closed and reused without being removed first */
+				if (entry->ready) list_delete(set->ready, &entry->ready_node);
+				evset_forget_key(set, entry);
+				release = entry->node;
+			} else {
+				entry = malloc(sizeof(struct evset_entry));
+				hashmap_set(set->by_fd, (void*)(uintptr_t)fd, entry);
+			}
+			open_fs(target, 0);
+			entry->fd = fd;
+			entry->node = target;
+			entry->events = event.events;
+			entry->data = event.data;
+			entry->ready = 0;
+			entry->key = evset_arm(set, entry);
+			list_t * matching = hashmap_get(set->by_key, entry->key);
+			if (!matching) {
+				matching = list_create("evset entries", entry->key);
+				hashmap_set(set->by_key, entry->key, matching);
+			}
+			list_insert(matching, entry);
+			if (selectcheck_fs(target) == 0) evset_make_ready(set, entry);
+			break;
+
+		case EVSET_MOD:
+			if (!entry || entry->node != target) {
+				result = -ENOENT;
+				break;
+			}
+			entry->events = event.events;
+			entry->data = event.data;
+			if (!entry->ready && selectcheck_fs(target) == 0) evset_make_ready(set, entry);
+			break;
+
+		case EVSET_DEL:
+			if (!entry || entry->node != target) {
+				result = -ENOENT;
+				break;
+			}
+			if (entry->ready) list_delete(set->ready, &entry->ready_node);
+			evset_forget_key(set, entry);
+			hashmap_remove(set->by_fd, (void*)(uintptr_t)fd);
+			release = entry->node;
+			free(entry);
+			break;
+
+		default:
+			result = -EINVAL;
+			break;
+	}
+
+	/* Something added while another thread waits on the set may already be ready */
+	list_t * waiters = NULL;
+	if (set->ready->length && set->alert_waiters->length) {
+		waiters = set->alert_waiters;
+		set->alert_waiters = list_create("evset alerts", set);
+	}
+	spin_unlock(set->lock);
+
+	if (waiters) {
+		foreach(node, waiters) {
+			process_alert_node(node->value, set);
+		}
+		list_free(waiters);
+		free(waiters);
+	}
+
+	if (release) close_fs(release);
+	return result;
+}
+
+long sys_evset_wait(int setfd, struct evset_event * uevents, int maxevents, int timeout) {
+	fs_node_t * set_node;
+	struct evset * set = evset_from_fd(setfd, &set_node);
+	if (!set) return FD_CHECK(setfd) ? -EINVAL : -EBADF;
+	if (maxevents <= 0) return -EINVAL;
+	if (maxevents > EVSET_MAX_EVENTS) maxevents = EVSET_MAX_EVENTS;
+	if (user_probe(uevents, sizeof(struct evset_event) * maxevents, MMU_PTR_WRITE)) return -EFAULT;
+
+	unsigned long end_s = 0, end_ss = 0;
+	if (timeout > 0) relative_time(0, timeout * 1000, &end_s, &end_ss);
+
+	/* Hold the set while waiting on it, in case another thread closes it */
+	open_fs(set_node, 0);
+
+	struct evset_event * events = malloc(sizeof(struct evset_event) * maxevents);
+	long result;
+	while (1) {
+		spin_lock(set->lock);
+		result = evset_collect(set, events, maxevents);
+		spin_unlock(set->lock);
+		if (result || timeout == 0) break;
+
+		int remaining = -1;
+		if (timeout > 0) {
+			unsigned long now_s, now_ss;
+			relative_time(0, 0, &now_s, &now_ss);
+			if (now_s > end_s || (now_s == end_s && now_ss >= end_ss)) break;
+			remaining = ((end_s - now_s) * 1000000 + end_ss - now_ss + 999) / 1000;
+		}
+
+		fs_node_t * nodes[] = {set_node, NULL};
+		int index = process_wait_nodes((process_t *)this_core->current_process, nodes, remaining);
+		if (index < 0) {
+			result = -EINTR;
+			break;
+		}
+	}
+
+	if (result > 0 && copy_to_user(uevents, events, sizeof(struct evset_event) * result)) result = -EFAULT;
+	free(events);
+	close_fs(set_node);
+	return result;
+}
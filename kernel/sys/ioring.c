@@ -0,0 +1,499 @@
+/**
+ * @file  kernel/sys/ioring.c
+ * @brief Asynchronous I/O submission and completion rings.
+ *
+ * A process sets up a ring with @c ioring_setup and gets back a file
+ * descriptor and a shared memory mapping holding a submission queue
+ * and a completion queue. It fills in submission entries, then a
+ * single @c ioring_enter both hands any number of them to the kernel
+ * and, optionally, waits for some number of them to complete.
+ *
+ * The ring itself is a private shm chunk, which no other process can
+ * obtain by name. The kernel holds its own reference to the chunk and
+ * reaches the ring through the physical map, so completions can be
+ * posted from any context, and a process unmapping its ring can't
+ * fault the kernel.
+ *
+ * Submitted entries are carried out by a pool of kernel worker
+ * threads. Descriptors are resolved, and references taken on them,
+ * at submission, so closing one doesn't affect operations already
+ * in flight. A worker runs each operation in the submitting process's
+ * address space, so buffers are used in place just as they would be
+ * by the equivalent system call. Operations that block, like socket
+ * receives and timeouts, hold a worker for as long as they block; the
+ * pool grows as needed, up to a limit.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2021 K. Lange
+ */
+#include <stdint.h>
+#include <errno.h>
+#include <kernel/types.h>
+#include <kernel/string.h>
+#include <kernel/printf.h>
+#include <kernel/vfs.h>
+#include <kernel/process.h>
+#include <kernel/spinlock.h>
+#include <kernel/list.h>
+#include <kernel/mmu.h>
+#include <kernel/shm.h>
+#include <kernel/time.h>
+#include <kernel/syscall.h>
+#include <kernel/procfs.h>
+#include <kernel/net/netif.h>
+
+#include <sys/ioring.h>
+#include <sys/socket.h>
+
+#define IORING_MIN_WORKERS 2
+#define IORING_MAX_WORKERS 16
+
+struct ioring {
+	spin_lock_t lock;
+	int refcount;   /* The descriptor, plus each operation in flight */
+	int closed;
+
+	char shm_path[64];
+	shm_chunk_t * chunk;
+
+	uint32_t sq_entries;
+	uint32_t cq_entries;
+	uint32_t sq_head;   /* Kernel's copy; the shared one is only ever written */
+
+	list_t * cq_wait;
+	list_t * overflow;  /* Completions that didn't fit */
+};
+
+struct ioring_work {
+	struct ioring * ring;
+	struct ioring_sqe sqe;
+	fs_node_t * node;
+	page_directory_t * directory;
+};
+
+static spin_lock_t work_lock = { 0 };
+static list_t * work_queue = NULL;
+static list_t * work_wait = NULL;
+static int worker_count = 0;
+static int worker_idle = 0;
+
+static uint64_t submitted_count = 0;
+static uint64_t completed_count = 0;
+static uint64_t overflow_count = 0;
+
+/**
+ * @brief Find a spot in the ring through the physical map.
+ *
+ * Entries never cross a page, so one page's mapping is always enough.
+ */
+static void * ring_at(struct ioring * ring, size_t offset) {
+	return (char*)mmu_map_from_physical(ring->chunk->frames[offset >> 12] << 12) + (offset & 0xFFF);
+}
+
+static struct ioring_header * ring_header(struct ioring * ring) {
+	return ring_at(ring, 0);
+}
+
+static void ioring_put(struct ioring * ring) {
+	spin_lock(ring->lock);
+	ring->refcount--;
+	if (ring->refcount > 0) {
+		spin_unlock(ring->lock);
+		return;
+	}
+	spin_unlock(ring->lock);
+
+	while (ring->overflow->length) {
+		node_t * n = list_dequeue(ring->overflow);
+		free(n->value);
+		free(n);
+	}
+	free(ring->overflow);
+	free(ring->cq_wait);
+	shm_chunk_release(ring->chunk);
+	free(ring);
+}
+
+/* Must be called with the ring locked */
+static int ioring_post_locked(struct ioring * ring, struct ioring_cqe * cqe) {
+	struct ioring_header * header = ring_header(ring);
+	uint32_t tail = header->cq_tail;
+	if (tail - header->cq_head >= ring->cq_entries) return 1;
+	struct ioring_cqe * slot = ring_at(ring, header->cq_offset + (tail & header->cq_mask) * sizeof(struct ioring_cqe));
+	memcpy(slot, cqe, sizeof(struct ioring_cqe));
+	__sync_synchronize();
+	header->cq_tail = tail + 1;
+	return 0;
+}
+
+/* Must be called with the ring locked */
+static void ioring_flush_overflow_locked(struct ioring * ring) {
+	while (ring->overflow->length) {
+		if (ioring_post_locked(ring, ring->overflow->head->value)) break;
+		node_t * n = list_dequeue(ring->overflow);
+		free(n->value);
+		free(n);
+	}
+	ring_header(ring)->cq_overflow = ring->overflow->length;
+}
+
+static void ioring_complete(struct ioring * ring, uint64_t user_data, int64_t res) {
+	struct ioring_cqe cqe = { user_data, res };
+
+	spin_lock(ring->lock);
+	ioring_flush_overflow_locked(ring);
+	if (ring->overflow->length || ioring_post_locked(ring, &cqe)) {
+		/* Hold on to it rather than lose it; it goes out once there's room */
+		struct ioring_cqe * held = malloc(sizeof(struct ioring_cqe));
+		memcpy(held, &cqe, sizeof(struct ioring_cqe));
+		list_insert(ring->overflow, held);
+		ring_header(ring)->cq_overflow = ring->overflow->length;
+		overflow_count++;
+	}
+	completed_count++;
+	spin_unlock(ring->lock);
+
+	wakeup_queue(ring->cq_wait);
+}
+
+static int64_t ioring_msg(fs_node_t * node, struct ioring_sqe * sqe, int send) {
+	struct msghdr msg;
+	if (copy_from_user(&msg, (void*)(uintptr_t)sqe->addr, sizeof(struct msghdr))) return -EFAULT;
+	if (msg.msg_iovlen > IOV_MAX) return -EINVAL;
+	if (msg.msg_name && user_probe(msg.msg_name, msg.msg_namelen, send ? 0 : MMU_PTR_WRITE)) return -EFAULT;
+
+	struct iovec * kiov;
+	long status = iovec_from_user(msg.msg_iov, msg.msg_iovlen, send ? 0 : MMU_PTR_WRITE, &kiov);
+	if (status) return status;
+	msg.msg_iov = kiov;
+
+	int64_t out = send ? net_sock_send(node, &msg, sqe->op_flags) : net_sock_recv(node, &msg, sqe->op_flags);
+	if (kiov) free(kiov);
+	return out;
+}
+
+static int64_t ioring_execute(struct ioring_work * work) {
+	struct ioring_sqe * sqe = &work->sqe;
+	void * addr = (void*)(uintptr_t)sqe->addr;
+
+	switch (sqe->opcode) {
+		case IORING_OP_NOP:
+			return 0;
+
+		case IORING_OP_READ:
+			if (user_probe(addr, sqe->len, MMU_PTR_WRITE)) return -EFAULT;
+			return read_fs(work->node, sqe->off, sqe->len, addr);
+
+		case IORING_OP_WRITE:
+			if (user_probe(addr, sqe->len, 0)) return -EFAULT;
+			return write_fs(work->node, sqe->off, sqe->len, addr);
+
+		case IORING_OP_READV:
+		case IORING_OP_WRITEV: {
+			int reading = sqe->opcode == IORING_OP_READV;
+			struct iovec * kiov;
+			long status = iovec_from_user(addr, sqe->len, reading ? MMU_PTR_WRITE : 0, &kiov);
+			if (status) return status;
+			if (!kiov) return 0;
+			int64_t out = reading ? readv_fs(work->node, sqe->off, kiov, sqe->len) : writev_fs(work->node, sqe->off, kiov, sqe->len);
+			free(kiov);
+			return out;
+		}
+
+		case IORING_OP_FSYNC:
+			return fsync_fs(work->node, !!(sqe->op_flags & IORING_FSYNC_DATASYNC));
+
+		case IORING_OP_ACCEPT:
+			/* Same as accept(): no socket type takes incoming connections yet */
+			if (work->node->selectcheck != sock_generic_check) return -ENOTSOCK;
+			return -EINVAL;
+
+		case IORING_OP_RECV:
+			return ioring_msg(work->node, sqe, 0);
+
+		case IORING_OP_SEND:
+			return ioring_msg(work->node, sqe, 1);
+
+		case IORING_OP_TIMEOUT: {
+			unsigned long s, ss;
+			relative_time(sqe->off / 1000000, sqe->off % 1000000, &s, &ss);
+			sleep_until((process_t *)this_core->current_process, s, ss);
+			switch_task(0);
+			return -ETIME;
+		}
+	}
+
+	return -EINVAL;
+}
+
+static void ioring_worker(void * argp) {
+	page_directory_t * own = this_core->current_process->thread.page_directory;
+
+	while (1) {
+		spin_lock(work_lock);
+		while (!work_queue->length) {
+			worker_idle++;
+			sleep_on_unlocking(work_wait, &work_lock);
+			spin_lock(work_lock);
+			worker_idle--;
+		}
+		node_t * head = list_dequeue(work_queue);
+		/* If that was the last idle worker, make sure the next request doesn't wait behind this one */
+		int spawn = !worker_idle && worker_count < IORING_MAX_WORKERS;
+		if (spawn) worker_count++;
+		spin_unlock(work_lock);
+
+		if (spawn) spawn_worker_thread(ioring_worker, "[ioring]", NULL);
+
+		struct ioring_work * work = head->value;
+		free(head);
+
+		/* Borrow the submitter's address space so its buffers can be used directly */
+		this_core->current_process->thread.page_directory = work->directory;
+		mmu_set_directory(work->directory->directory);
+
+		int64_t res = ioring_execute(work);
+
+		this_core->current_process->thread.page_directory = own;
+		mmu_set_directory(own->directory);
+		process_release_directory(work->directory);
+
+		if (work->node) close_fs(work->node);
+		ioring_complete(work->ring, work->sqe.user_data, res);
+		ioring_put(work->ring);
+		free(work);
+	}
+}
+
+static int sqe_needs_fd(uint8_t opcode) {
+	return opcode != IORING_OP_NOP && opcode != IORING_OP_TIMEOUT;
+}
+
+static int sqe_access(uint8_t opcode) {
+	switch (opcode) {
+		case IORING_OP_READ:
+		case IORING_OP_READV:
+		case IORING_OP_RECV:
+			return 01;
+		case IORING_OP_WRITE:
+		case IORING_OP_WRITEV:
+		case IORING_OP_SEND:
+			return 02;
+		default:
+			return 0;
+	}
+}
+
+/**
+ * @brief Check a submission and hand it to the workers.
+ *
+ * @returns 0 if queued, or the error it should complete with right away.
+ */
+static long ioring_queue(struct ioring * ring, struct ioring_sqe * sqe) {
+	if (sqe->flags || sqe->opcode > IORING_OP_TIMEOUT) return -EINVAL;
+
+	fs_node_t * node = NULL;
+	if (sqe_needs_fd(sqe->opcode)) {
+		if (!FD_CHECK(sqe->fd)) return -EBADF;
+		int access = sqe_access(sqe->opcode);
+		if (access && !(FD_MODE(sqe->fd) & access)) return -EBADF;
+		node = FD_ENTRY(sqe->fd);
+		open_fs(node, 0);
+	}
+
+	struct ioring_work * work = malloc(sizeof(struct ioring_work));
+	work->ring = ring;
+	memcpy(&work->sqe, sqe, sizeof(struct ioring_sqe));
+	work->node = node;
+	work->directory = this_core->current_process->thread.page_directory;
+	spin_lock(work->directory->lock);
+	work->directory->refcount++;
+	spin_unlock(work->directory->lock);
+
+	spin_lock(ring->lock);
+	ring->refcount++;
+	spin_unlock(ring->lock);
+
+	spin_lock(work_lock);
+	list_insert(work_queue, work);
+	submitted_count++;
+	spin_unlock(work_lock);
+
+	return 0;
+}
+
+static void ioring_close(fs_node_t * node) {
+	struct ioring * ring = node->device;
+	ring->closed = 1;
+	wakeup_queue(ring->cq_wait);
+	ioring_put(ring);
+}
+
+static uint32_t round_up_pow2(uint32_t n) {
+	uint32_t out = 1;
+	while (out < n) out <<= 1;
+	return out;
+}
+
+long sys_ioring_setup(struct ioring_params * uparams) {
+	struct ioring_params params;
+	if (copy_from_user(&params, uparams, sizeof(struct ioring_params))) return -EFAULT;
+	if (params.flags) return -EINVAL;
+	if (!params.sq_entries || params.sq_entries > IORING_MAX_ENTRIES) return -EINVAL;
+	if (params.cq_entries > IORING_MAX_ENTRIES * 2) return -EINVAL;
+	if (!work_queue) return -ENOSYS;
+
+	uint32_t sq_entries = round_up_pow2(params.sq_entries);
+	uint32_t cq_entries = round_up_pow2(params.cq_entries ? params.cq_entries : sq_entries * 2);
+	if (cq_entries < sq_entries) cq_entries = sq_entries;
+
+	/* Header in the first page; both arrays start on an entry-sized boundary, so no entry spans pages */
+	size_t sq_offset = 0x1000;
+	size_t cq_offset = sq_offset + sq_entries * sizeof(struct ioring_sqe);
+	size_t size = cq_offset + cq_entries * sizeof(struct ioring_cqe);
+
+	struct ioring * ring = calloc(1, sizeof(struct ioring));
+	static volatile uint32_t ring_id = 0;
+	void * mapping = NULL;
+	/* Someone else may have taken the name first; it's only a name, so pick another */
+	for (int attempt = 0; !mapping && attempt < 16; ++attempt) {
+		snprintf(ring->shm_path, sizeof(ring->shm_path), "sys.ioring.%d.%u",
+			this_core->current_process->id, __sync_fetch_and_add(&ring_id, 1));
+		mapping = shm_obtain_private(ring->shm_path, &size);
+	}
+	if (!mapping) {
+		free(ring);
+		return -ENOMEM;
+	}
+	ring->chunk = shm_chunk_retain(ring->shm_path);
+	ring->refcount = 1;
+	ring->sq_entries = sq_entries;
+	ring->cq_entries = cq_entries;
+	ring->cq_wait = list_create("ioring completion waiters", ring);
+	ring->overflow = list_create("ioring overflowed completions", ring);
+
+	struct ioring_header * header = ring_header(ring);
+	memset(header, 0, sizeof(struct ioring_header));
+	header->sq_mask = sq_entries - 1;
+	header->cq_mask = cq_entries - 1;
+	header->sq_offset = sq_offset;
+	header->cq_offset = cq_offset;
+
+	fs_node_t * fnode = calloc(1, sizeof(fs_node_t));
+	snprintf(fnode->name, 100, "[ioring]");
+	fnode->flags = FS_CHARDEVICE;
+	fnode->mask = 0600;
+	fnode->uid = this_core->current_process->user;
+	fnode->gid = this_core->current_process->user_group;
+	fnode->device = ring;
+	fnode->close = ioring_close;
+	fnode->ctime = fnode->mtime = fnode->atime = now();
+	open_fs(fnode, 0);
+
+	int fd = process_append_fd((process_t *)this_core->current_process, fnode);
+	FD_MODE(fd) = 03;
+
+	params.sq_entries = sq_entries;
+	params.cq_entries = cq_entries;
+	params.ring = mapping;
+	params.ring_size = size;
+	if (copy_to_user(uparams, &params, sizeof(struct ioring_params))) {
+		/* They can't find out about the ring, so take it all back */
+		shm_release(ring->shm_path);
+		close_fs(fnode);
+		FD_ENTRY(fd) = NULL;
+		return -EFAULT;
+	}
+
+	return fd;
+}
+
+long sys_ioring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags) {
+	if (!FD_CHECK(fd)) return -EBADF;
+	if (FD_ENTRY(fd)->close != ioring_close) return -EINVAL;
+	if (flags) return -EINVAL;
+
+	struct ioring * ring = FD_ENTRY(fd)->device;
+	struct ioring_header * header = ring_header(ring);
+	long submitted = 0;
+
+	/* Another thread may close the descriptor while we wait */
+	spin_lock(ring->lock);
+	ring->refcount++;
+	while ((unsigned int)submitted < to_submit) {
+		uint32_t tail = header->sq_tail;
+		if (ring->sq_head == tail) break;
+		if (tail - ring->sq_head > ring->sq_entries) {
+			/* Userspace moved the tail somewhere impossible */
+			spin_unlock(ring->lock);
+			ioring_put(ring);
+			return submitted ? submitted : -EINVAL;
+		}
+		__sync_synchronize();
+
+		struct ioring_sqe sqe;
+		memcpy(&sqe, ring_at(ring, header->sq_offset + (ring->sq_head & header->sq_mask) * sizeof(struct ioring_sqe)), sizeof(struct ioring_sqe));
+		ring->sq_head++;
+		header->sq_head = ring->sq_head;
+		spin_unlock(ring->lock);
+
+		long status = ioring_queue(ring, &sqe);
+		if (status) ioring_complete(ring, sqe.user_data, status);
+		submitted++;
+
+		spin_lock(ring->lock);
+	}
+	spin_unlock(ring->lock);
+
+	if (submitted) wakeup_queue(work_wait);
+
+	if (min_complete) {
+		spin_lock(ring->lock);
+		while (!ring->closed) {
+			ioring_flush_overflow_locked(ring);
+			if (header->cq_tail - header->cq_head >= min_complete) break;
+			if (sleep_on_unlocking(ring->cq_wait, &ring->lock)) {
+				/* Interrupted by a signal */
+				if (!submitted) submitted = -EINTR;
+				spin_lock(ring->lock);
+				break;
+			}
+			spin_lock(ring->lock);
+		}
+		spin_unlock(ring->lock);
+	}
+
+	ioring_put(ring);
+	return submitted;
+}
+
+static void ioring_func(fs_node_t * node) {
+	procfs_printf(node,
+		"Workers:\t%d\n"
+		"Idle:\t%d\n"
+		"Submitted:\t%zu\n"
+		"Completed:\t%zu\n"
+		"Overflowed:\t%zu\n"
+		"Queued:\t%zu\n",
+		worker_count, worker_idle,
+		(size_t)submitted_count, (size_t)completed_count, (size_t)overflow_count,
+		(size_t)work_queue->length);
+}
+
+static struct procfs_entry ioring_entry = {
+	0,
+	"ioring",
+	ioring_func,
+};
+
+void ioring_initialize(void) {
+	work_wait = list_create("ioring workers", NULL);
+	work_queue = list_create("ioring work", NULL);
+	worker_count = IORING_MIN_WORKERS;
+	for (int i = 0; i < IORING_MIN_WORKERS; ++i) {
+		spawn_worker_thread(ioring_worker, "[ioring]", NULL);
+	}
+	procfs_install(&ioring_entry);
+}
@@ -6,6 +6,7 @@
  * of the NCSA / University of Illinois License - see LICENSE.md
  * Copyright (C) 2021 K. Lange <klange@toaruos.org>
  */
+#include <errno.h>
 #include <kernel/types.h>
 #include <kernel/printf.h>
 #include <kernel/time.h>
@@ -40,6 +41,23 @@ int mutex_acquire(sched_mutex_t * mutex) {
 	return 0;
 }
 
+/**
+ * @brief Take the mutex only if nobody holds it.
+ *
+ * @returns 0 if it was taken, -EBUSY if it is held.
+ */
+int mutex_try_acquire(sched_mutex_t * mutex) {
+	spin_lock(mutex->inner_lock);
+	if (mutex->status) {
+		spin_unlock(mutex->inner_lock);
+		return -EBUSY;
+	}
+	mutex->status = 1;
+	mutex->owner  = (process_t*)this_core->current_process;
+	spin_unlock(mutex->inner_lock);
+	return 0;
+}
+
 int mutex_release(sched_mutex_t * mutex) {
 	assert(mutex->owner == this_core->current_process);
 	spin_lock(mutex->inner_lock);
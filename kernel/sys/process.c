@@ -824,6 +824,19 @@ int sleep_on_unlocking(list_t * queue, spin_lock_t * release) {
 	return !!(this_core->current_process->flags & PROC_FLAG_SLEEP_INT);
 }
 
+/**
+ * @brief Wait for an event, without being woken by signals.
+ *
+ * For waits that can't be given up part way, such as for a device
+ * to finish with memory it was handed. Signals stay pending, and
+ * are dealt with once the caller gets back to userspace.
+ */
+void sleep_on_unlocking_uninterruptible(list_t * queue, spin_lock_t * release) {
+	__sync_or_and_fetch(&this_core->current_process->flags, PROC_FLAG_SLEEP_UNINT);
+	sleep_on_unlocking(queue, release);
+	__sync_and_and_fetch(&this_core->current_process->flags, ~(PROC_FLAG_SLEEP_UNINT));
+}
+
 /**
  * @brief Indicates whether a process is ready to be run but not currently running.
  */
@@ -1108,6 +1121,23 @@ int process_wait_nodes(process_t * process,fs_node_t * nodes[], int timeout) {
 			}
 			n++;
 		} while (*n);
+
+		/* Anything that became ready after the checks above, but before it knew
+		 * to alert us, has alerted no one; look again before going to sleep. */
+		n = nodes;
+		index = 0;
+		do {
+			if (selectcheck_fs(*n) == 0) {
+				list_free(process->node_waits);
+				free(process->node_waits);
+				process->node_waits = NULL;
+				spin_unlock(process->sched_lock);
+				spin_unlock(sleep_lock);
+				return index;
+			}
+			n++;
+			index++;
+		} while (*n);
 	}
 
 	if (timeout > 0) {
@@ -1160,9 +1190,14 @@ void process_awaken_signal(process_t * process) {
 	spin_unlock(sleep_lock);
 }
 
+extern int evset_alert(void * watcher, void * value);
+
 int process_alert_node_locked(process_t * process, void * value) {
 	must_have_lock(sleep_lock);
 
+	/* Event sets register with drivers as if they were processes */
+	if (evset_alert(process, value)) return 0;
+
 	if (!is_valid_process(process)) {
 		dprintf("core %d (pid=%d %s) attempted to alert invalid process %#zx\n",
 			this_core->cpu_id, this_core->current_process->id, this_core->current_process->name,
@@ -263,14 +263,14 @@ long ptrace_detach(pid_t pid, int sig) {
  * @returns 0 on success, -ESRCH if tracee is invalid.
  */
 long ptrace_getregs(pid_t pid, void * data) {
-	if (!data || ptr_validate(data, "ptrace")) return -EFAULT;
+	if (!data) return -EFAULT;
 	process_t * tracee = process_from_pid(pid);
 	if (!tracee || (tracee->tracer != this_core->current_process->id) || !(tracee->flags & PROC_FLAG_SUSPENDED)) return -ESRCH;
 
 	/* Copy registers */
-	memcpy(data, tracee->interrupt_registers ? tracee->interrupt_registers : tracee->syscall_registers, sizeof(struct regs));
+	if (copy_to_user(data, tracee->interrupt_registers ? tracee->interrupt_registers : tracee->syscall_registers, sizeof(struct regs))) return -EFAULT;
 #ifdef __aarch64__
-	memcpy((char*)data + sizeof(struct regs), &tracee->thread.context.saved[10], sizeof(uintptr_t));
+	if (copy_to_user((char*)data + sizeof(struct regs), &tracee->thread.context.saved[10], sizeof(uintptr_t))) return -EFAULT;
 #endif
 
 	return 0;
@@ -292,7 +292,7 @@ long ptrace_getregs(pid_t pid, void * data) {
  * @returns 0 on success, -EFAULT if the requested address is not mapped and readable in the tracee, -ESRCH if tracee is invalid.
  */
 long ptrace_peek(pid_t pid, void * addr, void * data) {
-	if (!data || ptr_validate(data, "ptrace")) return -EFAULT;
+	if (!data) return -EFAULT;
 	process_t * tracee = process_from_pid(pid);
 	if (!tracee || (tracee->tracer != this_core->current_process->id) || !(tracee->flags & PROC_FLAG_SUSPENDED)) return -ESRCH;
 
@@ -308,9 +308,7 @@ long ptrace_peek(pid_t pid, void * addr, void * data) {
 	uintptr_t blarg = (uintptr_t)mmu_map_from_physical(mapped_address);
 
 	/* Yeah, uh, one byte. That works. */
-	*(char*)data = *(char*)blarg;
-
-	return 0;
+	return copy_to_user(data, (char*)blarg, 1);
 }
 
 /**
@@ -332,7 +330,9 @@ long ptrace_peek(pid_t pid, void * addr, void * data) {
  * @returns 0 on success, -ESRCH if tracee is invalid, -EFAULT if the tracee address is not mapped or not writable.
  */
 long ptrace_poke(pid_t pid, void * addr, void * data) {
-	if (!data || ptr_validate(data, "ptrace")) return -EFAULT;
+	if (!data) return -EFAULT;
+	char byte;
+	if (copy_from_user(&byte, data, 1)) return -EFAULT;
 	process_t * tracee = process_from_pid(pid);
 	if (!tracee || (tracee->tracer != this_core->current_process->id) || !(tracee->flags & PROC_FLAG_SUSPENDED)) return -ESRCH;
 
@@ -348,7 +348,7 @@ long ptrace_poke(pid_t pid, void * addr, void * data) {
 	uintptr_t blarg = (uintptr_t)mmu_map_from_physical(mapped_address);
 
 	/* Yeah, uh, one byte. That works. */
-	*(char*)blarg = *(char*)data;
+	*(char*)blarg = byte;
 
 	return 0;
 }
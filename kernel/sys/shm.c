@@ -101,6 +101,7 @@ static shm_chunk_t * create_chunk (shm_node_t * parent, size_t size) {
 	chunk->parent = parent;
 	chunk->lock = 0;
 	chunk->ref_count = 1;
+	chunk->owner = 0;
 
 	chunk->num_frames = (size / 0x1000) + ((size % 0x1000) ? 1 : 0);
 	chunk->frames = malloc(sizeof(uintptr_t) * chunk->num_frames);
@@ -233,7 +234,7 @@ static size_t chunk_size (shm_chunk_t * chunk) {
 /* Kernel-Facing Functions and Syscalls */
 
 
-void * shm_obtain (char * path, size_t * size) {
+static void * obtain (char * path, size_t * size, int private) {
 	spin_lock(bsl);
 	volatile process_t * volatile proc = this_core->current_process;
 
@@ -259,7 +260,12 @@ void * shm_obtain (char * path, size_t * size) {
 			return NULL;
 		}
 
+		if (private) chunk->owner = proc->id;
 		node->chunk = chunk;
+	} else if (private || (chunk->owner && chunk->owner != proc->id)) {
+		/* Private chunks are only ever made fresh, and only their owner can get at them */
+		spin_unlock(bsl);
+		return NULL;
 	} else {
 		/* New accessor! */
 		chunk->ref_count++;
@@ -273,6 +279,21 @@ void * shm_obtain (char * path, size_t * size) {
 	return vshm_start;
 }
 
+void * shm_obtain (char * path, size_t * size) {
+	return obtain(path, size, 0);
+}
+
+/**
+ * @brief Create a new chunk that only the calling process can map.
+ *
+ * For chunks the kernel shares with one process, like I/O rings;
+ * other processes asking for the same path get nothing. Fails if
+ * the path is already in use.
+ */
+void * shm_obtain_private (char * path, size_t * size) {
+	return obtain(path, size, 1);
+}
+
 int shm_release (char * path) {
 	spin_lock(bsl);
 	process_t * proc = (process_t *)this_core->current_process;
@@ -322,6 +343,30 @@ int shm_release (char * path) {
 	return 0;
 }
 
+/**
+ * @brief Take a reference to the chunk behind a path, for kernel use.
+ *
+ * Keeps the chunk's frames alive independently of any process
+ * mappings, so the kernel can reach them through the physical map.
+ */
+shm_chunk_t * shm_chunk_retain(char * path) {
+	spin_lock(bsl);
+	shm_node_t * node = get_node(path, 0);
+	shm_chunk_t * chunk = node ? node->chunk : NULL;
+	if (chunk) chunk->ref_count++;
+	spin_unlock(bsl);
+	return chunk;
+}
+
+/**
+ * @brief Drop a reference taken with shm_chunk_retain.
+ */
+void shm_chunk_release(shm_chunk_t * chunk) {
+	spin_lock(bsl);
+	release_chunk(chunk);
+	spin_unlock(bsl);
+}
+
 /* This function should only be called if the process's address space
  * is about to be destroyed -- chunks will not be unmounted therefrom ! */
 void shm_release_all (process_t * proc) {
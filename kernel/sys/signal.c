@@ -256,7 +256,8 @@ int send_signal(pid_t process, int signal, int force_root) {
 
 	/* Schedule processes awoken by signals to be run. Unless they're us, we'll
 	 * jump to the signal handler as part of returning from this call. */
-	if (receiver != this_core->current_process && !process_is_ready(receiver)) {
+	if (receiver != this_core->current_process && !process_is_ready(receiver) &&
+	    !(receiver->flags & PROC_FLAG_SLEEP_UNINT)) {
 		make_process_ready(receiver);
 	}
 
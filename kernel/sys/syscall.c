@@ -30,6 +30,7 @@
 #include <kernel/syscall.h>
 #include <kernel/misc.h>
 #include <kernel/ptrace.h>
+#include <kernel/bcache.h>
 
 static char   hostname[256];
 static size_t hostname_len = 0;
@@ -45,7 +46,159 @@ int ptr_validate(void * ptr, const char * syscall) {
 	return 0;
 }
 
-#define PTRCHECK(addr,size,flags) do { if (!mmu_validate_user_pointer(addr,size,flags)) return -EFAULT; } while (0)
+/**
+ * @brief Check that [ptr, ptr+n) lies entirely in the user half of the address space.
+ */
+static int user_range_ok(const void * ptr, size_t n) {
+	uintptr_t base = (uintptr_t)ptr;
+	return base + n >= base && base + n <= 0x800000000000;
+}
+
+/**
+ * @brief Copy @p n bytes from userspace at @p src to the kernel at @p dest.
+ *
+ * Faults while copying are caught by the page fault handler and turned
+ * into an error return, so the user mapping is not walked beforehand.
+ *
+ * @returns 0 on success, -EFAULT if any part of @p src was inaccessible.
+ */
+long copy_from_user(void * dest, const void * src, size_t n) {
+	if (!user_range_ok(src, n)) return -EFAULT;
+	return arch_user_copy(dest, src, n) ? -EFAULT : 0;
+}
+
+/**
+ * @brief Copy @p n bytes from the kernel at @p src to userspace at @p dest.
+ *
+ * @returns 0 on success, -EFAULT if any part of @p dest was not writable.
+ */
+long copy_to_user(void * dest, const void * src, size_t n) {
+	if (!user_range_ok(dest, n)) return -EFAULT;
+	return arch_user_copy(dest, src, n) ? -EFAULT : 0;
+}
+
+/**
+ * @brief Find the length of a user string, looking at no more than @p max bytes.
+ *
+ * @returns The length of the string, @p max if it was not terminated, or -EFAULT.
+ */
+long strnlen_user(const char * src, size_t max) {
+	if (!user_range_ok(src, 1)) return -EFAULT;
+	if (max > 0x800000000000 - (uintptr_t)src) max = 0x800000000000 - (uintptr_t)src;
+	size_t len = arch_user_strnlen(src, max);
+	if (len == (size_t)-1) return -EFAULT;
+	return len;
+}
+
+#define USER_PATH_MAX  4096
+#define USER_ARG_MAX   0x20000 /* longest single argument or environment string for exec */
+#define USER_ARGS_MAX  0x10000 /* most arguments or environment strings for exec */
+
+/**
+ * @brief Copy a string argument, such as a path, into a new kernel buffer.
+ *
+ * @param out Set to the copy, which the caller frees.
+ * @returns 0 on success, -EFAULT if the string was inaccessible, or
+ *          -ENAMETOOLONG if it is not terminated within @p max bytes.
+ */
+static long copy_string_from_user(char ** out, const char * src, size_t max) {
+	if (!src) return -EFAULT;
+	long len = strnlen_user(src, max);
+	if (len < 0) return len;
+	if ((size_t)len == max) return -ENAMETOOLONG;
+	char * str = malloc(len + 1);
+	if (copy_from_user(str, src, len)) {
+		free(str);
+		return -EFAULT;
+	}
+	/* It may have changed since we measured it */
+	str[len] = '\0';
+	*out = str;
+	return 0;
+}
+
+/**
+ * @brief Copy a NULL-terminated array of user strings, like argv, into the kernel.
+ *
+ * @param out   Set to the copy, also NULL-terminated; see free_string_list.
+ * @param count Set to the number of strings.
+ * @returns 0 on success, or a negative error code.
+ */
+static long copy_string_list_from_user(char *** out, int * count, char *const * src) {
+	char ** list = malloc(sizeof(char *));
+	int n = 0;
+	long error = 0;
+	while (1) {
+		char * str;
+		if (copy_from_user(&str, &src[n], sizeof(char *))) {
+			error = -EFAULT;
+			break;
+		}
+		if (!str) break;
+		if (n == USER_ARGS_MAX) {
+			error = -E2BIG;
+			break;
+		}
+		list = realloc(list, sizeof(char *) * (n + 2));
+		error = copy_string_from_user(&list[n], str, USER_ARG_MAX);
+		if (error) {
+			if (error == -ENAMETOOLONG) error = -E2BIG;
+			break;
+		}
+		n++;
+	}
+	list[n] = NULL;
+	if (error) {
+		for (int i = 0; i < n; ++i) free(list[i]);
+		free(list);
+		return error;
+	}
+	*out = list;
+	*count = n;
+	return 0;
+}
+
+/**
+ * @brief Free a list made by copy_string_list_from_user.
+ */
+static void free_string_list(char ** list) {
+	for (char ** s = list; *s; ++s) free(*s);
+	free(list);
+}
+
+/**
+ * @brief Copy the first @p n pointer-sized arguments of a sysfunc call.
+ */
+static long sysfunc_args(void ** out, char ** args, int n) {
+	if (!args) return -EFAULT;
+	return copy_from_user(out, args, sizeof(void *) * n);
+}
+
+/**
+ * @brief Fault in a user buffer that will be accessed directly by a filesystem.
+ *
+ * Touches one byte of each page in the buffer through the fault-tolerant
+ * accessors. This resolves stack growth and copy-on-write up front and
+ * costs a single (normally TLB-hot) access per page on the success path,
+ * rather than a software walk of the page tables.
+ *
+ * @param flags @c MMU_PTR_WRITE if the buffer will be written to.
+ * @returns 0 on success, -EFAULT if any page was inaccessible.
+ */
+long user_probe(void * ptr, size_t n, int flags) {
+	if (!n) return 0;
+	if (!user_range_ok(ptr, n)) return -EFAULT;
+	uintptr_t page = (uintptr_t)ptr;
+	uintptr_t last = ((uintptr_t)ptr + n - 1) & ~0xFFFUL;
+	while (1) {
+		if (arch_user_probe((void*)page, flags & MMU_PTR_WRITE)) return -EFAULT;
+		if ((page & ~0xFFFUL) == last) break;
+		page = (page & ~0xFFFUL) + 0x1000;
+	}
+	return 0;
+}
+
+#define PTRCHECK(addr,size,flags) do { if (user_probe(addr,size,flags)) return -EFAULT; } while (0)
 
 long sys_sbrk(ssize_t size) {
 	if (size & 0xFFF) return -EINVAL;
@@ -73,11 +226,8 @@ long sys_sysfunc(long fn, char ** args) {
 	/* FIXME: Most of these should be top-level, many are hacks/broken in Misaka */
 	switch (fn) {
 		case TOARU_SYS_FUNC_SYNC:
-			/* FIXME: There is no sync ability in the VFS at the moment.
-			 * XXX: Should this just be an ioctl on individual devices?
-			 *      Or possibly even an ioctl we can send to arbitrary files? */
-			printf("sync: not implemented\n");
-			return -EINVAL;
+			/* Write back everything held in the block cache. */
+			return bcache_sync(NULL) ? -EIO : 0;
 
 		case TOARU_SYS_FUNC_LOGHERE:
 			/* FIXME: The entire kernel logging system needs to be revamped as
@@ -85,7 +235,13 @@ long sys_sysfunc(long fn, char ** args) {
 			 *        removed most of them for cleanliness... first task would
 			 *        be to reintroduce kernel fprintf() to printf to fs_nodes. */
 			//if (this_core->current_process->user != 0) return -EACCES;
-			printf("\033[32m%s\033[0m", (char*)args);
+			{
+				char * msg;
+				long error = copy_string_from_user(&msg, (char*)args, USER_PATH_MAX);
+				if (error) return error;
+				printf("\033[32m%s\033[0m", msg);
+				free(msg);
+			}
 			return -EINVAL;
 
 		case TOARU_SYS_FUNC_KDEBUG:
@@ -95,46 +251,52 @@ long sys_sysfunc(long fn, char ** args) {
 			printf("kdebug: not implemented\n");
 			return -EINVAL;
 
-		case 42:
+		case 42: {
 			#ifdef __aarch64__
-			PTR_VALIDATE(&args[0]);
-			PTR_VALIDATE(&args[1]);
+			void * a[2];
+			if (sysfunc_args(a, args, 2)) return -EFAULT;
+			if (!user_range_ok(a[0], (uintptr_t)a[1] - (uintptr_t)a[0])) return -EFAULT;
 			extern void arch_clear_icache(uintptr_t,uintptr_t);
-			arch_clear_icache((uintptr_t)args[0], (uintptr_t)args[1]);
+			arch_clear_icache((uintptr_t)a[0], (uintptr_t)a[1]);
 			#endif
 			return 0;
+		}
 
 		case 43: {
 			extern void mmu_unmap_user(uintptr_t addr, size_t size);
-			PTR_VALIDATE(&args[0]);
-			PTR_VALIDATE(&args[1]);
-			mmu_unmap_user((uintptr_t)args[0], (size_t)args[1]);
+			void * a[2];
+			if (sysfunc_args(a, args, 2)) return -EFAULT;
+			if (!user_range_ok(a[0], (size_t)a[1])) return -EFAULT;
+			mmu_unmap_user((uintptr_t)a[0], (size_t)a[1]);
 			return 0;
 		}
 
 		case TOARU_SYS_FUNC_INSMOD:
 			/* Linux has init_module as a system call? */
 			if (this_core->current_process->user != 0) return -EACCES;
-			PTR_VALIDATE(args);
 			if (!args) return -EFAULT;
-			PTR_VALIDATE(args[0]);
-			if (!args[0]) return -EFAULT;
-			for (char ** aa = args; *aa; ++aa) { PTR_VALIDATE(*aa); }
-			return elf_module(args);
+			{
+				char ** kargs;
+				int count;
+				long error = copy_string_list_from_user(&kargs, &count, args);
+				if (error) return error;
+				error = count ? elf_module(kargs) : -EFAULT;
+				free_string_list(kargs);
+				return error;
+			}
 
 		case TOARU_SYS_FUNC_SETHEAP: {
 			/* I'm not really sure how this should be done...
 			 * traditional brk() would be expected to map everything in-between,
 			 * but we use this to move the heap in ld.so, and we don't want
 			 * the stuff in the middle to be mapped necessarily... */
-			PTR_VALIDATE(args);
-			if (!args) return -EFAULT;
-			if (!PTR_INRANGE(args[0])) return -EFAULT;
-			if (!args[0]) return -EFAULT;
+			void * heap;
+			if (sysfunc_args(&heap, args, 1)) return -EFAULT;
+			if (!heap || !PTR_INRANGE(heap)) return -EFAULT;
 			volatile process_t * volatile proc = this_core->current_process;
 			if (proc->group != 0) proc = process_from_pid(proc->group);
 			spin_lock(proc->image.lock);
-			proc->image.heap = (uintptr_t)args[0];
+			proc->image.heap = (uintptr_t)heap;
 			spin_unlock(proc->image.lock);
 			return 0;
 		}
@@ -143,16 +305,15 @@ long sys_sysfunc(long fn, char ** args) {
 			/* FIXME: This whole thing should be removed; we need a proper mmap interface,
 			 *        preferrably with all of the file mapping options, too. And it should
 			 *        probably also interact with the SHM subsystem... */
-			PTR_VALIDATE(args);
-			if (!args) return -EFAULT;
+			void * a[2];
+			if (sysfunc_args(a, args, 2)) return -EFAULT;
+			/* Align inputs */
+			uintptr_t start = ((uintptr_t)a[0]) & 0xFFFFffffFFFFf000UL;
+			uintptr_t end   = ((uintptr_t)a[0] + (size_t)a[1] + 0xFFF) & 0xFFFFffffFFFFf000UL;
+			if (!PTR_INRANGE(start) || !user_range_ok((void*)start, end - start)) return -EFAULT;
 			volatile process_t * volatile proc = this_core->current_process;
 			if (proc->group != 0) proc = process_from_pid(proc->group);
 			spin_lock(proc->image.lock);
-			/* Align inputs */
-			uintptr_t start = ((uintptr_t)args[0]) & 0xFFFFffffFFFFf000UL;
-			uintptr_t end   = ((uintptr_t)args[0] + (size_t)args[1] + 0xFFF) & 0xFFFFffffFFFFf000UL;
-			if (!PTR_INRANGE(start)) return -EFAULT;
-			if (!PTR_INRANGE(end)) return -EFAULT;
 			for (uintptr_t i = start; i < end; i += 0x1000) {
 				union PML * page = mmu_get_page(i, MMU_GET_MAKE);
 				mmu_frame_allocate(page, MMU_FLAG_WRITABLE);
@@ -163,33 +324,24 @@ long sys_sysfunc(long fn, char ** args) {
 
 		case TOARU_SYS_FUNC_THREADNAME: {
 			/* This should probably be moved to a new system call. */
-			int count = 0;
-			char **arg = args;
-			PTR_VALIDATE(args);
 			if (!args) return -EFAULT;
-			while (*arg) {
-				PTR_VALIDATE(*arg);
-				count++;
-				arg++;
-			}
-			this_core->current_process->cmdline = malloc(sizeof(char*)*(count+1));
-			int i = 0;
-			while (i < count) {
-				this_core->current_process->cmdline[i] = strdup(args[i]);
-				i++;
-			}
-			this_core->current_process->cmdline[i] = NULL;
+			char ** cmdline;
+			int count;
+			long error = copy_string_list_from_user(&cmdline, &count, args);
+			if (error) return error;
+			this_core->current_process->cmdline = cmdline;
 			return 0;
 		}
 
-		case TOARU_SYS_FUNC_SETGSBASE:
+		case TOARU_SYS_FUNC_SETGSBASE: {
 			/* This should be a new system call; see what Linux, et al., call it. */
-			PTR_VALIDATE(args);
-			if (!args) return -EFAULT;
-			PTR_VALIDATE(args[0]);
-			this_core->current_process->thread.context.tls_base = (uintptr_t)args[0];
+			void * base;
+			if (sysfunc_args(&base, args, 1)) return -EFAULT;
+			if (base && !PTR_INRANGE(base)) return -EFAULT;
+			this_core->current_process->thread.context.tls_base = (uintptr_t)base;
 			arch_set_tls_base(this_core->current_process->thread.context.tls_base);
 			return 0;
+		}
 
 		case TOARU_SYS_FUNC_NPROC:
 			return processor_count;
@@ -215,7 +367,7 @@ long sys_write(int fd, char * ptr, unsigned long len) {
 	}
 #endif
 	if (FD_CHECK(fd)) {
-		PTRCHECK(ptr,len,MMU_PTR_NULL);
+		PTRCHECK(ptr,len,0);
 		fs_node_t * node = FD_ENTRY(fd);
 		if (!(FD_MODE(fd) & 2)) return -EACCES;
 		if (len && !ptr) {
@@ -231,11 +383,13 @@ long sys_write(int fd, char * ptr, unsigned long len) {
 }
 
 static long stat_node(fs_node_t * fn, uintptr_t st) {
-	struct stat * f = (struct stat *)st;
+	struct stat _f;
+	struct stat * f = &_f;
+	memset(f, 0x00, sizeof(struct stat));
 
 	if (!fn) {
 		/* XXX: Does this need to zero the stat struct when returning -ENOENT? */
-		memset(f, 0x00, sizeof(struct stat));
+		if (copy_to_user((void*)st, f, sizeof(struct stat))) return -EFAULT;
 		return -ENOENT;
 	}
 
@@ -266,11 +420,10 @@ static long stat_node(fs_node_t * fn, uintptr_t st) {
 		f->st_size = fn->get_size(fn);
 	}
 
-	return 0;
+	return copy_to_user((void*)st, f, sizeof(struct stat));
 }
 
 long sys_stat(int fd, uintptr_t st) {
-	PTR_VALIDATE(st);
 	if (!st) return -EFAULT;
 	if (FD_CHECK(fd)) {
 		return stat_node(FD_ENTRY(fd), st);
@@ -279,13 +432,13 @@ long sys_stat(int fd, uintptr_t st) {
 }
 
 long sys_statf(char * file, uintptr_t st) {
-	int result;
-	PTR_VALIDATE(file);
-	PTR_VALIDATE(st);
-
-	if (!file || !st) return -EFAULT;
+	if (!st) return -EFAULT;
+	char * path;
+	long result = copy_string_from_user(&path, file, USER_PATH_MAX);
+	if (result) return result;
 
-	fs_node_t * fn = kopen(file, 0);
+	fs_node_t * fn = kopen(path, 0);
+	free(path);
 	result = stat_node(fn, st);
 	if (fn) {
 		close_fs(fn);
@@ -294,39 +447,49 @@ long sys_statf(char * file, uintptr_t st) {
 }
 
 long sys_symlink(char * target, char * name) {
-	PTR_VALIDATE(target);
-	PTR_VALIDATE(name);
-	if (!target || !name) return -EFAULT;
-	return symlink_fs(target, name);
+	char * ktarget, * kname;
+	long result = copy_string_from_user(&ktarget, target, USER_PATH_MAX);
+	if (result) return result;
+	result = copy_string_from_user(&kname, name, USER_PATH_MAX);
+	if (!result) {
+		result = symlink_fs(ktarget, kname);
+		free(kname);
+	}
+	free(ktarget);
+	return result;
 }
 
 long sys_readlink(const char * file, char * ptr, long len) {
-	PTR_VALIDATE(file);
-	if (!file) return -EFAULT;
-	fs_node_t * node = kopen((char *) file, O_PATH | O_NOFOLLOW);
+	if (len < 0) return -EINVAL;
+	PTRCHECK(ptr,len,MMU_PTR_WRITE);
+	char * path;
+	long rv = copy_string_from_user(&path, file, USER_PATH_MAX);
+	if (rv) return rv;
+	fs_node_t * node = kopen(path, O_PATH | O_NOFOLLOW);
+	free(path);
 	if (!node) {
 		return -ENOENT;
 	}
-	long rv = readlink_fs(node, ptr, len);
+	rv = readlink_fs(node, ptr, len);
 	close_fs(node);
 	return rv;
 }
 
 long sys_lstat(char * file, uintptr_t st) {
-	PTR_VALIDATE(file);
-	PTR_VALIDATE(st);
-	if (!file || !st) return -EFAULT;
-	fs_node_t * fn = kopen(file, O_PATH | O_NOFOLLOW);
-	long result = stat_node(fn, st);
+	if (!st) return -EFAULT;
+	char * path;
+	long result = copy_string_from_user(&path, file, USER_PATH_MAX);
+	if (result) return result;
+	fs_node_t * fn = kopen(path, O_PATH | O_NOFOLLOW);
+	free(path);
+	result = stat_node(fn, st);
 	if (fn) {
 		close_fs(fn);
 	}
 	return result;
 }
 
-long sys_open(const char * file, long flags, long mode) {
-	PTR_VALIDATE(file);
-	if (!file) return -EFAULT;
+static long open_path(const char * file, long flags, long mode) {
 	fs_node_t * node = kopen((char *)file, flags);
 
 	int access_bits = 0;
@@ -400,6 +563,15 @@ long sys_open(const char * file, long flags, long mode) {
 	return fd;
 }
 
+long sys_open(const char * file, long flags, long mode) {
+	char * path;
+	long result = copy_string_from_user(&path, file, USER_PATH_MAX);
+	if (result) return result;
+	result = open_path(path, flags, mode);
+	free(path);
+	return result;
+}
+
 long sys_close(int fd) {
 	if (FD_CHECK(fd)) {
 		close_fs(FD_ENTRY(fd));
@@ -432,7 +604,7 @@ long sys_seek(int fd, long offset, long whence) {
 
 long sys_read(int fd, char * ptr, unsigned long len) {
 	if (FD_CHECK(fd)) {
-		PTRCHECK(ptr,len,MMU_PTR_NULL|MMU_PTR_WRITE);
+		PTRCHECK(ptr,len,MMU_PTR_WRITE);
 		if (len && !ptr) {
 			return -EFAULT;
 		}
@@ -448,9 +620,158 @@ long sys_read(int fd, char * ptr, unsigned long len) {
 	return -EBADF;
 }
 
+/**
+ * @brief Bring in an iovec array from userspace.
+ *
+ * The array is copied once and every buffer it describes is checked,
+ * so the result can be handed straight to readv_fs/writev_fs.
+ *
+ * @param uiov   User iovec array
+ * @param iovcnt Number of entries
+ * @param flags  MMU_PTR_WRITE if the buffers will be written to
+ * @param out    Receives the kernel copy, to be freed by the caller
+ */
+long iovec_from_user(const struct iovec * uiov, int iovcnt, int flags, struct iovec ** out) {
+	if (iovcnt < 0 || iovcnt > IOV_MAX) return -EINVAL;
+	*out = NULL;
+	if (!iovcnt) return 0;
+
+	struct iovec * kiov = malloc(sizeof(struct iovec) * iovcnt);
+	if (copy_from_user(kiov, uiov, sizeof(struct iovec) * iovcnt)) {
+		free(kiov);
+		return -EFAULT;
+	}
+
+	size_t total = 0;
+	for (int i = 0; i < iovcnt; ++i) {
+		if (kiov[i].iov_len > (SIZE_MAX >> 1) - total) {
+			free(kiov);
+			return -EINVAL;
+		}
+		total += kiov[i].iov_len;
+		if (!kiov[i].iov_len) continue;
+		if (!kiov[i].iov_base || user_probe(kiov[i].iov_base, kiov[i].iov_len, flags)) {
+			free(kiov);
+			return -EFAULT;
+		}
+	}
+
+	*out = kiov;
+	return 0;
+}
+
+long sys_readv(int fd, const struct iovec * iov, int iovcnt) {
+	if (!FD_CHECK(fd)) return -EBADF;
+	if (!(FD_MODE(fd) & 01)) return -EACCES;
+
+	struct iovec * kiov;
+	long status = iovec_from_user(iov, iovcnt, MMU_PTR_WRITE, &kiov);
+	if (status) return status;
+	if (!kiov) return 0;
+
+	ssize_t out = readv_fs(FD_ENTRY(fd), FD_OFFSET(fd), kiov, iovcnt);
+	if (out > 0) FD_OFFSET(fd) += out;
+	free(kiov);
+	return out;
+}
+
+long sys_writev(int fd, const struct iovec * iov, int iovcnt) {
+	if (!FD_CHECK(fd)) return -EBADF;
+	if (!(FD_MODE(fd) & 2)) return -EACCES;
+
+	struct iovec * kiov;
+	long status = iovec_from_user(iov, iovcnt, 0, &kiov);
+	if (status) return status;
+	if (!kiov) return 0;
+
+	ssize_t out = writev_fs(FD_ENTRY(fd), FD_OFFSET(fd), kiov, iovcnt);
+	if (out > 0) FD_OFFSET(fd) += out;
+	free(kiov);
+	return out;
+}
+
+long sys_pread(int fd, char * ptr, unsigned long len, long offset) {
+	if (!FD_CHECK(fd)) return -EBADF;
+	if ((FD_ENTRY(fd)->flags & FS_PIPE) || (FD_ENTRY(fd)->flags & FS_CHARDEVICE)) return -ESPIPE;
+	if (offset < 0) return -EINVAL;
+	if (!(FD_MODE(fd) & 01)) return -EACCES;
+	PTRCHECK(ptr,len,MMU_PTR_WRITE);
+	if (len && !ptr) return -EFAULT;
+	return read_fs(FD_ENTRY(fd), offset, len, (uint8_t *)ptr);
+}
+
+long sys_pwrite(int fd, char * ptr, unsigned long len, long offset) {
+	if (!FD_CHECK(fd)) return -EBADF;
+	if ((FD_ENTRY(fd)->flags & FS_PIPE) || (FD_ENTRY(fd)->flags & FS_CHARDEVICE)) return -ESPIPE;
+	if (offset < 0) return -EINVAL;
+	if (!(FD_MODE(fd) & 2)) return -EACCES;
+	PTRCHECK(ptr,len,0);
+	if (len && !ptr) return -EFAULT;
+	return write_fs(FD_ENTRY(fd), offset, len, (uint8_t *)ptr);
+}
+
+/**
+ * @brief Move data between two descriptors with splice_fs.
+ *
+ * Either side may give an explicit offset, which is used and updated
+ * in place of the descriptor's own position, like pread/pwrite.
+ */
+static long fd_splice(int fd_in, off_t * off_in, int fd_out, off_t * off_out, size_t len) {
+	if (!FD_CHECK(fd_in) || !FD_CHECK(fd_out)) return -EBADF;
+	if (!(FD_MODE(fd_in) & 01) || !(FD_MODE(fd_out) & 2)) return -EBADF;
+
+	fs_node_t * in = FD_ENTRY(fd_in);
+	fs_node_t * out = FD_ENTRY(fd_out);
+
+	off_t in_offset, out_offset;
+	if (off_in) {
+		if ((in->flags & FS_PIPE) || (in->flags & FS_CHARDEVICE)) return -ESPIPE;
+		if (copy_from_user(&in_offset, off_in, sizeof(off_t))) return -EFAULT;
+		if (in_offset < 0) return -EINVAL;
+	} else {
+		in_offset = FD_OFFSET(fd_in);
+	}
+	if (off_out) {
+		if ((out->flags & FS_PIPE) || (out->flags & FS_CHARDEVICE)) return -ESPIPE;
+		if (copy_from_user(&out_offset, off_out, sizeof(off_t))) return -EFAULT;
+		if (out_offset < 0) return -EINVAL;
+	} else {
+		out_offset = FD_OFFSET(fd_out);
+	}
+
+	ssize_t out_len = splice_fs(in, &in_offset, out, &out_offset, len);
+
+	if (off_in) {
+		if (copy_to_user(off_in, &in_offset, sizeof(off_t))) return -EFAULT;
+	} else {
+		FD_OFFSET(fd_in) = in_offset;
+	}
+	if (off_out) {
+		if (copy_to_user(off_out, &out_offset, sizeof(off_t))) return -EFAULT;
+	} else {
+		FD_OFFSET(fd_out) = out_offset;
+	}
+
+	return out_len;
+}
+
+long sys_sendfile(int out_fd, int in_fd, off_t * offset, size_t count) {
+	return fd_splice(in_fd, offset, out_fd, NULL, count);
+}
+
+long sys_splice(int fd_in, off_t * off_in, int fd_out, off_t * off_out, size_t len) {
+	return fd_splice(fd_in, off_in, fd_out, off_out, len);
+}
+
+/**
+ * @brief Pass a request on to a device.
+ *
+ * How much of @p argp a request uses is up to the device, so it is
+ * handed over as is; ioctl methods access it with copy_from_user and
+ * copy_to_user like any other user pointer.
+ */
 long sys_ioctl(int fd, unsigned long request, void * argp) {
 	if (FD_CHECK(fd)) {
-		PTR_VALIDATE(argp);
 		return ioctl_fs(FD_ENTRY(fd), request, argp);
 	}
 	return -EBADF;
@@ -458,13 +779,12 @@ long sys_ioctl(int fd, unsigned long request, void * argp) {
 
 long sys_readdir(int fd, long index, struct dirent * entry) {
 	if (FD_CHECK(fd)) {
-		PTR_VALIDATE(entry);
 		if (!entry) return -EFAULT;
 		struct dirent * kentry = readdir_fs(FD_ENTRY(fd), (uint64_t)index);
 		if (kentry) {
-			memcpy(entry, kentry, sizeof *entry);
+			long result = copy_to_user(entry, kentry, sizeof *entry);
 			free(kentry);
-			return 1;
+			return result ? result : 1;
 		} else {
 			return 0;
 		}
@@ -472,32 +792,80 @@ long sys_readdir(int fd, long index, struct dirent * entry) {
 	return -EBADF;
 }
 
+/* Most entries handed out by one getdents call */
+#define GETDENTS_MAX 32
+
+long sys_getdents(int fd, struct dirent * entries, size_t size) {
+	if (FD_CHECK(fd)) {
+		size_t count = size / sizeof(struct dirent);
+		if (!count) return -EINVAL;
+		if (count > GETDENTS_MAX) count = GETDENTS_MAX;
+
+		struct dirent * kentries = malloc(sizeof(struct dirent) * count);
+		uint64_t cursor = FD_OFFSET(fd);
+		ssize_t result = getdents_fs(FD_ENTRY(fd), &cursor, kentries, count);
+		if (result > 0) {
+			if (copy_to_user(entries, kentries, sizeof(struct dirent) * result)) {
+				/* Leave the cursor alone so the entries aren't lost */
+				result = -EFAULT;
+			} else {
+				FD_OFFSET(fd) = cursor;
+				result *= sizeof(struct dirent);
+			}
+		}
+		free(kentries);
+		return result;
+	}
+	return -EBADF;
+}
+
+long sys_fsync(int fd) {
+	if (FD_CHECK(fd)) {
+		return fsync_fs(FD_ENTRY(fd), 0);
+	}
+	return -EBADF;
+}
+
+long sys_fdatasync(int fd) {
+	if (FD_CHECK(fd)) {
+		return fsync_fs(FD_ENTRY(fd), 1);
+	}
+	return -EBADF;
+}
+
 long sys_mkdir(char * path, uint64_t mode) {
-	PTR_VALIDATE(path);
-	if (!path) return -EFAULT;
-	return mkdir_fs(path, mode);
+	char * kpath;
+	long result = copy_string_from_user(&kpath, path, USER_PATH_MAX);
+	if (result) return result;
+	result = mkdir_fs(kpath, mode);
+	free(kpath);
+	return result;
 }
 
 long sys_access(const char * file, long flags) {
-	PTR_VALIDATE(file);
-	if (!file) return -EFAULT;
-	fs_node_t * node = kopen((char *)file, 0);
+	char * path;
+	long result = copy_string_from_user(&path, file, USER_PATH_MAX);
+	if (result) return result;
+	fs_node_t * node = kopen(path, 0);
+	free(path);
 	if (!node) return -ENOENT;
 	close_fs(node);
 	return 0;
 }
 
 long sys_chmod(char * file, long mode) {
-	PTR_VALIDATE(file);
-	if (!file) return -EFAULT;
-	fs_node_t * fn = kopen(file, 0);
+	char * path;
+	long result = copy_string_from_user(&path, file, USER_PATH_MAX);
+	if (result) return result;
+	fs_node_t * fn = kopen(path, 0);
+	free(path);
 	if (fn) {
 		/* Can group members change bits? I think it's only owners. */
 		if (this_core->current_process->user != 0 && this_core->current_process->user != fn->uid) {
 			close_fs(fn);
 			return -EACCES;
 		}
-		long result = chmod_fs(fn, mode);
+		result = chmod_fs(fn, mode);
 		close_fs(fn);
 		return result;
 	} else {
@@ -514,9 +882,11 @@ static int current_group_matches(gid_t gid) {
 }
 
 long sys_chown(char * file, uid_t uid, uid_t gid) {
-	PTR_VALIDATE(file);
-	if (!file) return -EFAULT;
-	fs_node_t * fn = kopen(file, 0);
+	char * path;
+	long result = copy_string_from_user(&path, file, USER_PATH_MAX);
+	if (result) return result;
+	fs_node_t * fn = kopen(path, 0);
+	free(path);
 	if (fn) {
 
 		/* Only a privileged user can change the owner of a file. */
@@ -542,7 +912,7 @@ long sys_chown(char * file, uid_t uid, uid_t gid) {
 			 chmod_fs(fn, fn->mask & (~0x800));
 		}
 
-		long result = chown_fs(fn, uid, gid);
+		result = chown_fs(fn, uid, gid);
 		close_fs(fn);
 		return result;
 	} else {
@@ -555,18 +925,20 @@ _access:
 }
 
 long sys_gettimeofday(struct timeval * tv, void * tz) {
-	PTR_VALIDATE(tv);
-	PTR_VALIDATE(tz);
 	if (!tv) return -EFAULT;
-	return gettimeofday(tv, tz);
+	struct timeval ktv;
+	int result = gettimeofday(&ktv, NULL);
+	if (copy_to_user(tv, &ktv, sizeof(struct timeval))) return -EFAULT;
+	return result;
 }
 
 long sys_settimeofday(struct timeval * tv, void * tz) {
 	extern int settimeofday(struct timeval * t, void *z);
 	if (this_core->current_process->user != USER_ROOT_UID) return -EPERM;
-	PTR_VALIDATE(tv);
-	PTR_VALIDATE(tz);
-	return settimeofday(tv,tz);
+	if (!tv) return -EINVAL;
+	struct timeval ktv;
+	if (copy_from_user(&ktv, tv, sizeof(struct timeval))) return -EFAULT;
+	return settimeofday(&ktv,NULL);
 }
 
 long sys_getuid(void) {
@@ -609,12 +981,9 @@ long sys_getgroups(int size, gid_t list[]) {
 	} else if (size < this_core->current_process->supplementary_group_count) {
 		return -EINVAL;
 	} else {
-		PTR_VALIDATE(list);
 		if (!list) return -EFAULT;
-		for (int i = 0; i < this_core->current_process->supplementary_group_count; ++i) {
-			PTR_VALIDATE(list + i);
-			list[i] = this_core->current_process->supplementary_group_list[i];
-		}
+		if (copy_to_user(list, this_core->current_process->supplementary_group_list,
+			sizeof(gid_t) * this_core->current_process->supplementary_group_count)) return -EFAULT;
 		return this_core->current_process->supplementary_group_count;
 	}
 }
@@ -623,6 +992,10 @@ long sys_setgroups(int size, const gid_t list[]) {
 	if (this_core->current_process->user != USER_ROOT_UID) return -EPERM;
 	if (size < 0) return -EINVAL;
 	if (size > 32) return -EINVAL; /* Arbitrary decision */
+	if (size && !list) return -EFAULT;
+
+	gid_t klist[32];
+	if (copy_from_user(klist, list, sizeof(gid_t) * size)) return -EFAULT;
 
 	/* Free the current set. */
 	if (this_core->current_process->supplementary_group_count) {
@@ -634,14 +1007,7 @@ long sys_setgroups(int size, const gid_t list[]) {
 	if (size == 0) return 0;
 
 	this_core->current_process->supplementary_group_list = malloc(sizeof(gid_t) * size);
-
-	PTR_VALIDATE(list);
-	if (!list) return -EFAULT;
-
-	for (int i = 0; i < size; ++i) {
-		PTR_VALIDATE(list + i);
-		this_core->current_process->supplementary_group_list[i] = list[i];
-	}
+	memcpy(this_core->current_process->supplementary_group_list, klist, sizeof(gid_t) * size);
 
 	return 0;
 }
@@ -712,9 +1078,10 @@ long sys_getpgid(pid_t pid) {
 	return proc->job;
 }
 
-long sys_uname(struct utsname * name) {
-	PTR_VALIDATE(name);
-	if (!name) return -EFAULT;
+long sys_uname(struct utsname * uname) {
+	if (!uname) return -EFAULT;
+	struct utsname _name;
+	struct utsname * name = &_name;
 	char version_number[256];
 	snprintf(version_number, 255, __kernel_version_format,
 			__kernel_version_major,
@@ -732,13 +1099,15 @@ long sys_uname(struct utsname * name) {
 	strcpy(name->version,  version_string);
 	strcpy(name->machine,  __kernel_arch);
 	strcpy(name->domainname, ""); /* TODO */
-	return 0;
+	return copy_to_user(uname, name, sizeof(struct utsname));
 }
 
 long sys_chdir(char * newdir) {
-	PTR_VALIDATE(newdir);
-	if (!newdir) return -EFAULT;
-	char * path = canonicalize_path(this_core->current_process->wd_name, newdir);
+	char * knewdir;
+	long result = copy_string_from_user(&knewdir, newdir, USER_PATH_MAX);
+	if (result) return result;
+	char * path = canonicalize_path(this_core->current_process->wd_name, knewdir);
+	free(knewdir);
 	fs_node_t * chd = kopen(path, 0);
 	if (chd) {
 		if ((chd->flags & FS_DIRECTORY) == 0) {
@@ -761,9 +1130,9 @@ long sys_chdir(char * newdir) {
 
 long sys_getcwd(char * buf, size_t size) {
 	if (buf) {
-		PTR_VALIDATE(buf);
 		size_t len = strlen(this_core->current_process->wd_name) + 1;
-		return (long)memcpy(buf, this_core->current_process->wd_name, size < len ? size : len);
+		if (copy_to_user(buf, this_core->current_process->wd_name, size < len ? size : len)) return -EFAULT;
+		return (long)buf;
 	}
 	return 0;
 }
@@ -774,14 +1143,14 @@ long sys_dup2(int old, int new) {
 
 long sys_sethostname(char * new_hostname) {
 	if (this_core->current_process->user == USER_ROOT_UID) {
-		PTR_VALIDATE(new_hostname);
 		if (!new_hostname) return -EFAULT;
-		size_t len = strlen(new_hostname) + 1;
-		if (len > 256) {
+		long len = strnlen_user(new_hostname, 256);
+		if (len < 0) return len;
+		if (len == 256) {
 			return -ENAMETOOLONG;
 		}
-		hostname_len = len;
-		memcpy(hostname, new_hostname, hostname_len);
+		if (copy_from_user(hostname, new_hostname, len + 1)) return -EFAULT;
+		hostname_len = len + 1;
 		return 0;
 	} else {
 		return -EPERM;
@@ -789,9 +1158,8 @@ long sys_sethostname(char * new_hostname) {
 }
 
 long sys_gethostname(char * buffer) {
-	PTR_VALIDATE(buffer);
 	if (!buffer) return -EFAULT;
-	memcpy(buffer, hostname, hostname_len);
+	if (copy_to_user(buffer, hostname, hostname_len)) return -EFAULT;
 	return hostname_len;
 }
 
@@ -804,11 +1172,22 @@ long sys_mount(char * arg, char * mountpoint, char * type, unsigned long flags,
 		return -EPERM;
 	}
 
-	if (PTR_INRANGE(arg) && PTR_INRANGE(mountpoint) && PTR_INRANGE(type)) {
-		return vfs_mount_type(type, arg, mountpoint);
-	}
+	char * karg, * kmountpoint, * ktype;
+	long result = copy_string_from_user(&karg, arg, USER_PATH_MAX);
+	if (result) return result;
+	result = copy_string_from_user(&kmountpoint, mountpoint, USER_PATH_MAX);
+	if (result) goto _free_arg;
+	result = copy_string_from_user(&ktype, type, USER_PATH_MAX);
+	if (result) goto _free_mountpoint;
+
+	result = vfs_mount_type(ktype, karg, kmountpoint);
 
-	return -EFAULT;
+	free(ktype);
+_free_mountpoint:
+	free(kmountpoint);
+_free_arg:
+	free(karg);
+	return result;
 }
 
 long sys_umask(long mode) {
@@ -817,46 +1196,38 @@ long sys_umask(long mode) {
 }
 
 long sys_unlink(char * file) {
-	PTR_VALIDATE(file);
-	if (!file) return -EFAULT;
-	return unlink_fs(file);
+	char * path;
+	long result = copy_string_from_user(&path, file, USER_PATH_MAX);
+	if (result) return result;
+	result = unlink_fs(path);
+	free(path);
+	return result;
 }
 
 long sys_execve(const char * filename, char *const argv[], char *const envp[]) {
-	PTR_VALIDATE(filename);
-	PTR_VALIDATE(argv);
-	PTR_VALIDATE(envp);
+	if (!argv) return -EFAULT;
 
-	if (!filename || !argv) return -EFAULT;
+	char * path;
+	long result = copy_string_from_user(&path, filename, USER_PATH_MAX);
+	if (result) return result;
 
 	int argc = 0;
 	int envc = 0;
-	while (argv[argc]) {
-		PTR_VALIDATE(argv[argc]);
-		++argc;
-	}
-
-	if (envp) {
-		while (envp[envc]) {
-			PTR_VALIDATE(envp[envc]);
-			++envc;
-		}
+	char ** argv_;
+	result = copy_string_list_from_user(&argv_, &argc, argv);
+	if (result) {
+		free(path);
+		return result;
 	}
 
-	char **argv_ = malloc(sizeof(char*) * (argc + 1));
-	for (int j = 0; j < argc; ++j) {
-		argv_[j] = malloc(strlen(argv[j]) + 1);
-		memcpy(argv_[j], argv[j], strlen(argv[j]) + 1);
-	}
-	argv_[argc] = 0;
 	char ** envp_;
-	if (envp && envc) {
-		envp_ = malloc(sizeof(char*) * (envc + 1));
-		for (int j = 0; j < envc; ++j) {
-			envp_[j] = malloc(strlen(envp[j]) + 1);
-			memcpy(envp_[j], envp[j], strlen(envp[j]) + 1);
+	if (envp) {
+		result = copy_string_list_from_user(&envp_, &envc, envp);
+		if (result) {
+			free_string_list(argv_);
+			free(path);
+			return result;
 		}
-		envp_[envc] = 0;
 	} else {
 		envp_ = malloc(sizeof(char*));
 		envp_[0] = NULL;
@@ -875,8 +1246,15 @@ long sys_execve(const char * filename, char *const argv[], char *const envp[]) {
 
 	shm_release_all((process_t *)this_core->current_process);
 
+	/* exec() only returns on failure, so the path can't be freed after it */
+	char kpath[strlen(path) + 1];
+	memcpy(kpath, path, sizeof(kpath));
+	free(path);
+
 	this_core->current_process->cmdline = argv_;
-	return exec(filename, argc, argv_, envp_, 0);
+	result = exec(kpath, argc, argv_, envp_, 0);
+	free_string_list(envp_);
+	return result;
 }
 
 long sys_fork(void) {
@@ -936,10 +1314,17 @@ long sys_pipe(int pipes[2]) {
 	open_fs(outpipes[0], 0);
 	open_fs(outpipes[1], 0);
 
-	pipes[0] = process_append_fd((process_t *)this_core->current_process, outpipes[0]);
-	pipes[1] = process_append_fd((process_t *)this_core->current_process, outpipes[1]);
-	FD_MODE(pipes[0]) = 03;
-	FD_MODE(pipes[1]) = 03;
+	int kpipes[2];
+	kpipes[0] = process_append_fd((process_t *)this_core->current_process, outpipes[0]);
+	kpipes[1] = process_append_fd((process_t *)this_core->current_process, outpipes[1]);
+	FD_MODE(kpipes[0]) = 03;
+	FD_MODE(kpipes[1]) = 03;
+
+	if (copy_to_user(pipes, kpipes, sizeof(kpipes))) {
+		sys_close(kpipes[0]);
+		sys_close(kpipes[1]);
+		return -EFAULT;
+	}
 	return 0;
 }
 
@@ -952,76 +1337,101 @@ long sys_signal(long signum, uintptr_t handler) {
 	return old;
 }
 
-long sys_fswait(int c, int fds[]) {
-	PTR_VALIDATE(fds);
-	if (!fds) return -EFAULT;
-	for (int i = 0; i < c; ++i) {
-		if (!FD_CHECK(fds[i])) return -EBADF;
+/**
+ * @brief Copy a user array of file descriptors and resolve them to nodes.
+ *
+ * @returns NULL-terminated node list to be freed by the caller, or NULL with @p err set.
+ */
+static fs_node_t ** fswait_nodes(int c, int fds[], long * err) {
+	if (!fds) { *err = -EFAULT; return NULL; }
+	if (c < 0) { *err = -EINVAL; return NULL; }
+	int * kfds = malloc(sizeof(int) * (c+1));
+	if (copy_from_user(kfds, fds, sizeof(int) * c)) {
+		free(kfds);
+		*err = -EFAULT;
+		return NULL;
 	}
 	fs_node_t ** nodes = malloc(sizeof(fs_node_t *)*(c+1));
 	for (int i = 0; i < c; ++i) {
-		nodes[i] = FD_ENTRY(fds[i]);
+		if (!FD_CHECK(kfds[i])) {
+			free(kfds);
+			free(nodes);
+			*err = -EBADF;
+			return NULL;
+		}
+		nodes[i] = FD_ENTRY(kfds[i]);
 	}
 	nodes[c] = NULL;
-
-	int result = process_wait_nodes((process_t *)this_core->current_process, nodes, -1);
-	free(nodes);
-	return result;
+	free(kfds);
+	return nodes;
 }
 
 long sys_fswait_timeout(int c, int fds[], int timeout) {
-	PTR_VALIDATE(fds);
-	if (!fds) return -EFAULT;
-	for (int i = 0; i < c; ++i) {
-		if (!FD_CHECK(fds[i])) return -EBADF;
-	}
-	fs_node_t ** nodes = malloc(sizeof(fs_node_t *)*(c+1));
-	for (int i = 0; i < c; ++i) {
-		nodes[i] = FD_ENTRY(fds[i]);
-	}
-	nodes[c] = NULL;
+	long err;
+	fs_node_t ** nodes = fswait_nodes(c, fds, &err);
+	if (!nodes) return err;
 
 	int result = process_wait_nodes((process_t *)this_core->current_process, nodes, timeout);
 	free(nodes);
 	return result;
 }
 
+long sys_fswait(int c, int fds[]) {
+	return sys_fswait_timeout(c, fds, -1);
+}
+
 long sys_fswait_multi(int c, int fds[], int timeout, int out[]) {
-	PTR_VALIDATE(fds);
-	PTR_VALIDATE(out);
-	if (!fds || !out) return -EFAULT;
+	if (!out) return -EFAULT;
+	long err;
+	fs_node_t ** nodes = fswait_nodes(c, fds, &err);
+	if (!nodes) return err;
+
+	int * kout = malloc(sizeof(int) * (c+1));
 	int has_match = -1;
 	for (int i = 0; i < c; ++i) {
-		if (!FD_CHECK(fds[i])) {
-			return -EBADF;
-		}
-		if (selectcheck_fs(FD_ENTRY(fds[i])) == 0) {
-			out[i] = 1;
+		if (selectcheck_fs(nodes[i]) == 0) {
+			kout[i] = 1;
 			has_match = (has_match == -1) ? i : has_match;
 		} else {
-			out[i] = 0;
+			kout[i] = 0;
 		}
 	}
 
 	/* Already found a match, return immediately with the first match */
-	if (has_match != -1) return has_match;
+	int result = has_match;
+	if (has_match == -1) {
+		result = process_wait_nodes((process_t *)this_core->current_process, nodes, timeout);
+		if (result >= 0) kout[result] = 1;
+	}
 
-	int result = sys_fswait_timeout(c, fds, timeout);
-	if (result >= 0) out[result] = 1;
+	free(nodes);
+	if (copy_to_user(out, kout, sizeof(int) * c)) result = -EFAULT;
+	free(kout);
 	return result;
 }
 
 long sys_shm_obtain(char * path, size_t * size) {
-	PTR_VALIDATE(path);
-	PTR_VALIDATE(size);
-	if (!path || !size) return -EFAULT;
-	return (long)shm_obtain(path, size);
+	size_t ksize;
+	if (!size || copy_from_user(&ksize, size, sizeof(size_t))) return -EFAULT;
+	char * kpath;
+	long result = copy_string_from_user(&kpath, path, USER_PATH_MAX);
+	if (result) return result;
+	result = (long)shm_obtain(kpath, &ksize);
+	if (result && copy_to_user(size, &ksize, sizeof(size_t))) {
+		shm_release(kpath);
+		result = -EFAULT;
+	}
+	free(kpath);
+	return result;
 }
 
 long sys_shm_release(char * path) {
-	PTR_VALIDATE(path);
-	if (!path) return -EFAULT;
-	return shm_release(path);
+	char * kpath;
+	long result = copy_string_from_user(&kpath, path, USER_PATH_MAX);
+	if (result) return result;
+	result = shm_release(kpath);
+	free(kpath);
+	return result;
 }
 
 long sys_openpty(int * master, int * slave, char * name, void * _ign0, void * size) {
@@ -1038,15 +1448,21 @@ long sys_openpty(int * master, int * slave, char * name, void * _ign0, void * si
 	pty_create(size, &fs_master, &fs_slave);
 
 	/* Append the master and slave to the calling process */
-	*master = process_append_fd((process_t *)this_core->current_process, fs_master);
-	*slave  = process_append_fd((process_t *)this_core->current_process, fs_slave);
+	int kmaster = process_append_fd((process_t *)this_core->current_process, fs_master);
+	int kslave  = process_append_fd((process_t *)this_core->current_process, fs_slave);
 
-	FD_MODE(*master) = 03;
-	FD_MODE(*slave) = 03;
+	FD_MODE(kmaster) = 03;
+	FD_MODE(kslave) = 03;
 
 	open_fs(fs_master, 0);
 	open_fs(fs_slave, 0);
 
+	if (copy_to_user(master, &kmaster, sizeof(int)) || copy_to_user(slave, &kslave, sizeof(int))) {
+		sys_close(kmaster);
+		sys_close(kslave);
+		return -EFAULT;
+	}
+
 	/* Return success */
 	return 0;
 }
@@ -1071,12 +1487,12 @@ long sys_reboot(void) {
 
 long sys_times(struct tms *buf) {
 	if (buf) {
-		PTR_VALIDATE(buf);
-
-		buf->tms_utime  = this_core->current_process->time_total        / arch_cpu_mhz();
-		buf->tms_stime  = this_core->current_process->time_sys          / arch_cpu_mhz();
-		buf->tms_cutime = this_core->current_process->time_children     / arch_cpu_mhz();
-		buf->tms_cstime = this_core->current_process->time_sys_children / arch_cpu_mhz();
+		struct tms kbuf;
+		kbuf.tms_utime  = this_core->current_process->time_total        / arch_cpu_mhz();
+		kbuf.tms_stime  = this_core->current_process->time_sys          / arch_cpu_mhz();
+		kbuf.tms_cutime = this_core->current_process->time_children     / arch_cpu_mhz();
+		kbuf.tms_cstime = this_core->current_process->time_sys_children / arch_cpu_mhz();
+		if (copy_to_user(buf, &kbuf, sizeof(struct tms))) return -EFAULT;
 	}
 
 	return arch_perf_timer() / arch_cpu_mhz();
@@ -1094,6 +1510,11 @@ extern long net_send();
 extern long net_shutdown();
 
 extern long ptrace_handle(long,pid_t,void*,void*);
+extern long sys_ioring_setup();
+extern long sys_ioring_enter();
+extern long sys_evset_create();
+extern long sys_evset_ctl();
+extern long sys_evset_wait();
 
 static long (*syscalls[])() = {
 	/* System Call Table */
@@ -1159,6 +1580,20 @@ static long (*syscalls[])() = {
 	[SYS_TIMES]        = sys_times,
 	[SYS_PTRACE]       = ptrace_handle,
 	[SYS_SETTIMEOFDAY] = sys_settimeofday,
+	[SYS_GETDENTS]     = sys_getdents,
+	[SYS_FSYNC]        = sys_fsync,
+	[SYS_FDATASYNC]    = sys_fdatasync,
+	[SYS_READV]        = sys_readv,
+	[SYS_WRITEV]       = sys_writev,
+	[SYS_PREAD]        = sys_pread,
+	[SYS_PWRITE]       = sys_pwrite,
+	[SYS_SENDFILE]     = sys_sendfile,
+	[SYS_SPLICE]       = sys_splice,
+	[SYS_IORING_SETUP] = sys_ioring_setup,
+	[SYS_IORING_ENTER] = sys_ioring_enter,
+	[SYS_EVSET_CREATE] = sys_evset_create,
+	[SYS_EVSET_CTL]    = sys_evset_ctl,
+	[SYS_EVSET_WAIT]   = sys_evset_wait,
 
 	[SYS_SOCKET]       = net_socket,
 	[SYS_SETSOCKOPT]   = net_setsockopt,
@@ -0,0 +1,735 @@
+/**
+ * @file  kernel/vfs/bcache.c
+ * @brief Block buffer cache shared by block filesystems.
+ *
+ * Filesystems read and write fixed-size blocks of their backing
+ * device through here instead of calling read_fs/write_fs on the
+ * device for every access. Buffers are keyed by (device, block,
+ * block size) and found through a hash table; replacement uses
+ * a CLOCK sweep over a fixed pool of buffer headers, sized from
+ * the amount of free memory at boot.
+ *
+ * Writes are absorbed in the cache and marked dirty, along with a
+ * write-back pass chosen by the filesystem. Whenever buffers are
+ * written back for a device, lower passes go first, so a filesystem
+ * can make sure (for example) that an allocation bitmap reaches the
+ * disk before anything that points into the blocks it allocated.
+ * Filesystems push out buffers that have been dirty for a while
+ * with @ref bcache_flush_expired, and writers are made to wait for
+ * write-back with @ref bcache_balance once too much of the cache is
+ * dirty. Eviction prefers clean buffers, and only writes back a
+ * lone dirty one when nothing else is available.
+ *
+ * Write-back to devices with block layer queues is done in batches
+ * submitted together, so that the queue can sort and merge them.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2021 K. Lange
+ */
+#include <errno.h>
+#include <kernel/types.h>
+#include <kernel/string.h>
+#include <kernel/printf.h>
+#include <kernel/process.h>
+#include <kernel/spinlock.h>
+#include <kernel/mutex.h>
+#include <kernel/mmu.h>
+#include <kernel/time.h>
+#include <kernel/vfs.h>
+#include <kernel/procfs.h>
+#include <kernel/bcache.h>
+#include <kernel/blkdev.h>
+
+/* Cache size limits, in KiB */
+#define BCACHE_MIN_SIZE  512
+#define BCACHE_MAX_SIZE  (64 * 1024)
+
+/* Headers are allotted assuming 4KiB blocks */
+#define BCACHE_UNIT      4
+
+/* Most blocks to read ahead with one request */
+#define BCACHE_PREFETCH_RUN 32
+
+/* Most buffers to write back in one batch of requests */
+#define BCACHE_FLUSH_BATCH  64
+
+/* Percentage of buffers that may be dirty before flushing is forced... */
+#define BCACHE_DIRTY_BACKGROUND 10 /* ...on periodic write-back */
+#define BCACHE_DIRTY_LIMIT      25 /* ...on writers, who must wait for it */
+
+static spin_lock_t bcache_lock = { 0 };
+static struct bcache_buf * buffers = NULL;
+static size_t bcache_count = 0;
+static struct bcache_buf ** bcache_hash = NULL;
+static size_t bcache_hash_mask = 0;
+static size_t clock_hand = 0;
+static volatile size_t dirty_count = 0;
+
+static uint64_t hit_count = 0;
+static uint64_t miss_count = 0;
+static uint64_t eviction_count = 0;
+static uint64_t writeback_count = 0;
+static uint64_t prefetch_count = 0;
+
+static size_t bcache_hash_index(fs_node_t * dev, uint64_t block) {
+	return ((((uintptr_t)dev) >> 4) ^ (block * 2654435761UL)) & bcache_hash_mask;
+}
+
+/* Must be called with bcache_lock held. */
+static struct bcache_buf * bcache_find(fs_node_t * dev, uint64_t block, size_t size) {
+	struct bcache_buf * buf = bcache_hash[bcache_hash_index(dev, block)];
+	while (buf) {
+		if (buf->dev == dev && buf->block == block && buf->size == size) return buf;
+		buf = buf->hash_next;
+	}
+	return NULL;
+}
+
+/* Must be called with bcache_lock held. */
+static void bcache_unhash(struct bcache_buf * buf) {
+	struct bcache_buf ** link = &bcache_hash[bcache_hash_index(buf->dev, buf->block)];
+	while (*link) {
+		if (*link == buf) {
+			*link = buf->hash_next;
+			break;
+		}
+		link = &(*link)->hash_next;
+	}
+	buf->hash_next = NULL;
+}
+
+/* Milliseconds since boot */
+static uint64_t bcache_clock(void) {
+	unsigned long s, ss;
+	relative_time(0, 0, &s, &ss);
+	return (uint64_t)s * 1000 + ss / 1000;
+}
+
+/**
+ * @brief Mark a buffer as needing to be written back.
+ *
+ * The caller must hold the buffer's lock. A buffer that is already
+ * dirty keeps the earlier of its passes, so that dirtying it again
+ * doesn't keep putting off its write-back.
+ *
+ * @param pass When to write the buffer relative to the device's other
+ *             dirty buffers; lower passes are written first.
+ */
+void bcache_dirty(struct bcache_buf * buf, int pass) {
+	if (pass < 0) pass = 0;
+	if (pass >= BCACHE_PASSES) pass = BCACHE_PASSES - 1;
+	if (buf->flags & BCACHE_DIRTY) {
+		if (pass < buf->pass) buf->pass = pass;
+		return;
+	}
+	buf->pass = pass;
+	buf->dirtied = bcache_clock();
+	__sync_fetch_and_or(&buf->flags, BCACHE_DIRTY);
+	__sync_add_and_fetch(&dirty_count, 1);
+}
+
+/* Must be called with buf->lock held. */
+static void bcache_clean(struct bcache_buf * buf) {
+	if (__sync_fetch_and_and(&buf->flags, ~BCACHE_DIRTY) & BCACHE_DIRTY) {
+		__sync_sub_and_fetch(&dirty_count, 1);
+	}
+}
+
+/**
+ * @brief Write a buffer back to its device if it is dirty.
+ *
+ * The caller must hold a reference to @p buf.
+ */
+static int bcache_writeback(struct bcache_buf * buf) {
+	int result = 0;
+	mutex_acquire(buf->lock);
+	if (buf->flags & BCACHE_DIRTY) {
+		bcache_clean(buf);
+		ssize_t written = write_fs(buf->dev, buf->block * buf->size, buf->size, buf->data);
+		if (written < (ssize_t)buf->size) {
+			printf("bcache: failed to write back block %zu of %s\n", (size_t)buf->block, buf->dev->name);
+			/* Keep it around to try again later */
+			bcache_dirty(buf, buf->pass);
+			result = -EIO;
+		}
+		writeback_count++;
+	}
+	mutex_release(buf->lock);
+	return result;
+}
+
+/**
+ * @brief Find or claim the buffer for a block, and take a reference to it.
+ *
+ * A newly claimed buffer is not yet valid; whoever takes its lock
+ * first is responsible for filling it.
+ */
+static struct bcache_buf * bcache_grab(fs_node_t * dev, uint64_t block, size_t size) {
+	spin_lock(bcache_lock);
+	while (1) {
+		struct bcache_buf * buf = bcache_find(dev, block, size);
+		if (buf) {
+			buf->refcount++;
+			__sync_or_and_fetch(&buf->flags, BCACHE_REFERENCED);
+			hit_count++;
+			spin_unlock(bcache_lock);
+			return buf;
+		}
+
+		/* Sweep for an unreferenced buffer that hasn't been used since our last pass.
+		 * Dirty ones are passed over, as writing them back here would do so out of order. */
+		struct bcache_buf * victim = NULL;
+		struct bcache_buf * dirty = NULL;
+		for (size_t scanned = 0; scanned < bcache_count * 2; ++scanned) {
+			struct bcache_buf * candidate = &buffers[clock_hand];
+			clock_hand = (clock_hand + 1) % bcache_count;
+			if (candidate->refcount) continue;
+			if (candidate->flags & BCACHE_REFERENCED) {
+				__sync_and_and_fetch(&candidate->flags, ~BCACHE_REFERENCED);
+				continue;
+			}
+			if (candidate->flags & BCACHE_DIRTY) {
+				if (!dirty) dirty = candidate;
+				continue;
+			}
+			victim = candidate;
+			break;
+		}
+		if (!victim) victim = dirty;
+
+		if (!victim) {
+			/* Everything is in use; let someone else finish and try again. */
+			spin_unlock(bcache_lock);
+			switch_task(1);
+			spin_lock(bcache_lock);
+			continue;
+		}
+
+		if (victim->flags & BCACHE_DIRTY) {
+			/* Write it back while it is still visible, then look again from the top,
+			 * as someone may have brought in our block while we were unlocked. */
+			victim->refcount++;
+			spin_unlock(bcache_lock);
+			bcache_writeback(victim);
+			spin_lock(bcache_lock);
+			victim->refcount--;
+			continue;
+		}
+
+		if (victim->dev) {
+			bcache_unhash(victim);
+			eviction_count++;
+		}
+
+		miss_count++;
+		victim->dev = dev;
+		victim->block = block;
+		victim->flags = 0;
+		victim->refcount = 1;
+		victim->size = size; /* data is resized by the filler, under the buffer lock */
+		size_t index = bcache_hash_index(dev, block);
+		victim->hash_next = bcache_hash[index];
+		bcache_hash[index] = victim;
+		spin_unlock(bcache_lock);
+		return victim;
+	}
+}
+
+/* Must be called with buf->lock held. */
+static void bcache_prepare(struct bcache_buf * buf, size_t size) {
+	if (buf->data_size != size) {
+		if (buf->data) free(buf->data);
+		buf->data = malloc(size);
+		buf->data_size = size;
+	}
+}
+
+/* Must be called with buf->lock held. */
+static int bcache_fill(struct bcache_buf * buf, size_t size) {
+	if (buf->flags & BCACHE_VALID) return 0;
+	bcache_prepare(buf, size);
+	ssize_t result = read_fs(buf->dev, buf->block * size, size, buf->data);
+	if (result <= 0) return result < 0 ? result : -EIO;
+	if ((size_t)result < size) {
+		/* Short read at the end of the device */
+		memset(buf->data + result, 0, size - result);
+	}
+	__sync_or_and_fetch(&buf->flags, BCACHE_VALID);
+	return 0;
+}
+
+/**
+ * @brief Obtain a referenced, valid buffer for a block.
+ *
+ * The buffer's data may be read directly until it is released
+ * with @ref bcache_release. Modifications must be made with the
+ * buffer's lock held, and should mark it dirty.
+ *
+ * @returns The buffer, or NULL if the block could not be read.
+ */
+struct bcache_buf * bcache_get(fs_node_t * dev, uint64_t block, size_t size) {
+	struct bcache_buf * buf = bcache_grab(dev, block, size);
+	mutex_acquire(buf->lock);
+	int result = bcache_fill(buf, size);
+	mutex_release(buf->lock);
+	if (result) {
+		bcache_release(buf);
+		return NULL;
+	}
+	return buf;
+}
+
+void bcache_release(struct bcache_buf * buf) {
+	spin_lock(bcache_lock);
+	buf->refcount--;
+	spin_unlock(bcache_lock);
+}
+
+/**
+ * @brief Copy a block into @p out, reading it from the device if needed.
+ *
+ * @returns 0 on success, negative error code on failure.
+ */
+int bcache_read(fs_node_t * dev, uint64_t block, size_t size, uint8_t * out) {
+	struct bcache_buf * buf = bcache_grab(dev, block, size);
+	mutex_acquire(buf->lock);
+	int result = bcache_fill(buf, size);
+	if (!result) memcpy(out, buf->data, size);
+	mutex_release(buf->lock);
+	bcache_release(buf);
+	return result;
+}
+
+/**
+ * @brief Replace the contents of a block.
+ *
+ * The block is not read from the device first, as all of it is
+ * being overwritten. It will be written back later.
+ *
+ * @param pass Write-back pass; see @ref bcache_dirty
+ */
+int bcache_write(fs_node_t * dev, uint64_t block, size_t size, const uint8_t * in, int pass) {
+	struct bcache_buf * buf = bcache_grab(dev, block, size);
+	mutex_acquire(buf->lock);
+	bcache_prepare(buf, size);
+	memcpy(buf->data, in, size);
+	__sync_or_and_fetch(&buf->flags, BCACHE_VALID);
+	bcache_dirty(buf, pass);
+	mutex_release(buf->lock);
+	bcache_release(buf);
+	return 0;
+}
+
+/**
+ * @brief Modify part of a block.
+ *
+ * @param offset Offset within the block to write to.
+ * @param len    Number of bytes from @p in to write.
+ * @param pass   Write-back pass; see @ref bcache_dirty
+ */
+int bcache_update(fs_node_t * dev, uint64_t block, size_t size, size_t offset, size_t len, const uint8_t * in, int pass) {
+	if (offset + len > size) return -EINVAL;
+	struct bcache_buf * buf = bcache_grab(dev, block, size);
+	mutex_acquire(buf->lock);
+	int result = bcache_fill(buf, size);
+	if (!result) {
+		memcpy(buf->data + offset, in, len);
+		bcache_dirty(buf, pass);
+	}
+	mutex_release(buf->lock);
+	bcache_release(buf);
+	return result;
+}
+
+/**
+ * @brief Take a reference to a block's buffer only if it is already cached.
+ */
+static struct bcache_buf * bcache_peek(fs_node_t * dev, uint64_t block, size_t size) {
+	spin_lock(bcache_lock);
+	struct bcache_buf * buf = bcache_find(dev, block, size);
+	if (buf) buf->refcount++;
+	spin_unlock(bcache_lock);
+	return buf;
+}
+
+/**
+ * @brief Read a run of consecutive blocks, mostly bypassing the cache.
+ *
+ * Blocks that are cached are copied from the cache, as they may be
+ * newer than what is on the device; every stretch of blocks that
+ * isn't is read from the device with a single request, directly
+ * into @p out. Blocks read this way are not added to the cache, so
+ * large sequential reads don't push out everything else.
+ */
+int bcache_read_run(fs_node_t * dev, uint64_t block, size_t count, size_t size, uint8_t * out) {
+	size_t missing = 0; /* start of the stretch we still need from the device */
+	for (size_t i = 0; i <= count; ++i) {
+		struct bcache_buf * buf = (i < count) ? bcache_peek(dev, block + i, size) : NULL;
+		int cached = 0;
+		if (buf) {
+			mutex_acquire(buf->lock);
+			if (buf->flags & BCACHE_VALID) {
+				memcpy(out + i * size, buf->data, size);
+				cached = 1;
+			}
+			mutex_release(buf->lock);
+			bcache_release(buf);
+		}
+
+		if ((cached || i == count) && missing < i) {
+			size_t length = (i - missing) * size;
+			ssize_t result = read_fs(dev, (block + missing) * size, length, out + missing * size);
+			if (result < 0) return result;
+			if ((size_t)result < length) memset(out + missing * size + result, 0, length - result);
+		}
+
+		if (cached) missing = i + 1;
+	}
+	return 0;
+}
+
+/**
+ * @brief Bring a run of consecutive blocks into the cache ahead of use.
+ *
+ * Each stretch of blocks that isn't cached is read with a single
+ * request. The buffers are claimed and locked before the read is
+ * issued, so anyone who wants one of them in the meantime waits for
+ * it instead of reading it again. They are left unreferenced, so the
+ * CLOCK sweep reclaims them first if nothing ends up using them.
+ *
+ * @returns 0 on success, negative error code on failure.
+ */
+int bcache_prefetch(fs_node_t * dev, uint64_t block, size_t count, size_t size) {
+	struct bcache_buf * run[BCACHE_PREFETCH_RUN];
+	size_t i = 0;
+	while (i < count) {
+		size_t n = 0;
+		while (i + n < count && n < BCACHE_PREFETCH_RUN) {
+			struct bcache_buf * buf = bcache_peek(dev, block + i + n, size);
+			if (buf) {
+				bcache_release(buf);
+				break;
+			}
+			buf = bcache_grab(dev, block + i + n, size);
+			mutex_acquire(buf->lock);
+			if (buf->flags & BCACHE_VALID) {
+				/* Someone else got to it first */
+				mutex_release(buf->lock);
+				bcache_release(buf);
+				break;
+			}
+			run[n++] = buf;
+		}
+
+		if (!n) {
+			i++;
+			continue;
+		}
+
+		uint8_t * data = malloc(n * size);
+		ssize_t result = read_fs(dev, (block + i) * size, n * size, data);
+		for (size_t j = 0; j < n; ++j) {
+			if (result >= (ssize_t)((j + 1) * size)) {
+				bcache_prepare(run[j], size);
+				memcpy(run[j]->data, data + j * size, size);
+				__sync_or_and_fetch(&run[j]->flags, BCACHE_VALID);
+			}
+			mutex_release(run[j]->lock);
+			bcache_release(run[j]);
+		}
+		free(data);
+		prefetch_count += n;
+
+		if (result < 0) return result;
+		i += n;
+	}
+	return 0;
+}
+
+/**
+ * @brief Write a run of consecutive blocks through to the device.
+ *
+ * The whole run is written with a single request. Cached copies of
+ * any of the blocks are updated to match first, and stay locked
+ * until the write is done, so that no write-back of an older copy
+ * can land on the device after it. They are clean afterwards.
+ */
+int bcache_write_run(fs_node_t * dev, uint64_t block, size_t count, size_t size, const uint8_t * in) {
+	struct bcache_buf ** cached = malloc(sizeof(struct bcache_buf *) * count);
+	for (size_t i = 0; i < count; ++i) {
+		struct bcache_buf * buf = bcache_peek(dev, block + i, size);
+		cached[i] = buf;
+		if (!buf) continue;
+		mutex_acquire(buf->lock);
+		bcache_prepare(buf, size);
+		memcpy(buf->data, in + i * size, size);
+		__sync_or_and_fetch(&buf->flags, BCACHE_VALID);
+	}
+
+	ssize_t result = write_fs(dev, block * size, count * size, (uint8_t *)in);
+
+	for (size_t i = 0; i < count; ++i) {
+		struct bcache_buf * buf = cached[i];
+		if (!buf) continue;
+		if (result == (ssize_t)(count * size)) {
+			bcache_clean(buf);
+		} else {
+			/* Keep it around to try again later */
+			bcache_dirty(buf, buf->pass);
+		}
+		mutex_release(buf->lock);
+		bcache_release(buf);
+	}
+	free(cached);
+
+	if (result < 0) return result;
+	return result < (ssize_t)(count * size) ? -EIO : 0;
+}
+
+/**
+ * @brief Write back a batch of buffers, all at once where we can.
+ *
+ * Dirty buffers on devices with block layer queues are locked and
+ * submitted together under a plug, so they reach the queue already
+ * sorted and merged, and stay locked until their writes are done.
+ * Only buffers nobody else holds are taken this way, so we never
+ * wait for one lock while holding others; the rest, and buffers on
+ * other devices, are written back one at a time afterwards. The
+ * caller must hold a reference to each buffer.
+ */
+static int bcache_writeback_batch(struct bcache_buf ** batch, int count) {
+	struct blk_request * requests = malloc(sizeof(struct blk_request) * count);
+	char * submitted = malloc(count);
+	struct blk_plug plug = { NULL };
+	int result = 0;
+
+	for (int i = 0; i < count; ++i) {
+		struct bcache_buf * buf = batch[i];
+		struct blkdev * blk = blkdev_get(buf->dev);
+		submitted[i] = 0;
+
+		if (!blk || buf->size % blk->sector_size) continue;
+		if (mutex_try_acquire(buf->lock)) continue;
+
+		if (!(buf->flags & BCACHE_DIRTY)) {
+			mutex_release(buf->lock);
+			continue;
+		}
+
+		size_t sectors = buf->size / blk->sector_size;
+		requests[i] = (struct blk_request){
+			.dev = blk,
+			.sector = buf->block * sectors,
+			.count = sectors,
+			.write = 1,
+			.buffer = buf->data,
+		};
+		blk_submit(&requests[i], &plug);
+		submitted[i] = 1;
+	}
+
+	blk_unplug(&plug);
+
+	for (int i = 0; i < count; ++i) {
+		if (!submitted[i]) continue;
+		struct bcache_buf * buf = batch[i];
+		if (blk_wait(&requests[i])) {
+			/* Keep it around to try again later */
+			printf("bcache: failed to write back block %zu of %s\n", (size_t)buf->block, buf->dev->name);
+			result = -EIO;
+		} else {
+			bcache_clean(buf);
+		}
+		writeback_count++;
+		mutex_release(buf->lock);
+	}
+
+	for (int i = 0; i < count; ++i) {
+		if (submitted[i]) continue;
+		int status = bcache_writeback(batch[i]);
+		if (status) result = status;
+	}
+
+	free(submitted);
+	free(requests);
+	return result;
+}
+
+/**
+ * @brief Write back the dirty buffers of one pass that were dirtied by @p cutoff.
+ */
+static int bcache_flush_pass(fs_node_t * dev, int pass, uint64_t cutoff) {
+	struct bcache_buf * batch[BCACHE_FLUSH_BATCH];
+	int result = 0;
+	size_t i = 0;
+
+	while (1) {
+		int count = 0;
+		spin_lock(bcache_lock);
+		for (; i < bcache_count && count < BCACHE_FLUSH_BATCH; ++i) {
+			struct bcache_buf * buf = &buffers[i];
+			if (!buf->dev || !(buf->flags & BCACHE_DIRTY)) continue;
+			if (dev && buf->dev != dev) continue;
+			if (buf->pass != pass || buf->dirtied > cutoff) continue;
+			buf->refcount++;
+			batch[count++] = buf;
+		}
+		spin_unlock(bcache_lock);
+
+		if (!count) break;
+
+		int status = bcache_writeback_batch(batch, count);
+		if (status) result = status;
+
+		spin_lock(bcache_lock);
+		for (int j = 0; j < count; ++j) batch[j]->refcount--;
+		spin_unlock(bcache_lock);
+	}
+
+	return result;
+}
+
+/**
+ * @brief Write back dirty buffers in pass order.
+ *
+ * Every dirty buffer in a pass is written before any in the next,
+ * so that if the system goes down part way through, what reached
+ * the device is whatever the filesystem considered safe to land first.
+ *
+ * @param dev      Device to flush, or NULL to flush every device.
+ * @param max_pass Last pass to write back.
+ */
+int bcache_flush(fs_node_t * dev, int max_pass) {
+	int result = 0;
+	for (int pass = 0; pass <= max_pass && pass < BCACHE_PASSES; ++pass) {
+		int status = bcache_flush_pass(dev, pass, UINT64_MAX);
+		if (status) result = status;
+	}
+	return result;
+}
+
+/**
+ * @brief Write back all dirty buffers belonging to a device.
+ *
+ * @param dev Device to flush, or NULL to flush every device.
+ */
+int bcache_sync(fs_node_t * dev) {
+	return bcache_flush(dev, BCACHE_PASSES - 1);
+}
+
+/**
+ * @brief Periodic write-back.
+ *
+ * Writes back buffers that have been dirty for at least @p age
+ * milliseconds, along with everything in earlier passes, which
+ * they may depend on. If more of the cache is dirty than should
+ * be left for the next period, everything is written back.
+ */
+int bcache_flush_expired(fs_node_t * dev, unsigned long age) {
+	if (dirty_count * 100 > bcache_count * BCACHE_DIRTY_BACKGROUND) {
+		return bcache_sync(dev);
+	}
+
+	uint64_t clock = bcache_clock();
+	if (clock < age) return 0;
+	uint64_t cutoff = clock - age;
+
+	int top = -1;
+	spin_lock(bcache_lock);
+	for (size_t i = 0; i < bcache_count; ++i) {
+		struct bcache_buf * buf = &buffers[i];
+		if (!buf->dev || !(buf->flags & BCACHE_DIRTY)) continue;
+		if (dev && buf->dev != dev) continue;
+		if (buf->dirtied <= cutoff && buf->pass > top) top = buf->pass;
+	}
+	spin_unlock(bcache_lock);
+
+	if (top < 0) return 0;
+	int result = bcache_flush(dev, top - 1);
+	int status = bcache_flush_pass(dev, top, cutoff);
+	return status ? status : result;
+}
+
+/**
+ * @brief Make a writer wait for write-back if too much of the cache is dirty.
+ *
+ * Filesystems call this after an operation that dirtied buffers,
+ * with no buffer locks held.
+ */
+void bcache_balance(fs_node_t * dev) {
+	if (dirty_count * 100 > bcache_count * BCACHE_DIRTY_LIMIT) {
+		bcache_sync(dev);
+	}
+}
+
+/**
+ * @brief Retrieve hit, miss, eviction, and write-back counts.
+ */
+void bcache_stats(uint64_t out[4]) {
+	out[0] = hit_count;
+	out[1] = miss_count;
+	out[2] = eviction_count;
+	out[3] = writeback_count;
+}
+
+static void bcache_func(fs_node_t * node) {
+	size_t used = 0, dirty = 0, bytes = 0;
+	spin_lock(bcache_lock);
+	for (size_t i = 0; i < bcache_count; ++i) {
+		if (!buffers[i].dev) continue;
+		used++;
+		bytes += buffers[i].data_size;
+		if (buffers[i].flags & BCACHE_DIRTY) dirty++;
+	}
+	spin_unlock(bcache_lock);
+
+	procfs_printf(node,
+		"Buffers:\t%zu\n"
+		"Used:\t%zu\n"
+		"Dirty:\t%zu\n"
+		"Cached:\t%zu kB\n"
+		"Hits:\t%zu\n"
+		"Misses:\t%zu\n"
+		"Evictions:\t%zu\n"
+		"Writebacks:\t%zu\n"
+		"Prefetched:\t%zu\n",
+		bcache_count, used, dirty, bytes / 1024,
+		(size_t)hit_count, (size_t)miss_count, (size_t)eviction_count, (size_t)writeback_count,
+		(size_t)prefetch_count);
+}
+
+static struct procfs_entry bcache_entry = {
+	0,
+	"bcache",
+	bcache_func,
+};
+
+/**
+ * @brief Size and allocate the buffer pool.
+ *
+ * Uses an eighth of the memory that is free at startup, within
+ * fixed bounds. Buffer data is allocated on first use.
+ */
+void bcache_initialize(void) {
+	size_t free_kb = mmu_total_memory() - mmu_used_memory();
+	size_t cache_kb = free_kb / 8;
+	if (cache_kb < BCACHE_MIN_SIZE) cache_kb = BCACHE_MIN_SIZE;
+	if (cache_kb > BCACHE_MAX_SIZE) cache_kb = BCACHE_MAX_SIZE;
+
+	bcache_count = cache_kb / BCACHE_UNIT;
+	buffers = malloc(sizeof(struct bcache_buf) * bcache_count);
+	memset(buffers, 0, sizeof(struct bcache_buf) * bcache_count);
+	for (size_t i = 0; i < bcache_count; ++i) {
+		buffers[i].lock = mutex_init("bcache buffer");
+	}
+
+	size_t hash_size = 1;
+	while (hash_size < bcache_count) hash_size <<= 1;
+	bcache_hash = malloc(sizeof(struct bcache_buf *) * hash_size);
+	memset(bcache_hash, 0, sizeof(struct bcache_buf *) * hash_size);
+	bcache_hash_mask = hash_size - 1;
+
+	procfs_install(&bcache_entry);
+}
@@ -0,0 +1,501 @@
+/**
+ * @file  kernel/vfs/blkdev.c
+ * @brief Block device request queues and I/O scheduling.
+ *
+ * Disk drivers register a @ref blkdev describing their geometry and
+ * limits, and a transfer function that carries out one request. The
+ * block layer provides the device node, turns byte-granular reads and
+ * writes into requests for whole sectors, and keeps a queue of them
+ * per device in sector order.
+ *
+ * A request for sectors that continue on from one already queued in
+ * the same direction is merged into it (a back merge), as is one for
+ * the sectors just before it (a front merge), as long as the result
+ * stays within the driver's limits. Submitting through a plug holds
+ * a batch of requests back until all of them are queued, so they can
+ * be sorted and merged before the device sees any of them.
+ *
+ * Requests are handed to the driver in one-way elevator order from
+ * where the last one ended, wrapping around to the lowest sector.
+ * Every request also has a deadline - short for reads, which someone
+ * is usually waiting on, and longer for writes - and once the oldest
+ * has passed it is dispatched next regardless of where it is.
+ *
+ * Transfers are synchronous, so there is no thread of our own to run
+ * the queue: whoever is waiting on a queued request dispatches the
+ * next one while the driver has room for more, until its own has gone
+ * to the device. A driver that can work on several requests at once
+ * sets a queue depth, and gets that many waiters dispatching together.
+ *
+ * Partitions get devices of their own that pass their requests on to
+ * the whole disk's queue.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2021 K. Lange
+ */
+#include <errno.h>
+#include <kernel/types.h>
+#include <kernel/string.h>
+#include <kernel/printf.h>
+#include <kernel/process.h>
+#include <kernel/spinlock.h>
+#include <kernel/time.h>
+#include <kernel/vfs.h>
+#include <kernel/list.h>
+#include <kernel/procfs.h>
+#include <kernel/bcache.h>
+#include <kernel/blkdev.h>
+#include <kernel/syscall.h>
+
+#include <sys/ioctl.h>
+
+/* Deadlines, in microseconds */
+#define BLK_READ_EXPIRE   500000
+#define BLK_WRITE_EXPIRE  5000000
+
+static list_t * blkdevs = NULL;
+static spin_lock_t blkdevs_lock = { 0 };
+
+/* Microseconds since boot */
+static uint64_t blk_clock(void) {
+	unsigned long s, ss;
+	relative_time(0, 0, &s, &ss);
+	return (uint64_t)s * 1000000 + ss;
+}
+
+/* Whether @p b can be added to the end of @p a. */
+static int blk_can_merge(struct blkdev * dev, struct blk_request * a, struct blk_request * b) {
+	return a->write == b->write &&
+		a->sector + a->span == b->sector &&
+		a->span + b->span <= dev->max_sectors &&
+		a->pieces + b->pieces <= dev->max_pieces;
+}
+
+/* Add @p b, and everything it carries, to the end of @p a. */
+static void blk_merge(struct blk_request * a, struct blk_request * b) {
+	a->merged_tail->merged = b;
+	a->merged_tail = b->merged_tail;
+	a->span += b->span;
+	a->pieces += b->pieces;
+	if (b->deadline < a->deadline) a->deadline = b->deadline;
+}
+
+/**
+ * @brief Put a request in the device queue, merging it if we can.
+ *
+ * Must be called with dev->lock held.
+ */
+static void blk_enqueue(struct blkdev * dev, struct blk_request * req) {
+	struct blk_request * prev = NULL;
+	struct blk_request ** link = &dev->queue;
+	while (*link && (*link)->sector < req->sector) {
+		prev = *link;
+		link = &prev->next;
+	}
+
+	if (prev && blk_can_merge(dev, prev, req)) {
+		blk_merge(prev, req);
+		dev->stats.back_merges++;
+		/* It may now reach the one after it, too */
+		if (prev->next && blk_can_merge(dev, prev, prev->next)) {
+			struct blk_request * after = prev->next;
+			prev->next = after->next;
+			blk_merge(prev, after);
+			dev->queued--;
+			dev->stats.back_merges++;
+		}
+		return;
+	}
+
+	if (*link && blk_can_merge(dev, req, *link)) {
+		struct blk_request * after = *link;
+		req->next = after->next;
+		blk_merge(req, after);
+		*link = req;
+		dev->stats.front_merges++;
+		return;
+	}
+
+	req->next = *link;
+	*link = req;
+	dev->queued++;
+}
+
+/**
+ * @brief Take the request that should go to the device next off the queue.
+ *
+ * Must be called with dev->lock held.
+ */
+static struct blk_request * blk_pick(struct blkdev * dev) {
+	if (!dev->queue) return NULL;
+
+	struct blk_request ** oldest = &dev->queue;
+	struct blk_request ** ahead = NULL;
+	for (struct blk_request ** link = &dev->queue; *link; link = &(*link)->next) {
+		if ((*link)->deadline < (*oldest)->deadline) oldest = link;
+		if (!ahead && (*link)->sector >= dev->position) ahead = link;
+	}
+
+	struct blk_request ** pick;
+	if ((*oldest)->deadline <= blk_clock()) {
+		pick = oldest;
+		dev->stats.expired++;
+	} else {
+		pick = ahead ? ahead : &dev->queue;
+	}
+
+	struct blk_request * req = *pick;
+	*pick = req->next;
+	req->next = NULL;
+	dev->queued--;
+	return req;
+}
+
+/**
+ * @brief Hand the next queued request to the driver and wait for it.
+ *
+ * Must be called with dev->lock held; it is released during the
+ * transfer, and held again on return.
+ */
+static void blk_dispatch(struct blkdev * dev) {
+	struct blk_request * req = blk_pick(dev);
+	for (struct blk_request * p = req; p; p = p->merged) p->state = BLK_DISPATCHED;
+	dev->in_flight++;
+	dev->position = req->sector + req->span;
+	dev->stats.dispatches++;
+	spin_unlock(dev->lock);
+
+	int error = dev->transfer(dev, req);
+
+	uint64_t now = blk_clock();
+	spin_lock(dev->lock);
+	dev->in_flight--;
+	for (struct blk_request * p = req; p; ) {
+		struct blk_request * next = p->merged;
+		uint64_t latency = now - p->submitted;
+		dev->stats.latency_total += latency;
+		if (latency > dev->stats.latency_max) dev->stats.latency_max = latency;
+		if (p->write) {
+			dev->stats.writes++;
+			dev->stats.write_sectors += p->count;
+		} else {
+			dev->stats.reads++;
+			dev->stats.read_sectors += p->count;
+		}
+		p->error = error;
+		/* Once it is done, the owner may reuse it at any time */
+		p->state = BLK_DONE;
+		p = next;
+	}
+	wakeup_queue(dev->wait);
+}
+
+/**
+ * @brief Queue a request.
+ *
+ * The request must stay where it is until @ref blk_wait has returned
+ * for it. Requests for a partition are moved to the whole disk.
+ *
+ * @param plug If not NULL, hold the request back until @ref blk_unplug.
+ */
+void blk_submit(struct blk_request * req, struct blk_plug * plug) {
+	if (!req->count || req->sector >= req->dev->sectors || req->count > req->dev->sectors - req->sector) {
+		req->error = -EINVAL;
+		req->state = BLK_DONE;
+		return;
+	}
+
+	while (req->dev->parent) {
+		req->sector += req->dev->start;
+		req->dev = req->dev->parent;
+	}
+
+	req->next = NULL;
+	req->merged = NULL;
+	req->merged_tail = req;
+	req->span = req->count;
+	req->pieces = 1;
+	req->submitted = blk_clock();
+	req->deadline = req->submitted + (req->write ? BLK_WRITE_EXPIRE : BLK_READ_EXPIRE);
+	req->state = BLK_QUEUED;
+	req->error = 0;
+
+	if (plug) {
+		req->next = plug->head;
+		plug->head = req;
+		return;
+	}
+
+	spin_lock(req->dev->lock);
+	blk_enqueue(req->dev, req);
+	spin_unlock(req->dev->lock);
+}
+
+/**
+ * @brief Queue everything submitted through a plug.
+ */
+void blk_unplug(struct blk_plug * plug) {
+	while (plug->head) {
+		struct blk_request * req = plug->head;
+		plug->head = req->next;
+		spin_lock(req->dev->lock);
+		blk_enqueue(req->dev, req);
+		spin_unlock(req->dev->lock);
+	}
+}
+
+/**
+ * @brief Wait for a queued request to complete, dispatching while we do.
+ *
+ * @returns 0 on success, negative error code on failure.
+ */
+int blk_wait(struct blk_request * req) {
+	struct blkdev * dev = req->dev;
+	spin_lock(dev->lock);
+	while (req->state != BLK_DONE) {
+		if (req->state == BLK_QUEUED && dev->queue && dev->in_flight < dev->depth) {
+			blk_dispatch(dev);
+			continue;
+		}
+		/* The device owns the buffer until the request is done, so a signal can't cut this short */
+		sleep_on_unlocking_uninterruptible(dev->wait, &dev->lock);
+		spin_lock(dev->lock);
+	}
+	spin_unlock(dev->lock);
+	return req->error;
+}
+
+/**
+ * @brief Read or write whole sectors and wait for it.
+ */
+int blk_rw(struct blkdev * dev, uint64_t sector, unsigned int count, uint8_t * buffer, int write) {
+	struct blk_request req = {
+		.dev = dev,
+		.sector = sector,
+		.count = count,
+		.write = write,
+		.buffer = buffer,
+	};
+	blk_submit(&req, NULL);
+	return blk_wait(&req);
+}
+
+static int blk_direct(struct blkdev * dev, uint8_t * buffer) {
+	return (uintptr_t)buffer >= 0xFFFF800000000000UL && !((uintptr_t)buffer & dev->align);
+}
+
+/**
+ * Byte-granular access to a device. Whole sectors into suitable kernel
+ * buffers go straight to the device; anything else goes through a
+ * temporary buffer, reading first where a write only covers part
+ * of a sector.
+ */
+static ssize_t blkdev_rw(struct blkdev * dev, off_t offset, size_t size, uint8_t * buffer, int write) {
+	size_t sector_size = dev->sector_size;
+	uint64_t capacity = dev->sectors * sector_size;
+	if (offset < 0 || (uint64_t)offset >= capacity) return 0;
+	if (offset + size > capacity) size = capacity - offset;
+
+	size_t bounce_size = dev->max_sectors * sector_size;
+	uint8_t * bounce = NULL;
+	size_t done = 0;
+	int error = 0;
+
+	while (done < size) {
+		uint64_t pos = offset + done;
+		uint64_t sector = pos / sector_size;
+		size_t skip = pos % sector_size;
+		size_t want = size - done;
+
+		if (!skip && want >= sector_size && blk_direct(dev, buffer + done)) {
+			unsigned int count = want / sector_size;
+			if (count > dev->max_sectors) count = dev->max_sectors;
+			error = blk_rw(dev, sector, count, buffer + done, write);
+			if (error) break;
+			done += count * sector_size;
+			continue;
+		}
+
+		if (!bounce) bounce = malloc(bounce_size);
+
+		size_t span = skip + want;
+		if (span > bounce_size) span = bounce_size;
+		span = (span + sector_size - 1) / sector_size * sector_size;
+		unsigned int count = span / sector_size;
+		size_t len = span - skip < want ? span - skip : want;
+
+		if (!write || skip || len % sector_size) {
+			error = blk_rw(dev, sector, count, bounce, 0);
+			if (error) break;
+		}
+
+		if (write) {
+			memcpy(bounce + skip, buffer + done, len);
+			error = blk_rw(dev, sector, count, bounce, 1);
+			if (error) break;
+		} else {
+			memcpy(buffer + done, bounce + skip, len);
+		}
+
+		done += len;
+	}
+
+	if (bounce) free(bounce);
+	return error ? error : (ssize_t)done;
+}
+
+static ssize_t read_blkdev(fs_node_t * node, off_t offset, size_t size, uint8_t * buffer) {
+	return blkdev_rw(node->device, offset, size, buffer, 0);
+}
+
+static ssize_t write_blkdev(fs_node_t * node, off_t offset, size_t size, uint8_t * buffer) {
+	return blkdev_rw(node->device, offset, size, buffer, 1);
+}
+
+static int ioctl_blkdev(fs_node_t * node, unsigned long request, void * argp) {
+	struct blkdev * dev = node->device;
+	while (dev->parent) dev = dev->parent;
+
+	switch (request) {
+		case 0x2A01234UL: {
+			uint64_t stats[4];
+			bcache_stats(stats);
+			return copy_to_user(argp, stats, sizeof(stats));
+		}
+
+		default:
+			if (dev->ioctl) return dev->ioctl(dev, request, argp);
+			/* Writes are not cached here; see bcache_sync */
+			return request == IOCTLSYNC ? 0 : -EINVAL;
+	}
+}
+
+/**
+ * @brief Allocate a device description for a driver to fill in.
+ *
+ * Defaults to one request at a time, of up to 128 sectors.
+ */
+struct blkdev * blkdev_create(const char * name, size_t sector_size, uint64_t sectors) {
+	struct blkdev * dev = malloc(sizeof(struct blkdev));
+	memset(dev, 0, sizeof(struct blkdev));
+	snprintf(dev->name, sizeof(dev->name), "%s", name);
+	dev->sector_size = sector_size;
+	dev->sectors = sectors;
+	dev->max_sectors = 128;
+	dev->max_pieces = 32;
+	dev->depth = 1;
+	return dev;
+}
+
+/**
+ * @brief Set up the queue and device node for a device.
+ *
+ * @returns The device node, for the driver to mount where it likes.
+ */
+fs_node_t * blkdev_register(struct blkdev * dev) {
+	spin_init(dev->lock);
+	dev->wait = list_create("block device waiters", dev);
+
+	fs_node_t * fnode = malloc(sizeof(fs_node_t));
+	memset(fnode, 0x00, sizeof(fs_node_t));
+	fnode->inode = 0;
+	snprintf(fnode->name, sizeof(fnode->name), "%s", dev->name);
+	fnode->device  = dev;
+	fnode->uid = 0;
+	fnode->gid = 0;
+	fnode->mask    = 0660;
+	fnode->length  = dev->sectors * dev->sector_size;
+	fnode->flags   = FS_BLOCKDEVICE;
+	fnode->read    = read_blkdev;
+	fnode->write   = write_blkdev;
+	fnode->ioctl   = ioctl_blkdev;
+	dev->node = fnode;
+
+	if (!dev->parent) {
+		spin_lock(blkdevs_lock);
+		list_insert(blkdevs, dev);
+		spin_unlock(blkdevs_lock);
+	}
+
+	return fnode;
+}
+
+/**
+ * @brief Create a device for part of another.
+ *
+ * @param start   First sector of the partition, in @p parent's sectors.
+ * @param sectors Size of the partition.
+ */
+fs_node_t * blkdev_partition(struct blkdev * parent, const char * name, uint64_t start, uint64_t sectors) {
+	if (start >= parent->sectors) return NULL;
+	if (sectors > parent->sectors - start) sectors = parent->sectors - start;
+
+	struct blkdev * dev = blkdev_create(name, parent->sector_size, sectors);
+	dev->max_sectors = parent->max_sectors;
+	dev->max_pieces = parent->max_pieces;
+	dev->depth = parent->depth;
+	dev->align = parent->align;
+	dev->parent = parent;
+	dev->start = start;
+	return blkdev_register(dev);
+}
+
+/**
+ * @brief Find the block layer device behind a device node.
+ *
+ * @returns The device, or NULL if @p node is not one of ours.
+ */
+struct blkdev * blkdev_get(fs_node_t * node) {
+	if (!node || node->read != read_blkdev) return NULL;
+	return node->device;
+}
+
+static void blkdev_func(fs_node_t * node) {
+	spin_lock(blkdevs_lock);
+	foreach(item, blkdevs) {
+		struct blkdev * dev = item->value;
+		spin_lock(dev->lock);
+		struct blkdev_stats stats = dev->stats;
+		int queued = dev->queued;
+		int in_flight = dev->in_flight;
+		spin_unlock(dev->lock);
+
+		uint64_t completed = stats.reads + stats.writes;
+		procfs_printf(node,
+			"Device:\t%s\n"
+			"Sectors:\t%zu\n"
+			"SectorSize:\t%zu\n"
+			"Depth:\t%d\n"
+			"Queued:\t%d\n"
+			"InFlight:\t%d\n"
+			"Reads:\t%zu\n"
+			"ReadSectors:\t%zu\n"
+			"Writes:\t%zu\n"
+			"WriteSectors:\t%zu\n"
+			"BackMerges:\t%zu\n"
+			"FrontMerges:\t%zu\n"
+			"Dispatches:\t%zu\n"
+			"Expired:\t%zu\n"
+			"AvgLatency:\t%zu us\n"
+			"MaxLatency:\t%zu us\n"
+			"\n",
+			dev->name, (size_t)dev->sectors, dev->sector_size, dev->depth, queued, in_flight,
+			(size_t)stats.reads, (size_t)stats.read_sectors, (size_t)stats.writes, (size_t)stats.write_sectors,
+			(size_t)stats.back_merges, (size_t)stats.front_merges, (size_t)stats.dispatches, (size_t)stats.expired,
+			(size_t)(completed ? stats.latency_total / completed : 0), (size_t)stats.latency_max);
+	}
+	spin_unlock(blkdevs_lock);
+}
+
+static struct procfs_entry blkdev_entry = {
+	0,
+	"blkdev",
+	blkdev_func,
+};
+
+void blkdev_initialize(void) {
+	blkdevs = list_create("block devices", NULL);
+	procfs_install(&blkdev_entry);
+}
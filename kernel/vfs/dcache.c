@@ -0,0 +1,245 @@
+/**
+ * @file  kernel/vfs/dcache.c
+ * @brief Directory entry cache for path resolution.
+ *
+ * Caches the results of finddir for directories that opt in by
+ * setting FS_DCACHE, keyed by the parent directory's identity and
+ * the name looked up. Failed lookups are cached as negative entries
+ * so repeated searches for missing files (such as execvp walking
+ * PATH) don't have to scan directories again.
+ *
+ * Cached nodes are only handed out for intermediate path components,
+ * where nothing but their identity and operations matter; the final
+ * component of a path is always looked up again so that callers see
+ * current metadata. Negative entries are used everywhere.
+ *
+ * Entries for a name are dropped when it is created, unlinked, or
+ * otherwise changed through the VFS, and the whole cache is dropped
+ * when something is mounted.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2021 K. Lange
+ */
+#include <stdint.h>
+#include <kernel/types.h>
+#include <kernel/string.h>
+#include <kernel/printf.h>
+#include <kernel/vfs.h>
+#include <kernel/spinlock.h>
+#include <kernel/procfs.h>
+
+#define DCACHE_BUCKETS 1024
+#define DCACHE_CHAIN   8
+
+struct dcache_entry {
+	struct dcache_entry * next;
+	finddir_type_t finddir;
+	void * device;
+	uint64_t inode;
+	fs_node_t * node; /* NULL for a negative entry */
+	char name[];
+};
+
+static spin_lock_t dcache_lock = { 0 };
+static struct dcache_entry * dcache_buckets[DCACHE_BUCKETS] = {0};
+static uint64_t dcache_generation = 0; /* bumped by every invalidation */
+
+static uint64_t hit_count = 0;
+static uint64_t negative_count = 0;
+static uint64_t miss_count = 0;
+
+static size_t dcache_hash(fs_node_t * parent, const char * name) {
+	size_t hash = 5381;
+	while (*name) {
+		hash = (hash << 5) + hash + (unsigned char)*name++;
+	}
+	hash ^= ((uintptr_t)parent->device >> 4) ^ (parent->inode * 2654435761UL);
+	return hash % DCACHE_BUCKETS;
+}
+
+static int dcache_match(struct dcache_entry * entry, fs_node_t * parent, const char * name) {
+	return entry->finddir == parent->finddir &&
+	       entry->device == parent->device &&
+	       entry->inode == parent->inode &&
+	       !strcmp(entry->name, name);
+}
+
+static void dcache_free(struct dcache_entry * entry) {
+	if (entry->node) free(entry->node);
+	free(entry);
+}
+
+static fs_node_t * dcache_clone(fs_node_t * node) {
+	fs_node_t * out = malloc(sizeof(fs_node_t));
+	memcpy(out, node, sizeof(fs_node_t));
+	out->refcount = 0;
+	return out;
+}
+
+/**
+ * @brief Record the result of a lookup, replacing any older one.
+ *
+ * Takes ownership of @p entry. Chains are kept short by dropping
+ * the least recently used entry in the bucket. If anything was
+ * invalidated since @p generation, the lookup may have raced with
+ * a change to the directory and the entry is discarded.
+ */
+static void dcache_insert(size_t index, struct dcache_entry * entry, uint64_t generation) {
+	struct dcache_entry * stale = NULL;
+	spin_lock(dcache_lock);
+	if (generation != dcache_generation) {
+		spin_unlock(dcache_lock);
+		dcache_free(entry);
+		return;
+	}
+	struct dcache_entry ** link = &dcache_buckets[index];
+	size_t length = 0;
+	while (*link) {
+		struct dcache_entry * other = *link;
+		if ((other->finddir == entry->finddir && other->device == entry->device &&
+			other->inode == entry->inode && !strcmp(other->name, entry->name)) ||
+			++length >= DCACHE_CHAIN) {
+			stale = *link;
+			*link = stale->next;
+			break;
+		}
+		link = &(*link)->next;
+	}
+	entry->next = dcache_buckets[index];
+	dcache_buckets[index] = entry;
+	spin_unlock(dcache_lock);
+	if (stale) dcache_free(stale);
+}
+
+/**
+ * @brief Look up a name in a directory, using the cache where possible.
+ *
+ * @param parent Directory to search.
+ * @param name   Name to find.
+ * @param leaf   Whether this is the final component of the path.
+ * @returns A node the caller can free, or NULL if the name was not found.
+ */
+fs_node_t * dcache_finddir(fs_node_t * parent, char * name, int leaf) {
+	if (!parent || !(parent->flags & FS_DCACHE)) return finddir_fs(parent, name);
+
+	size_t index = dcache_hash(parent, name);
+
+	spin_lock(dcache_lock);
+	struct dcache_entry ** link = &dcache_buckets[index];
+	while (*link) {
+		struct dcache_entry * entry = *link;
+		if (dcache_match(entry, parent, name)) {
+			if (!entry->node) {
+				negative_count++;
+				spin_unlock(dcache_lock);
+				return NULL;
+			}
+			if (!leaf) {
+				/* Move to front */
+				*link = entry->next;
+				entry->next = dcache_buckets[index];
+				dcache_buckets[index] = entry;
+				hit_count++;
+				fs_node_t * out = dcache_clone(entry->node);
+				spin_unlock(dcache_lock);
+				return out;
+			}
+			break;
+		}
+		link = &entry->next;
+	}
+	miss_count++;
+	uint64_t generation = dcache_generation;
+	spin_unlock(dcache_lock);
+
+	fs_node_t * result = finddir_fs(parent, name);
+
+	struct dcache_entry * entry = malloc(sizeof(struct dcache_entry) + strlen(name) + 1);
+	entry->finddir = parent->finddir;
+	entry->device  = parent->device;
+	entry->inode   = parent->inode;
+	entry->node    = result ? dcache_clone(result) : NULL;
+	strcpy(entry->name, name);
+	dcache_insert(index, entry, generation);
+
+	return result;
+}
+
+/**
+ * @brief Forget anything cached about @p name in @p parent.
+ *
+ * Called after operations that may add or remove a directory entry.
+ */
+void dcache_invalidate(fs_node_t * parent, char * name) {
+	if (!parent || !(parent->flags & FS_DCACHE)) return;
+
+	struct dcache_entry * stale = NULL;
+	size_t index = dcache_hash(parent, name);
+	spin_lock(dcache_lock);
+	dcache_generation++;
+	struct dcache_entry ** link = &dcache_buckets[index];
+	while (*link) {
+		if (dcache_match(*link, parent, name)) {
+			stale = *link;
+			*link = stale->next;
+			break;
+		}
+		link = &(*link)->next;
+	}
+	spin_unlock(dcache_lock);
+	if (stale) dcache_free(stale);
+}
+
+/**
+ * @brief Drop every cached entry.
+ */
+void dcache_purge(void) {
+	for (size_t i = 0; i < DCACHE_BUCKETS; ++i) {
+		spin_lock(dcache_lock);
+		dcache_generation++;
+		struct dcache_entry * entry = dcache_buckets[i];
+		dcache_buckets[i] = NULL;
+		spin_unlock(dcache_lock);
+		while (entry) {
+			struct dcache_entry * next = entry->next;
+			dcache_free(entry);
+			entry = next;
+		}
+	}
+}
+
+static void dcache_func(fs_node_t * node) {
+	size_t entries = 0, negative = 0;
+	spin_lock(dcache_lock);
+	for (size_t i = 0; i < DCACHE_BUCKETS; ++i) {
+		for (struct dcache_entry * entry = dcache_buckets[i]; entry; entry = entry->next) {
+			entries++;
+			if (!entry->node) negative++;
+		}
+	}
+	spin_unlock(dcache_lock);
+
+	uint64_t lookups = hit_count + negative_count + miss_count;
+	procfs_printf(node,
+		"Entries:\t%zu\n"
+		"Negative:\t%zu\n"
+		"Hits:\t%zu\n"
+		"NegativeHits:\t%zu\n"
+		"Misses:\t%zu\n"
+		"HitRate:\t%zu%%\n",
+		entries, negative,
+		(size_t)hit_count, (size_t)negative_count, (size_t)miss_count,
+		lookups ? (size_t)((hit_count + negative_count) * 100 / lookups) : (size_t)0);
+}
+
+static struct procfs_entry dcache_entry = {
+	0,
+	"dcache",
+	dcache_func,
+};
+
+void dcache_initialize(void) {
+	procfs_install(&dcache_entry);
+}
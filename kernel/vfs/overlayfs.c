@@ -0,0 +1,523 @@
+/**
+ * @file  kernel/vfs/overlayfs.c
+ * @brief Copy-on-write overlay of a writable filesystem on a read-only one.
+ *
+ * An overlay merges two directory trees: a read-only lower layer,
+ * typically the tarfs ramdisk, and a writable upper layer, by default
+ * a private tmpfs. Lookups see the upper layer first and fall through
+ * to the lower one, and directories present in both list the contents
+ * of both. Nothing is copied until it is modified: the first write,
+ * truncation, or attribute change of a lower file copies it (and any
+ * directories above it) into the upper layer, which takes over from
+ * then on.
+ *
+ * Each path that has been looked up gets an entry recording which
+ * layers it exists in. Removing something that exists in the lower
+ * layer leaves a "whiteout": an entry that is in neither layer, which
+ * hides the lower file from then on. Since nodes handed out for open
+ * files refer to these entries, they live as long as the mount does.
+ *
+ * Usage: mount overlay lower[,upper] mountpoint
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2021 K. Lange
+ */
+#include <errno.h>
+#include <kernel/types.h>
+#include <kernel/string.h>
+#include <kernel/printf.h>
+#include <kernel/vfs.h>
+#include <kernel/tmpfs.h>
+#include <kernel/mutex.h>
+#include <kernel/tokenize.h>
+#include <kernel/hashmap.h>
+
+#define OVERLAY_COPY_CHUNK   0x10000
+#define OVERLAY_CURSOR_SHIFT 60
+#define OVERLAY_CURSOR_MASK  ((1UL << OVERLAY_CURSOR_SHIFT) - 1)
+
+/* getdents cursors: which part of the listing, and the layer's own cursor */
+#define OVERLAY_PHASE_DOTS  0UL
+#define OVERLAY_PHASE_UPPER 1UL
+#define OVERLAY_PHASE_LOWER 2UL
+#define OVERLAY_PHASE_DONE  3UL
+
+struct overlay {
+	sched_mutex_t * lock; /* Held for lookups, copy-up, and changes to directories */
+	uint64_t next_inode;
+};
+
+struct overlay_entry {
+	struct overlay * overlay;
+	struct overlay_entry * parent; /* NULL for the root */
+	char * name;
+	uint64_t inode;
+	fs_node_t * upper;     /* Node in the upper layer, or NULL if it hasn't been copied up */
+	fs_node_t * lower;     /* Node in the lower layer, or NULL if it isn't there or is hidden */
+	hashmap_t * children;  /* Entries looked up in this directory, by name */
+};
+
+static fs_node_t * overlay_node(struct overlay_entry * entry);
+
+static struct overlay_entry * overlay_entry_new(struct overlay * overlay, struct overlay_entry * parent, const char * name) {
+	struct overlay_entry * entry = malloc(sizeof(struct overlay_entry));
+	memset(entry, 0, sizeof(struct overlay_entry));
+	entry->overlay = overlay;
+	entry->parent = parent;
+	entry->name = strdup(name);
+	entry->inode = overlay->next_inode++;
+	if (parent) {
+		if (!parent->children) parent->children = hashmap_create(16);
+		hashmap_set(parent->children, name, entry);
+	}
+	return entry;
+}
+
+static int overlay_is_dir(fs_node_t * node) {
+	return (node->flags & FS_DIRECTORY) && !(node->flags & FS_SYMLINK);
+}
+
+/**
+ * @brief Find the entry for a name in a directory.
+ *
+ * Entries are created the first time a name is found in either layer.
+ * A lower node is only kept if nothing in the upper layer hides it,
+ * which for a directory means the upper layer has a directory there
+ * to merge it with.
+ *
+ * @returns The entry, or NULL if the name doesn't exist or has been removed.
+ */
+static struct overlay_entry * overlay_lookup(struct overlay_entry * dir, char * name) {
+	struct overlay_entry * entry = dir->children ? hashmap_get(dir->children, name) : NULL;
+	if (entry) {
+		return (entry->upper || entry->lower) ? entry : NULL;
+	}
+
+	fs_node_t * upper = dir->upper ? finddir_fs(dir->upper, name) : NULL;
+	fs_node_t * lower = dir->lower ? finddir_fs(dir->lower, name) : NULL;
+	if (upper && lower && !(overlay_is_dir(upper) && overlay_is_dir(lower))) {
+		free(lower);
+		lower = NULL;
+	}
+	if (!upper && !lower) return NULL;
+
+	entry = overlay_entry_new(dir->overlay, dir, name);
+	entry->upper = upper;
+	entry->lower = lower;
+	return entry;
+}
+
+/**
+ * @brief Copy a file, directory, or symlink into the upper layer.
+ *
+ * Directories above it are copied first. Ownership and permissions
+ * come from the lower node.
+ *
+ * @param entry     Entry to copy up; must exist in at least one layer.
+ * @param with_data Whether to copy a file's contents; not needed when it is about to be truncated.
+ * @returns 0 on success, or a negative error code.
+ */
+static int overlay_copy_up(struct overlay_entry * entry, int with_data) {
+	if (entry->upper) return 0;
+	if (!entry->parent || !entry->lower) return -ENOENT;
+
+	int ret = overlay_copy_up(entry->parent, 0);
+	if (ret) return ret;
+
+	fs_node_t * dir = entry->parent->upper;
+	fs_node_t * src = entry->lower;
+
+	if (src->flags & FS_SYMLINK) {
+		char * target = malloc(4096);
+		ssize_t len = readlink_fs(src, target, 4096);
+		if (len < 0) {
+			free(target);
+			return len;
+		}
+		ret = dir->symlink ? dir->symlink(dir, target, entry->name) : -EROFS;
+		free(target);
+	} else if (src->flags & FS_DIRECTORY) {
+		ret = dir->mkdir ? dir->mkdir(dir, entry->name, src->mask) : -EROFS;
+	} else {
+		ret = dir->create ? dir->create(dir, entry->name, src->mask) : -EROFS;
+	}
+	if (ret < 0) return ret;
+
+	fs_node_t * upper = finddir_fs(dir, entry->name);
+	if (!upper) return -EIO;
+
+	chown_fs(upper, src->uid, src->gid);
+	if (!(src->flags & FS_SYMLINK)) chmod_fs(upper, src->mask);
+
+	if (with_data && !(src->flags & (FS_DIRECTORY | FS_SYMLINK))) {
+		uint8_t * buf = malloc(OVERLAY_COPY_CHUNK);
+		off_t offset = 0;
+		while ((uint64_t)offset < src->length) {
+			ssize_t r = read_fs(src, offset, OVERLAY_COPY_CHUNK, buf);
+			if (r <= 0) break;
+			ssize_t w = write_fs(upper, offset, r, buf);
+			if (w != r) {
+				ret = w < 0 ? w : -ENOSPC;
+				break;
+			}
+			offset += r;
+		}
+		free(buf);
+		if (ret < 0) {
+			if (dir->unlink) dir->unlink(dir, entry->name);
+			free(upper);
+			return ret;
+		}
+	}
+
+	/* Only publish the upper node once it is complete; readers don't take the lock */
+	entry->upper = upper;
+	return 0;
+}
+
+static int overlay_copy_up_locked(struct overlay_entry * entry, int with_data) {
+	if (entry->upper) return 0;
+	mutex_acquire(entry->overlay->lock);
+	int ret = overlay_copy_up(entry, with_data);
+	mutex_release(entry->overlay->lock);
+	return ret;
+}
+
+static fs_node_t * overlay_layer(struct overlay_entry * entry) {
+	return entry->upper ? entry->upper : entry->lower;
+}
+
+static ssize_t read_overlay(fs_node_t * node, off_t offset, size_t size, uint8_t * buffer) {
+	fs_node_t * layer = overlay_layer(node->device);
+	return layer ? read_fs(layer, offset, size, buffer) : -ENOENT;
+}
+
+static ssize_t write_overlay(fs_node_t * node, off_t offset, size_t size, uint8_t * buffer) {
+	struct overlay_entry * entry = node->device;
+	int ret = overlay_copy_up_locked(entry, 1);
+	if (ret) return ret;
+	return write_fs(entry->upper, offset, size, buffer);
+}
+
+static int truncate_overlay(fs_node_t * node) {
+	struct overlay_entry * entry = node->device;
+	int ret = overlay_copy_up_locked(entry, 0);
+	if (ret) return ret;
+	return truncate_fs(entry->upper);
+}
+
+static void open_overlay(fs_node_t * node, unsigned int flags) {
+	/* Writes would copy up anyway, but this way O_TRUNC doesn't copy data just to drop it */
+	if (!(flags & (O_WRONLY | O_RDWR))) return;
+	if (!has_permission(node, 02)) return;
+	overlay_copy_up_locked(node->device, !(flags & O_TRUNC));
+}
+
+static ssize_t readlink_overlay(fs_node_t * node, char * buf, size_t size) {
+	fs_node_t * layer = overlay_layer(node->device);
+	return layer ? readlink_fs(layer, buf, size) : -ENOENT;
+}
+
+static int chmod_overlay(fs_node_t * node, mode_t mode) {
+	struct overlay_entry * entry = node->device;
+	int ret = overlay_copy_up_locked(entry, 1);
+	if (ret) return ret;
+	ret = chmod_fs(entry->upper, mode);
+	entry->upper->mask = mode;
+	return ret;
+}
+
+static int chown_overlay(fs_node_t * node, uid_t uid, gid_t gid) {
+	struct overlay_entry * entry = node->device;
+	int ret = overlay_copy_up_locked(entry, 1);
+	if (ret) return ret;
+	ret = chown_fs(entry->upper, uid, gid);
+	if ((int)uid != -1) entry->upper->uid = uid;
+	if ((int)gid != -1) entry->upper->gid = gid;
+	return ret;
+}
+
+/**
+ * @brief Whether a name from the lower layer of a directory should be skipped when listing it.
+ *
+ * It is hidden if it was removed, or if the upper layer has the same
+ * name and it was already listed from there.
+ */
+static int overlay_lower_hidden(struct overlay_entry * dir, char * name) {
+	struct overlay_entry * entry = dir->children ? hashmap_get(dir->children, name) : NULL;
+	if (entry) return entry->upper || !entry->lower;
+	if (!dir->upper) return 0;
+	fs_node_t * upper = finddir_fs(dir->upper, name);
+	if (upper) {
+		free(upper);
+		return 1;
+	}
+	return 0;
+}
+
+static ssize_t getdents_overlay(fs_node_t * node, uint64_t * cursor, struct dirent * out, size_t count) {
+	struct overlay_entry * dir = node->device;
+	size_t read = 0;
+
+	mutex_acquire(dir->overlay->lock);
+	while (read < count) {
+		uint64_t phase = *cursor >> OVERLAY_CURSOR_SHIFT;
+		uint64_t inner = *cursor & OVERLAY_CURSOR_MASK;
+
+		if (phase == OVERLAY_PHASE_DOTS) {
+			memset(&out[read], 0, sizeof(struct dirent));
+			out[read].d_ino = dir->inode;
+			strcpy(out[read].d_name, inner ? ".." : ".");
+			read++;
+			*cursor = inner ? (OVERLAY_PHASE_UPPER << OVERLAY_CURSOR_SHIFT) : 1;
+			continue;
+		}
+
+		if (phase >= OVERLAY_PHASE_DONE) break;
+
+		fs_node_t * layer = phase == OVERLAY_PHASE_UPPER ? dir->upper : dir->lower;
+		struct dirent ent;
+		uint64_t next = inner;
+		ssize_t r = layer ? getdents_fs(layer, &next, &ent, 1) : 0;
+		if (r < 0) {
+			mutex_release(dir->overlay->lock);
+			return read ? (ssize_t)read : r;
+		}
+		if (r == 0) {
+			*cursor = (phase + 1) << OVERLAY_CURSOR_SHIFT;
+			continue;
+		}
+
+		/* A layer cursor that doesn't fit can only mean that layer is finished */
+		*cursor = next > OVERLAY_CURSOR_MASK ? (phase + 1) << OVERLAY_CURSOR_SHIFT : (phase << OVERLAY_CURSOR_SHIFT) | next;
+
+		if (!strcmp(ent.d_name, ".") || !strcmp(ent.d_name, "..")) continue;
+		if (phase == OVERLAY_PHASE_LOWER && overlay_lower_hidden(dir, ent.d_name)) continue;
+
+		memcpy(&out[read], &ent, sizeof(struct dirent));
+		read++;
+	}
+	mutex_release(dir->overlay->lock);
+
+	return read;
+}
+
+static struct dirent * readdir_overlay(fs_node_t * node, unsigned long index) {
+	uint64_t cursor = 0;
+	struct dirent * out = malloc(sizeof(struct dirent));
+	for (unsigned long i = 0; i <= index; ++i) {
+		if (getdents_overlay(node, &cursor, out, 1) != 1) {
+			free(out);
+			return NULL;
+		}
+	}
+	return out;
+}
+
+static fs_node_t * finddir_overlay(fs_node_t * node, char * name) {
+	struct overlay_entry * dir = node->device;
+
+	mutex_acquire(dir->overlay->lock);
+	struct overlay_entry * entry = overlay_lookup(dir, name);
+	fs_node_t * out = entry ? overlay_node(entry) : NULL;
+	mutex_release(dir->overlay->lock);
+
+	return out;
+}
+
+#define OVERLAY_CREATE  0
+#define OVERLAY_MKDIR   1
+#define OVERLAY_SYMLINK 2
+
+/**
+ * @brief Create something new in the upper layer of a directory.
+ *
+ * The directory is copied up first if it only exists in the lower
+ * layer. Creating a directory where a lower one was removed doesn't
+ * bring back its old contents, as the entry no longer refers to it.
+ */
+static int overlay_make(fs_node_t * parent, char * name, int type, mode_t mode, char * target) {
+	struct overlay_entry * dir = parent->device;
+	if (!name || !*name) return -EINVAL;
+
+	mutex_acquire(dir->overlay->lock);
+	if (overlay_lookup(dir, name)) {
+		mutex_release(dir->overlay->lock);
+		return -EEXIST;
+	}
+
+	int ret = overlay_copy_up(dir, 0);
+	if (!ret) {
+		fs_node_t * upper = dir->upper;
+		switch (type) {
+			case OVERLAY_CREATE:
+				ret = upper->create ? upper->create(upper, name, mode) : -EROFS;
+				break;
+			case OVERLAY_MKDIR:
+				ret = upper->mkdir ? upper->mkdir(upper, name, mode) : -EROFS;
+				break;
+			case OVERLAY_SYMLINK:
+				ret = upper->symlink ? upper->symlink(upper, target, name) : -EROFS;
+				break;
+		}
+	}
+
+	if (!ret) {
+		struct overlay_entry * entry = dir->children ? hashmap_get(dir->children, name) : NULL;
+		if (!entry) entry = overlay_entry_new(dir->overlay, dir, name);
+		entry->upper = finddir_fs(dir->upper, name);
+	}
+	mutex_release(dir->overlay->lock);
+
+	return ret;
+}
+
+static int create_overlay(fs_node_t * parent, char * name, mode_t permission) {
+	return overlay_make(parent, name, OVERLAY_CREATE, permission, NULL);
+}
+
+static int mkdir_overlay(fs_node_t * parent, char * name, mode_t permission) {
+	return overlay_make(parent, name, OVERLAY_MKDIR, permission, NULL);
+}
+
+static int symlink_overlay(fs_node_t * parent, char * target, char * name) {
+	return overlay_make(parent, name, OVERLAY_SYMLINK, 0777, target);
+}
+
+static int unlink_overlay(fs_node_t * parent, char * name) {
+	struct overlay_entry * dir = parent->device;
+
+	mutex_acquire(dir->overlay->lock);
+	struct overlay_entry * entry = overlay_lookup(dir, name);
+	if (!entry) {
+		mutex_release(dir->overlay->lock);
+		return -ENOENT;
+	}
+
+	int ret = 0;
+	if (entry->upper) {
+		ret = dir->upper->unlink ? dir->upper->unlink(dir->upper, name) : -EROFS;
+	}
+
+	if (!ret) {
+		/* Leave a whiteout; the old nodes may still be in use by open files */
+		entry->upper = NULL;
+		entry->lower = NULL;
+		if (entry->children) {
+			hashmap_free(entry->children);
+			free(entry->children);
+			entry->children = NULL;
+		}
+	}
+	mutex_release(dir->overlay->lock);
+
+	return ret;
+}
+
+/**
+ * @brief Build a node for an entry, with the current attributes of whichever layer it is in.
+ */
+static fs_node_t * overlay_node(struct overlay_entry * entry) {
+	fs_node_t * fresh = NULL;
+	fs_node_t * meta = entry->lower;
+	if (entry->upper) {
+		/* The upper layer can change underneath the node we kept, so look it up again */
+		fresh = entry->parent ? finddir_fs(entry->parent->upper, entry->name) : NULL;
+		meta = fresh ? fresh : entry->upper;
+	}
+
+	fs_node_t * fnode = malloc(sizeof(fs_node_t));
+	memset(fnode, 0x00, sizeof(fs_node_t));
+	strcpy(fnode->name, entry->parent ? entry->name : "overlay");
+	fnode->device = entry;
+	fnode->inode  = entry->inode;
+	fnode->mask   = meta->mask;
+	fnode->uid    = meta->uid;
+	fnode->gid    = meta->gid;
+	fnode->length = meta->length;
+	fnode->atime  = meta->atime;
+	fnode->mtime  = meta->mtime;
+	fnode->ctime  = meta->ctime;
+	fnode->nlink  = meta->nlink;
+	fnode->flags  = meta->flags & ~(FS_MOUNTPOINT | FS_DCACHE);
+
+	if (meta->flags & FS_SYMLINK) {
+		fnode->readlink = readlink_overlay;
+	} else if (meta->flags & FS_DIRECTORY) {
+		fnode->flags   |= FS_DCACHE;
+		fnode->readdir  = readdir_overlay;
+		fnode->getdents = getdents_overlay;
+		fnode->finddir  = finddir_overlay;
+		fnode->create   = create_overlay;
+		fnode->mkdir    = mkdir_overlay;
+		fnode->symlink  = symlink_overlay;
+		fnode->unlink   = unlink_overlay;
+	} else {
+		fnode->read     = read_overlay;
+		fnode->write    = write_overlay;
+		fnode->open     = open_overlay;
+		fnode->truncate = truncate_overlay;
+	}
+	fnode->chmod = chmod_overlay;
+	fnode->chown = chown_overlay;
+
+	if (fresh) free(fresh);
+	return fnode;
+}
+
+static fs_node_t * overlay_mount(const char * device, const char * mount_path) {
+	char * arg = strdup(device);
+	char * argv[10];
+	int argc = tokenize(arg, ",", argv);
+
+	if (argc < 1) {
+		printf("overlay: expected lower[,upper]\n");
+		free(arg);
+		return NULL;
+	}
+
+	fs_node_t * lower = kopen(argv[0], 0);
+	if (!lower || !(lower->flags & FS_DIRECTORY)) {
+		printf("overlay: %s is not a directory\n", argv[0]);
+		if (lower) close_fs(lower);
+		free(arg);
+		return NULL;
+	}
+
+	fs_node_t * upper;
+	if (argc > 1) {
+		upper = kopen(argv[1], 0);
+		if (!upper || !(upper->flags & FS_DIRECTORY)) {
+			printf("overlay: %s is not a directory\n", argv[1]);
+			if (upper) close_fs(upper);
+			close_fs(lower);
+			free(arg);
+			return NULL;
+		}
+	} else {
+		/* A private tmpfs, which starts out looking like the lower root */
+		upper = tmpfs_create("overlay");
+		chmod_fs(upper, lower->mask);
+		chown_fs(upper, lower->uid, lower->gid);
+		upper->mask = lower->mask;
+		upper->uid  = lower->uid;
+		upper->gid  = lower->gid;
+	}
+	free(arg);
+
+	struct overlay * overlay = malloc(sizeof(struct overlay));
+	overlay->lock = mutex_init("overlay");
+	overlay->next_inode = 1;
+
+	struct overlay_entry * root = overlay_entry_new(overlay, NULL, "");
+	root->upper = upper;
+	root->lower = lower;
+
+	return overlay_node(root);
+}
+
+void overlayfs_register_init(void) {
+	vfs_register("overlay", overlay_mount);
+}
@@ -9,6 +9,11 @@
  * Care must be taken to ensure that this is backed by an atomic
  * stream; the legacy pseudo-pipe interface is used at the moment.
  *
+ * Packets come from a small per-exchange cache rather than the heap,
+ * and a broadcast is a single packet shared by every client. With
+ * IOCTL_PACKETFS_BATCH, one read returns as many queued packets as
+ * will fit, and the server can send several with one writev().
+ *
  * @bug We leak kernel heap addresses directly to userspace as the
  *      client identifiers in PEX messages. We should probably do
  *      something else. I'm also reasonably certain a server can
@@ -30,6 +35,7 @@
 #include <kernel/pipe.h>
 #include <kernel/spinlock.h>
 #include <kernel/process.h>
+#include <kernel/syscall.h>
 
 extern void pipe_destroy(fs_node_t * node);
 
@@ -44,33 +50,135 @@ typedef struct packet_manager {
 	spin_lock_t lock;
 } pex_t;
 
+typedef struct packet_slab pex_slab_t;
+typedef struct packet packet_t;
+
 typedef struct packet_exchange {
 	char * name;
 	char fresh;
+	char batch;
 	spin_lock_t lock;
 	fs_node_t * server_pipe;
+	packet_t * pending;
 	list_t * clients;
 	pex_t * parent;
+	pex_slab_t * slab;
 } pex_ex_t;
 
 typedef struct packet_client {
 	pex_ex_t * parent;
 	fs_node_t * pipe;
+	packet_t * pending;
+	char batch;
 } pex_client_t;
 
+/**
+ * Packets are fixed-size buffers big enough for any message, so they
+ * can be kept and handed out again instead of going back to the heap.
+ * A broadcast queues the same packet to every client; the last of
+ * them to read it puts it back.
+ */
+struct packet {
+	pex_client_t * source;
+	size_t      size;
+	pex_slab_t * slab;
+	packet_t *  next;
+	volatile int refcount;
+	uint8_t     data[];
+};
+
+#define PEX_SLAB_CACHED 32
 
-typedef struct packet {
+/**
+ * Free packets belonging to one exchange. Packets can still be
+ * sitting in a client's queue after the server has gone away, so
+ * the slab is counted: once for the exchange, and once for each
+ * packet that is out of it.
+ */
+struct packet_slab {
+	spin_lock_t lock;
+	packet_t * free;
+	size_t cached;
+	size_t refs;
+};
+
+/* What a reader sees of each packet, as pex_packet_t */
+typedef struct packet_record {
 	pex_client_t * source;
 	size_t      size;
 	uint8_t     data[];
-} packet_t;
+} record_t;
+
+#define RECORD_ALIGN(n) (((n) + sizeof(uintptr_t) - 1) & ~(sizeof(uintptr_t) - 1))
 
 typedef struct server_write_header {
 	pex_client_t * target;
 	uint8_t data[];
 } header_t;
 
-static ssize_t receive_packet(pex_ex_t * exchange, fs_node_t * socket, packet_t ** out) {
+static pex_slab_t * slab_create(void) {
+	pex_slab_t * slab = malloc(sizeof(pex_slab_t));
+	spin_init(slab->lock);
+	slab->free = NULL;
+	slab->cached = 0;
+	slab->refs = 1;
+	return slab;
+}
+
+/* Drops a reference to a slab whose lock is held, and the lock. */
+static void slab_release_locked(pex_slab_t * slab) {
+	int last = !--slab->refs;
+	spin_unlock(slab->lock);
+	if (!last) return;
+	while (slab->free) {
+		packet_t * next = slab->free->next;
+		free(slab->free);
+		slab->free = next;
+	}
+	free(slab);
+}
+
+static packet_t * packet_alloc(pex_slab_t * slab) {
+	spin_lock(slab->lock);
+	packet_t * packet = slab->free;
+	if (packet) {
+		slab->free = packet->next;
+		slab->cached--;
+	}
+	slab->refs++;
+	spin_unlock(slab->lock);
+
+	if (!packet) packet = malloc(sizeof(packet_t) + MAX_PACKET_SIZE);
+	packet->slab = slab;
+	packet->refcount = 1;
+	return packet;
+}
+
+static void packet_release(packet_t * packet) {
+	if (__sync_sub_and_fetch(&packet->refcount, 1)) return;
+	pex_slab_t * slab = packet->slab;
+	spin_lock(slab->lock);
+	if (slab->cached < PEX_SLAB_CACHED) {
+		packet->next = slab->free;
+		slab->free = packet;
+		slab->cached++;
+		packet = NULL;
+	}
+	slab_release_locked(slab);
+	if (packet) free(packet);
+}
+
+static packet_t * make_packet(pex_ex_t * p, pex_client_t * source, size_t size, void * data) {
+	packet_t * packet = packet_alloc(p->slab);
+	packet->source = source;
+	packet->size = size;
+	if (size) {
+		memcpy(packet->data, data, size);
+	}
+	return packet;
+}
+
+static ssize_t receive_packet(fs_node_t * socket, packet_t ** out) {
 	ssize_t r;
 	do {
 		r = read_fs(socket, 0, sizeof(struct packet *), (uint8_t*)out);
@@ -81,26 +189,37 @@ static ssize_t receive_packet(pex_ex_t * exchange, fs_node_t * socket, packet_t
 	return r;
 }
 
+/* Release everything still queued on a pipe that is going away. */
+static void drain_packets(fs_node_t * pipe, packet_t ** pending) {
+	packet_t * packet = __sync_lock_test_and_set(pending, NULL);
+	if (packet) packet_release(packet);
+	while (pipe_size(pipe) >= (int)sizeof(struct packet*)) {
+		if (read_fs(pipe, 0, sizeof(struct packet*), (uint8_t*)&packet) != sizeof(struct packet*)) break;
+		packet_release(packet);
+	}
+}
+
 static void send_to_server(pex_ex_t * p, pex_client_t * c, size_t size, void * data) {
-	size_t p_size = size + sizeof(struct packet);
-	packet_t * packet = malloc(p_size);
 	if ((uintptr_t)c < 0x800000000) {
 		printf("suspicious pex client received: %p\n", (char*)c);
 	}
 
-	packet->source = c;
-	packet->size = size;
+	packet_t * packet = make_packet(p, c, size, data);
+	write_fs(p->server_pipe, 0, sizeof(struct packet*), (uint8_t*)&packet);
+}
 
-	if (size) {
-		memcpy(packet->data, data, size);
+/* Queue a reference to @p packet for a client, if it has room. */
+static int queue_to_client(pex_client_t * c, packet_t * packet) {
+	if (pipe_unsize(c->pipe) < (int)sizeof(struct packet*)) {
+		return -1;
 	}
 
-	write_fs(p->server_pipe, 0, sizeof(struct packet*), (uint8_t*)&packet);
+	__sync_add_and_fetch(&packet->refcount, 1);
+	write_fs(c->pipe, 0, sizeof(struct packet*), (uint8_t*)&packet);
+	return 0;
 }
 
 static int send_to_client(pex_ex_t * p, pex_client_t * c, size_t size, void * data) {
-	size_t p_size = size + sizeof(struct packet);
-
 	/* Verify there is space on the client */
 	if (pipe_unsize(c->pipe) < (int)sizeof(struct packet*)) {
 		return -1;
@@ -110,21 +229,66 @@ static int send_to_client(pex_ex_t * p, pex_client_t * c, size_t size, void * da
 		printf("suspicious pex client received: %p\n", (char*)c);
 	}
 
-	packet_t * packet = malloc(p_size);
+	packet_t * packet = make_packet(p, NULL, size, data);
+	int result = queue_to_client(c, packet);
+	packet_release(packet);
 
-	memcpy(packet->data, data, size);
-	packet->source = NULL;
-	packet->size = size;
+	return result < 0 ? -1 : (int)size;
+}
 
-	write_fs(c->pipe, 0, sizeof(struct packet*), (uint8_t*)&packet);
+/**
+ * Copy queued packets out to a reader.
+ *
+ * Only the first packet is waited for. In batch mode, further packets
+ * are taken for as long as some are already queued and they fit in
+ * what is left of @p buffer, each one as a record starting on a word
+ * boundary. A packet that does not fit is held back for the next read.
+ *
+ * @param records Whether packets are copied with their record header,
+ *                as the server always gets them, or as bare data.
+ */
+static ssize_t read_packets(fs_node_t * pipe, packet_t ** pending, int records, int batch, size_t size, uint8_t * buffer) {
+	size_t offset = 0;
 
-	return size;
+	do {
+		size_t start = records ? RECORD_ALIGN(offset) : offset;
+		packet_t * packet = __sync_lock_test_and_set(pending, NULL);
+
+		if (!packet) {
+			if (offset && pipe_size(pipe) < (int)sizeof(struct packet*)) break;
+			ssize_t r = receive_packet(pipe, &packet);
+			if (r < 0) return offset ? (ssize_t)offset : r;
+		}
+
+		size_t needed = packet->size + (records ? sizeof(record_t) : 0);
+		if (start + needed > size) {
+			*pending = packet;
+			if (offset) break;
+			printf("pex: read of %zu bytes can not hold packet of size %zu\n", size, packet->size);
+			return -EINVAL;
+		}
+
+		if (records) {
+			record_t head = { packet->source, packet->size };
+			memcpy(buffer + start, &head, sizeof(record_t));
+			memcpy(buffer + start + sizeof(record_t), packet->data, packet->size);
+		} else {
+			memcpy(buffer + start, packet->data, packet->size);
+		}
+
+		offset = start + needed;
+		packet_release(packet);
+	} while (batch && offset < size);
+
+	return offset;
 }
 
 static pex_client_t * create_client(pex_ex_t * p) {
 	pex_client_t * out = malloc(sizeof(pex_client_t));
 	out->parent = p;
 	out->pipe = make_pipe(4096);
+	out->pending = NULL;
+	out->batch = 0;
 	return out;
 }
 
@@ -132,62 +296,79 @@ static ssize_t read_server(fs_node_t * node, off_t offset, size_t size, uint8_t
 	pex_ex_t * p = (pex_ex_t *)node->device;
 	debug_print(INFO, "[pex] server read(...)");
 
-	packet_t * packet = NULL;
-
-	ssize_t response_size = receive_packet(p, p->server_pipe, &packet);
-
-	if (response_size < 0) return response_size;
-	if (!packet) return -1;
-
-	debug_print(INFO, "Server recevied packet of size %zu, was waiting for at most %lu", packet->size, size);
-
-	if (packet->size + sizeof(packet_t) > size) {
-		printf("pex: read in server would be incomplete\n");
-		return -1;
-	}
-
-	memcpy(buffer, packet, packet->size + sizeof(packet_t));
-	ssize_t out = packet->size + sizeof(packet_t);
-
-	free(packet);
-	return out;
+	return read_packets(p->server_pipe, &p->pending, 1, p->batch, size, buffer);
 }
 
-static ssize_t write_server(fs_node_t * node, off_t offset, size_t size, uint8_t * buffer) {
-	pex_ex_t * p = (pex_ex_t *)node->device;
-	debug_print(INFO, "[pex] server write(...)");
-
+/* Send one header_t and payload from the server; -EINVAL if it is bad. */
+static ssize_t server_send(pex_ex_t * p, size_t size, uint8_t * buffer) {
 	header_t * head = (header_t *)buffer;
 
-	if (size - sizeof(header_t) > MAX_PACKET_SIZE) {
+	if (size < sizeof(header_t) || size - sizeof(header_t) > MAX_PACKET_SIZE) {
 		printf("pex: server write is too big\n");
-		return -1;
+		return -EINVAL;
 	}
 
 	if (head->target == NULL) {
-		/* Brodcast packet */
+		/* Brodcast packet: one copy, queued to every client */
+		packet_t * packet = make_packet(p, NULL, size - sizeof(header_t), head->data);
 		spin_lock(p->lock);
 		foreach(f, p->clients) {
 			debug_print(INFO, "Sending to client %p", f->value);
-			send_to_client(p, (pex_client_t *)f->value, size - sizeof(header_t), head->data);
+			queue_to_client((pex_client_t *)f->value, packet);
 		}
 		spin_unlock(p->lock);
+		packet_release(packet);
 		debug_print(INFO, "Done broadcasting to clients.");
 		return size;
 	} else if (head->target->parent != p) {
 		debug_print(WARNING, "[pex] Invalid packet from server? (pid=%d)", this_core->current_process->id);
-		return -1;
+		return -EINVAL;
 	}
 
 	return send_to_client(p, head->target, size - sizeof(header_t), head->data) + sizeof(header_t);
 }
 
+static ssize_t write_server(fs_node_t * node, off_t offset, size_t size, uint8_t * buffer) {
+	pex_ex_t * p = (pex_ex_t *)node->device;
+	debug_print(INFO, "[pex] server write(...)");
+
+	ssize_t result = server_send(p, size, buffer);
+	return result < 0 ? -1 : result;
+}
+
+/**
+ * Each vector is one packet. A client with a full queue misses its
+ * packet, as with a single write, without holding up the rest.
+ */
+static ssize_t writev_server(fs_node_t * node, off_t offset, const struct iovec * iov, int iovcnt) {
+	pex_ex_t * p = (pex_ex_t *)node->device;
+	ssize_t total = 0;
+
+	for (int i = 0; i < iovcnt; ++i) {
+		if (!iov[i].iov_len) continue;
+		ssize_t result = server_send(p, iov[i].iov_len, iov[i].iov_base);
+		if (result < 0) return total ? total : result;
+		total += iov[i].iov_len;
+	}
+
+	return total;
+}
+
+static int pex_set_batch(char * batch, void * argp) {
+	int enable;
+	if (copy_from_user(&enable, argp, sizeof(int))) return -EFAULT;
+	*batch = !!enable;
+	return 0;
+}
+
 static int ioctl_server(fs_node_t * node, unsigned long request, void * argp) {
 	pex_ex_t * p = (pex_ex_t *)node->device;
 
 	switch (request) {
 		case IOCTL_PACKETFS_QUEUED:
-			return pipe_size(p->server_pipe);
+			return pipe_size(p->server_pipe) + (p->pending ? (int)sizeof(struct packet*) : 0);
+		case IOCTL_PACKETFS_BATCH:
+			return pex_set_batch(&p->batch, argp);
 		default:
 			return -1;
 	}
@@ -202,27 +383,12 @@ static ssize_t read_client(fs_node_t * node, off_t offset, size_t size, uint8_t
 
 	debug_print(INFO, "[pex] client read(...)");
 
-	packet_t * packet = NULL;
-
-	ssize_t response_size = receive_packet(c->parent, c->pipe, &packet);
+	ssize_t out = read_packets(c->pipe, &c->pending, c->batch, c->batch, size, buffer);
 
-	if (response_size < 0) return response_size;
-	if (!packet) return -EIO;
-
-	if (packet->size > size) {
-		printf("pex: Client is not reading enough bytes to hold packet of size %zu\n", packet->size);
-		return -EINVAL;
-	}
-
-	memcpy(buffer, &packet->data, packet->size);
-	ssize_t out = packet->size;
-
-	debug_print(INFO, "[pex] Client received packet of size %zu", packet->size);
 	if (out == 0) {
 		printf("pex: packet is empty?\n");
 	}
 
-	free(packet);
 	return out;
 }
 
@@ -251,7 +417,9 @@ static int ioctl_client(fs_node_t * node, unsigned long request, void * argp) {
 
 	switch (request) {
 		case IOCTL_PACKETFS_QUEUED:
-			return pipe_size(c->pipe);
+			return pipe_size(c->pipe) + (c->pending ? (int)sizeof(struct packet*) : 0);
+		case IOCTL_PACKETFS_BATCH:
+			return pex_set_batch(&c->batch, argp);
 		default:
 			return -1;
 	}
@@ -274,6 +442,7 @@ static void close_client(fs_node_t * node) {
 		send_to_server(p, c, 0, tmp);
 	}
 
+	drain_packets(c->pipe, &c->pending);
 	pipe_destroy(c->pipe);
 	free(c->pipe);
 	free(c);
@@ -283,8 +452,13 @@ static int wait_server(fs_node_t * node, void * process) {
 	pex_ex_t * p = (pex_ex_t *)node->device;
 	return selectwait_fs(p->server_pipe, process);
 }
+static void unwait_server(fs_node_t * node, void * process) {
+	pex_ex_t * p = (pex_ex_t *)node->device;
+	selectunwait_fs(p->server_pipe, process);
+}
 static int check_server(fs_node_t * node) {
 	pex_ex_t * p = (pex_ex_t *)node->device;
+	if (p->pending) return 0;
 	return selectcheck_fs(p->server_pipe);
 }
 
@@ -292,8 +466,13 @@ static int wait_client(fs_node_t * node, void * process) {
 	pex_client_t * c = (pex_client_t *)node->inode;
 	return selectwait_fs(c->pipe, process);
 }
+static void unwait_client(fs_node_t * node, void * process) {
+	pex_client_t * c = (pex_client_t *)node->inode;
+	selectunwait_fs(c->pipe, process);
+}
 static int check_client(fs_node_t * node) {
 	pex_client_t * c = (pex_client_t *)node->inode;
+	if (c->pending) return 0;
 	return selectcheck_fs(c->pipe);
 }
 
@@ -324,8 +503,11 @@ static void close_server(fs_node_t * node) {
 	spin_unlock(ex->lock);
 
 	free(ex->clients);
+	drain_packets(ex->server_pipe, &ex->pending);
 	pipe_destroy(ex->server_pipe);
 	free(ex->server_pipe);
+	spin_lock(ex->slab->lock);
+	slab_release_locked(ex->slab);
 	node->device = NULL;
 	free(ex);
 
@@ -347,10 +529,12 @@ static void open_pex(fs_node_t * node, unsigned int flags) {
 		/* Set up the server side */
 		node->read   = read_server;
 		node->write  = write_server;
+		node->writev = writev_server;
 		node->ioctl  = ioctl_server;
 		node->close  = close_server;
 		node->selectcheck = check_server;
 		node->selectwait  = wait_server;
+		node->selectunwait = unwait_server;
 		debug_print(INFO, "[pex] Server launched: %s", t->name);
 		debug_print(INFO, "fs_node = %p", (void*)node);
 	} else {
@@ -364,6 +548,7 @@ static void open_pex(fs_node_t * node, unsigned int flags) {
 
 		node->selectcheck = check_client;
 		node->selectwait  = wait_client;
+		node->selectunwait = unwait_client;
 
 		list_insert(t->clients, client);
 
@@ -479,6 +664,9 @@ static int create_packetfs(fs_node_t *parent, char *name, mode_t permission) {
 
 	new_exchange->name = strdup(name);
 	new_exchange->fresh = 1;
+	new_exchange->batch = 0;
+	new_exchange->pending = NULL;
+	new_exchange->slab = slab_create();
 	new_exchange->clients = list_create("pex clients",new_exchange);
 	new_exchange->server_pipe = make_pipe(4096);
 	new_exchange->parent = p;
@@ -71,28 +71,38 @@ int pipe_unsize(fs_node_t * node) {
 	return out;
 }
 
-static inline void pipe_increment_read(pipe_device_t * pipe) {
+/**
+ * @brief Copy @p count bytes out of the pipe, which must have them.
+ *
+ * The data is at most two contiguous spans, one up to the end of the
+ * buffer and one from its start, so this is at most two copies and
+ * one update of the read pointer.
+ */
+static void pipe_copy_out(pipe_device_t * pipe, uint8_t * buffer, size_t count) {
+	size_t first = pipe->size - pipe->read_ptr;
+	if (first > count) first = count;
+	memcpy(buffer, pipe->buffer + pipe->read_ptr, first);
+	if (count > first) memcpy(buffer + first, pipe->buffer, count - first);
+
 	spin_lock(pipe->ptr_lock);
-	pipe->read_ptr++;
-	if (pipe->read_ptr == pipe->size) {
-		pipe->read_ptr = 0;
-	}
+	pipe->read_ptr = (pipe->read_ptr + count) % pipe->size;
 	spin_unlock(pipe->ptr_lock);
 }
 
-static inline void pipe_increment_write(pipe_device_t * pipe) {
+/**
+ * @brief Copy @p count bytes into the pipe, which must have room.
+ */
+static void pipe_copy_in(pipe_device_t * pipe, const uint8_t * buffer, size_t count) {
+	size_t first = pipe->size - pipe->write_ptr;
+	if (first > count) first = count;
+	memcpy(pipe->buffer + pipe->write_ptr, buffer, first);
+	if (count > first) memcpy(pipe->buffer, buffer + first, count - first);
+
 	spin_lock(pipe->ptr_lock);
-	pipe->write_ptr++;
-	if (pipe->write_ptr == pipe->size) {
-		pipe->write_ptr = 0;
-	}
+	pipe->write_ptr = (pipe->write_ptr + count) % pipe->size;
 	spin_unlock(pipe->ptr_lock);
 }
 
-static inline void pipe_increment_write_by(pipe_device_t * pipe, size_t amount) {
-	pipe->write_ptr = (pipe->write_ptr + amount) % pipe->size;
-}
-
 static void pipe_alert_waiters(pipe_device_t * pipe) {
 	spin_lock(pipe->alert_lock);
 	while (pipe->alert_waiters->head) {
@@ -121,11 +131,8 @@ ssize_t read_pipe(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
 	while (collected == 0) {
 		spin_lock(pipe->lock_read);
 		if (pipe_unread(pipe) >= size) {
-			while (pipe_unread(pipe) > 0 && collected < size) {
-				buffer[collected] = pipe->buffer[pipe->read_ptr];
-				pipe_increment_read(pipe);
-				collected++;
-			}
+			pipe_copy_out(pipe, buffer, size);
+			collected = size;
 		}
 		wakeup_queue(pipe->wait_queue_writers);
 		/* Deschedule and switch */
@@ -156,11 +163,8 @@ ssize_t write_pipe(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer)
 		spin_lock(pipe->lock_read);
 		/* These pipes enforce atomic writes, poorly. */
 		if (pipe_available(pipe) > size) {
-			while (pipe_available(pipe) > 0 && written < size) {
-				pipe->buffer[pipe->write_ptr] = buffer[written];
-				pipe_increment_write(pipe);
-				written++;
-			}
+			pipe_copy_in(pipe, buffer, size);
+			written = size;
 		}
 		wakeup_queue(pipe->wait_queue_readers);
 		pipe_alert_waiters(pipe);
@@ -236,6 +240,18 @@ static int pipe_wait(fs_node_t * node, void * process) {
 	return 0;
 }
 
+static void pipe_unwait(fs_node_t * node, void * process) {
+	pipe_device_t * pipe = (pipe_device_t *)node->device;
+
+	spin_lock(pipe->alert_lock);
+	node_t * waiter = list_find(pipe->alert_waiters, process);
+	if (waiter) {
+		list_delete(pipe->alert_waiters, waiter);
+		free(waiter);
+	}
+	spin_unlock(pipe->alert_lock);
+}
+
 void pipe_destroy(fs_node_t * node) {
 	pipe_device_t * pipe = (pipe_device_t *)node->device;
 	spin_lock(pipe->ptr_lock);
@@ -275,6 +291,7 @@ fs_node_t * make_pipe(size_t size) {
 
 	fnode->selectcheck = pipe_check;
 	fnode->selectwait  = pipe_wait;
+	fnode->selectunwait = pipe_unwait;
 
 	fnode->atime = now();
 	fnode->mtime = fnode->atime;
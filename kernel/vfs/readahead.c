@@ -0,0 +1,161 @@
+/**
+ * @file  kernel/vfs/readahead.c
+ * @brief Sequential readahead for files on cached block filesystems.
+ *
+ * Every open file tracks where its next read would start if it is
+ * being read sequentially. While that keeps being the case, reads
+ * start pulling the data after them into the filesystem's cache
+ * ahead of time, in a window that doubles with each batch up to a
+ * limit; a read anywhere else resets it. Once a reader gets within
+ * half a window of where readahead has reached, the next batch is
+ * started, so the device stays busy while the reader works through
+ * what is already in memory.
+ *
+ * Readahead is done by a worker thread through the filesystem's
+ * readahead method, which should bring the blocks backing a range
+ * of the file into its cache without copying them anywhere. If a
+ * reader gets to a block while it is still being read in, it waits
+ * for it in the cache as it would for any other reader.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2021 K. Lange
+ */
+#include <stdint.h>
+#include <kernel/types.h>
+#include <kernel/string.h>
+#include <kernel/printf.h>
+#include <kernel/vfs.h>
+#include <kernel/process.h>
+#include <kernel/spinlock.h>
+#include <kernel/list.h>
+#include <kernel/procfs.h>
+
+#define READAHEAD_MIN_WINDOW 0x4000   /* 16KiB */
+#define READAHEAD_MAX_WINDOW 0x20000  /* 128KiB */
+#define READAHEAD_MAX_PENDING 32
+
+struct readahead_request {
+	fs_node_t * node; /* A copy, as the file may be closed before we get to it */
+	off_t offset;
+	size_t size;
+};
+
+static spin_lock_t readahead_lock = { 0 };
+static list_t * readahead_queue = NULL;
+static list_t * readahead_wait = NULL;
+
+static uint64_t request_count = 0;
+static uint64_t request_bytes = 0;
+static uint64_t dropped_count = 0;
+
+static void readahead_queue_request(fs_node_t * node, off_t offset, size_t size) {
+	if (!readahead_queue) return;
+
+	spin_lock(readahead_lock);
+	if (readahead_queue->length >= READAHEAD_MAX_PENDING) {
+		/* The device can't keep up; readers will just wait for it themselves */
+		dropped_count++;
+		spin_unlock(readahead_lock);
+		return;
+	}
+	spin_unlock(readahead_lock);
+
+	struct readahead_request * request = malloc(sizeof(struct readahead_request));
+	request->node = malloc(sizeof(fs_node_t));
+	memcpy(request->node, node, sizeof(fs_node_t));
+	request->node->refcount = 0;
+	request->offset = offset;
+	request->size = size;
+
+	spin_lock(readahead_lock);
+	list_insert(readahead_queue, request);
+	request_count++;
+	request_bytes += size;
+	spin_unlock(readahead_lock);
+
+	wakeup_queue(readahead_wait);
+}
+
+/**
+ * @brief Note a completed read and start readahead if access is sequential.
+ *
+ * Called by read_fs for nodes with a readahead method.
+ *
+ * @param node   File that was read
+ * @param offset Where the read started
+ * @param size   How much was actually read
+ */
+void readahead_fs(fs_node_t * node, off_t offset, size_t size) {
+	uint64_t end = offset + size;
+
+	if ((uint64_t)offset != node->ra_next) {
+		/* Not sequential; stop reading ahead until it is again */
+		node->ra_next = end;
+		node->ra_window = 0;
+		node->ra_end = end;
+		return;
+	}
+	node->ra_next = end;
+
+	if (!node->ra_window) {
+		node->ra_window = size * 2 < READAHEAD_MIN_WINDOW ? READAHEAD_MIN_WINDOW : size * 2;
+		if (node->ra_window > READAHEAD_MAX_WINDOW) node->ra_window = READAHEAD_MAX_WINDOW;
+	}
+	if (node->ra_end < end) node->ra_end = end;
+
+	if (node->ra_end - end > node->ra_window / 2) return;
+	if (node->ra_end >= node->length) return;
+
+	uint64_t start = node->ra_end;
+	uint64_t length = node->ra_window;
+	if (start + length > node->length) length = node->length - start;
+	node->ra_end = start + length;
+	if (node->ra_window < READAHEAD_MAX_WINDOW) node->ra_window *= 2;
+
+	readahead_queue_request(node, start, length);
+}
+
+static void readahead_worker(void * argp) {
+	while (1) {
+		spin_lock(readahead_lock);
+		while (!readahead_queue->length) {
+			sleep_on_unlocking(readahead_wait, &readahead_lock);
+			spin_lock(readahead_lock);
+		}
+		node_t * head = list_dequeue(readahead_queue);
+		spin_unlock(readahead_lock);
+
+		struct readahead_request * request = head->value;
+		free(head);
+
+		request->node->readahead(request->node, request->offset, request->size);
+
+		free(request->node);
+		free(request);
+	}
+}
+
+static void readahead_func(fs_node_t * node) {
+	procfs_printf(node,
+		"Requests:\t%zu\n"
+		"Bytes:\t%zu\n"
+		"Dropped:\t%zu\n"
+		"Pending:\t%zu\n",
+		(size_t)request_count, (size_t)request_bytes, (size_t)dropped_count,
+		(size_t)readahead_queue->length);
+}
+
+static struct procfs_entry readahead_entry = {
+	0,
+	"readahead",
+	readahead_func,
+};
+
+void readahead_initialize(void) {
+	readahead_wait = list_create("readahead waiters", NULL);
+	readahead_queue = list_create("readahead requests", NULL);
+	spawn_worker_thread(readahead_worker, "[readahead]", NULL);
+	procfs_install(&readahead_entry);
+}
@@ -2,6 +2,16 @@
  * @file  kernel/vfs/tarfs.c
  * @brief Read-only filesystem driver for ustar archives.
  *
+ * The archive is scanned once when it is mounted, building an index
+ * of every path in it: a hash table from full paths to entries, and
+ * for each directory, a list of its children in archive order. After
+ * that, lookups and directory listings don't touch the archive at all,
+ * and reads go straight to the file contents.
+ *
+ * Directories that only appear as part of other paths get entries of
+ * their own, and when a path appears more than once, the last header
+ * for it wins, as it would when extracting the archive.
+ *
  * @copyright
  * This file is part of ToaruOS and is released under the terms
  * of the NCSA / University of Illinois License - see LICENSE.md
@@ -18,9 +28,31 @@
 
 #define TARFS_LOG_LEVEL WARNING
 
+#define TARFS_NONE      ((uint32_t)-1)
+#define TARFS_NO_HEADER ((unsigned int)-1)
+
+struct tarfs_entry {
+	char * path;           /* Full path, without leading or trailing slashes; "" for the root */
+	char * name;           /* Last component of path */
+	unsigned int header;   /* Offset of the ustar header, or TARFS_NO_HEADER if implied */
+	unsigned int data;     /* Offset of the contents */
+	unsigned int size;
+	unsigned int mode;
+	unsigned int uid;
+	unsigned int gid;
+	char type;
+	uint32_t first_child;  /* Entry numbers, or TARFS_NONE */
+	uint32_t last_child;
+	uint32_t next_sibling;
+};
+
 struct tarfs {
 	fs_node_t * device;
 	unsigned int length;
+	hashmap_t * index;             /* path -> entry number + 1 */
+	struct tarfs_entry * entries;  /* Indexed by inode number; 0 is the root */
+	uint32_t count;
+	uint32_t capacity;
 };
 
 struct ustar {
@@ -104,122 +136,207 @@ static unsigned int round_to_512(unsigned int i) {
 }
 
 static int ustar_from_offset(struct tarfs * self, unsigned int offset, struct ustar * out);
-static fs_node_t * file_from_ustar(struct tarfs * self, struct ustar * file, unsigned int offset);
 
-#ifndef strncat
-static char * strncat(char *dest, const char *src, size_t n) {
-	char * end = dest;
-	while (*end != '\0') {
-		++end;
+/**
+ * @brief Find a path in the index.
+ *
+ * @returns Entry number, or TARFS_NONE.
+ */
+static uint32_t tarfs_lookup(struct tarfs * self, const char * path) {
+	uintptr_t id = (uintptr_t)hashmap_get(self->index, path);
+	return id ? (uint32_t)(id - 1) : TARFS_NONE;
+}
+
+static uint32_t tarfs_new_entry(struct tarfs * self, const char * path, uint32_t parent) {
+	if (self->count == self->capacity) {
+		self->capacity *= 2;
+		self->entries = realloc(self->entries, sizeof(struct tarfs_entry) * self->capacity);
 	}
-	size_t i = 0;
-	while (*src && i < n) {
-		*end = *src;
-		end++;
-		src++;
-		i++;
+
+	uint32_t id = self->count++;
+	struct tarfs_entry * entry = &self->entries[id];
+	memset(entry, 0, sizeof(struct tarfs_entry));
+	entry->path = strdup(path);
+	char * slash = strrchr(entry->path, '/');
+	entry->name = slash ? slash + 1 : entry->path;
+	entry->header = TARFS_NO_HEADER;
+	entry->mode = 0555;
+	entry->type = '5';
+	entry->first_child = TARFS_NONE;
+	entry->last_child = TARFS_NONE;
+	entry->next_sibling = TARFS_NONE;
+	hashmap_set(self->index, entry->path, (void *)(uintptr_t)(id + 1));
+
+	if (parent != TARFS_NONE) {
+		struct tarfs_entry * dir = &self->entries[parent];
+		if (dir->last_child == TARFS_NONE) {
+			dir->first_child = id;
+		} else {
+			self->entries[dir->last_child].next_sibling = id;
+		}
+		dir->last_child = id;
 	}
-	*end = '\0';
-	return dest;
+
+	return id;
 }
-#endif
 
-static int count_slashes(char * string) {
-	int i = 0;
-	char * s = strstr(string, "/");
-	while (s) {
-		if (*(s+1) == '\0') return i;
-		i++;
-		s = strstr(s+1,"/");
+/**
+ * @brief Find or create the entry for a path, and any directories leading to it.
+ *
+ * New entries start out as implied directories.
+ *
+ * @param path Normalized path; modified temporarily.
+ */
+static uint32_t tarfs_add_path(struct tarfs * self, char * path) {
+	uint32_t parent = 0;
+	char * component = path;
+	while (1) {
+		char * slash = strchr(component, '/');
+		if (slash) *slash = '\0';
+		uint32_t id = tarfs_lookup(self, path);
+		if (id == TARFS_NONE) id = tarfs_new_entry(self, path, parent);
+		if (!slash) return id;
+		*slash = '/';
+		parent = id;
+		component = slash + 1;
 	}
-	return i;
 }
 
-static struct dirent * readdir_tar_root(fs_node_t *node, unsigned long index) {
-	if (index == 0) {
-		struct dirent * out = malloc(sizeof(struct dirent));
-		memset(out, 0x00, sizeof(struct dirent));
-		out->d_ino = 0;
-		strcpy(out->d_name, ".");
-		return out;
+/**
+ * @brief Copy a path out of an archive field, dropping "." components and extra slashes.
+ *
+ * @param out   Where to append; must have room for len more bytes plus a terminator.
+ * @param field Field to copy from, which need not be terminated.
+ * @param len   Size of the field.
+ */
+static void tarfs_append_path(char * out, const char * field, size_t len) {
+	size_t o = strlen(out);
+	size_t i = 0;
+	while (i < len && field[i]) {
+		size_t j = i;
+		while (j < len && field[j] && field[j] != '/') j++;
+		int dot = (j - i == 1 && field[i] == '.');
+		if (j > i && !dot) {
+			if (o) out[o++] = '/';
+			memcpy(out + o, field + i, j - i);
+			o += j - i;
+		}
+		i = j;
+		while (i < len && field[i] == '/') i++;
 	}
+	out[o] = '\0';
+}
 
-	if (index == 1) {
-		struct dirent * out = malloc(sizeof(struct dirent));
-		memset(out, 0x00, sizeof(struct dirent));
-		out->d_ino = 0;
-		strcpy(out->d_name, "..");
-		return out;
+/**
+ * @brief Pull the path out of a pax extended header, if it has one.
+ *
+ * Records look like "<length> path=<value>\n".
+ */
+static void tarfs_pax_path(struct tarfs * self, unsigned int offset, unsigned int size, char * out, size_t out_size) {
+	char * data = malloc(size + 1);
+	if (read_fs(self->device, offset, size, (uint8_t *)data) != (ssize_t)size) {
+		free(data);
+		return;
+	}
+	data[size] = '\0';
+
+	unsigned int i = 0;
+	while (i < size) {
+		unsigned int length = 0;
+		unsigned int j = i;
+		while (j < size && data[j] >= '0' && data[j] <= '9') length = length * 10 + (data[j++] - '0');
+		if (!length || i + length > size || data[j] != ' ') break;
+		char * record = &data[j + 1];
+		size_t record_len = i + length - (j + 1) - 1; /* without the newline */
+		if (record_len > 5 && !memcmp(record, "path=", 5) && record_len - 5 < out_size) {
+			out[0] = '\0';
+			tarfs_append_path(out, record + 5, record_len - 5);
+		}
+		i += length;
 	}
 
-	index -= 2;
+	free(data);
+}
+
+/**
+ * @brief Scan the archive and build its index.
+ */
+static void tarfs_build_index(struct tarfs * self) {
+	size_t buckets = self->length / 4096;
+	if (buckets < 64) buckets = 64;
+	if (buckets > 65536) buckets = 65536;
+	self->index = hashmap_create(buckets);
+	self->capacity = 64;
+	self->entries = malloc(sizeof(struct tarfs_entry) * self->capacity);
+	self->count = 0;
+	tarfs_new_entry(self, "", TARFS_NONE);
 
-	struct tarfs * self = node->device;
-	/* Go through each file and pick the ones are at the root */
-	/* Root files will have no /, so this is easy */
-	unsigned int offset = 0;
 	struct ustar * file = malloc(sizeof(struct ustar));
-	while (offset < self->length) {
-		int status = ustar_from_offset(self, offset, file);
+	char path[512] = {0};   /* Long name from a pax header, for the next entry */
+	char workspace[512];
+
+	unsigned int offset = 0;
+	while (offset < self->length && ustar_from_offset(self, offset, file)) {
+		unsigned int size = interpret_size(file);
+		unsigned int data = offset + 512;
+		unsigned int next = data + round_to_512(size);
+
+		if (file->type[0] == 'x') {
+			tarfs_pax_path(self, data, size, path, sizeof(path));
+			offset = next;
+			continue;
+		} else if (file->type[0] == 'g') {
+			offset = next;
+			continue;
+		}
 
-		if (!status) {
-			free(file);
-			return NULL;
+		if (path[0]) {
+			strcpy(workspace, path);
+			path[0] = '\0';
+		} else {
+			workspace[0] = '\0';
+			tarfs_append_path(workspace, file->prefix, sizeof(file->prefix));
+			tarfs_append_path(workspace, file->filename, sizeof(file->filename));
 		}
 
-		char filename_workspace[256];
-
-		memset(filename_workspace, 0, 256);
-		strncat(filename_workspace, file->prefix, 155);
-		strncat(filename_workspace, file->filename, 100);
-
-		if (!count_slashes(filename_workspace)) {
-			char * slash = strstr(filename_workspace,"/");
-			if (slash) *slash = '\0'; /* remove trailing slash */
-			if (strlen(filename_workspace)) {
-				if (index == 0) {
-					struct dirent * out = malloc(sizeof(struct dirent));
-					memset(out, 0x00, sizeof(struct dirent));
-					out->d_ino = offset;
-					strcpy(out->d_name, filename_workspace);
-					free(file);
-					return out;
+		if (workspace[0]) {
+			if (file->type[0] == '1') {
+				/* A hard link reads as whatever it links to, which must come earlier */
+				char target_path[512] = {0};
+				tarfs_append_path(target_path, file->link, sizeof(file->link));
+				uint32_t target = tarfs_lookup(self, target_path);
+				if (target != TARFS_NONE && self->entries[target].type != '5') {
+					data = self->entries[target].data;
+					size = self->entries[target].size;
 				} else {
-					index--;
+					size = 0;
 				}
 			}
-		}
 
-		offset += 512;
-		offset += round_to_512(interpret_size(file));
+			uint32_t id = tarfs_add_path(self, workspace);
+			struct tarfs_entry * entry = &self->entries[id];
+			entry->header = offset;
+			entry->data   = data;
+			entry->size   = size;
+			entry->mode   = interpret_mode(file);
+			entry->uid    = interpret_uid(file);
+			entry->gid    = interpret_gid(file);
+			entry->type   = file->type[0];
+		}
 
+		offset = next;
 	}
 
 	free(file);
-	return NULL;
 }
 
-static ssize_t read_tarfs(fs_node_t * node, off_t offset, size_t size, uint8_t * buffer) {
-	struct tarfs * self = node->device;
-	struct ustar * file = malloc(sizeof(struct ustar));
-	ustar_from_offset(self, node->inode, file);
-	size_t file_size = interpret_size(file);
-
-	if ((size_t)offset > file_size) return 0;
-	if (offset + size > file_size) {
-		size = file_size - offset;
-	}
-
-	free(file);
-
-	return read_fs(self->device, offset + node->inode + 512, size, buffer);
-}
+static fs_node_t * file_from_entry(struct tarfs * self, uint32_t id);
 
 static struct dirent * readdir_tarfs(fs_node_t *node, unsigned long index) {
 	if (index == 0) {
 		struct dirent * out = malloc(sizeof(struct dirent));
 		memset(out, 0x00, sizeof(struct dirent));
-		out->d_ino = 0;
+		out->d_ino = node->inode;
 		strcpy(out->d_name, ".");
 		return out;
 	}
@@ -235,165 +352,147 @@ static struct dirent * readdir_tarfs(fs_node_t *node, unsigned long index) {
 	index -= 2;
 
 	struct tarfs * self = node->device;
+	uint32_t id = self->entries[node->inode].first_child;
+	while (id != TARFS_NONE && index) {
+		id = self->entries[id].next_sibling;
+		index--;
+	}
+	if (id == TARFS_NONE) return NULL;
 
-	/* Go through each file and pick the ones are at the root */
-	/* Root files will have no /, so this is easy */
-	unsigned int offset = node->inode;
-
-	/* Read myself */
-	struct ustar * file = malloc(sizeof(struct ustar));
-	int status = ustar_from_offset(self, node->inode, file);
-	char my_filename[256];
-
-	/* Figure out my own filename, with forward slash */
-	memset(my_filename, 0, 256);
-	strncat(my_filename, file->prefix, 155);
-	strncat(my_filename, file->filename, 100);
+	struct dirent * out = malloc(sizeof(struct dirent));
+	memset(out, 0x00, sizeof(struct dirent));
+	out->d_ino = id;
+	strcpy(out->d_name, self->entries[id].name);
+	return out;
+}
 
-	while (offset < self->length) {
-		ustar_from_offset(self, offset, file);
+/**
+ * @brief Fill a batch of directory entries.
+ *
+ * Cursors 0 and 1 are "." and ".."; 2 is the first child, and after
+ * that, the cursor is three past the entry number of the next child.
+ */
+static ssize_t getdents_tarfs(fs_node_t *node, uint64_t * cursor, struct dirent * out, size_t count) {
+	struct tarfs * self = node->device;
+	size_t read = 0;
+
+	while (*cursor < 2 && read < count) {
+		memset(&out[read], 0x00, sizeof(struct dirent));
+		out[read].d_ino = *cursor ? 0 : node->inode;
+		strcpy(out[read].d_name, *cursor ? ".." : ".");
+		read++;
+		(*cursor)++;
+	}
 
-		if (!status) {
-			free(file);
-			return NULL;
-		}
+	if (*cursor < 2) return read;
 
-		char filename_workspace[256];
-		memset(filename_workspace, 0, 256);
-		strncat(filename_workspace, file->prefix, 155);
-		strncat(filename_workspace, file->filename, 100);
-
-		if (startswith(filename_workspace, my_filename)) {
-			if (!count_slashes(filename_workspace + strlen(my_filename))) {
-				if (strlen(filename_workspace + strlen(my_filename))) {
-					if (index == 0) {
-						char * slash = strstr(filename_workspace+strlen(my_filename),"/");
-						if (slash) *slash = '\0'; /* remove trailing slash */
-						struct dirent * out = malloc(sizeof(struct dirent));
-						memset(out, 0x00, sizeof(struct dirent));
-						out->d_ino = offset;
-						strcpy(out->d_name, filename_workspace+strlen(my_filename));
-						free(file);
-						return out;
-					} else {
-						index--;
-					}
-				}
-			}
-		}
+	uint32_t id;
+	if (*cursor == 2) {
+		id = self->entries[node->inode].first_child;
+	} else if (*cursor - 3 < self->count) {
+		id = *cursor - 3;
+	} else {
+		return read;
+	}
 
-		offset += 512;
-		offset += round_to_512(interpret_size(file));
+	while (id != TARFS_NONE && read < count) {
+		memset(&out[read], 0x00, sizeof(struct dirent));
+		out[read].d_ino = id;
+		strcpy(out[read].d_name, self->entries[id].name);
+		read++;
+		id = self->entries[id].next_sibling;
 	}
 
-	free(file);
-	return NULL;
+	*cursor = (id == TARFS_NONE) ? (uint64_t)-1 : 3 + (uint64_t)id;
+	return read;
 }
 
 static fs_node_t * finddir_tarfs(fs_node_t *node, char *name) {
 	struct tarfs * self = node->device;
+	struct tarfs_entry * dir = &self->entries[node->inode];
 
-	/* find my own filename */
-	struct ustar * file = malloc(sizeof(struct ustar));
-	ustar_from_offset(self, node->inode, file);
-
-	char my_filename[256];
-	/* Figure out my own filename, with forward slash */
-	memset(my_filename, 0, 256);
-	strncat(my_filename, file->prefix, 155);
-	strncat(my_filename, file->filename, 100);
-
-	/* Append name */
-	strncat(my_filename, name, strlen(name));
-	if (strlen(my_filename) > 255) {
-		printf("tarfs: critical: what?");
-	}
-
-	unsigned int offset = node->inode;
-	while (offset < self->length) {
-		int status = ustar_from_offset(self, offset, file);
+	size_t dir_len = strlen(dir->path);
+	size_t name_len = strlen(name);
+	char * path = malloc(dir_len + name_len + 2);
+	memcpy(path, dir->path, dir_len);
+	if (dir_len) path[dir_len++] = '/';
+	memcpy(path + dir_len, name, name_len + 1);
 
-		if (!status) {
-			free(file);
-			return NULL;
-		}
+	uint32_t id = tarfs_lookup(self, path);
+	free(path);
 
-		char filename_workspace[256];
-		memset(filename_workspace, 0, 256);
-		strncat(filename_workspace, file->prefix, 155);
-		strncat(filename_workspace, file->filename, 100);
+	if (id == TARFS_NONE) return NULL;
+	return file_from_entry(self, id);
+}
 
-		if (filename_workspace[strlen(filename_workspace)-1] == '/') {
-			filename_workspace[strlen(filename_workspace)-1] = '\0';
-		}
-		if (!strcmp(filename_workspace, my_filename)) {
-			return file_from_ustar(self, file, offset);
-		}
+static ssize_t read_tarfs(fs_node_t * node, off_t offset, size_t size, uint8_t * buffer) {
+	struct tarfs * self = node->device;
+	struct tarfs_entry * entry = &self->entries[node->inode];
 
-		offset += 512;
-		offset += round_to_512(interpret_size(file));
+	if ((size_t)offset > entry->size) return 0;
+	if (offset + size > entry->size) {
+		size = entry->size - offset;
 	}
 
-
-	free(file);
-	return NULL;
+	return read_fs(self->device, offset + entry->data, size, buffer);
 }
 
 static ssize_t readlink_tarfs(fs_node_t * node, char * buf, size_t size) {
 	struct tarfs * self = node->device;
 	struct ustar * file = malloc(sizeof(struct ustar));
-	ustar_from_offset(self, node->inode, file);
+	ustar_from_offset(self, self->entries[node->inode].header, file);
 
-	if (size < strlen(file->link) + 1) {
-		//debug_print(INFO, "Requested read size was only %d, need %d.", size, strlen(file->link)+1);
+	size_t len = 0;
+	while (len < sizeof(file->link) && file->link[len]) len++;
+
+	if (size < len + 1) {
 		memcpy(buf, file->link, size-1);
 		buf[size-1] = '\0';
 		free(file);
 		return size-1;
 	} else {
-		//debug_print(INFO, "Reading link target is [%s]", file->link);
-		memcpy(buf, file->link, strlen(file->link) + 1);
+		memcpy(buf, file->link, len);
+		buf[len] = '\0';
 		free(file);
-		return strlen(file->link);
+		return len;
 	}
-
 }
 
 static int create_ret_rofs(fs_node_t *parent, char *name, mode_t permission) {
 	return -EROFS;
 }
 
-static fs_node_t * file_from_ustar(struct tarfs * self, struct ustar * file, unsigned int offset) {
+static fs_node_t * file_from_entry(struct tarfs * self, uint32_t id) {
+	struct tarfs_entry * entry = &self->entries[id];
 	fs_node_t * fs = malloc(sizeof(fs_node_t));
 	memset(fs, 0, sizeof(fs_node_t));
 	fs->device = self;
-	fs->inode  = offset;
+	fs->inode  = id;
 	fs->impl   = 0;
-	char filename_workspace[256];
-	memcpy(fs->name, filename_workspace, strlen(filename_workspace)+1);
-
-	fs->uid = interpret_uid(file);
-	fs->gid = interpret_gid(file);
-	fs->length = interpret_size(file);
-	fs->mask = interpret_mode(file);
+	size_t name_len = strlen(entry->name);
+	if (name_len > sizeof(fs->name) - 1) name_len = sizeof(fs->name) - 1;
+	memcpy(fs->name, entry->name, name_len);
+
+	fs->uid = entry->uid;
+	fs->gid = entry->gid;
+	fs->length = entry->size;
+	fs->mask = entry->mode;
 	fs->nlink = 0; /* Unsupported */
 	fs->flags = FS_FILE;
-	if (file->type[0] == '5') {
-		fs->flags = FS_DIRECTORY;
+	if (entry->type == '5') {
+		fs->flags = FS_DIRECTORY | FS_DCACHE;
+		fs->length = 0;
 		fs->readdir = readdir_tarfs;
+		fs->getdents = getdents_tarfs;
 		fs->finddir = finddir_tarfs;
 		fs->create  = create_ret_rofs;
-	} else if (file->type[0] == '1') {
-		//debug_print(ERROR, "Hardlink detected");
-		/* go through file and find target, reassign inode to point to that */
-	} else if (file->type[0] == '2') {
+	} else if (entry->type == '2') {
 		fs->flags = FS_SYMLINK;
 		fs->readlink = readlink_tarfs;
 	} else {
 		fs->flags = FS_FILE;
 		fs->read = read_tarfs;
 	}
-	free(file);
 #if 0
 	/* TODO times are also available from the file */
 	fs->atime = now();
@@ -403,42 +502,6 @@ static fs_node_t * file_from_ustar(struct tarfs * self, struct ustar * file, uns
 	return fs;
 }
 
-static fs_node_t * finddir_tar_root(fs_node_t *node, char *name) {
-	struct tarfs * self = node->device;
-
-	unsigned int offset = 0;
-	struct ustar * file = malloc(sizeof(struct ustar));
-	while (offset < self->length) {
-		int status = ustar_from_offset(self, offset, file);
-
-		if (!status) {
-			free(file);
-			return NULL;
-		}
-
-		char filename_workspace[256];
-		memset(filename_workspace, 0, 256);
-		strncat(filename_workspace, file->prefix, 155);
-		strncat(filename_workspace, file->filename, 100);
-
-		if (count_slashes(filename_workspace)) {
-			/* skip */
-		} else {
-			char * slash = strstr(filename_workspace,"/");
-			if (slash) *slash = '\0';
-			if (!strcmp(filename_workspace, name)) {
-				return file_from_ustar(self, file, offset);
-			}
-		}
-
-		offset += 512;
-		offset += round_to_512(interpret_size(file));
-	}
-
-	free(file);
-	return NULL;
-}
-
 static int ustar_from_offset(struct tarfs * self, unsigned int offset, struct ustar * out) {
 	read_fs(self->device, offset, sizeof(struct ustar), (unsigned char*)out);
 	if (out->ustar[0] != 'u' ||
@@ -475,6 +538,7 @@ static fs_node_t * tar_mount(const char * device, const char * mount_path) {
 
 	self->device = dev;
 	self->length = dev->length;
+	tarfs_build_index(self);
 
 	fs_node_t * root = malloc(sizeof(fs_node_t));
 	memset(root, 0, sizeof(fs_node_t));
@@ -483,10 +547,12 @@ static fs_node_t * tar_mount(const char * device, const char * mount_path) {
 	root->gid     = 0;
 	root->length  = 0;
 	root->mask    = 0555;
-	root->readdir = readdir_tar_root;
-	root->finddir = finddir_tar_root;
+	root->inode   = 0;
+	root->readdir = readdir_tarfs;
+	root->getdents = getdents_tarfs;
+	root->finddir = finddir_tarfs;
 	root->create  = create_ret_rofs;
-	root->flags   = FS_DIRECTORY;
+	root->flags   = FS_DIRECTORY | FS_DCACHE;
 	root->device  = self;
 
 	return root;
@@ -109,7 +109,7 @@ static ssize_t readlink_tmpfs(fs_node_t * node, char * buf, size_t size) {
 	}
 }
 
-static struct tmpfs_dir * tmpfs_dir_new(char * name, struct tmpfs_dir * parent) {
+static struct tmpfs_dir * tmpfs_dir_new(const char * name, struct tmpfs_dir * parent) {
 	struct tmpfs_dir * d = malloc(sizeof(struct tmpfs_dir));
 	spin_init(d->lock);
 	d->name = strdup(name);
@@ -521,7 +521,7 @@ static fs_node_t * tmpfs_from_dir(struct tmpfs_dir * d) {
 	return fnode;
 }
 
-fs_node_t * tmpfs_create(char * name) {
+fs_node_t * tmpfs_create(const char * name) {
 	tmpfs_root = tmpfs_dir_new(name, NULL);
 	tmpfs_root->mask = 0777;
 	tmpfs_root->uid  = 0;
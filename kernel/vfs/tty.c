@@ -19,6 +19,7 @@
 #include <kernel/process.h>
 #include <kernel/signal.h>
 #include <kernel/time.h>
+#include <kernel/syscall.h>
 #include <sys/ioctl.h>
 #include <sys/termios.h>
 #include <sys/signal_defs.h>
@@ -26,8 +27,6 @@
 #define TTY_BUFFER_SIZE 4096
 
 #define MIN(a,b) ((a) < (b) ? (a) : (b))
-extern void ptr_validate(void * ptr, const char * syscall);
-#define validate(o) ptr_validate(o,"ioctl")
 
 static int _pty_counter = 0;
 static hashmap_t * _pty_index = NULL;
@@ -273,55 +272,59 @@ int pty_ioctl(pty_t * pty, unsigned long request, void * argp) {
 			return IOCTL_DTYPE_TTY;
 		case IOCTLTTYNAME:
 			if (!argp) return -EINVAL;
-			validate(argp);
-			pty->fill_name(pty, argp);
-			return 0;
+			{
+				char name[100];
+				pty->fill_name(pty, name);
+				return copy_to_user(argp, name, strlen(name) + 1);
+			}
 		case IOCTLTTYLOGIN:
 			/* Set the user id of the login user */
 			if (this_core->current_process->user != 0) return -EPERM;
 			if (!argp) return -EINVAL;
-			validate(argp);
-			pty->slave->uid = *(int*)argp;
-			pty->master->uid = *(int*)argp;
+			{
+				int uid;
+				if (copy_from_user(&uid, argp, sizeof(int))) return -EFAULT;
+				pty->slave->uid = uid;
+				pty->master->uid = uid;
+			}
 			return 0;
 		case TIOCSWINSZ:
 			if (!argp) return -EINVAL;
-			validate(argp);
-			memcpy(&pty->size, argp, sizeof(struct winsize));
+			if (copy_from_user(&pty->size, argp, sizeof(struct winsize))) return -EFAULT;
 			if (pty->fg_proc) {
 				group_send_signal(pty->fg_proc, SIGWINCH, 1);
 			}
 			return 0;
 		case TIOCGWINSZ:
 			if (!argp) return -EINVAL;
-			validate(argp);
-			memcpy(argp, &pty->size, sizeof(struct winsize));
-			return 0;
+			return copy_to_user(argp, &pty->size, sizeof(struct winsize));
 		case TCGETS:
 			if (!argp) return -EINVAL;
-			validate(argp);
-			memcpy(argp, &pty->tios, sizeof(struct termios));
-			return 0;
+			return copy_to_user(argp, &pty->tios, sizeof(struct termios));
 		case TIOCSPGRP:
 			if (!argp) return -EINVAL;
-			validate(argp);
-			pty->fg_proc = *(pid_t *)argp;
+			{
+				pid_t pgrp;
+				if (copy_from_user(&pgrp, argp, sizeof(pid_t))) return -EFAULT;
+				pty->fg_proc = pgrp;
+			}
 			return 0;
 		case TIOCGPGRP:
 			if (!argp) return -EINVAL;
-			validate(argp);
-			*(pid_t *)argp = pty->fg_proc;
-			return 0;
+			return copy_to_user(argp, &pty->fg_proc, sizeof(pid_t));
 		case TCSETS:
 		case TCSETSW:
 		case TCSETSF:
 			if (!argp) return -EINVAL;
-			validate(argp);
-			if (!(((struct termios *)argp)->c_lflag & ICANON) && (pty->tios.c_lflag & ICANON)) {
-				/* Switch out of canonical mode, the dump the input buffer */
-				dump_input_buffer(pty);
+			{
+				struct termios tios;
+				if (copy_from_user(&tios, argp, sizeof(struct termios))) return -EFAULT;
+				if (!(tios.c_lflag & ICANON) && (pty->tios.c_lflag & ICANON)) {
+					/* Switch out of canonical mode, the dump the input buffer */
+					dump_input_buffer(pty);
+				}
+				memcpy(&pty->tios, &tios, sizeof(struct termios));
 			}
-			memcpy(&pty->tios, argp, sizeof(struct termios));
 			return 0;
 		default:
 			return -EINVAL;
@@ -440,6 +443,16 @@ static int wait_pty_slave(fs_node_t * node, void * process) {
 	return 0;
 }
 
+static void unwait_pty_master(fs_node_t * node, void * process) {
+	pty_t * pty = (pty_t *)node->device;
+	ring_buffer_select_unwait(pty->out, process);
+}
+
+static void unwait_pty_slave(fs_node_t * node, void * process) {
+	pty_t * pty = (pty_t *)node->device;
+	ring_buffer_select_unwait(pty->in, process);
+}
+
 fs_node_t * pty_master_create(pty_t * pty) {
 	fs_node_t * fnode = malloc(sizeof(fs_node_t));
 	memset(fnode, 0x00, sizeof(fs_node_t));
@@ -456,6 +469,7 @@ fs_node_t * pty_master_create(pty_t * pty) {
 	fnode->close = close_pty_master;
 	fnode->selectcheck = check_pty_master;
 	fnode->selectwait  = wait_pty_master;
+	fnode->selectunwait = unwait_pty_master;
 	fnode->readdir = NULL;
 	fnode->finddir = NULL;
 	fnode->ioctl = ioctl_pty_master;
@@ -485,6 +499,7 @@ fs_node_t * pty_slave_create(pty_t * pty) {
 	fnode->close = close_pty_slave;
 	fnode->selectcheck = check_pty_slave;
 	fnode->selectwait  = wait_pty_slave;
+	fnode->selectunwait = unwait_pty_slave;
 	fnode->readdir = NULL;
 	fnode->finddir = NULL;
 	fnode->ioctl = ioctl_pty_slave;
@@ -17,11 +17,13 @@
 #include <kernel/ringbuffer.h>
 #include <kernel/process.h>
 #include <kernel/signal.h>
+#include <kernel/syscall.h>
 
 #include <sys/signal_defs.h>
 #include <sys/ioctl.h>
 
 #define UNIX_PIPE_BUFFER 4096
+#define UNIX_PIPE_MAX_BUFFER (1024 * 1024) /* for anyone but root */
 
 struct unix_pipe {
 	fs_node_t * read_end;
@@ -94,6 +96,33 @@ static int wait_pipe(fs_node_t * node, void * process) {
 	return 0;
 }
 
+static void unwait_pipe(fs_node_t * node, void * process) {
+	struct unix_pipe * self = node->device;
+	ring_buffer_select_unwait(self->buffer, process);
+}
+
+static int ioctl_pipe(fs_node_t * node, unsigned long request, void * argp) {
+	struct unix_pipe * self = node->device;
+	switch (request) {
+		case IOCTL_PIPE_GETSZ:
+			/* The ring buffer keeps one byte free, so that's not ours to offer */
+			return self->buffer->size - 1;
+		case IOCTL_PIPE_SETSZ: {
+			int size;
+			if (copy_from_user(&size, argp, sizeof(int))) return -EFAULT;
+			if (size <= 0) return -EINVAL;
+			/* Whole pages, and the ring buffer keeps one byte free */
+			size_t capacity = ((size_t)size + 1 + 0xFFF) & ~0xFFFUL;
+			if (capacity > UNIX_PIPE_MAX_BUFFER && this_core->current_process->user != USER_ROOT_UID) return -EPERM;
+			if (capacity > INT32_MAX) return -EINVAL;
+			int result = ring_buffer_resize(self->buffer, capacity);
+			if (result < 0) return result;
+			return capacity - 1;
+		}
+		default:
+			return -EINVAL;
+	}
+}
 
 int make_unix_pipe(fs_node_t ** pipes) {
 	size_t size = UNIX_PIPE_BUFFER;
@@ -119,9 +148,13 @@ int make_unix_pipe(fs_node_t ** pipes) {
 	pipes[0]->close = close_read_pipe;
 	pipes[1]->close = close_write_pipe;
 
+	pipes[0]->ioctl = ioctl_pipe;
+	pipes[1]->ioctl = ioctl_pipe;
+
 	/* Read end can wait */
 	pipes[0]->selectcheck = check_pipe;
 	pipes[0]->selectwait = wait_pipe;
+	pipes[0]->selectunwait = unwait_pipe;
 
 	struct unix_pipe * internals = malloc(sizeof(struct unix_pipe));
 	internals->read_end = pipes[0];
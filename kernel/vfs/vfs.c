@@ -165,6 +165,20 @@ int selectwait_fs(fs_node_t * node, void * process) {
 	return -EINVAL;
 }
 
+/**
+ * @brief Ask a node to stop alerting a waiter it was given by selectwait_fs.
+ *
+ * Processes need not call this; drivers forget them once they alert.
+ * It is for waiters that are freed while a driver may still hold them.
+ */
+void selectunwait_fs(fs_node_t * node, void * process) {
+	if (!node) return;
+
+	if (node->selectunwait) {
+		node->selectunwait(node, process);
+	}
+}
+
 /**
  * @brief Read a file system node based on its underlying type.
  *
@@ -177,7 +191,9 @@ int selectwait_fs(fs_node_t * node, void * process) {
 ssize_t read_fs(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
 	if (!node) return -ENOENT;
 	if (node->read) {
-		return node->read(node, offset, size, buffer);
+		ssize_t result = node->read(node, offset, size, buffer);
+		if (result > 0 && node->readahead) readahead_fs(node, offset, result);
+		return result;
 	} else {
 		return -EINVAL;
 	}
@@ -201,6 +217,134 @@ ssize_t write_fs(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
 	}
 }
 
+/**
+ * @brief Read from a file system node into several buffers.
+ *
+ * Nodes that can fill a whole vector at once (like sockets, where
+ * each read is a separate message) provide a readv method; for
+ * everything else, the buffers are filled in order with read_fs,
+ * stopping at the first short read. Pipes and terminals block until
+ * they have something to give, so for those we stop as soon as a read
+ * returns anything, rather than waiting on them to fill the rest.
+ *
+ * @param node    Node to read from
+ * @param offset  Offset into the node data to start reading from
+ * @param iov     Buffers to read into, in kernel memory
+ * @param iovcnt  Number of buffers
+ * @returns Total bytes read, or an error if nothing was
+ */
+ssize_t readv_fs(fs_node_t *node, off_t offset, const struct iovec * iov, int iovcnt) {
+	if (!node) return -ENOENT;
+	if (node->readv) return node->readv(node, offset, iov, iovcnt);
+	if (!node->read) return -EINVAL;
+
+	ssize_t total = 0;
+	for (int i = 0; i < iovcnt; ++i) {
+		if (!iov[i].iov_len) continue;
+		ssize_t result = read_fs(node, offset + total, iov[i].iov_len, iov[i].iov_base);
+		if (result < 0) return total ? total : result;
+		total += result;
+		if ((size_t)result < iov[i].iov_len) break;
+		if (total && (node->flags & (FS_PIPE | FS_CHARDEVICE))) break;
+	}
+	return total;
+}
+
+/**
+ * @brief Write several buffers to a file system node.
+ *
+ * The counterpart of readv_fs; nodes without a writev method have the
+ * buffers written in order with write_fs, stopping at the first short write.
+ * A pipe only writes short when it is interrupted or its reader goes
+ * away, so a signal or an error after some buffers are in gives back
+ * what was written instead of failing (or restarting) the whole call.
+ *
+ * @param node    Node to write to
+ * @param offset  Offset into the node data to start writing at
+ * @param iov     Buffers to write from, in kernel memory
+ * @param iovcnt  Number of buffers
+ * @returns Total bytes written, or an error if nothing was
+ */
+ssize_t writev_fs(fs_node_t *node, off_t offset, const struct iovec * iov, int iovcnt) {
+	if (!node) return -ENOENT;
+	if (node->writev) return node->writev(node, offset, iov, iovcnt);
+	if (!node->write) return -EROFS;
+
+	ssize_t total = 0;
+	for (int i = 0; i < iovcnt; ++i) {
+		if (!iov[i].iov_len) continue;
+		ssize_t result = write_fs(node, offset + total, iov[i].iov_len, iov[i].iov_base);
+		if (result < 0) return total ? total : result;
+		total += result;
+		if ((size_t)result < iov[i].iov_len) break;
+	}
+	return total;
+}
+
+#define SPLICE_CHUNK 0x10000 /* 64KiB */
+
+/**
+ * @brief Move data from one node to another without going through userspace.
+ *
+ * Data is read from @p in and written to @p out through a kernel
+ * buffer, a chunk at a time. A short read ends the transfer, so this
+ * returns once a pipe, terminal or socket has given up what it has
+ * rather than waiting to fill the whole request.
+ *
+ * @p in_offset only moves past what was written, so a failed write
+ * leaves the rest of a file to be read again. There is no putting
+ * data back into a pipe, terminal or socket, though: whatever was
+ * read from one of those but couldn't be written is lost.
+ *
+ * @param in         Node to read from
+ * @param in_offset  Where to read from; advanced by the amount moved
+ * @param out        Node to write to
+ * @param out_offset Where to write to; advanced by the amount written
+ * @param len        Most bytes to move
+ * @returns Bytes moved, or an error if nothing was
+ */
+ssize_t splice_fs(fs_node_t * in, off_t * in_offset, fs_node_t * out, off_t * out_offset, size_t len) {
+	if (!in || !out) return -ENOENT;
+	if (!len) return 0;
+
+	size_t chunk = len < SPLICE_CHUNK ? len : SPLICE_CHUNK;
+	uint8_t * buffer = malloc(chunk);
+	ssize_t total = 0;
+
+	while ((size_t)total < len) {
+		size_t want = len - total < chunk ? len - total : chunk;
+		struct iovec iov = { buffer, want };
+		ssize_t r = readv_fs(in, *in_offset, &iov, 1);
+		if (r <= 0) {
+			if (!total) total = r;
+			break;
+		}
+
+		ssize_t written = 0;
+		while (written < r) {
+			iov.iov_base = buffer + written;
+			iov.iov_len  = r - written;
+			ssize_t w = writev_fs(out, *out_offset, &iov, 1);
+			if (w <= 0) {
+				*in_offset += written;
+				total += written;
+				if (!total) total = w ? w : -EIO;
+				goto _done;
+			}
+			written += w;
+			*out_offset += w;
+		}
+
+		*in_offset += r;
+		total += r;
+		if ((size_t)r < want) break;
+	}
+
+_done:
+	free(buffer);
+	return total;
+}
+
 /**
  * @brief set the size of a file to 9
  *
@@ -216,6 +360,26 @@ int truncate_fs(fs_node_t * node) {
 	return -EINVAL;
 }
 
+/**
+ * @brief Wait for a file's changes to reach its storage.
+ *
+ * Files and directories without an fsync method have nothing to
+ * write back; anything else doesn't support synchronization.
+ *
+ * @param node     File to synchronize
+ * @param datasync Only what is needed to read the data back is required
+ */
+int fsync_fs(fs_node_t * node, int datasync) {
+	if (!node) return -ENOENT;
+
+	if (node->fsync) {
+		return node->fsync(node, datasync);
+	}
+
+	if (node->flags & (FS_FILE | FS_DIRECTORY)) return 0;
+	return -EINVAL;
+}
+
 //volatile uint8_t tmp_refcount_lock = 0;
 static spin_lock_t tmp_refcount_lock = { 0 };
 
@@ -263,7 +427,11 @@ void close_fs(fs_node_t *node) {
 
 	spin_lock(tmp_refcount_lock);
 	node->refcount--;
-	if (node->refcount == 0) {
+	int last = node->refcount == 0;
+	spin_unlock(tmp_refcount_lock);
+
+	/* Nobody else can get at it now, and close methods may sleep */
+	if (last) {
 		debug_print(NOTICE, "Node refcount [%s] is now 0: %ld", node->name, node->refcount);
 
 		if (node->close) {
@@ -272,7 +440,6 @@ void close_fs(fs_node_t *node) {
 
 		free(node);
 	}
-	spin_unlock(tmp_refcount_lock);
 }
 
 /**
@@ -315,6 +482,42 @@ struct dirent *readdir_fs(fs_node_t *node, unsigned long index) {
 	}
 }
 
+/**
+ * @brief Read a batch of directory entries.
+ *
+ * Filesystems that can resume a directory scan from where they left
+ * off provide a getdents method and may use the cursor however they
+ * like; for everything else, the cursor is a readdir index.
+ *
+ * @param node   Directory to read
+ * @param cursor Position to start from, updated to where the next call should resume
+ * @param out    Array to fill
+ * @param count  Number of entries that fit in @p out
+ * @returns Number of entries read, 0 at the end of the directory, or a negative error code.
+ */
+ssize_t getdents_fs(fs_node_t *node, uint64_t * cursor, struct dirent * out, size_t count) {
+	if (!node) return -ENOENT;
+	if (!(node->flags & FS_DIRECTORY)) return -ENOTDIR;
+
+	if (node->getdents) {
+		return node->getdents(node, cursor, out, count);
+	}
+
+	if (!node->readdir) return -EINVAL;
+
+	size_t read = 0;
+	while (read < count) {
+		struct dirent * entry = node->readdir(node, *cursor);
+		if (!entry) break;
+		memcpy(&out[read], entry, sizeof(struct dirent));
+		free(entry);
+		(*cursor)++;
+		read++;
+	}
+
+	return read;
+}
+
 /**
  * @brief Find the requested file in the directory and return an fs_node for it
  *
@@ -403,6 +606,7 @@ int create_file_fs(char *name, mode_t permission) {
 	} else {
 		ret = -EINVAL;
 	}
+	dcache_invalidate(parent, f_path);
 
 	free(path);
 	free(parent);
@@ -453,6 +657,7 @@ int unlink_fs(char * name) {
 	} else {
 		ret = -EINVAL;
 	}
+	dcache_invalidate(parent, f_path);
 
 	free(path);
 	close_fs(parent);
@@ -518,6 +723,7 @@ int mkdir_fs(char *name, mode_t permission) {
 	} else {
 		ret = -EROFS;
 	}
+	dcache_invalidate(parent, f_path);
 
 	free(path);
 	close_fs(parent);
@@ -570,6 +776,7 @@ int symlink_fs(char * target, char * name) {
 	} else {
 		ret = -EINVAL;
 	}
+	dcache_invalidate(parent, f_path);
 
 	free(path);
 	close_fs(parent);
@@ -853,6 +1060,9 @@ void * vfs_mount(const char * path, fs_node_t * local_root) {
 
 	free(p);
 	spin_unlock(tmp_vfs_lock);
+
+	/* Lookups may now resolve differently */
+	dcache_purge();
 	return ret_val;
 }
 
@@ -1096,7 +1306,7 @@ fs_node_t *kopen_recur(const char *filename, uint64_t flags, uint64_t symlink_de
 		}
 		/* We are still searching... */
 		debug_print(INFO, "... Searching for %s", path_offset);
-		fs_node_t * node_next = finddir_fs(node_ptr, path_offset);
+		fs_node_t * node_next = dcache_finddir(node_ptr, path_offset, depth + 1 == path_depth);
 		free(node_ptr); /* Always a clone or an unopened thing */
 		node_ptr = node_next;
 		/* Search the active directory for the requested directory */
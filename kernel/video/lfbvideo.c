@@ -27,6 +27,7 @@
 #include <kernel/procfs.h>
 #include <kernel/mmu.h>
 #include <kernel/args.h>
+#include <kernel/syscall.h>
 
 /* FIXME: Not sure what to do with this; ifdef around it? */
 #include <kernel/arch/x86_64/ports.h>
@@ -66,74 +67,79 @@ void lfb_set_resolution(uint16_t x, uint16_t y) {
 	}
 }
 
-extern void ptr_validate(void * ptr, const char * syscall);
-#define validate(o) ptr_validate(o,"ioctl")
-
 /**
  * Framebuffer control ioctls.
  * Used by the compositor to get display sizes and by the
  * resolution changer to initiate modesetting.
  */
 static int ioctl_vid(fs_node_t * node, unsigned long request, void * argp) {
+	size_t value;
 	switch (request) {
 		case IO_VID_WIDTH:
 			/* Get framebuffer width */
-			validate(argp);
-			*((size_t *)argp) = lfb_resolution_x;
-			return 0;
+			value = lfb_resolution_x;
+			return copy_to_user(argp, &value, sizeof(size_t));
 		case IO_VID_HEIGHT:
 			/* Get framebuffer height */
-			validate(argp);
-			*((size_t *)argp) = lfb_resolution_y;
-			return 0;
+			value = lfb_resolution_y;
+			return copy_to_user(argp, &value, sizeof(size_t));
 		case IO_VID_DEPTH:
 			/* Get framebuffer bit depth */
-			validate(argp);
-			*((size_t *)argp) = lfb_resolution_b;
-			return 0;
+			value = lfb_resolution_b;
+			return copy_to_user(argp, &value, sizeof(size_t));
 		case IO_VID_STRIDE:
 			/* Get framebuffer scanline stride */
-			validate(argp);
-			*((size_t *)argp) = lfb_resolution_s;
-			return 0;
+			value = lfb_resolution_s;
+			return copy_to_user(argp, &value, sizeof(size_t));
 		case IO_VID_ADDR:
 			/* Map framebuffer into userspace process */
-			validate(argp);
 			{
 				uintptr_t lfb_user_offset;
-				if (*(uintptr_t*)argp == 0) {
+				if (copy_from_user(&lfb_user_offset, argp, sizeof(uintptr_t))) return -EFAULT;
+				if (lfb_user_offset == 0) {
 					/* Pick an address and map it */
 					lfb_user_offset = USER_DEVICE_MAP;
-				} else {
-					validate((void*)(*(uintptr_t*)argp));
-					lfb_user_offset = *(uintptr_t*)argp;
+				} else if (!PTR_INRANGE(lfb_user_offset) || !PTR_INRANGE(lfb_user_offset + lfb_memsize)) {
+					return -EINVAL;
 				}
 				for (uintptr_t i = 0; i < lfb_memsize; i += 0x1000) {
 					union PML * page = mmu_get_page(lfb_user_offset + i, MMU_GET_MAKE);
 					mmu_frame_map_address(page,MMU_FLAG_WRITABLE|MMU_FLAG_WC,((uintptr_t)(lfb_vid_memory) & 0xFFFFFFFF) + i);
 				}
-				*((uintptr_t *)argp) = lfb_user_offset;
+				return copy_to_user(argp, &lfb_user_offset, sizeof(uintptr_t));
 			}
-			return 0;
 		case IO_VID_SIGNAL:
 			/* ioctl to register for a signal (vid device change? idk) on display change */
 			display_change_recipient = this_core->current_process->id;
 			return 0;
 		case IO_VID_SET:
 			/* Initiate mode setting */
-			validate(argp);
-			lfb_set_resolution(((struct vid_size *)argp)->width, ((struct vid_size *)argp)->height);
+			{
+				struct vid_size size;
+				if (copy_from_user(&size, argp, sizeof(struct vid_size))) return -EFAULT;
+				lfb_set_resolution(size.width, size.height);
+			}
 			return 0;
 		case IO_VID_DRIVER:
-			validate(argp);
-			memcpy(argp, lfb_driver_name, strlen(lfb_driver_name));
-			return 0;
+			return copy_to_user(argp, lfb_driver_name, strlen(lfb_driver_name));
 		case IO_VID_REINIT:
 			if (this_core->current_process->user != 0) {
 				return -EPERM;
 			}
-			validate(argp);
-			return lfb_init(argp);
+			{
+				long len = strnlen_user(argp, 256);
+				if (len < 0) return len;
+				if (len == 256) return -EINVAL;
+				char * mode = malloc(len + 1);
+				if (copy_from_user(mode, argp, len)) {
+					free(mode);
+					return -EFAULT;
+				}
+				mode[len] = '\0';
+				int result = lfb_init(mode);
+				free(mode);
+				return result;
+			}
 		default:
 			return -EINVAL;
 	}
@@ -460,35 +466,32 @@ static void auto_scan_pci(uint32_t device, uint16_t v, uint16_t d, void * extra)
 static fs_node_t * vga_text_device = NULL;
 
 static int ioctl_vga(fs_node_t * node, unsigned long request, void * argp) {
+	size_t value;
 	switch (request) {
 		case IO_VID_WIDTH:
 			/* Get framebuffer width */
-			validate(argp);
-			*((size_t *)argp) = 80;
-			return 0;
+			value = 80;
+			return copy_to_user(argp, &value, sizeof(size_t));
 		case IO_VID_HEIGHT:
 			/* Get framebuffer height */
-			validate(argp);
-			*((size_t *)argp) = 25;
-			return 0;
+			value = 25;
+			return copy_to_user(argp, &value, sizeof(size_t));
 		case IO_VID_ADDR:
 			/* Map framebuffer into userspace process */
-			validate(argp);
 			{
 				uintptr_t vga_user_offset;
-				if (*(uintptr_t*)argp == 0) {
+				if (copy_from_user(&vga_user_offset, argp, sizeof(uintptr_t))) return -EFAULT;
+				if (vga_user_offset == 0) {
 					vga_user_offset = USER_DEVICE_MAP;
-				} else {
-					validate((void*)(*(uintptr_t*)argp));
-					vga_user_offset = *(uintptr_t*)argp;
+				} else if (!PTR_INRANGE(vga_user_offset) || !PTR_INRANGE(vga_user_offset + 0x1000)) {
+					return -EINVAL;
 				}
 				for (uintptr_t i = 0; i < 0x1000; i += 0x1000) {
 					union PML * page = mmu_get_page(vga_user_offset + i, MMU_GET_MAKE);
 					mmu_frame_map_address(page,MMU_FLAG_WRITABLE/*|MMU_FLAG_WC*/,(uintptr_t)(0xB8000 + i));
 				}
-				*((uintptr_t *)argp) = vga_user_offset;
+				return copy_to_user(argp, &vga_user_offset, sizeof(uintptr_t));
 			}
-			return 0;
 		default:
 			return -EINVAL;
 	}
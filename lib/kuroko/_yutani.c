@@ -285,6 +285,7 @@ static KrkValue _yutani_wait_for(int argc, KrkValue argv[], int hasKw) {
 	CHECK_YUTANI();
 	if (argc != 2 || !IS_INTEGER(argv[1])) { krk_runtimeError(vm.exceptions->argumentError, "expected int for msgtype"); return NONE_VAL(); }
 	yutani_msg_t * result = yutani_wait_for(self->yctx, AS_INTEGER(argv[1]));
+	if (!result) return krk_runtimeError(vm.exceptions->ioError, "Lost connection to compositor.");
 	KrkInstance * out = krk_newInstance(Message);
 	krk_push(OBJECT_VAL(out));
 	((struct MessageClass*)out)->msg = result;
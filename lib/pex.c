@@ -18,6 +18,7 @@
 #include <unistd.h>
 #include <fcntl.h>
 #include <sys/ioctl.h>
+#include <sys/uio.h>
 
 #include <toaru/pex.h>
 
@@ -77,3 +78,28 @@ FILE * pex_bind(char * target) {
 size_t pex_query(FILE * sock) {
 	return ioctl(fileno(sock), IOCTL_PACKETFS_QUEUED, NULL);
 }
+
+/**
+ * Switch a server or client socket to batched reads. Once set,
+ * reads return pex_packet_t records, as many as are queued and
+ * fit, instead of one packet at a time.
+ */
+int pex_batch(FILE * sock, int enable) {
+	return ioctl(fileno(sock), IOCTL_PACKETFS_BATCH, &enable);
+}
+
+/**
+ * Read a batch of records from either end of a batched socket.
+ * Step through them with PEX_NEXT_RECORD.
+ */
+size_t pex_listen_batch(FILE * sock, void * buffer, size_t size) {
+	return read(fileno(sock), buffer, size);
+}
+
+/**
+ * Send several packets from a server at once; each vector is a
+ * pex_header_t followed by its payload.
+ */
+size_t pex_send_batch(FILE * sock, struct iovec * packets, int count) {
+	return writev(fileno(sock), packets, count);
+}
@@ -10,6 +10,7 @@
  */
 #include <string.h>
 #include <stdlib.h>
+#include <sched.h>
 #include <sys/shm.h>
 
 #include <toaru/pex.h>
@@ -24,29 +25,189 @@
 /* We need the flags but don't want the library dep (maybe the flags should be here?) */
 #include <toaru/./decorations.h>
 
+#define YUTANI_BATCH_SIZE (PACKET_SIZE * 8)
+
 /**
- * yutani_wait_for
+ * yutani_ring_init
  *
- * Wait for a particular kind of message, queuing other types
- * of messages for processing later.
+ * Set up an empty ring, with its reader idle so the
+ * first message written to it rings the doorbell.
  */
-yutani_msg_t * yutani_wait_for(yutani_t * y, uint32_t type) {
-	do {
-		yutani_msg_t * out;
-		size_t size;
-		{
-			char tmp[MAX_PACKET_SIZE];
-			size = pex_recv(y->sock, tmp);
-			out = malloc(size);
-			memcpy(out, tmp, size);
+void yutani_ring_init(yutani_ring_t * ring) {
+	ring->head = 0;
+	ring->rung = 0;
+	ring->tail = 0;
+	ring->idle = 1;
+	ring->answered = 0;
+}
+
+#define YUTANI_RING_RECORD(size) ((sizeof(yutani_ring_record_t) + (size) + 7) & ~7)
+
+/**
+ * yutani_ring_write
+ *
+ * Append a message to a ring. Only one thread may write to a ring
+ * at a time. Returns -1 if there is no room, 1 if the reader was
+ * idle and must be sent a doorbell, or 0 if it will find the
+ * message without one.
+ */
+int yutani_ring_write(yutani_ring_t * ring, yutani_msg_t * msg) {
+	uint32_t size = msg->size;
+	if (size > MAX_PACKET_SIZE) return -1;
+
+	uint32_t need = YUTANI_RING_RECORD(size);
+	uint32_t start = ring->head;
+	uint32_t tail = __atomic_load_n(&ring->tail, __ATOMIC_ACQUIRE);
+	uint32_t offset = start % YUTANI_RING_SIZE;
+	uint32_t pad = (YUTANI_RING_SIZE - offset < need) ? YUTANI_RING_SIZE - offset : 0;
+
+	if (start - tail + pad + need > YUTANI_RING_SIZE) return -1;
+
+	yutani_ring_record_t * record = (void *)&ring->data[offset];
+	if (pad) {
+		record->size = 0;
+		record->flags = YUTANI_RING_PAD;
+		record = (void *)&ring->data[0];
+	}
+	record->size = size;
+	record->flags = 0;
+	memcpy(record->data, msg, size);
+
+	/*
+	 * Publish before claiming the flag: a reader that went idle without
+	 * seeing the new head set the flag before it looked, so we see it.
+	 */
+	__atomic_store_n(&ring->head, start + pad + need, __ATOMIC_SEQ_CST);
+	if (!__atomic_exchange_n(&ring->idle, 0, __ATOMIC_SEQ_CST)) return 0;
+
+	__atomic_store_n(&ring->rung, ring->rung + 1, __ATOMIC_RELEASE);
+	return 1;
+}
+
+/**
+ * yutani_ring_read
+ *
+ * Take the next message from a ring into @out, which must have
+ * room for MAX_PACKET_SIZE bytes. @first starts out set when a
+ * doorbell has been received, so that it is counted; reading stops
+ * while the writer has sent more doorbells than that, as the rest
+ * can wait for the next one. Returns the size of the message, 0
+ * when there is nothing more to read until the next doorbell, or
+ * -1 if the ring does not make sense.
+ */
+int yutani_ring_read(yutani_ring_t * ring, int * first, yutani_msg_t * out) {
+	if (*first) {
+		*first = 0;
+		__atomic_store_n(&ring->answered, ring->answered + 1, __ATOMIC_RELEASE);
+	}
+
+	while (1) {
+		if (__atomic_load_n(&ring->rung, __ATOMIC_ACQUIRE) != ring->answered) return 0;
+
+		uint32_t tail = ring->tail;
+		uint32_t head = __atomic_load_n(&ring->head, __ATOMIC_ACQUIRE);
+
+		if (head == tail) {
+			/* Empty; ask for a doorbell, then make sure nothing slipped in first. */
+			__atomic_store_n(&ring->idle, 1, __ATOMIC_SEQ_CST);
+			head = __atomic_load_n(&ring->head, __ATOMIC_SEQ_CST);
+			if (head == tail) return 0;
+			__atomic_exchange_n(&ring->idle, 0, __ATOMIC_SEQ_CST);
 		}
 
-		if (out->type == type) {
-			return out;
+		if (head - tail > YUTANI_RING_SIZE || (tail & 7)) return -1;
+
+		uint32_t offset = tail % YUTANI_RING_SIZE;
+		yutani_ring_record_t * record = (void *)&ring->data[offset];
+		uint32_t flags = record->flags;
+		uint32_t size = record->size;
+
+		uint32_t length = YUTANI_RING_SIZE - offset;
+		if (!(flags & YUTANI_RING_PAD)) {
+			if (size < sizeof(struct yutani_message) || size > MAX_PACKET_SIZE) return -1;
+			length = YUTANI_RING_RECORD(size);
+			if (length > YUTANI_RING_SIZE - offset) return -1;
+		}
+		if (length > head - tail) return -1;
+
+		if (!(flags & YUTANI_RING_PAD)) {
+			memcpy(out, record->data, size);
+		}
+		__atomic_store_n(&ring->tail, tail + length, __ATOMIC_RELEASE);
+
+		if (!(flags & YUTANI_RING_PAD)) return size;
+	}
+}
+
+/**
+ * _yutani_ring_drain
+ *
+ * A doorbell arrived; move what the server put in our
+ * ring onto the internal queue.
+ */
+static void _yutani_ring_drain(yutani_t * y) {
+	char tmp[MAX_PACKET_SIZE];
+	int first = 1;
+	int size;
+	while ((size = yutani_ring_read(&y->rings->to_client, &first, (yutani_msg_t *)tmp)) > 0) {
+		yutani_msg_t * out = malloc(size);
+		memcpy(out, tmp, size);
+		list_insert(y->queued, out);
+	}
+}
+
+/**
+ * _yutani_fill
+ *
+ * Read everything the server has queued for us, up to a
+ * batch at a time, onto the internal queue. Blocks until
+ * there is at least one message.
+ */
+static int _yutani_fill(yutani_t * y) {
+	char tmp[YUTANI_BATCH_SIZE];
+	size_t size = pex_listen_batch(y->sock, tmp, sizeof(tmp));
+	if (size == (size_t)-1 || !size) return -1;
+
+	pex_packet_t * p = (pex_packet_t *)tmp;
+	while ((char *)p < tmp + size) {
+		yutani_msg_t * out = (yutani_msg_t *)p->data;
+		if (y->rings && p->size >= sizeof(struct yutani_message) && out->type == YUTANI_MSG_RING_DOORBELL) {
+			_yutani_ring_drain(y);
 		} else {
+			out = malloc(p->size);
+			memcpy(out, p->data, p->size);
 			list_insert(y->queued, out);
 		}
-	} while (1); /* XXX: (!y->abort) */
+		p = PEX_NEXT_RECORD(p);
+	}
+
+	return 0;
+}
+
+/**
+ * yutani_wait_for
+ *
+ * Wait for a particular kind of message, queuing other types
+ * of messages for processing later. Returns NULL if the
+ * connection to the server is lost first.
+ */
+yutani_msg_t * yutani_wait_for(yutani_t * y, uint32_t type) {
+	/* Only look at messages that arrive from here on. */
+	node_t * seen = y->queued->tail;
+	do {
+		node_t * node = seen ? seen->next : y->queued->head;
+		while (node) {
+			yutani_msg_t * out = node->value;
+			if (out->type == type) {
+				list_delete(y->queued, node);
+				free(node);
+				return out;
+			}
+			seen = node;
+			node = node->next;
+		}
+		if (_yutani_fill(y) < 0) return NULL;
+	} while (1);
 }
 
 /**
@@ -112,21 +273,13 @@ static void _handle_internal(yutani_t * y, yutani_msg_t * out) {
 yutani_msg_t * yutani_poll(yutani_t * y) {
 	yutani_msg_t * out;
 
-	if (y->queued->length > 0) {
-		node_t * node = list_dequeue(y->queued);
-		out = (yutani_msg_t *)node->value;
-		free(node);
-		_handle_internal(y, out);
-		return out;
+	while (!y->queued->length) {
+		if (_yutani_fill(y) < 0) return NULL;
 	}
 
-	size_t size;
-	{
-		char tmp[MAX_PACKET_SIZE];
-		size = pex_recv(y->sock, tmp);
-		out = malloc(size);
-		memcpy(out, tmp, size);
-	}
+	node_t * node = list_dequeue(y->queued);
+	out = (yutani_msg_t *)node->value;
+	free(node);
 
 	_handle_internal(y, out);
 
@@ -501,6 +654,29 @@ void yutani_msg_buildx_special_request(yutani_msg_t * msg, yutani_wid_t wid, uin
 	sr->request = request;
 }
 
+void yutani_msg_buildx_ring_request(yutani_msg_t * msg) {
+	msg->magic = YUTANI_MSG__MAGIC;
+	msg->type  = YUTANI_MSG_RING_REQUEST;
+	msg->size  = sizeof(struct yutani_message);
+}
+
+void yutani_msg_buildx_ring_init(yutani_msg_t * msg, uint32_t bufid, uint32_t size) {
+	msg->magic = YUTANI_MSG__MAGIC;
+	msg->type  = YUTANI_MSG_RING_INIT;
+	msg->size  = sizeof(struct yutani_message) + sizeof(struct yutani_msg_ring_init);
+
+	struct yutani_msg_ring_init * ri = (void *)msg->data;
+
+	ri->bufid = bufid;
+	ri->size = size;
+}
+
+void yutani_msg_buildx_ring_doorbell(yutani_msg_t * msg) {
+	msg->magic = YUTANI_MSG__MAGIC;
+	msg->type  = YUTANI_MSG_RING_DOORBELL;
+	msg->size  = sizeof(struct yutani_message);
+}
+
 void yutani_msg_buildx_clipboard(yutani_msg_t * msg, char * content) {
 	msg->magic = YUTANI_MSG__MAGIC;
 	msg->type  = YUTANI_MSG_CLIPBOARD;
@@ -512,8 +688,33 @@ void yutani_msg_buildx_clipboard(yutani_msg_t * msg, char * content) {
 	memcpy(cl->content, content, strlen(content));
 }
 
+/**
+ * yutani_msg_send
+ *
+ * Send a message to the server, through our ring if we have
+ * one. A full ring is waited out; the server empties it each
+ * time it gets a doorbell.
+ */
 int yutani_msg_send(yutani_t * y, yutani_msg_t * msg) {
-	return pex_reply(y->sock, msg->size, (char *)msg);
+	if (!y->rings) {
+		return pex_reply(y->sock, msg->size, (char *)msg);
+	}
+
+	if (msg->size > MAX_PACKET_SIZE) return -1;
+
+	while (__sync_lock_test_and_set(&y->rings_lock, 1)) sched_yield();
+	int rang;
+	while ((rang = yutani_ring_write(&y->rings->to_server, msg)) < 0) {
+		sched_yield();
+	}
+	if (rang) {
+		yutani_msg_buildx_ring_doorbell_alloc(m);
+		yutani_msg_buildx_ring_doorbell(m);
+		pex_reply(y->sock, m->size, (char *)m);
+	}
+	__sync_lock_release(&y->rings_lock);
+
+	return msg->size;
 }
 
 yutani_t * yutani_context_create(FILE * socket) {
@@ -524,9 +725,43 @@ yutani_t * yutani_context_create(FILE * socket) {
 	out->display_height = 0;
 	out->windows = hashmap_create_int(10);
 	out->queued = list_create();
+	out->rings = NULL;
+	out->rings_bufid = 0;
+	out->rings_lock = 0;
+	pex_batch(socket, 1);
 	return out;
 }
 
+/**
+ * _yutani_setup_rings
+ *
+ * Ask the server for a pair of message rings. Until the reply
+ * arrives, messages go over the socket as usual; if the server
+ * has none to give, they keep doing so.
+ */
+static void _yutani_setup_rings(yutani_t * y) {
+	yutani_msg_buildx_ring_request_alloc(m);
+	yutani_msg_buildx_ring_request(m);
+	yutani_msg_send(y, m);
+
+	yutani_msg_t * mm = yutani_wait_for(y, YUTANI_MSG_RING_INIT);
+	if (!mm) return;
+	struct yutani_msg_ring_init * ri = (void *)&mm->data;
+
+	if (ri->bufid) {
+		char key[1024];
+		YUTANI_SHMKEY_EXP(y->server_ident, key, 1024, ri->bufid);
+		size_t size = ri->size;
+		yutani_rings_t * rings = shm_obtain(key, &size);
+		if (rings && size >= sizeof(yutani_rings_t)) {
+			y->rings = rings;
+			y->rings_bufid = ri->bufid;
+		}
+	}
+
+	free(mm);
+}
+
 /**
  * yutani_init
  *
@@ -551,12 +786,30 @@ yutani_t * yutani_init(void) {
 	yutani_msg_send(y, m);
 
 	yutani_msg_t * mm = yutani_wait_for(y, YUTANI_MSG_WELCOME);
+	if (!mm) {
+		/* The server hung up before welcoming us. */
+		while (y->queued->head) {
+			node_t * node = list_dequeue(y->queued);
+			free(node->value);
+			free(node);
+		}
+		free(y->queued);
+		hashmap_free(y->windows);
+		free(y->windows);
+		free(y);
+		fclose(c);
+		return NULL;
+	}
 	struct yutani_msg_welcome * mw = (void *)&mm->data;
 	y->display_width = mw->display_width;
 	y->display_height = mw->display_height;
 	y->server_ident = server_name;
 	free(mm);
 
+	if (!getenv("YUTANI_NO_RINGS")) {
+		_yutani_setup_rings(y);
+	}
+
 	return y;
 }
 
@@ -573,6 +826,10 @@ yutani_window_t * yutani_window_create_flags(yutani_t * y, int width, int height
 	yutani_msg_send(y, m);
 
 	yutani_msg_t * mm = yutani_wait_for(y, YUTANI_MSG_WINDOW_INIT);
+	if (!mm) {
+		free(win);
+		return NULL;
+	}
 	struct yutani_msg_window_init * mw = (void *)&mm->data;
 
 	win->width = mw->width;
@@ -722,10 +979,12 @@ void yutani_window_resize_accept(yutani_t * yctx, yutani_window_t * window, uint
 
 	/* Now wait for the new bufid */
 	yutani_msg_t * mm = yutani_wait_for(yctx, YUTANI_MSG_RESIZE_BUFID);
+	if (!mm) return;
 	struct yutani_msg_window_resize * wr = (void*)mm->data;
 
 	if (window->wid != wr->wid) {
 		/* I am not sure what to do here. */
+		free(mm);
 		return;
 	}
 
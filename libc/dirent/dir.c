@@ -1,3 +1,4 @@
+#include <stdlib.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <string.h>
@@ -7,6 +8,10 @@
 #include <bits/dirent.h>
 
 DEFN_SYSCALL3(readdir, SYS_READDIR, int, int, void *);
+DEFN_SYSCALL3(getdents, SYS_GETDENTS, int, void *, size_t);
+
+/* Entries fetched from the kernel at a time */
+#define DIR_BUF_ENTRIES 16
 
 DIR * opendir (const char * dirname) {
 	int fd = open(dirname, O_RDONLY);
@@ -18,32 +23,41 @@ DIR * opendir (const char * dirname) {
 	DIR * dir = (DIR *)malloc(sizeof(DIR));
 	dir->fd = fd;
 	dir->cur_entry = -1;
+	dir->buf_count = 0;
+	dir->buf_pos = 0;
+	dir->buf = malloc(sizeof(struct dirent) * DIR_BUF_ENTRIES);
 	return dir;
 }
 
 int closedir (DIR * dir) {
 	if (dir && (dir->fd != -1)) {
-		return close(dir->fd);
+		int ret = close(dir->fd);
+		free(dir->buf);
+		free(dir);
+		return ret;
 	} else {
 		return -EBADF;
 	}
 }
 
 struct dirent * readdir (DIR * dirp) {
-	static struct dirent ent;
-
-	int ret = syscall_readdir(dirp->fd, ++dirp->cur_entry, &ent);
-	if (ret < 0) {
-		errno = -ret;
-		memset(&ent, 0, sizeof(struct dirent));
-		return NULL;
-	}
-
-	if (ret == 0) {
-		/* end of directory */
-		memset(&ent, 0, sizeof(struct dirent));
-		return NULL;
+	if (dirp->buf_pos >= dirp->buf_count) {
+		/* Refill from the kernel; the open directory keeps our place. */
+		long ret = syscall_getdents(dirp->fd, dirp->buf, sizeof(struct dirent) * DIR_BUF_ENTRIES);
+		if (ret < 0) {
+			errno = -ret;
+			return NULL;
+		}
+
+		if (ret == 0) {
+			/* end of directory */
+			return NULL;
+		}
+
+		dirp->buf_count = ret / sizeof(struct dirent);
+		dirp->buf_pos = 0;
 	}
 
-	return &ent;
+	dirp->cur_entry++;
+	return &dirp->buf[dirp->buf_pos++];
 }
@@ -1,53 +1,156 @@
 #include <poll.h>
 #include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
 #include <errno.h>
-#include <sys/fswait.h>
+#include <unistd.h>
+#include <pthread.h>
+#include <sys/evset.h>
+#include <sys/time.h>
 
 extern char * _argv_0;
 
-int poll(struct pollfd *fds, nfds_t nfds, int timeout) {
-	int count_pollin = 0;
+#define POLL_EVENTS 32
 
-	for (nfds_t i = 0; i < nfds; ++i) {
-		if (fds[i].events & POLLIN) {
-			count_pollin++;
+/*
+ * poll() is built on an event set that is kept from one call to the
+ * next, so a program polling the same descriptors over and over only
+ * registers each of them with the kernel once. Descriptors are added
+ * as they first appear, and dropped when they turn up ready without
+ * being asked about, or when they are closed.
+ *
+ * The set belongs to the first thread to call poll(). Other threads,
+ * and children that inherited it, use a set of their own for the
+ * length of each call.
+ */
+static int _poll_set = -1;
+static int _poll_tid = 0;
+static pid_t _poll_pid = 0;
+static char * _poll_registered = NULL;
+static int _poll_registered_size = 0;
+
+static int _poll_is_registered(int fd) {
+	return fd < _poll_registered_size && _poll_registered[fd];
+}
+
+static void _poll_mark(int fd, char registered) {
+	if (fd >= _poll_registered_size) {
+		int size = _poll_registered_size ? _poll_registered_size : 32;
+		while (size <= fd) size *= 2;
+		_poll_registered = realloc(_poll_registered, size);
+		memset(_poll_registered + _poll_registered_size, 0, size - _poll_registered_size);
+		_poll_registered_size = size;
+	}
+	_poll_registered[fd] = registered;
+}
+
+/**
+ * Called by close() and dup2() before a descriptor goes away, so the
+ * set doesn't hold on to it.
+ */
+void __poll_forget(int fd) {
+	if (fd < 0 || !_poll_is_registered(fd)) return;
+	if (getpid() != _poll_pid) return;
+	int saved = errno;
+	evset_ctl(_poll_set, EVSET_DEL, fd, NULL);
+	errno = saved;
+	_poll_registered[fd] = 0;
+}
+
+static int _poll_add(int set, struct pollfd * pfd, int persistent) {
+	if (persistent && _poll_is_registered(pfd->fd)) return 0;
+	struct evset_event event = { EVSET_IN, 0, pfd->fd };
+	if (evset_ctl(set, EVSET_ADD, pfd->fd, &event) < 0) {
+		if (errno == EEXIST) return 0; /* Asked about twice */
+		if (errno == EBADF) {
+			pfd->revents = POLLNVAL;
+			return 1;
 		}
-		fds[i].revents = 0;
+		return -1;
 	}
+	if (persistent) _poll_mark(pfd->fd, 1);
+	return 0;
+}
+
+static long _poll_now_ms(void) {
+	struct timeval now;
+	gettimeofday(&now, NULL);
+	return now.tv_sec * 1000L + now.tv_usec / 1000L;
+}
 
+static int _poll_on(int set, struct pollfd * fds, nfds_t nfds, int timeout, int persistent) {
+	int invalid = 0;
 	for (nfds_t i = 0; i < nfds; ++i) {
-		if (fds[i].events & (~POLLIN)) {
-			fprintf(stderr, "%s: poll: unsupported bit set in fds (this implementation only supports POLLIN)\n", _argv_0);
-			return -EINVAL;
+		if (fds[i].fd < 0 || !(fds[i].events & POLLIN)) continue;
+		int result = _poll_add(set, &fds[i], persistent);
+		if (result < 0) return -1;
+		invalid += result;
+	}
+	if (invalid) return invalid;
+
+	struct evset_event events[POLL_EVENTS];
+	int count = 0;
+	long deadline = timeout > 0 ? _poll_now_ms() + timeout : 0;
+	while (!count) {
+		int ready = evset_wait(set, events, POLL_EVENTS, timeout);
+		if (ready <= 0) return ready;
+
+		for (int j = 0; j < ready; ++j) {
+			int fd = events[j].data;
+			int asked = 0;
+			for (nfds_t i = 0; i < nfds; ++i) {
+				if (fds[i].fd == fd && (fds[i].events & POLLIN)) {
+					if (!fds[i].revents) count++;
+					fds[i].revents = POLLIN;
+					asked = 1;
+				}
+			}
+			if (!asked && persistent) {
+				/* Left over from an earlier call; stop watching it. */
+				evset_ctl(set, EVSET_DEL, fd, NULL);
+				_poll_mark(fd, 0);
+			}
+		}
+
+		if (!count && timeout == 0) return 0;
+		if (!count && timeout > 0) {
+			/* Only stale descriptors woke us; wait out what is left. */
+			long left = deadline - _poll_now_ms();
+			if (left <= 0) return 0;
+			timeout = left;
 		}
 	}
 
-	int fswait_fds[count_pollin];
-	int fswait_backref[count_pollin];
-	int fswait_results[count_pollin];
-	int j = 0;
+	return count;
+}
+
+int poll(struct pollfd *fds, nfds_t nfds, int timeout) {
 	for (nfds_t i = 0; i < nfds; ++i) {
-		if (fds[i].events & POLLIN) {
-			fswait_fds[j] = fds[i].fd;
-			fswait_backref[j] = i;
-			j++;
+		if (fds[i].events & (~POLLIN)) {
+			fprintf(stderr, "%s: poll: unsupported bit set in fds (this implementation only supports POLLIN)\n", _argv_0);
+			errno = EINVAL;
+			return -1;
 		}
+		fds[i].revents = 0;
 	}
 
-	int ret = fswait3(count_pollin, fswait_fds, timeout, fswait_results);
+	int tid = gettid();
+	if (_poll_set == -1) {
+		_poll_set = evset_create(0);
+		if (_poll_set < 0) return -1;
+		_poll_tid = tid;
+		_poll_pid = getpid();
+	}
 
-	if (ret >= 0 && ret < count_pollin) {
-		int count = 0;
-		for (int i = 0; i < count_pollin; ++i) {
-			if (fswait_results[i]) {
-				fds[fswait_backref[i]].revents = POLLIN;
-				count++;
-			}
-		}
-		return count;
-	} else if (ret == count_pollin) {
-		return 0;
-	} else {
-		return ret; /* Error */
+	if (tid == _poll_tid) {
+		return _poll_on(_poll_set, fds, nfds, timeout, 1);
 	}
+
+	int set = evset_create(0);
+	if (set < 0) return -1;
+	int result = _poll_on(set, fds, nfds, timeout, 0);
+	int saved = errno;
+	close(set);
+	errno = saved;
+	return result;
 }
@@ -0,0 +1,67 @@
+#include <poll.h>
+#include <errno.h>
+#include <sys/select.h>
+
+/*
+ * select() is poll() with its descriptors packed into bitmaps, and
+ * shares its event set. As with poll(), only readability can be
+ * waited for; no descriptor ever has an exceptional condition.
+ */
+int select(int nfds, fd_set * readfds, fd_set * writefds, fd_set * exceptfds, struct timeval * timeout) {
+	if (nfds < 0 || nfds > FD_SETSIZE) {
+		errno = EINVAL;
+		return -1;
+	}
+
+	if (writefds) {
+		for (int fd = 0; fd < nfds; ++fd) {
+			if (FD_ISSET(fd, writefds)) {
+				errno = EINVAL;
+				return -1;
+			}
+		}
+	}
+
+	struct pollfd fds[FD_SETSIZE];
+	nfds_t count = 0;
+	if (readfds) {
+		for (int fd = 0; fd < nfds; ++fd) {
+			if (FD_ISSET(fd, readfds)) {
+				fds[count].fd = fd;
+				fds[count].events = POLLIN;
+				fds[count].revents = 0;
+				count++;
+			}
+		}
+	}
+
+	int ms = -1;
+	if (timeout) {
+		if (timeout->tv_sec < 0 || timeout->tv_usec < 0) {
+			errno = EINVAL;
+			return -1;
+		}
+		ms = timeout->tv_sec * 1000 + (timeout->tv_usec + 999) / 1000;
+	}
+
+	int ready = poll(fds, count, ms);
+	if (ready < 0) return -1;
+
+	int out = 0;
+	if (readfds) {
+		FD_ZERO(readfds);
+		for (nfds_t i = 0; i < count; ++i) {
+			if (fds[i].revents & POLLNVAL) {
+				errno = EBADF;
+				return -1;
+			}
+			if (fds[i].revents & POLLIN) {
+				FD_SET(fds[i].fd, readfds);
+				out++;
+			}
+		}
+	}
+	if (exceptfds) FD_ZERO(exceptfds);
+
+	return out;
+}
@@ -2,6 +2,7 @@
 #include <syscall.h>
 #include <string.h>
 #include <sys/types.h>
+#include <sys/uio.h>
 #include <unistd.h>
 #include <fcntl.h>
 #include <errno.h>
@@ -27,6 +28,8 @@ struct _FILE {
 	struct _FILE * next;
 };
 
+extern void __poll_forget(int fd);
+
 FILE _stdin = {
 	.fd = 0,
 	.read_buf = NULL,
@@ -275,6 +278,7 @@ FILE * freopen(const char *path, const char *mode, FILE * stream) {
 
 	if (path) {
 		fflush(stream);
+		__poll_forget(stream->fd);
 		syscall_close(stream->fd);
 		int flags, mask;
 		parse_mode(mode, &flags, &mask);
@@ -341,6 +345,7 @@ int _fwouldblock(FILE * stream) {
 
 int fclose(FILE * stream) {
 	fflush(stream);
+	__poll_forget(stream->fd);
 	int out = syscall_close(stream->fd);
 	free(stream->_name);
 	free(stream->read_buf);
@@ -446,6 +451,29 @@ size_t fread(void *ptr, size_t size, size_t nmemb, FILE * stream) {
 }
 
 size_t fwrite(const void *ptr, size_t size, size_t nmemb, FILE * stream) {
+	if (!size || !nmemb) return 0;
+	size_t total = size * nmemb;
+
+	if (stream->write_buf && total >= stream->wbufsiz - stream->written) {
+		/* Too big to buffer; send what's buffered and the new data together */
+		struct iovec iov[2] = {
+			{ stream->write_buf, stream->written },
+			{ (void*)ptr, total },
+		};
+		size_t buffered = stream->written;
+		ssize_t r = writev(stream->fd, iov, 2);
+		if (r < (ssize_t)buffered) {
+			/* Keep whatever of the buffer didn't make it out; none of the new data did */
+			if (r > 0) {
+				memmove(stream->write_buf, stream->write_buf + r, buffered - r);
+				stream->written = buffered - r;
+			}
+			return 0;
+		}
+		stream->written = 0;
+		return (r - buffered) / size;
+	}
+
 	char * tracking = (char*)ptr;
 	for (size_t i = 0; i < nmemb; ++i) {
 		int r = write_bytes(stream, tracking, size);
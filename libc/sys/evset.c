@@ -0,0 +1,20 @@
+#include <errno.h>
+#include <syscall.h>
+#include <syscall_nums.h>
+#include <sys/evset.h>
+
+DEFN_SYSCALL1(evset_create, SYS_EVSET_CREATE, int);
+DEFN_SYSCALL4(evset_ctl, SYS_EVSET_CTL, int, int, int, void *);
+DEFN_SYSCALL4(evset_wait, SYS_EVSET_WAIT, int, void *, int, int);
+
+int evset_create(int flags) {
+	__sets_errno(syscall_evset_create(flags));
+}
+
+int evset_ctl(int set, int op, int fd, struct evset_event * event) {
+	__sets_errno(syscall_evset_ctl(set, op, fd, event));
+}
+
+int evset_wait(int set, struct evset_event * events, int maxevents, int timeout) {
+	__sets_errno(syscall_evset_wait(set, events, maxevents, timeout));
+}
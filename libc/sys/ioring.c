@@ -0,0 +1,15 @@
+#include <errno.h>
+#include <syscall.h>
+#include <syscall_nums.h>
+#include <sys/ioring.h>
+
+DEFN_SYSCALL1(ioring_setup, SYS_IORING_SETUP, void *);
+DEFN_SYSCALL4(ioring_enter, SYS_IORING_ENTER, int, unsigned int, unsigned int, unsigned int);
+
+int ioring_setup(struct ioring_params * params) {
+	__sets_errno(syscall_ioring_setup(params));
+}
+
+int ioring_enter(int fd, unsigned int to_submit, unsigned int min_complete, unsigned int flags) {
+	__sets_errno(syscall_ioring_enter(fd, to_submit, min_complete, flags));
+}
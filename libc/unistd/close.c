@@ -4,6 +4,9 @@
 
 DEFN_SYSCALL1(close, SYS_CLOSE, int);
 
+extern void __poll_forget(int fd);
+
 int close(int file) {
+	__poll_forget(file);
 	return syscall_close(file);
 }
@@ -4,7 +4,10 @@
 
 DEFN_SYSCALL2(dup2, SYS_DUP2, int, int);
 
+extern void __poll_forget(int fd);
+
 int dup2(int oldfd, int newfd) {
+	if (newfd != oldfd) __poll_forget(newfd);
 	return syscall_dup2(oldfd, newfd);
 }
 
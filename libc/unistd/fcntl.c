@@ -1,4 +1,6 @@
 #include <fcntl.h>
+#include <stdarg.h>
+#include <sys/ioctl.h>
 
 int fcntl(int fd, int cmd, ...) {
     switch (cmd) {
@@ -6,6 +8,15 @@ int fcntl(int fd, int cmd, ...) {
             return 0;
         case F_SETFD:
             return 0;
+        case F_GETPIPE_SZ:
+            return ioctl(fd, IOCTL_PIPE_GETSZ, NULL);
+        case F_SETPIPE_SZ: {
+            va_list args;
+            va_start(args, cmd);
+            int size = va_arg(args, int);
+            va_end(args);
+            return ioctl(fd, IOCTL_PIPE_SETSZ, &size);
+        }
     }
     return -1;
 }
@@ -0,0 +1,10 @@
+#include <unistd.h>
+#include <syscall.h>
+#include <syscall_nums.h>
+#include <errno.h>
+
+DEFN_SYSCALL1(fdatasync, SYS_FDATASYNC, int);
+
+int fdatasync(int fd) {
+	__sets_errno(syscall_fdatasync(fd));
+}
@@ -0,0 +1,10 @@
+#include <unistd.h>
+#include <errno.h>
+#include <syscall.h>
+#include <syscall_nums.h>
+
+DEFN_SYSCALL4(pwrite, SYS_PWRITE, int, char *, size_t, long);
+
+ssize_t pwrite(int fd, const void * buf, size_t count, off_t offset) {
+	__sets_errno(syscall_pwrite(fd, (char *)buf, count, offset));
+}
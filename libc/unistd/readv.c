@@ -0,0 +1,11 @@
+#include <unistd.h>
+#include <errno.h>
+#include <syscall.h>
+#include <syscall_nums.h>
+#include <sys/uio.h>
+
+DEFN_SYSCALL3(readv, SYS_READV, int, const void *, int);
+
+ssize_t readv(int fd, const struct iovec * iov, int iovcnt) {
+	__sets_errno(syscall_readv(fd, iov, iovcnt));
+}
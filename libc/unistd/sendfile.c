@@ -0,0 +1,11 @@
+#include <unistd.h>
+#include <errno.h>
+#include <syscall.h>
+#include <syscall_nums.h>
+#include <sys/sendfile.h>
+
+DEFN_SYSCALL4(sendfile, SYS_SENDFILE, int, int, long *, size_t);
+
+ssize_t sendfile(int out_fd, int in_fd, off_t * offset, size_t count) {
+	__sets_errno(syscall_sendfile(out_fd, in_fd, offset, count));
+}
@@ -0,0 +1,16 @@
+#include <unistd.h>
+#include <fcntl.h>
+#include <errno.h>
+#include <syscall.h>
+#include <syscall_nums.h>
+
+DEFN_SYSCALL5(splice, SYS_SPLICE, int, long *, int, long *, size_t);
+
+ssize_t splice(int fd_in, off_t * off_in, int fd_out, off_t * off_out, size_t len, unsigned int flags) {
+	/* There are no flags yet, and no room left in the system call for them */
+	if (flags) {
+		errno = EINVAL;
+		return -1;
+	}
+	__sets_errno(syscall_splice(fd_in, off_in, fd_out, off_out, len));
+}
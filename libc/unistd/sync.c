@@ -1,8 +1,8 @@
 #include <unistd.h>
 #include <errno.h>
 #include <sys/types.h>
+#include <sys/sysfunc.h>
 
 void sync(void) {
-	/* TODO */
+	sysfunc(TOARU_SYS_FUNC_SYNC, NULL);
 }
-
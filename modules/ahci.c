@@ -3,19 +3,177 @@
  * @file modules/ahci.c
  * @package x86_64
  *
- * @warning This is a stub driver.
+ * Drives SATA disks attached to AHCI host controllers. Each port
+ * gets a command list with one command table per slot, and
+ * requests from any number of threads are issued concurrently,
+ * up to the number of slots the controller and drive support.
+ * Drives that support native command queuing get queued commands;
+ * others get plain DMA commands, which the controller runs one at
+ * a time. Requests come from the block layer, which merges adjacent
+ * ones into a single command.
+ *
+ * Completions arrive by MSI where the platform can route one, and
+ * on the controller's legacy interrupt line otherwise.
+ *
+ * ATAPI devices are put into an idle state and left alone.
  *
  * @copyright
  * This file is part of ToaruOS and is released under the terms
  * of the NCSA / University of Illinois License - see LICENSE.md
  * Copyright (C) 2021 K. Lange
  */
+#include <errno.h>
+#include <kernel/types.h>
+#include <kernel/string.h>
 #include <kernel/syscall.h>
 #include <kernel/module.h>
 #include <kernel/printf.h>
+#include <kernel/process.h>
+#include <kernel/spinlock.h>
 #include <kernel/pci.h>
 #include <kernel/vfs.h>
 #include <kernel/mmu.h>
+#include <kernel/list.h>
+#include <kernel/time.h>
+#include <kernel/blkdev.h>
+
+#include <kernel/arch/x86_64/irq.h>
+
+/* HBA registers */
+#define AHCI_CAP    0x00
+#define AHCI_GHC    0x04
+#define AHCI_IS     0x08
+#define AHCI_PI     0x0C
+#define AHCI_VS     0x10
+
+#define AHCI_CAP_NCS(cap) ((((cap) >> 8) & 0x1F) + 1)
+#define AHCI_CAP_SCLO    (1UL << 24)
+#define AHCI_CAP_SNCQ    (1UL << 30)
+#define AHCI_CAP_S64A    (1UL << 31)
+
+#define AHCI_GHC_IE      (1UL << 1)
+#define AHCI_GHC_AE      (1UL << 31)
+
+/* Port registers, relative to the port's base */
+#define AHCI_PXCLB  0x00
+#define AHCI_PXCLBU 0x04
+#define AHCI_PXFB   0x08
+#define AHCI_PXFBU  0x0C
+#define AHCI_PXIS   0x10
+#define AHCI_PXIE   0x14
+#define AHCI_PXCMD  0x18
+#define AHCI_PXTFD  0x20
+#define AHCI_PXSIG  0x24
+#define AHCI_PXSSTS 0x28
+#define AHCI_PXSERR 0x30
+#define AHCI_PXSACT 0x34
+#define AHCI_PXCI   0x38
+
+#define AHCI_PXCMD_ST    (1 << 0UL)
+#define AHCI_PXCMD_SUD   (1 << 1UL)
+#define AHCI_PXCMD_POD   (1 << 2UL)
+#define AHCI_PXCMD_CLO   (1 << 3UL)
+#define AHCI_PXCMD_FRE   (1 << 4UL)
+#define AHCI_PXCMD_MPSS  (1 << 13UL)
+#define AHCI_PXCMD_FR    (1 << 14UL)
+#define AHCI_PXCMD_CR    (1 << 15UL)
+
+/* Interrupts we take: register, PIO setup, DMA setup and set device
+ * bits FISes, descriptor processed, and the fatal errors. */
+#define AHCI_PXIS_ERRORS 0x78000000
+#define AHCI_PXIE_ENABLE (0x0000002F | AHCI_PXIS_ERRORS)
+
+#define AHCI_TFD_ERR     0x01
+#define AHCI_TFD_DRQ     0x08
+#define AHCI_TFD_BSY     0x80
+
+#define AHCI_SIG_ATA     0x00000101
+#define AHCI_SIG_ATAPI   0xeb140101
+
+/* Command header flags */
+#define AHCI_CMD_CFL_H2D 5 /* register FIS length in dwords */
+#define AHCI_CMD_WRITE   (1 << 6)
+#define AHCI_CMD_PREFETCH (1 << 7)
+
+#define FIS_TYPE_REG_H2D 0x27
+
+#define ATA_CMD_READ_DMA_EXT      0x25
+#define ATA_CMD_WRITE_DMA_EXT     0x35
+#define ATA_CMD_READ_FPDMA_QUEUED 0x60
+#define ATA_CMD_WRITE_FPDMA_QUEUED 0x61
+#define ATA_CMD_IDENTIFY          0xEC
+
+#define AHCI_SECTOR_SIZE  512
+#define AHCI_MAX_SECTORS  1024 /* 512KiB per command */
+#define AHCI_PRDT_MAX     ((0x1000 - 0x80) / sizeof(struct ahci_prd))
+#define AHCI_PRD_MAX      0x400000 /* bytes described by one entry */
+#define AHCI_MAX_PIECES   32 /* requests merged into one command; each may add two entries */
+
+struct ahci_cmd_header {
+	uint16_t flags;
+	uint16_t prdtl;
+	volatile uint32_t prdbc;
+	uint32_t ctba;
+	uint32_t ctbau;
+	uint32_t reserved[4];
+} __attribute__((packed));
+
+struct ahci_prd {
+	uint32_t dba;
+	uint32_t dbau;
+	uint32_t reserved;
+	uint32_t dbc; /* byte count minus one */
+} __attribute__((packed));
+
+struct ahci_cmd_table {
+	uint8_t cfis[64];
+	uint8_t acmd[16];
+	uint8_t reserved[48];
+	struct ahci_prd prdt[];
+} __attribute__((packed));
+
+struct ahci_slot {
+	struct ahci_cmd_table * table;
+	uintptr_t table_phys;
+	list_t * waiter;
+	volatile int done;
+	int error;
+};
+
+struct ahci_hba;
+
+struct ahci_port {
+	struct ahci_hba * hba;
+	uintptr_t mmio;
+	int number;
+	spin_lock_t lock;
+
+	struct ahci_cmd_header * cmd_list;
+	uintptr_t cmd_list_phys;
+	uintptr_t fis_phys;
+
+	struct ahci_slot slots[32];
+	uint32_t free;    /* slots no thread is using */
+	uint32_t issued;  /* slots handed to the HBA and not yet completed */
+	list_t * slot_waiter;
+
+	int ncq;
+	int depth;
+	uint64_t sectors;
+};
+
+struct ahci_hba {
+	uint32_t pcidev;
+	uintptr_t mmio;
+	uint32_t cap;
+	int irq;
+	int msi;
+	struct ahci_port * ports[32];
+};
+
+static list_t * ahci_hbas = NULL;
+static uint16_t ahci_irqs_installed = 0;
+static char ahci_drive_char = 'a';
 
 static uint32_t mmio_read4(uintptr_t mmiobase, intptr_t offset) {
 	volatile uint32_t * data = (volatile uint32_t *)(mmiobase + offset);
@@ -36,14 +194,289 @@ static char * ahci_device_name(uint32_t pcidev, int port) {
 	return buf;
 }
 
-#define AHCI_PXCMD_ST    (1 << 0UL)
-#define AHCI_PXCMD_SUD   (1 << 1UL)
-#define AHCI_PXCMD_POD   (1 << 2UL)
-#define AHCI_PXCMD_CLO   (1 << 3UL)
-#define AHCI_PXCMD_FRE   (1 << 4UL)
-#define AHCI_PXCMD_MPSS  (1 << 13UL)
-#define AHCI_PXCMD_FR    (1 << 14UL)
-#define AHCI_PXCMD_CR    (1 << 15UL)
+static void * kvmalloc_p(size_t size, uintptr_t * outphys) {
+	uintptr_t index = mmu_allocate_n_frames((size + 0xFFF) / 0x1000) << 12;
+	*outphys = index;
+	void * out = mmu_map_from_physical(index);
+	memset(out, 0, size);
+	return out;
+}
+
+static void delay_yield(size_t subticks) {
+	unsigned long s, ss;
+	relative_time(0, subticks, &s, &ss);
+	sleep_until((process_t *)this_core->current_process, s, ss);
+	switch_task(0);
+}
+
+/**
+ * Spin until (reg & mask) == value. This is also used from the
+ * interrupt handler, so it can't sleep; the registers it is used
+ * on settle within a few hundred milliseconds at worst.
+ */
+static int ahci_port_spin(struct ahci_port * port, intptr_t reg, uint32_t mask, uint32_t value) {
+	for (int i = 0; i < 10000000; ++i) {
+		if ((mmio_read4(port->mmio, reg) & mask) == value) return 0;
+		asm volatile ("pause" ::: "memory");
+	}
+	return -ETIMEDOUT;
+}
+
+static int ahci_port_stop(struct ahci_port * port) {
+	uint32_t cmd = mmio_read4(port->mmio, AHCI_PXCMD);
+	mmio_write4(port->mmio, AHCI_PXCMD, cmd & ~AHCI_PXCMD_ST);
+	if (ahci_port_spin(port, AHCI_PXCMD, AHCI_PXCMD_CR, 0)) return -ETIMEDOUT;
+	cmd = mmio_read4(port->mmio, AHCI_PXCMD);
+	mmio_write4(port->mmio, AHCI_PXCMD, cmd & ~AHCI_PXCMD_FRE);
+	return ahci_port_spin(port, AHCI_PXCMD, AHCI_PXCMD_FR, 0);
+}
+
+static int ahci_port_start(struct ahci_port * port) {
+	mmio_write4(port->mmio, AHCI_PXCMD, mmio_read4(port->mmio, AHCI_PXCMD) | AHCI_PXCMD_FRE);
+
+	if (mmio_read4(port->mmio, AHCI_PXTFD) & (AHCI_TFD_BSY | AHCI_TFD_DRQ)) {
+		/* Left busy by a failed command; clear it with a command list override */
+		if (port->hba->cap & AHCI_CAP_SCLO) {
+			mmio_write4(port->mmio, AHCI_PXCMD, mmio_read4(port->mmio, AHCI_PXCMD) | AHCI_PXCMD_CLO);
+			ahci_port_spin(port, AHCI_PXCMD, AHCI_PXCMD_CLO, 0);
+		}
+		if (ahci_port_spin(port, AHCI_PXTFD, AHCI_TFD_BSY | AHCI_TFD_DRQ, 0)) return -ETIMEDOUT;
+	}
+
+	mmio_write4(port->mmio, AHCI_PXCMD, mmio_read4(port->mmio, AHCI_PXCMD) | AHCI_PXCMD_ST);
+	return 0;
+}
+
+/**
+ * Mark @p slots as finished and wake up whoever is waiting for
+ * them. Called with the port locked.
+ */
+static void ahci_port_complete(struct ahci_port * port, uint32_t slots, int error) {
+	port->issued &= ~slots;
+	while (slots) {
+		int slot = __builtin_ctz(slots);
+		slots &= ~(1UL << slot);
+		port->slots[slot].error = error;
+		port->slots[slot].done = 1;
+		wakeup_queue(port->slots[slot].waiter);
+	}
+}
+
+/**
+ * After a task file or bus error the port stops processing
+ * commands. Everything outstanding is failed, since with queued
+ * commands there is no cheap way to tell which one went wrong,
+ * and the port is restarted. Called with the port locked.
+ */
+static void ahci_port_recover(struct ahci_port * port, uint32_t is) {
+	dprintf("%s: error (is=%#x tfd=%#x serr=%#x), failing %d commands\n",
+		ahci_device_name(port->hba->pcidev, port->number), is,
+		mmio_read4(port->mmio, AHCI_PXTFD), mmio_read4(port->mmio, AHCI_PXSERR),
+		__builtin_popcount(port->issued));
+
+	ahci_port_stop(port);
+	mmio_write4(port->mmio, AHCI_PXSERR, 0xFFFFFFFF);
+	mmio_write4(port->mmio, AHCI_PXIS, 0xFFFFFFFF);
+	ahci_port_complete(port, port->issued, -EIO);
+	ahci_port_start(port);
+}
+
+static void ahci_port_interrupt(struct ahci_port * port) {
+	uint32_t is = mmio_read4(port->mmio, AHCI_PXIS);
+	mmio_write4(port->mmio, AHCI_PXIS, is);
+
+	spin_lock(port->lock);
+	if (is & AHCI_PXIS_ERRORS) {
+		ahci_port_recover(port, is);
+	} else {
+		uint32_t busy = mmio_read4(port->mmio, AHCI_PXCI);
+		if (port->ncq) busy |= mmio_read4(port->mmio, AHCI_PXSACT);
+		ahci_port_complete(port, port->issued & ~busy, 0);
+	}
+	spin_unlock(port->lock);
+}
+
+static int ahci_irq_handler(struct regs * r) {
+	int irq = r->int_no - 32;
+	int handled = 0;
+
+	foreach(node, ahci_hbas) {
+		struct ahci_hba * hba = node->value;
+		if (hba->irq != irq) continue;
+
+		uint32_t is = mmio_read4(hba->mmio, AHCI_IS);
+		if (!is) continue;
+
+		for (int i = 0; i < 32; ++i) {
+			if ((is & (1UL << i)) && hba->ports[i]) ahci_port_interrupt(hba->ports[i]);
+		}
+
+		mmio_write4(hba->mmio, AHCI_IS, is);
+		handled = 1;
+	}
+
+	if (!handled) return 0;
+	irq_ack(irq);
+	return 1;
+}
+
+/**
+ * Describe @p buf to the HBA in @p table after the @p entries entries
+ * already there, merging pages that are physically adjacent. Returns
+ * the number of entries then in use, or 0 if the buffer can't be
+ * described.
+ */
+static int ahci_prdt_map(struct ahci_port * port, struct ahci_cmd_table * table, int entries, uint8_t * buf, size_t bytes) {
+	while (bytes) {
+		uintptr_t virt = (uintptr_t)buf;
+		uintptr_t phys = mmu_map_to_physical(this_core->current_pml, virt);
+		if (phys >= (uintptr_t)-4) return 0;
+		if (!(port->hba->cap & AHCI_CAP_S64A) && phys >= 0x100000000UL) return 0;
+
+		size_t chunk = 0x1000 - (virt & 0xFFF);
+		if (chunk > bytes) chunk = bytes;
+
+		struct ahci_prd * last = entries ? &table->prdt[entries-1] : NULL;
+		if (last && ((uintptr_t)last->dbau << 32 | last->dba) + last->dbc + 1 == phys &&
+		    last->dbc + 1 + chunk <= AHCI_PRD_MAX) {
+			last->dbc += chunk;
+		} else {
+			if (entries == (int)AHCI_PRDT_MAX) return 0;
+			table->prdt[entries].dba = phys & 0xFFFFFFFF;
+			table->prdt[entries].dbau = phys >> 32;
+			table->prdt[entries].reserved = 0;
+			table->prdt[entries].dbc = chunk - 1;
+			entries++;
+		}
+
+		buf += chunk;
+		bytes -= chunk;
+	}
+
+	return entries;
+}
+
+static void ahci_fis_h2d(struct ahci_cmd_table * table, uint8_t command, uint64_t lba, uint16_t count, uint16_t features, uint8_t device) {
+	uint8_t * fis = table->cfis;
+	memset(fis, 0, 20);
+	fis[0] = FIS_TYPE_REG_H2D;
+	fis[1] = 0x80; /* command, not control */
+	fis[2] = command;
+	fis[3] = features & 0xFF;
+	fis[4] = lba & 0xFF;
+	fis[5] = (lba >> 8) & 0xFF;
+	fis[6] = (lba >> 16) & 0xFF;
+	fis[7] = device;
+	fis[8] = (lba >> 24) & 0xFF;
+	fis[9] = (lba >> 32) & 0xFF;
+	fis[10] = (lba >> 40) & 0xFF;
+	fis[11] = (features >> 8) & 0xFF;
+	fis[12] = count & 0xFF;
+	fis[13] = (count >> 8) & 0xFF;
+}
+
+/**
+ * Carry out a request from the block layer, with one command covering
+ * it and everything merged into it. Any number of threads can be in
+ * here at once; each takes a free slot, or waits for one.
+ */
+static int ahci_port_transfer(struct blkdev * dev, struct blk_request * req) {
+	struct ahci_port * port = dev->driver;
+	uint64_t lba = req->sector;
+	unsigned int sectors = req->span;
+	int write = req->write;
+
+	spin_lock(port->lock);
+	while (!port->free) {
+		sleep_on_unlocking(port->slot_waiter, &port->lock);
+		spin_lock(port->lock);
+	}
+	int slot = __builtin_ctz(port->free);
+	port->free &= ~(1UL << slot);
+	spin_unlock(port->lock);
+
+	struct ahci_slot * s = &port->slots[slot];
+	struct ahci_cmd_header * header = &port->cmd_list[slot];
+
+	int entries = 0;
+	for (struct blk_request * piece = req; piece; piece = piece->merged) {
+		entries = ahci_prdt_map(port, s->table, entries, piece->buffer, piece->count * AHCI_SECTOR_SIZE);
+		if (!entries) break;
+	}
+	int error = 0;
+
+	if (!entries) {
+		error = -EFAULT;
+		spin_lock(port->lock);
+		goto _release;
+	}
+
+	if (port->ncq) {
+		/* Count goes in the features register; the tag goes in the count register. */
+		ahci_fis_h2d(s->table, write ? ATA_CMD_WRITE_FPDMA_QUEUED : ATA_CMD_READ_FPDMA_QUEUED,
+			lba, slot << 3, sectors, 0x40);
+	} else {
+		ahci_fis_h2d(s->table, write ? ATA_CMD_WRITE_DMA_EXT : ATA_CMD_READ_DMA_EXT,
+			lba, sectors, 0, 0x40);
+	}
+
+	header->flags = AHCI_CMD_CFL_H2D | (write ? AHCI_CMD_WRITE : 0);
+	header->prdtl = entries;
+	header->prdbc = 0;
+
+	spin_lock(port->lock);
+	s->done = 0;
+	port->issued |= (1UL << slot);
+	asm volatile ("" ::: "memory");
+	if (port->ncq) mmio_write4(port->mmio, AHCI_PXSACT, 1UL << slot);
+	mmio_write4(port->mmio, AHCI_PXCI, 1UL << slot);
+
+	while (!s->done) {
+		/* The command can't be taken back, so signals just mean going back to sleep. */
+		sleep_on_unlocking(s->waiter, &port->lock);
+		spin_lock(port->lock);
+	}
+	error = s->error;
+
+_release:
+	port->free |= (1UL << slot);
+	wakeup_queue(port->slot_waiter);
+	spin_unlock(port->lock);
+	return error;
+}
+
+/**
+ * Issue IDENTIFY DEVICE before interrupts are enabled, and
+ * poll for it to finish.
+ */
+static int ahci_port_identify(struct ahci_port * port, uint16_t * identify) {
+	struct ahci_slot * s = &port->slots[0];
+	struct ahci_cmd_header * header = &port->cmd_list[0];
+
+	int entries = ahci_prdt_map(port, s->table, 0, (uint8_t *)identify, 512);
+	if (!entries) return -EFAULT;
+
+	ahci_fis_h2d(s->table, ATA_CMD_IDENTIFY, 0, 0, 0, 0);
+	header->flags = AHCI_CMD_CFL_H2D;
+	header->prdtl = entries;
+	header->prdbc = 0;
+
+	mmio_write4(port->mmio, AHCI_PXCI, 1);
+
+	for (int i = 0; i < 100; ++i) {
+		if (!(mmio_read4(port->mmio, AHCI_PXCI) & 1)) break;
+		delay_yield(10000);
+	}
+
+	if ((mmio_read4(port->mmio, AHCI_PXCI) & 1) ||
+	    (mmio_read4(port->mmio, AHCI_PXTFD) & AHCI_TFD_ERR) ||
+	    (mmio_read4(port->mmio, AHCI_PXIS) & AHCI_PXIS_ERRORS)) {
+		return -EIO;
+	}
+
+	mmio_write4(port->mmio, AHCI_PXIS, 0xFFFFFFFF);
+	return 0;
+}
 
 #define DPRINT(fmt,...) fprintf(stderr, "%s: " fmt, ahci_device_name(pcidev,port), ##__VA_ARGS__)
 static void ahci_setup_atapi(fs_node_t * stderr, uint32_t pcidev, uintptr_t mmio_addr, int port) {
@@ -66,6 +499,112 @@ static void ahci_setup_atapi(fs_node_t * stderr, uint32_t pcidev, uintptr_t mmio
 	}
 }
 
+/**
+ * Bring up the disk on @p port: give it a command list and FIS
+ * area, identify it, work out how many commands it can have in
+ * flight, and make it available as /dev/sdX.
+ */
+static void ahci_setup_disk(fs_node_t * stderr, struct ahci_hba * hba, int port) {
+	uint32_t pcidev = hba->pcidev;
+	uint32_t ssts = mmio_read4(hba->mmio, 0x100 + port * 0x80 + AHCI_PXSSTS);
+	if ((ssts & 0xF) != 3) {
+		DPRINT("no link (ssts=%#x)\n", ssts);
+		return;
+	}
+
+	struct ahci_port * p = calloc(sizeof(struct ahci_port), 1);
+	p->hba = hba;
+	p->mmio = hba->mmio + 0x100 + port * 0x80;
+	p->number = port;
+	spin_init(p->lock);
+	p->slot_waiter = list_create("ahci slot waiters", p);
+
+	if (ahci_port_stop(p)) {
+		DPRINT("port did not stop\n");
+		free(p);
+		return;
+	}
+
+	/* Command list (1KiB) and received FIS area (256 bytes) share a page */
+	p->cmd_list = kvmalloc_p(0x1000, &p->cmd_list_phys);
+	p->fis_phys = p->cmd_list_phys + 0x400;
+
+	int slots = AHCI_CAP_NCS(hba->cap);
+	for (int i = 0; i < slots; ++i) {
+		p->slots[i].table = kvmalloc_p(0x1000, &p->slots[i].table_phys);
+		p->slots[i].waiter = list_create("ahci command waiter", p);
+		p->cmd_list[i].ctba = p->slots[i].table_phys & 0xFFFFFFFF;
+		p->cmd_list[i].ctbau = p->slots[i].table_phys >> 32;
+	}
+
+	mmio_write4(p->mmio, AHCI_PXCLB, p->cmd_list_phys & 0xFFFFFFFF);
+	mmio_write4(p->mmio, AHCI_PXCLBU, p->cmd_list_phys >> 32);
+	mmio_write4(p->mmio, AHCI_PXFB, p->fis_phys & 0xFFFFFFFF);
+	mmio_write4(p->mmio, AHCI_PXFBU, p->fis_phys >> 32);
+	mmio_write4(p->mmio, AHCI_PXSERR, 0xFFFFFFFF);
+	mmio_write4(p->mmio, AHCI_PXIS, 0xFFFFFFFF);
+	mmio_write4(p->mmio, AHCI_PXIE, 0);
+
+	if (ahci_port_start(p)) {
+		DPRINT("port did not start\n");
+		return;
+	}
+
+	uintptr_t identify_phys;
+	uint16_t * identify = kvmalloc_p(0x1000, &identify_phys);
+	if (ahci_port_identify(p, identify)) {
+		DPRINT("IDENTIFY failed\n");
+		ahci_port_stop(p);
+		return;
+	}
+
+	char model[41];
+	for (int i = 0; i < 20; ++i) {
+		model[i*2] = identify[27+i] >> 8;
+		model[i*2+1] = identify[27+i] & 0xFF;
+	}
+	model[40] = '\0';
+	for (int i = 39; i >= 0 && model[i] == ' '; --i) model[i] = '\0';
+
+	if (identify[83] & (1 << 10)) {
+		p->sectors = (uint64_t)identify[100] | ((uint64_t)identify[101] << 16) |
+			((uint64_t)identify[102] << 32) | ((uint64_t)identify[103] << 48);
+	} else {
+		p->sectors = (uint64_t)identify[60] | ((uint64_t)identify[61] << 16);
+	}
+
+	if ((hba->cap & AHCI_CAP_SNCQ) && (identify[76] & (1 << 8))) {
+		p->ncq = 1;
+		p->depth = (identify[75] & 0x1F) + 1;
+		if (p->depth > slots) p->depth = slots;
+	} else {
+		p->depth = 1; /* plain DMA commands are not queued by the drive */
+	}
+	p->free = p->depth == 32 ? 0xFFFFFFFF : ((1UL << p->depth) - 1);
+
+	DPRINT("%s, %lu sectors, %s, %d commands in flight\n", model, p->sectors,
+		p->ncq ? "NCQ" : "no NCQ", p->depth);
+
+	mmio_write4(p->mmio, AHCI_PXIS, 0xFFFFFFFF);
+	mmio_write4(p->mmio, AHCI_PXIE, AHCI_PXIE_ENABLE);
+	hba->ports[port] = p;
+
+	char devname[20];
+	snprintf(devname, 20, "sd%c", ahci_drive_char);
+	struct blkdev * blk = blkdev_create(devname, AHCI_SECTOR_SIZE, p->sectors);
+	blk->driver = p;
+	blk->transfer = ahci_port_transfer;
+	blk->max_sectors = AHCI_MAX_SECTORS;
+	blk->max_pieces = AHCI_MAX_PIECES;
+	blk->depth = p->depth;
+	blk->align = 1;
+
+	snprintf(devname, 20, "/dev/sd%c", ahci_drive_char);
+	vfs_mount(devname, blkdev_register(blk));
+	DPRINT("mounted as %s\n", devname);
+	ahci_drive_char++;
+}
+
 static void find_ahci(uint32_t device, uint16_t vendorid, uint16_t deviceid, void * extra) {
 	if (pci_find_type(device) != 0x0106) return; /* Mass Storage, SATA controller */
 	if (pci_read_field(device, PCI_PROG_IF, 1) != 0x01) return; /* AHCI */
@@ -76,63 +615,71 @@ static void find_ahci(uint32_t device, uint16_t vendorid, uint16_t deviceid, voi
 	uint16_t command_reg = pci_read_field(device, PCI_COMMAND, 2);
 	command_reg |= (1 << 2);
 	command_reg |= (1 << 1);
-	command_reg ^= (1 << 10);
+	command_reg &= ~PCI_COMMAND_INTX_DISABLE;
 	pci_write_field(device, PCI_COMMAND, 2, command_reg);
 
-	fprintf(stderr, "ahci: examining PCI config space...\n");
-	fprintf(stderr, "ahci: interrupt line = %d\n", pci_get_interrupt(device));
-	fprintf(stderr, "ahci: BAR5 = %#x\n", pci_read_field(device, PCI_BAR5, 4));
-
-	uintptr_t mmio_addr = (uintptr_t)mmu_map_mmio_region(pci_read_field(device, PCI_BAR5, 4) & 0xFFFFFFF0, 0x2000); /* I have no idea how much space this needs */
-	fprintf(stderr, "ahci: mapping mmio to %#zx\n", mmio_addr);
+	struct ahci_hba * hba = calloc(sizeof(struct ahci_hba), 1);
+	hba->pcidev = device;
+	hba->irq = pci_get_interrupt(device);
+	hba->mmio = (uintptr_t)mmu_map_mmio_region(pci_read_field(device, PCI_BAR5, 4) & 0xFFFFFFF0, 0x2000);
 
-	uint32_t enabledPorts = mmio_read4(mmio_addr, 0x0C);
-	fprintf(stderr, "ahci: implemented ports = %#x\n", enabledPorts);
+	if (hba->irq >= 16) {
+		fprintf(stderr, "ahci: no usable interrupt line (%d)\n", hba->irq);
+		free(hba);
+		return;
+	}
 
-	uint32_t ahciVersion = mmio_read4(mmio_addr, 0x10);
-	fprintf(stderr, "ahci: version %d.%d%d\n",
+	uint32_t enabledPorts = mmio_read4(hba->mmio, AHCI_PI);
+	uint32_t ahciVersion = mmio_read4(hba->mmio, AHCI_VS);
+	fprintf(stderr, "ahci: version %d.%d%d, implemented ports = %#x, irq %d\n",
 		(ahciVersion >> 16) & 0xFFF,
 		(ahciVersion >> 8) & 0xFF,
-		(ahciVersion) & 0xFF);
+		(ahciVersion) & 0xFF,
+		enabledPorts, hba->irq);
 
-	fprintf(stderr, "ahci: Telling host controller we are aware of it.\n");
-	mmio_write4(mmio_addr, 0x04, mmio_read4(mmio_addr, 0x04) | (1 << 31UL));
+	/* Telling host controller we are aware of it. */
+	mmio_write4(hba->mmio, AHCI_GHC, mmio_read4(hba->mmio, AHCI_GHC) | AHCI_GHC_AE);
+	hba->cap = mmio_read4(hba->mmio, AHCI_CAP);
 
-	int offset = 0x100;
 	for (int port = 0; port < 32; ++port) {
-		if (enabledPorts & (1UL << port)) {
-			/* Check status */
-			uint32_t portSig    = mmio_read4(mmio_addr, offset + 0x24);
-			uint32_t portStatus = mmio_read4(mmio_addr, offset + 0x28);
-			fprintf(stderr, "ahci: port %d: status = %#x\n", port, portStatus);
-			fprintf(stderr, "ahci: port %d: sig    = %#x\n", port, portSig);
-
-			switch (portSig) {
-				case 0xeb140101:
-					fprintf(stderr, "ahci:           ATAPI (CD, DVD)\n");
-					ahci_setup_atapi(stderr, device, mmio_addr, port);
-					break;
-				case 0x00000101:
-					fprintf(stderr, "ahci:           hard disk\n");
-					break;
-				case 0xffff0101:
-					fprintf(stderr, "ahci:           no device\n");
-					break;
-				default:
-					fprintf(stderr, "ahci:           unsupported/unknown\n");
-					break;
-			}
+		if (!(enabledPorts & (1UL << port))) continue;
 
+		uint32_t portSig = mmio_read4(hba->mmio, 0x100 + port * 0x80 + AHCI_PXSIG);
+		switch (portSig) {
+			case AHCI_SIG_ATAPI:
+				ahci_setup_atapi(stderr, device, hba->mmio, port);
+				break;
+			case AHCI_SIG_ATA:
+				ahci_setup_disk(stderr, hba, port);
+				break;
+			case 0xffff0101:
+				break; /* no device */
+			default:
+				fprintf(stderr, "ahci: port %d: unsupported signature %#x\n", port, portSig);
+				break;
 		}
-		offset += 0x80;
 	}
 
+	uint64_t msi_address;
+	uint32_t msi_data;
+	if (!msi_message(hba->irq, &msi_address, &msi_data) && !pci_enable_msi(device, msi_address, msi_data)) {
+		hba->msi = 1;
+	}
+	fprintf(stderr, "ahci: completions by %s\n", hba->msi ? "MSI" : "legacy interrupt");
 
-	
+	list_insert(ahci_hbas, hba);
+	if (!(ahci_irqs_installed & (1 << hba->irq))) {
+		ahci_irqs_installed |= (1 << hba->irq);
+		irq_install_handler(hba->irq, ahci_irq_handler, "ahci");
+	}
+
+	mmio_write4(hba->mmio, AHCI_IS, 0xFFFFFFFF);
+	mmio_write4(hba->mmio, AHCI_GHC, mmio_read4(hba->mmio, AHCI_GHC) | AHCI_GHC_IE);
 }
 
 static int init(int argc, char * argv[]) {
 	fs_node_t * node = FD_ENTRY(1); /* Get the stdout for the process that loaded the module */
+	ahci_hbas = list_create("ahci controllers", NULL);
 	pci_scan(find_ahci, -1, node);
 	return 0;
 }
@@ -146,4 +693,3 @@ struct Module metadata = {
 	.init = init,
 	.fini = fini,
 };
-
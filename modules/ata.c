@@ -27,12 +27,11 @@
 #include <kernel/time.h>
 #include <kernel/misc.h>
 #include <kernel/mutex.h>
+#include <kernel/blkdev.h>
 
 #include <kernel/arch/x86_64/ports.h>
 #include <kernel/arch/x86_64/irq.h>
 
-#include <sys/ioctl.h>
-
 #define ATA_SR_BSY     0x80
 #define ATA_SR_DRDY    0x40
 #define ATA_SR_DF      0x20
@@ -154,7 +153,6 @@ typedef struct {
 static char ata_drive_char = 'a';
 static int  cdrom_number = 0;
 static uint32_t ata_pci = 0x00000000;
-static list_t * atapi_waiter;
 static int  found_something = 0;
 
 typedef union {
@@ -169,11 +167,51 @@ static void find_ata_pci(uint32_t device, uint16_t vendorid, uint16_t deviceid,
 	}
 }
 
+/* Physical region descriptor; the table may not cross a 64KiB boundary */
 typedef struct {
-	uintptr_t offset;
-	uint16_t bytes;
+	uint32_t offset;
+	uint16_t bytes; /* 0 means 64KiB */
 	uint16_t last;
-} prdt_t;
+} __attribute__((packed)) prdt_t;
+
+#define ATA_PRDT_MAX 64
+#define ATA_PRDT_EOT 0x8000
+
+/* Bus master registers, relative to a channel's base */
+#define ATA_BM_COMMAND 0x00
+#define ATA_BM_STATUS  0x02
+#define ATA_BM_PRDT    0x04
+
+#define ATA_BM_CMD_START 0x01
+#define ATA_BM_CMD_READ  0x08 /* device to memory */
+#define ATA_BM_SR_ERR    0x02
+#define ATA_BM_SR_IRQ    0x04
+
+/**
+ * An IDE channel runs one command at a time, so it is the channel
+ * rather than the drive that owns the lock, the interrupt and the
+ * DMA tables. The two channels are independent of each other.
+ */
+struct ata_channel {
+	uint16_t io_base;
+	uint16_t bmide;
+	int irq;
+	sched_mutex_t * lock;
+	spin_lock_t irq_lock;
+	list_t * waiter;
+	volatile int irq_done;
+	uint8_t dma_status;
+	uint8_t status;
+	prdt_t * prdt;
+	uintptr_t prdt_phys;
+	uint8_t * bounce;
+	uintptr_t bounce_phys;
+};
+
+static struct ata_channel ata_channels[2] = {
+	{.io_base = 0x1F0, .irq = 14},
+	{.io_base = 0x170, .irq = 15},
+};
 
 struct ata_device {
 	int io_base;
@@ -181,50 +219,24 @@ struct ata_device {
 	int slave;
 	int is_atapi;
 	ata_identify_t identity;
-	prdt_t * dma_prdt;
-	uintptr_t dma_prdt_phys;
-	uint8_t * dma_start;
-	uintptr_t dma_start_phys;
-	uint32_t bar4;
+	struct ata_channel * channel;
 	uint32_t atapi_lba;
 	uint32_t atapi_sector_size;
 };
 
-static struct ata_device ata_primary_master   = {.io_base = 0x1F0, .control = 0x3F6, .slave = 0};
-static struct ata_device ata_primary_slave    = {.io_base = 0x1F0, .control = 0x3F6, .slave = 1};
-static struct ata_device ata_secondary_master = {.io_base = 0x170, .control = 0x376, .slave = 0};
-static struct ata_device ata_secondary_slave  = {.io_base = 0x170, .control = 0x376, .slave = 1};
-
-static spin_lock_t atapi_cmd_lock = { 0 };
+static struct ata_device ata_primary_master   = {.io_base = 0x1F0, .control = 0x3F6, .slave = 0, .channel = &ata_channels[0]};
+static struct ata_device ata_primary_slave    = {.io_base = 0x1F0, .control = 0x3F6, .slave = 1, .channel = &ata_channels[0]};
+static struct ata_device ata_secondary_master = {.io_base = 0x170, .control = 0x376, .slave = 0, .channel = &ata_channels[1]};
+static struct ata_device ata_secondary_slave  = {.io_base = 0x170, .control = 0x376, .slave = 1, .channel = &ata_channels[1]};
 
 /* TODO support other sector sizes */
 #define ATA_SECTOR_SIZE 512
-#define ATA_CACHE_SIZE  4096
-#define SECTORS_PER_CACHE_BLOCK 8
-
-static void ata_device_read_sector(struct ata_device * dev, uint64_t lba, uint8_t * buf);
-static void ata_device_read_sector_atapi(struct ata_device * dev, uint64_t lba, uint8_t * buf);
-static void ata_device_write_sector(struct ata_device * dev, uint64_t lba, uint8_t * buf);
-static void ata_device_write_sector_actual(struct ata_device * dev, uint64_t lba);
-
-struct CacheEntry {
-	struct ata_device * dev;
-	uint64_t lba;
-	uint64_t last_use;
-	uint64_t flags;
-};
 
-#define CACHE_COUNT 4096
+/* Largest single command: 128KiB, which is what each channel's bounce buffer holds */
+#define ATA_MAX_SECTORS 256
 
-static uint64_t hit_count = 0;
-static uint64_t miss_count = 0;
-static uint64_t eviction_count = 0;
-static uint64_t write_count = 0;
-static sched_mutex_t * ata_mutex = NULL;
-
-static struct CacheEntry * cache_entries = NULL;
-static char * cache_blocks = NULL;
-static uint64_t counter = 1;
+static void ata_device_read_sector_atapi(struct ata_device * dev, uint64_t lba, uint8_t * buf);
+static int ata_device_transfer(struct blkdev * blk, struct blk_request * req);
 
 static off_t ata_max_offset(struct ata_device * dev) {
 	uint64_t sectors = dev->identity.sectors_48;
@@ -245,57 +257,6 @@ static off_t atapi_max_offset(struct ata_device * dev) {
 	return (max_sector + 1) * dev->atapi_sector_size;
 }
 
-static ssize_t read_ata(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
-	struct ata_device * dev = (struct ata_device *)node->device;
-	unsigned int start_block = offset / ATA_CACHE_SIZE;
-	unsigned int end_block = (offset + size - 1) / ATA_CACHE_SIZE;
-	unsigned int x_offset = 0;
-
-
-	if (offset > ata_max_offset(dev)) {
-		return 0;
-	}
-
-	if (offset + (ssize_t)size > ata_max_offset(dev)) {
-		unsigned int i = ata_max_offset(dev) - offset;
-		size = i;
-	}
-
-	if (offset % ATA_CACHE_SIZE || size < ATA_CACHE_SIZE) {
-		unsigned int prefix_size = (ATA_CACHE_SIZE - (offset % ATA_CACHE_SIZE));
-		if (prefix_size > size) prefix_size = size;
-		char * tmp = malloc(ATA_CACHE_SIZE);
-		ata_device_read_sector(dev, start_block, (uint8_t *)tmp);
-
-		memcpy(buffer, (void *)((uintptr_t)tmp + ((uintptr_t)offset % ATA_CACHE_SIZE)), prefix_size);
-
-		free(tmp);
-
-		x_offset += prefix_size;
-		start_block++;
-	}
-
-	if ((offset + size)  % ATA_CACHE_SIZE && start_block <= end_block) {
-		unsigned int postfix_size = (offset + size) % ATA_CACHE_SIZE;
-		char * tmp = malloc(ATA_CACHE_SIZE);
-		ata_device_read_sector(dev, end_block, (uint8_t *)tmp);
-
-		memcpy((void *)((uintptr_t)buffer + size - postfix_size), tmp, postfix_size);
-
-		free(tmp);
-
-		end_block--;
-	}
-
-	while (start_block <= end_block) {
-		ata_device_read_sector(dev, start_block, (uint8_t *)((uintptr_t)buffer + x_offset));
-		x_offset += ATA_CACHE_SIZE;
-		start_block++;
-	}
-
-	return size;
-}
-
 static ssize_t read_atapi(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
 
 	struct ata_device * dev = (struct ata_device *)node->device;
@@ -350,60 +311,6 @@ static ssize_t read_atapi(fs_node_t *node, off_t offset, size_t size, uint8_t *b
 }
 
 
-static ssize_t write_ata(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
-	struct ata_device * dev = (struct ata_device *)node->device;
-
-	unsigned int start_block = offset / ATA_CACHE_SIZE;
-	unsigned int end_block = (offset + size - 1) / ATA_CACHE_SIZE;
-
-	unsigned int x_offset = 0;
-
-	if (offset > ata_max_offset(dev)) {
-		return 0;
-	}
-
-	if (offset + (ssize_t)size > ata_max_offset(dev)) {
-		unsigned int i = ata_max_offset(dev) - offset;
-		size = i;
-	}
-
-	if (offset % ATA_CACHE_SIZE) {
-		unsigned int prefix_size = (ATA_CACHE_SIZE - (offset % ATA_CACHE_SIZE));
-
-		char * tmp = malloc(ATA_CACHE_SIZE);
-		ata_device_read_sector(dev, start_block, (uint8_t *)tmp);
-
-		memcpy((void *)((uintptr_t)tmp + ((uintptr_t)offset % ATA_CACHE_SIZE)), buffer, prefix_size);
-		ata_device_write_sector(dev, start_block, (uint8_t *)tmp);
-
-		free(tmp);
-		x_offset += prefix_size;
-		start_block++;
-	}
-
-	if ((offset + size)  % ATA_CACHE_SIZE && start_block <= end_block) {
-		unsigned int postfix_size = (offset + size) % ATA_CACHE_SIZE;
-
-		char * tmp = malloc(ATA_CACHE_SIZE);
-		ata_device_read_sector(dev, end_block, (uint8_t *)tmp);
-
-		memcpy(tmp, (void *)((uintptr_t)buffer + size - postfix_size), postfix_size);
-
-		ata_device_write_sector(dev, end_block, (uint8_t *)tmp);
-
-		free(tmp);
-		end_block--;
-	}
-
-	while (start_block <= end_block) {
-		ata_device_write_sector(dev, start_block, (uint8_t *)((uintptr_t)buffer + x_offset));
-		x_offset += ATA_CACHE_SIZE;
-		start_block++;
-	}
-
-	return size;
-}
-
 static void open_ata(fs_node_t * node, unsigned int flags) {
 	return;
 }
@@ -412,38 +319,6 @@ static void close_ata(fs_node_t * node) {
 	return;
 }
 
-static int ioctl_ata(fs_node_t * node, unsigned long request, void * argp) {
-	struct ata_device * dev = (struct ata_device *)node->device;
-
-	switch (request) {
-		case IOCTLSYNC: {
-			mutex_acquire(ata_mutex);
-			for (int i = 0; i < CACHE_COUNT; ++i) {
-				if (cache_entries[i].dev == dev && cache_entries[i].flags & 1) {
-					eviction_count++;
-					memcpy(cache_entries[i].dev->dma_start, cache_blocks + i * ATA_CACHE_SIZE, ATA_CACHE_SIZE);
-					ata_device_write_sector_actual(cache_entries[i].dev, cache_entries[i].lba);
-					cache_entries[i].flags = 0;
-				}
-			}
-			mutex_release(ata_mutex);
-			return 0;
-		}
-
-		case 0x2A01234UL: {
-			uint64_t * args = argp;
-			memcpy(&args[0], &hit_count, sizeof(uint64_t));
-			memcpy(&args[1], &miss_count, sizeof(uint64_t));
-			memcpy(&args[2], &eviction_count, sizeof(uint64_t));
-			memcpy(&args[3], &write_count, sizeof(uint64_t));
-			return 0;
-		}
-
-		default:
-			return -EINVAL;
-	}
-}
-
 static fs_node_t * atapi_device_create(struct ata_device * device) {
 	fs_node_t * fnode = malloc(sizeof(fs_node_t));
 	memset(fnode, 0x00, sizeof(fs_node_t));
@@ -465,27 +340,6 @@ static fs_node_t * atapi_device_create(struct ata_device * device) {
 	return fnode;
 }
 
-static fs_node_t * ata_device_create(struct ata_device * device) {
-	fs_node_t * fnode = malloc(sizeof(fs_node_t));
-	memset(fnode, 0x00, sizeof(fs_node_t));
-	fnode->inode = 0;
-	snprintf(fnode->name, 10, "atadev%d", ata_drive_char - 'a');
-	fnode->device  = device;
-	fnode->uid = 0;
-	fnode->gid = 0;
-	fnode->mask    = 0660;
-	fnode->length  = ata_max_offset(device); /* TODO */
-	fnode->flags   = FS_BLOCKDEVICE;
-	fnode->read    = read_ata;
-	fnode->write   = write_ata;
-	fnode->open    = open_ata;
-	fnode->close   = close_ata;
-	fnode->readdir = NULL;
-	fnode->finddir = NULL;
-	fnode->ioctl   = ioctl_ata; /* TODO, identify, etc? */
-	return fnode;
-}
-
 static void ata_io_wait(struct ata_device * dev) {
 	inportb(dev->io_base + ATA_REG_ALTSTATUS);
 	inportb(dev->io_base + ATA_REG_ALTSTATUS);
@@ -527,18 +381,54 @@ static void ata_soft_reset(struct ata_device * dev) {
 	outportb(dev->control, 0x00);
 }
 
-static int ata_irq_handler(struct regs *r) {
-	struct ata_device * dev = r->int_no == 14 ? &ata_primary_master : &ata_secondary_master;
-	inportb(dev->io_base + ATA_REG_STATUS);
+/**
+ * Note the completion of whatever the channel was doing, and wake
+ * up the thread waiting for it. Reading the status register is
+ * what tells the drive its interrupt has been seen.
+ */
+static void ata_channel_interrupt(struct ata_channel * ch) {
+	uint8_t dma_status = ch->bmide ? inportb(ch->bmide + ATA_BM_STATUS) : 0;
+	uint8_t status = inportb(ch->io_base + ATA_REG_STATUS);
+
+	spin_lock(ch->irq_lock);
+	ch->dma_status = dma_status;
+	ch->status = status;
+	ch->irq_done = 1;
+	wakeup_queue(ch->waiter);
+	spin_unlock(ch->irq_lock);
+
+	irq_ack(ch->irq);
+}
 
-	spin_lock(atapi_cmd_lock);
-	wakeup_queue(atapi_waiter);
-	spin_unlock(atapi_cmd_lock);
-	irq_ack(r->int_no);
+static int ata_irq_primary(struct regs *r) {
+	ata_channel_interrupt(&ata_channels[0]);
+	return 1;
+}
 
+static int ata_irq_secondary(struct regs *r) {
+	ata_channel_interrupt(&ata_channels[1]);
 	return 1;
 }
 
+/**
+ * Commands that finish with an interrupt are issued between these:
+ * arm, with the channel lock held, then wait, which sleeps until
+ * the interrupt handler has run.
+ */
+static void ata_channel_arm(struct ata_channel * ch) {
+	spin_lock(ch->irq_lock);
+	ch->irq_done = 0;
+}
+
+static void ata_channel_wait(struct ata_channel * ch) {
+	while (!ch->irq_done) {
+		/* The transfer can't be abandoned, so signals just mean going back to sleep. */
+		sleep_on_unlocking(ch->waiter, &ch->irq_lock);
+		spin_lock(ch->irq_lock);
+	}
+	spin_unlock(ch->irq_lock);
+}
+
 static void * kvmalloc_p(size_t size, uintptr_t * outphys) {
 	uintptr_t index = mmu_allocate_n_frames(size / 0x1000) << 12;
 	*outphys = index;
@@ -573,25 +463,36 @@ static void ata_device_init(struct ata_device * dev) {
 	}
 
 	dev->is_atapi = 0;
-	dev->dma_prdt  = (void *)kvmalloc_p(4096, &dev->dma_prdt_phys);
-	dev->dma_start = (void *)kvmalloc_p(4096, &dev->dma_start_phys);
-	dev->dma_prdt[0].offset = dev->dma_start_phys;
-	dev->dma_prdt[0].bytes = ATA_CACHE_SIZE;
-	dev->dma_prdt[0].last = 0x8000;
-
-	uint16_t command_reg = pci_read_field(ata_pci, PCI_COMMAND, 4);
-	if (!(command_reg & (1 << 2))) {
-		command_reg |= (1 << 2); /* bit 2 */
-		pci_write_field(ata_pci, PCI_COMMAND, 4, command_reg);
-		command_reg = pci_read_field(ata_pci, PCI_COMMAND, 4);
+}
+
+/**
+ * Find the bus master registers and set up DMA tables for both
+ * channels. The bounce buffer is used when a caller's buffer
+ * can't be handed to the controller directly.
+ */
+static void ata_channels_init(void) {
+	uint32_t bar4 = 0;
+
+	if (ata_pci) {
+		uint16_t command_reg = pci_read_field(ata_pci, PCI_COMMAND, 4);
+		if (!(command_reg & (1 << 2))) {
+			command_reg |= (1 << 2); /* bit 2 */
+			pci_write_field(ata_pci, PCI_COMMAND, 4, command_reg);
+		}
+		bar4 = pci_read_field(ata_pci, PCI_BAR4, 4);
 	}
 
-	dev->bar4 = pci_read_field(ata_pci, PCI_BAR4, 4);
+	for (int i = 0; i < 2; ++i) {
+		struct ata_channel * ch = &ata_channels[i];
+		ch->lock = mutex_init(i ? "ata secondary" : "ata primary");
+		ch->waiter = list_create(i ? "ata secondary waiter" : "ata primary waiter", ch);
+		spin_init(ch->irq_lock);
 
-	if (dev->bar4 & 0x00000001) {
-		dev->bar4 = dev->bar4 & 0xFFFFFFFC;
-	} else {
-		return; /* No DMA because we're not sure what to do here */
+		if (!(bar4 & 0x00000001)) continue; /* No DMA because we're not sure what to do here */
+
+		ch->bmide = (bar4 & 0xFFFFFFFC) + (i ? 8 : 0);
+		ch->prdt = kvmalloc_p(0x1000, &ch->prdt_phys);
+		ch->bounce = kvmalloc_p(ATA_MAX_SECTORS * ATA_SECTOR_SIZE, &ch->bounce_phys);
 	}
 }
 
@@ -725,10 +626,15 @@ static int ata_device_detect(struct ata_device * dev) {
 		}
 
 		char devname[64];
-		snprintf((char *)&devname, 20, "/dev/hd%c", ata_drive_char);
-		fs_node_t * node = ata_device_create(dev);
-		vfs_mount(devname, node);
-		node->length  = sectors;
+		snprintf(devname, 20, "hd%c", ata_drive_char);
+		struct blkdev * blk = blkdev_create(devname, ATA_SECTOR_SIZE, sectors / ATA_SECTOR_SIZE);
+		blk->driver = dev;
+		blk->transfer = ata_device_transfer;
+		blk->max_sectors = ATA_MAX_SECTORS;
+		blk->align = 3;
+
+		snprintf(devname, 20, "/dev/hd%c", ata_drive_char);
+		vfs_mount(devname, blkdev_register(blk));
 
 		ata_drive_char++;
 		found_something = 1;
@@ -754,25 +660,90 @@ static int ata_device_detect(struct ata_device * dev) {
 	return 0;
 }
 
-static void ata_device_read_sector_actual(struct ata_device * dev, uint64_t lba) {
-	uint16_t bus = dev->io_base;
-	uint8_t slave = dev->slave;
+/**
+ * Describe @p buf to the controller, after the @p entries entries
+ * already in the channel's table. Each page is looked up separately,
+ * and neighbours are merged where they are physically adjacent.
+ * Returns the number of entries then in use, or 0 if the buffer
+ * can't be used directly: it is in userspace, oddly aligned, or
+ * somewhere the 32-bit PRDs can't reach.
+ */
+static int ata_prdt_map(struct ata_channel * ch, int entries, uint8_t * buf, size_t bytes) {
+	if ((uintptr_t)buf < 0xFFFF800000000000UL || ((uintptr_t)buf & 3)) return 0;
+
+	while (bytes) {
+		uintptr_t virt = (uintptr_t)buf;
+		uintptr_t phys = mmu_map_to_physical(this_core->current_pml, virt);
+		if (phys >= 0x100000000UL) return 0;
+
+		size_t chunk = 0x1000 - (virt & 0xFFF);
+		if (chunk > bytes) chunk = bytes;
+
+		prdt_t * last = entries ? &ch->prdt[entries-1] : NULL;
+		size_t length = last ? (last->bytes ? last->bytes : 0x10000) : 0;
+		if (last && last->offset + length == phys &&
+		    ((phys + chunk - 1) & ~0xFFFFUL) == (last->offset & ~0xFFFFUL)) {
+			last->bytes = (length + chunk) & 0xFFFF;
+		} else {
+			if (entries == ATA_PRDT_MAX) return 0;
+			ch->prdt[entries].offset = phys;
+			ch->prdt[entries].bytes = chunk & 0xFFFF;
+			ch->prdt[entries].last = 0;
+			entries++;
+		}
 
-	if (dev->is_atapi) return;
+		buf += chunk;
+		bytes -= chunk;
+	}
 
-	ata_wait(dev, 0);
+	return entries;
+}
 
-	/* Stop */
-	outportb(dev->bar4, 0x00);
+/**
+ * Move the sectors of @p req, and everything merged into it, between
+ * their buffers and the disk with a single DMA command, then sleep
+ * until the drive interrupts. Buffers the controller can't reach go
+ * through the channel's bounce buffer. Must be called with the
+ * channel locked.
+ */
+static int ata_device_dma(struct ata_device * dev, struct blk_request * req, int direction) {
+	struct ata_channel * ch = dev->channel;
+	uint16_t bus = dev->io_base;
+	uint8_t slave = dev->slave;
+	uint64_t lba = req->sector;
+	unsigned int sectors = req->span;
+	size_t bytes = sectors * ATA_SECTOR_SIZE;
+
+	if (dev->is_atapi || !ch->bmide) return -EIO;
+
+	int entries = 0;
+	for (struct blk_request * piece = req; piece; piece = piece->merged) {
+		entries = ata_prdt_map(ch, entries, piece->buffer, piece->count * ATA_SECTOR_SIZE);
+		if (!entries) break;
+	}
+
+	int direct = entries != 0;
+	if (!direct) {
+		entries = ata_prdt_map(ch, 0, ch->bounce, bytes);
+		if (direction == ATA_WRITE) {
+			size_t offset = 0;
+			for (struct blk_request * piece = req; piece; piece = piece->merged) {
+				memcpy(ch->bounce + offset, piece->buffer, piece->count * ATA_SECTOR_SIZE);
+				offset += piece->count * ATA_SECTOR_SIZE;
+			}
+		}
+	}
+	ch->prdt[entries-1].last = ATA_PRDT_EOT;
 
-	/* Set the PRDT */
-	outportl(dev->bar4 + 0x04, dev->dma_prdt_phys);
+	ata_wait(dev, 0);
 
-	/* Enable error, irq status */
-	outportb(dev->bar4 + 0x2, inportb(dev->bar4 + 0x02) | 0x04 | 0x02);
+	/* Stop, set the PRDT, and clear error and interrupt status */
+	outportb(ch->bmide + ATA_BM_COMMAND, 0x00);
+	outportl(ch->bmide + ATA_BM_PRDT, ch->prdt_phys);
+	outportb(ch->bmide + ATA_BM_STATUS, inportb(ch->bmide + ATA_BM_STATUS) | ATA_BM_SR_IRQ | ATA_BM_SR_ERR);
 
-	/* set read */
-	outportb(dev->bar4, 0x08);
+	uint8_t bm_direction = direction == ATA_READ ? ATA_BM_CMD_READ : 0x00;
+	outportb(ch->bmide + ATA_BM_COMMAND, bm_direction);
 
 	while (1) {
 		uint8_t status = inportb(dev->io_base + ATA_REG_STATUS);
@@ -784,12 +755,13 @@ static void ata_device_read_sector_actual(struct ata_device * dev, uint64_t lba)
 	ata_io_wait(dev);
 	outportb(bus + ATA_REG_FEATURES, 0x00);
 
-	outportb(bus + ATA_REG_SECCOUNT0, 0);
+	/* High bytes first; a count of 0 means 65536 */
+	outportb(bus + ATA_REG_SECCOUNT0, (sectors >> 8) & 0xFF);
 	outportb(bus + ATA_REG_LBA0, (lba & 0xff000000) >> 24);
 	outportb(bus + ATA_REG_LBA1, (lba & 0xff00000000) >> 32);
 	outportb(bus + ATA_REG_LBA2, (lba & 0xff0000000000) >> 40);
 
-	outportb(bus + ATA_REG_SECCOUNT0, SECTORS_PER_CACHE_BLOCK);
+	outportb(bus + ATA_REG_SECCOUNT0, sectors & 0xFF);
 	outportb(bus + ATA_REG_LBA0, (lba & 0x000000ff) >>  0);
 	outportb(bus + ATA_REG_LBA1, (lba & 0x0000ff00) >>  8);
 	outportb(bus + ATA_REG_LBA2, (lba & 0x00ff0000) >> 16);
@@ -798,27 +770,32 @@ static void ata_device_read_sector_actual(struct ata_device * dev, uint64_t lba)
 		uint8_t status = inportb(dev->io_base + ATA_REG_STATUS);
 		if (!(status & ATA_SR_BSY) && (status & ATA_SR_DRDY)) break;
 	}
-	spin_lock(atapi_cmd_lock);
-	outportb(bus + ATA_REG_COMMAND, ATA_CMD_READ_DMA_EXT);
 
+	ata_channel_arm(ch);
+	outportb(bus + ATA_REG_COMMAND, direction == ATA_READ ? ATA_CMD_READ_DMA_EXT : ATA_CMD_WRITE_DMA_EXT);
 	ata_io_wait(dev);
+	outportb(ch->bmide + ATA_BM_COMMAND, bm_direction | ATA_BM_CMD_START);
+	ata_channel_wait(ch);
 
-	outportb(dev->bar4, 0x08 | 0x01);
-	sleep_on_unlocking(atapi_waiter, &atapi_cmd_lock);
+	/* Stop the engine and acknowledge. */
+	outportb(ch->bmide + ATA_BM_COMMAND, 0x00);
+	outportb(ch->bmide + ATA_BM_STATUS, inportb(ch->bmide + ATA_BM_STATUS) | ATA_BM_SR_IRQ | ATA_BM_SR_ERR);
 
-	while (1) {
-		int status = inportb(dev->bar4 + 0x02);
-		int dstatus = inportb(dev->io_base + ATA_REG_STATUS);
-		if (!(status & 0x04)) {
-			continue;
-		}
-		if (!(dstatus & ATA_SR_BSY)) {
-			break;
+	if ((ch->dma_status & ATA_BM_SR_ERR) || (ch->status & (ATA_SR_ERR | ATA_SR_DF))) {
+		dprintf("ata: DMA %s of %u sectors at %#lx failed (status %#x, dma %#x)\n",
+			direction == ATA_READ ? "read" : "write", sectors, lba, ch->status, ch->dma_status);
+		return -EIO;
+	}
+
+	if (!direct && direction == ATA_READ) {
+		size_t offset = 0;
+		for (struct blk_request * piece = req; piece; piece = piece->merged) {
+			memcpy(piece->buffer, ch->bounce + offset, piece->count * ATA_SECTOR_SIZE);
+			offset += piece->count * ATA_SECTOR_SIZE;
 		}
 	}
 
-	/* Inform device we are done. */
-	outportb(dev->bar4 + 0x2, inportb(dev->bar4 + 0x02) | 0x04 | 0x02);
+	return 0;
 }
 
 static void ata_device_read_sector_atapi_actual(struct ata_device * dev, uint64_t lba, uint8_t * buf) {
@@ -858,12 +835,12 @@ static void ata_device_read_sector_atapi_actual(struct ata_device * dev, uint64_
 	command.command_bytes[10] = 0;
 	command.command_bytes[11] = 0;
 
-	spin_lock(atapi_cmd_lock);
+	ata_channel_arm(dev->channel);
 	for (int i = 0; i < 6; ++i) {
 		outports(bus, command.command_words[i]);
 	}
 
-	sleep_on_unlocking(atapi_waiter, &atapi_cmd_lock);
+	ata_channel_wait(dev->channel);
 
 	while (1) {
 		uint8_t status = inportb(dev->io_base + ATA_REG_STATUS);
@@ -891,145 +868,22 @@ atapi_timeout:
 	return;
 }
 
-static void ata_device_write_sector_actual(struct ata_device * dev, uint64_t lba) {
-	uint16_t bus = dev->io_base;
-	uint8_t slave = dev->slave;
-
-	ata_wait(dev, 0);
-	outportb(dev->bar4, 0x00);
-	outportl(dev->bar4 + 0x04, dev->dma_prdt_phys);
-	outportb(dev->bar4 + 0x2, inportb(dev->bar4 + 0x02) | 0x04 | 0x02);
-
-	/* set write */
-	outportb(dev->bar4, 0x00);
-
-	while (1) {
-		uint8_t status = inportb(dev->io_base + ATA_REG_STATUS);
-		if (!(status & ATA_SR_BSY)) break;
-	}
-
-	outportb(bus + ATA_REG_CONTROL, 0x02);
-	outportb(bus + ATA_REG_HDDEVSEL, 0xe0 | slave << 4);
-	ata_wait(dev, 0);
-	outportb(bus + ATA_REG_FEATURES, 0x00);
-
-	outportb(bus + ATA_REG_SECCOUNT0, 0);
-	outportb(bus + ATA_REG_LBA0, (lba & 0xff000000) >> 24);
-	outportb(bus + ATA_REG_LBA1, (lba & 0xff00000000) >> 32);
-	outportb(bus + ATA_REG_LBA2, (lba & 0xff0000000000) >> 40);
-
-	outportb(bus + ATA_REG_SECCOUNT0, SECTORS_PER_CACHE_BLOCK);
-	outportb(bus + ATA_REG_LBA0, (lba & 0x000000ff) >>  0);
-	outportb(bus + ATA_REG_LBA1, (lba & 0x0000ff00) >>  8);
-	outportb(bus + ATA_REG_LBA2, (lba & 0x00ff0000) >> 16);
-
-	while (1) {
-		uint8_t status = inportb(dev->io_base + ATA_REG_STATUS);
-		if (!(status & ATA_SR_BSY) && (status & ATA_SR_DRDY)) break;
-	}
-	spin_lock(atapi_cmd_lock);
-	outportb(bus + ATA_REG_COMMAND, ATA_CMD_WRITE_DMA_EXT);
-
-	ata_io_wait(dev);
-
-	outportb(dev->bar4, 0x00 | 0x01);
-	sleep_on_unlocking(atapi_waiter, &atapi_cmd_lock);
-
-	#if 0
-	ata_wait(dev, 0);
-	int size = ATA_SECTOR_SIZE / 2;
-	outportsm(bus,buf,size);
-	#endif
-
-	outportb(dev->bar4 + 0x2, inportb(dev->bar4 + 0x02) | 0x04 | 0x02);
-
-#if 0
-	outportb(bus + 0x07, ATA_CMD_CACHE_FLUSH);
-	ata_wait(dev, 0);
-#endif
-}
-
-static void ata_device_read_sector(struct ata_device * dev, uint64_t lba, uint8_t * buf) {
-	lba *= SECTORS_PER_CACHE_BLOCK;
-	/* Is it in the cache? */
-	mutex_acquire(ata_mutex);
-	int found = 0;
-	int oldest = 0;
-	uint64_t lu = -1;
-	for (int i = 0; i < CACHE_COUNT; ++i) {
-		if (cache_entries[i].dev == dev && cache_entries[i].lba == lba) {
-			//dprintf("ata: cache hit\n");
-			hit_count++;
-			oldest = i;
-			found = 1;
-			break;
-		} else if (cache_entries[i].dev == NULL) {
-			oldest = i;
-			break;
-		} else if (cache_entries[i].last_use < lu) {
-			oldest = i;
-			lu = cache_entries[oldest].last_use;
-		}
-	}
-	if (!found) {
-		miss_count++;
-		if (cache_entries[oldest].dev && cache_entries[oldest].flags & 1) {
-			eviction_count++;
-			memcpy(cache_entries[oldest].dev->dma_start, cache_blocks + oldest * ATA_CACHE_SIZE, ATA_CACHE_SIZE);
-			ata_device_write_sector_actual(cache_entries[oldest].dev, cache_entries[oldest].lba);
-		}
-		ata_device_read_sector_actual(dev, lba);
-		cache_entries[oldest].dev = dev;
-		cache_entries[oldest].lba = lba;
-		cache_entries[oldest].flags = 0;
-		memcpy(cache_blocks + oldest * ATA_CACHE_SIZE, dev->dma_start, ATA_CACHE_SIZE);
-	}
-	cache_entries[oldest].last_use = counter++;
-	memcpy(buf, cache_blocks + ATA_CACHE_SIZE * oldest, ATA_CACHE_SIZE);
-	mutex_release(ata_mutex);
+/*
+ * Requests come from the block layer, one at a time, at most
+ * ATA_MAX_SECTORS long with whatever has been merged into them.
+ */
+static int ata_device_transfer(struct blkdev * blk, struct blk_request * req) {
+	struct ata_device * dev = blk->driver;
+	mutex_acquire(dev->channel->lock);
+	int error = ata_device_dma(dev, req, req->write ? ATA_WRITE : ATA_READ);
+	mutex_release(dev->channel->lock);
+	return error;
 }
 
-static void ata_device_write_sector(struct ata_device * dev, uint64_t lba, uint8_t * buf) {
-	lba *= SECTORS_PER_CACHE_BLOCK;
-	mutex_acquire(ata_mutex);
-	int found = 0;
-	int oldest = 0;
-	uint64_t lu = -1;
-	for (int i = 0; i < CACHE_COUNT; ++i) {
-		if (cache_entries[i].dev == dev && cache_entries[i].lba == lba) {
-			//dprintf("ata: cache hit\n");
-			hit_count++;
-			oldest = i;
-			found = 1;
-			break;
-		} else if (cache_entries[i].dev == NULL) {
-			oldest = i;
-			break;
-		} else if (cache_entries[i].last_use < lu) {
-			oldest = i;
-			lu = cache_entries[oldest].last_use;
-		}
-	}
-	if (!found) {
-		miss_count++;
-		if (cache_entries[oldest].dev && cache_entries[oldest].flags & 1) {
-			eviction_count++;
-			memcpy(cache_entries[oldest].dev->dma_start, cache_blocks + oldest * ATA_CACHE_SIZE, ATA_CACHE_SIZE);
-			ata_device_write_sector_actual(cache_entries[oldest].dev, cache_entries[oldest].lba);
-		}
-		cache_entries[oldest].dev = dev;
-		cache_entries[oldest].lba = lba;
-	}
-	write_count++;
-	cache_entries[oldest].last_use = counter++;
-	memcpy(cache_blocks + oldest * ATA_CACHE_SIZE, buf, ATA_CACHE_SIZE);
-	cache_entries[oldest].flags = 1;
-	mutex_release(ata_mutex);
-}
 static void ata_device_read_sector_atapi(struct ata_device * dev, uint64_t lba, uint8_t * buf) {
-	mutex_acquire(ata_mutex);
+	mutex_acquire(dev->channel->lock);
 	ata_device_read_sector_atapi_actual(dev, lba, buf);
-	mutex_release(ata_mutex);
+	mutex_release(dev->channel->lock);
 }
 
 static int ata_initialize(int argc, char * argv[]) {
@@ -1038,15 +892,10 @@ static int ata_initialize(int argc, char * argv[]) {
 	/* Locate ATA device via PCI */
 	pci_scan(&find_ata_pci, -1, &ata_pci);
 
-	irq_install_handler(14, ata_irq_handler, "ide master");
-	irq_install_handler(15, ata_irq_handler, "ide slave");
-
-	atapi_waiter = list_create("atapi waiter", NULL);
+	ata_channels_init();
 
-	cache_entries = malloc(sizeof(struct CacheEntry) * CACHE_COUNT);
-	memset(cache_entries, 0, sizeof(struct CacheEntry) * CACHE_COUNT);
-	cache_blocks  = mmu_map_module(CACHE_COUNT * ATA_CACHE_SIZE);
-	ata_mutex = mutex_init("ata lock");
+	irq_install_handler(14, ata_irq_primary, "ide primary");
+	irq_install_handler(15, ata_irq_secondary, "ide secondary");
 
 	ata_device_detect(&ata_primary_master);
 	ata_device_detect(&ata_primary_slave);
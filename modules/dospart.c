@@ -16,6 +16,9 @@
 #include <kernel/vfs.h>
 #include <kernel/printf.h>
 #include <kernel/tokenize.h>
+#include <kernel/blkdev.h>
+#include <sys/ioctl.h>
+#include <errno.h>
 
 #define SECTORSIZE      512
 
@@ -67,6 +70,19 @@ static ssize_t write_part(fs_node_t *node, off_t offset, size_t size, uint8_t *b
 	return write_fs(device->device, offset + device->partition.lba_first_sector * SECTORSIZE, size, buffer);
 }
 
+static int ioctl_part(fs_node_t * node, unsigned long request, void * argp) {
+	struct dos_partition_entry * device = (struct dos_partition_entry *)node->device;
+
+	switch (request) {
+		case IOCTLSYNC:
+			/* Writes land on the parent disk, so flush that */
+			return ioctl_fs(device->device, IOCTLSYNC, NULL);
+
+		default:
+			return -EINVAL;
+	}
+}
+
 static void open_part(fs_node_t * node, unsigned int flags) {
 	return;
 }
@@ -79,6 +95,16 @@ static fs_node_t * dospart_device_create(int i, fs_node_t * dev, mbr_t * mbr, in
 
 	vfs_lock(dev);
 
+	/* Disks with request queues get partitions that share the queue */
+	struct blkdev * disk = blkdev_get(dev);
+	if (disk) {
+		char name[20];
+		snprintf(name, 20, "dospart%d", i);
+		return blkdev_partition(disk, name,
+			(uint64_t)mbr->partitions[id].lba_first_sector * SECTORSIZE / disk->sector_size,
+			(uint64_t)mbr->partitions[id].sector_count * SECTORSIZE / disk->sector_size);
+	}
+
 	struct dos_partition_entry * device = malloc(sizeof(struct dos_partition_entry));
 	memcpy(&device->partition, &mbr->partitions[id], sizeof(partition_t));
 	device->device = dev;
@@ -99,7 +125,7 @@ static fs_node_t * dospart_device_create(int i, fs_node_t * dev, mbr_t * mbr, in
 	fnode->close   = close_part;
 	fnode->readdir = NULL;
 	fnode->finddir = NULL;
-	fnode->ioctl   = NULL; /* TODO, identify, etc? */
+	fnode->ioctl   = ioctl_part; /* TODO, identify, etc? */
 	return fnode;
 }
 
@@ -120,6 +146,7 @@ static fs_node_t * dospart_map(const char * device, const char * mount_path) {
 		for (int i = 0; i < 4; ++i) {
 			if (mbr.partitions[i].status & 0x80) {
 				fs_node_t * node = dospart_device_create(i, dev, &mbr, i);
+				if (!node) continue;
 				char tmp[64];
 				snprintf(tmp, 20, "%s%d", device, i);
 				vfs_mount(tmp, node);
@@ -25,6 +25,7 @@
 #include <kernel/mod/net.h>
 #include <kernel/net/netif.h>
 #include <kernel/net/eth.h>
+#include <kernel/syscall.h>
 #include <kernel/module.h>
 #include <errno.h>
 
@@ -390,32 +391,28 @@ static int ioctl_e1000(fs_node_t * node, unsigned long request, void * argp) {
 	switch (request) {
 		case SIOCGIFHWADDR:
 			/* fill argp with mac */
-			memcpy(argp, nic->eth.mac, 6);
-			return 0;
+			return copy_to_user(argp, nic->eth.mac, 6);
 
 		case SIOCGIFADDR:
 			if (nic->eth.ipv4_addr == 0) return -ENOENT;
-			memcpy(argp, &nic->eth.ipv4_addr, sizeof(nic->eth.ipv4_addr));
-			return 0;
+			return copy_to_user(argp, &nic->eth.ipv4_addr, sizeof(nic->eth.ipv4_addr));
 		case SIOCSIFADDR:
 			privileged();
-			memcpy(&nic->eth.ipv4_addr, argp, sizeof(nic->eth.ipv4_addr));
+			if (copy_from_user(&nic->eth.ipv4_addr, argp, sizeof(nic->eth.ipv4_addr))) return -EFAULT;
 			return 0;
 		case SIOCGIFNETMASK:
 			if (nic->eth.ipv4_subnet == 0) return -ENOENT;
-			memcpy(argp, &nic->eth.ipv4_subnet, sizeof(nic->eth.ipv4_subnet));
-			return 0;
+			return copy_to_user(argp, &nic->eth.ipv4_subnet, sizeof(nic->eth.ipv4_subnet));
 		case SIOCSIFNETMASK:
 			privileged();
-			memcpy(&nic->eth.ipv4_subnet, argp, sizeof(nic->eth.ipv4_subnet));
+			if (copy_from_user(&nic->eth.ipv4_subnet, argp, sizeof(nic->eth.ipv4_subnet))) return -EFAULT;
 			return 0;
 		case SIOCGIFGATEWAY:
 			if (nic->eth.ipv4_subnet == 0) return -ENOENT;
-			memcpy(argp, &nic->eth.ipv4_gateway, sizeof(nic->eth.ipv4_gateway));
-			return 0;
+			return copy_to_user(argp, &nic->eth.ipv4_gateway, sizeof(nic->eth.ipv4_gateway));
 		case SIOCSIFGATEWAY:
 			privileged();
-			memcpy(&nic->eth.ipv4_gateway, argp, sizeof(nic->eth.ipv4_gateway));
+			if (copy_from_user(&nic->eth.ipv4_gateway, argp, sizeof(nic->eth.ipv4_gateway))) return -EFAULT;
 			net_arp_ask(nic->eth.ipv4_gateway, node);
 			return 0;
 
@@ -423,28 +420,25 @@ static int ioctl_e1000(fs_node_t * node, unsigned long request, void * argp) {
 			return -ENOENT;
 		case SIOCSIFADDR6:
 			privileged();
-			memcpy(&nic->eth.ipv6_addr, argp, sizeof(nic->eth.ipv6_addr));
+			if (copy_from_user(&nic->eth.ipv6_addr, argp, sizeof(nic->eth.ipv6_addr))) return -EFAULT;
 			return 0;
 
 		case SIOCGIFFLAGS: {
-			uint32_t * flags = argp;
-			*flags = IFF_RUNNING;
-			if (nic->link_status) *flags |= IFF_UP;
+			uint32_t flags = IFF_RUNNING;
+			if (nic->link_status) flags |= IFF_UP;
 			/* We turn these on in our init_tx */
-			*flags |= IFF_BROADCAST;
-			*flags |= IFF_MULTICAST;
-			return 0;
+			flags |= IFF_BROADCAST;
+			flags |= IFF_MULTICAST;
+			return copy_to_user(argp, &flags, sizeof(uint32_t));
 		}
 
 		case SIOCGIFMTU: {
-			uint32_t * mtu = argp;
-			*mtu = nic->eth.mtu;
-			return 0;
+			uint32_t mtu = nic->eth.mtu;
+			return copy_to_user(argp, &mtu, sizeof(uint32_t));
 		}
 
 		case SIOCGIFCOUNTS: {
-			memcpy(argp, &nic->counts, sizeof(netif_counters_t));
-			return 0;
+			return copy_to_user(argp, &nic->counts, sizeof(netif_counters_t));
 		}
 
 		default:
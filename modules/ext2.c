@@ -21,6 +21,9 @@
 #include <kernel/tokenize.h>
 #include <kernel/module.h>
 #include <kernel/mutex.h>
+#include <kernel/process.h>
+#include <kernel/bcache.h>
+#include <kernel/hashmap.h>
 
 #include <sys/ioctl.h>
 
@@ -95,7 +98,9 @@ struct ext2_superblock {
 	/* Other Options */
 	uint32_t default_mount_options;
 	uint32_t first_meta_bg;
-	uint8_t _unused[760];
+	uint8_t _unused_a[88];
+	uint32_t flags;
+	uint8_t _unused[668];
 
 } __attribute__ ((packed));
 
@@ -176,6 +181,38 @@ struct ext2_dir {
 
 typedef struct ext2_dir ext2_dir_t;
 
+/* Directory index (htree) structures */
+#define EXT2_FEATURE_COMPAT_DIR_INDEX 0x0020
+#define EXT2_INDEX_FL                 0x00001000
+#define EXT2_FLAGS_UNSIGNED_HASH      0x0002
+
+#define DX_HASH_LEGACY   0
+#define DX_HASH_HALF_MD4 1
+#define DX_HASH_TEA      2
+#define DX_HASH_UNSIGNED 3 /* Added to the above for the unsigned char variants */
+
+#define DX_MAX_LEVELS    2 /* The root and one level of index nodes */
+
+/* Follows the "." and ".." entries in the first block of an indexed directory */
+struct ext2_dx_root_info {
+	uint32_t reserved_zero;
+	uint8_t hash_version;
+	uint8_t info_length;
+	uint8_t indirect_levels;
+	uint8_t unused_flags;
+} __attribute__ ((packed));
+
+struct ext2_dx_entry {
+	uint32_t hash;
+	uint32_t block;
+} __attribute__ ((packed));
+
+/* Overlays the hash of the first entry in an index node */
+struct ext2_dx_countlimit {
+	uint16_t limit;
+	uint16_t count;
+} __attribute__ ((packed));
+
 #define EXT2_BGD_BLOCK 2
 
 #define E_SUCCESS   0
@@ -186,6 +223,80 @@ typedef struct ext2_dir ext2_dir_t;
 #undef _symlink
 #define _symlink(inode) ((char *)(inode)->block)
 
+/*
+ * Block map cache: a direct-mapped table of (inode, inode block) -> disk block,
+ * so that reading through a large file doesn't walk the indirect blocks for
+ * every block. Consecutive blocks of one inode land in consecutive slots.
+ */
+#define EXT2_BMAP_ENTRIES 4096
+
+struct ext2_bmap_entry {
+	uint32_t inode;
+	uint32_t iblock;
+	uint32_t block;
+};
+
+/*
+ * Block preallocation: a file that is growing sequentially gets a small window
+ * of blocks reserved beyond the ones it asked for, so that interleaved writers
+ * don't fragment each other. Reserved blocks are marked in the bitmap and go
+ * back to the free pool when the file's last open node is closed, or the slot
+ * is reused.
+ */
+#define EXT2_PREALLOC_SLOTS  8
+#define EXT2_PREALLOC_BLOCKS 8
+
+struct ext2_prealloc {
+	uint32_t inode;
+	uint32_t iblock;   /* Next inode block the window would be used for */
+	uint32_t block;    /* First reserved disk block */
+	uint32_t count;    /* Number of reserved blocks left */
+};
+
+/*
+ * Inode cache: inodes are shared between everyone using them and written back
+ * to the inode table once the last user releases them, so a sequence of changes
+ * to one inode costs a single table update. Unused clean inodes are kept around,
+ * least recently used first to go, so that repeated operations on the same file
+ * don't read its inode again.
+ */
+#define EXT2_ICACHE_ENTRIES 512
+#define EXT2_ICACHE_BUCKETS 256
+
+struct ext2_icache_entry {
+	struct ext2_icache_entry * hash_next;
+	struct ext2_icache_entry * lru_prev;
+	struct ext2_icache_entry * lru_next;
+	uint32_t inode_no;
+	int refcount;
+	int dirty;
+	int datasync;   /* Size or block map changed since the last fsync */
+	uint8_t data[]; /* inode_size bytes */
+};
+
+/*
+ * Write-back order: the block cache writes our dirty buffers back one pass at a
+ * time, so that a crash leaves leaked blocks and orphaned inodes behind rather
+ * than pointers to garbage. Allocations land before anything uses them, block
+ * contents before the pointers to them, and inodes before the directory entries
+ * that name them. A newly allocated block is written with the data, whatever it
+ * holds, as nothing can point to it yet.
+ */
+#define EXT2_PASS_ALLOC 0 /* Bitmaps and group descriptors */
+#define EXT2_PASS_DATA  1 /* File contents and newly allocated blocks */
+#define EXT2_PASS_MAP   2 /* Indirect blocks */
+#define EXT2_PASS_INODE 3 /* Inode tables */
+#define EXT2_PASS_DIR   4 /* Directory contents */
+#define EXT2_PASS_SUPER 5 /* The superblock, whose counts are only hints */
+
+/*
+ * Each read-write filesystem has a flusher thread that wakes up every interval,
+ * moves changed inodes into the block cache, and writes back buffers that have
+ * been dirty for longer than the expiry time.
+ */
+#define EXT2_FLUSH_INTERVAL 1    /* Seconds */
+#define EXT2_FLUSH_EXPIRE   5000 /* Milliseconds */
+
 /*
  * EXT2 filesystem object
  */
@@ -210,6 +321,21 @@ typedef struct {
 	int flags;
 
 	sched_mutex_t *           mutex;
+
+	struct ext2_bmap_entry *  bmap;                /* Cached logical->physical block mappings */
+	spin_lock_t               bmap_lock;
+
+	unsigned int              alloc_group;         /* Group the last allocation came from */
+	struct ext2_prealloc      prealloc[EXT2_PREALLOC_SLOTS]; /* Protected by mutex */
+	unsigned int              prealloc_next;
+	hashmap_t *               open_counts;         /* Open nodes for each inode; protected by mutex */
+	uint8_t *                 zero_block;
+
+	struct ext2_icache_entry ** icache;            /* Hash buckets of cached inodes */
+	struct ext2_icache_entry *  icache_head;       /* Most recently used */
+	struct ext2_icache_entry *  icache_tail;       /* Least recently used */
+	size_t                    icache_count;
+	spin_lock_t               icache_lock;
 } ext2_fs_t;
 
 #define EXT2_FLAG_READWRITE 0x0002
@@ -234,7 +360,7 @@ typedef struct {
 static int node_from_file(ext2_fs_t * this, ext2_inodetable_t *inode, ext2_dir_t *direntry,  fs_node_t *fnode);
 static int ext2_root(ext2_fs_t * this, ext2_inodetable_t *inode, fs_node_t *fnode);
 static ext2_inodetable_t * read_inode(ext2_fs_t * this, size_t inode);
-static void refresh_inode(ext2_fs_t * this, ext2_inodetable_t * inodet,  size_t inode);
+static void release_inode(ext2_fs_t * this, ext2_inodetable_t * inode);
 static int write_inode(ext2_fs_t * this, ext2_inodetable_t *inode, size_t index);
 static fs_node_t * finddir_ext2(fs_node_t *node, char *name);
 static size_t allocate_block(ext2_fs_t * this);
@@ -247,7 +373,12 @@ static size_t allocate_block(ext2_fs_t * this);
  * so we need to special-case it.
  */
 static int rewrite_superblock(ext2_fs_t * this) {
-	write_fs(this->block_device, 1024, sizeof(ext2_superblock_t), (uint8_t *)SB);
+	/* Go through the block cache at our block size, so we don't alias a cached block. */
+	if (this->block_size == 1024) {
+		bcache_write(this->block_device, 1, 1024, (uint8_t *)SB, EXT2_PASS_SUPER);
+	} else {
+		bcache_update(this->block_device, 0, this->block_size, 1024, sizeof(ext2_superblock_t), (uint8_t *)SB, EXT2_PASS_SUPER);
+	}
 	return E_SUCCESS;
 }
 
@@ -266,8 +397,10 @@ static int read_block(ext2_fs_t * this, unsigned int block_no, uint8_t * buf) {
 		return E_BADBLOCK;
 	}
 
-	/* In such cases, we read directly from the block device */
-	read_fs(this->block_device, block_no * this->block_size, this->block_size, (uint8_t *)buf);
+	/* Blocks are read through the shared buffer cache */
+	if (bcache_read(this->block_device, block_no, this->block_size, buf)) {
+		return E_BADBLOCK;
+	}
 
 	/* And return SUCCESS */
 	return E_SUCCESS;
@@ -278,22 +411,86 @@ static int read_block(ext2_fs_t * this, unsigned int block_no, uint8_t * buf) {
  *
  * @param block_no Block to write
  * @param buf      Data in the block
+ * @param pass     Write-back pass (EXT2_PASS_*) for the kind of block this is
  * @returns Error code or E_SUCCESSS
  */
-static int write_block(ext2_fs_t * this, unsigned int block_no, uint8_t *buf) {
+static int write_block(ext2_fs_t * this, unsigned int block_no, uint8_t *buf, int pass) {
 	if (!block_no) {
 		debug_print(ERROR, "Attempted to write to block #0. Enable tracing and retry this operation.");
 		debug_print(ERROR, "Your file system is most likely corrupted now.");
 		return E_BADBLOCK;
 	}
 
-	/* This operation requires the filesystem lock */
-	write_fs(this->block_device, block_no * this->block_size, this->block_size, buf);
+	/* The buffer cache will write this back later, in pass order */
+	bcache_write(this->block_device, block_no, this->block_size, buf, pass);
 
 	/* We're done. */
 	return E_SUCCESS;
 }
 
+static size_t bmap_index(uint32_t inode_no, uint32_t iblock) {
+	return (inode_no * 2654435761U + iblock) & (EXT2_BMAP_ENTRIES - 1);
+}
+
+/**
+ * ext2->bmap_lookup Find a cached block mapping.
+ *
+ * @returns The real block number, or 0 if it isn't cached.
+ */
+static uint32_t bmap_lookup(ext2_fs_t * this, uint32_t inode_no, uint32_t iblock) {
+	uint32_t out = 0;
+	struct ext2_bmap_entry * entry = &this->bmap[bmap_index(inode_no, iblock)];
+	spin_lock(this->bmap_lock);
+	if (entry->inode == inode_no && entry->iblock == iblock) out = entry->block;
+	spin_unlock(this->bmap_lock);
+	return out;
+}
+
+static void bmap_store(ext2_fs_t * this, uint32_t inode_no, uint32_t iblock, uint32_t block) {
+	struct ext2_bmap_entry * entry = &this->bmap[bmap_index(inode_no, iblock)];
+	spin_lock(this->bmap_lock);
+	entry->inode  = inode_no;
+	entry->iblock = iblock;
+	entry->block  = block;
+	spin_unlock(this->bmap_lock);
+}
+
+/**
+ * ext2->bmap_forget_inode Drop all cached mappings for an inode whose number is being reused.
+ */
+static void bmap_forget_inode(ext2_fs_t * this, uint32_t inode_no) {
+	spin_lock(this->bmap_lock);
+	for (size_t i = 0; i < EXT2_BMAP_ENTRIES; ++i) {
+		if (this->bmap[i].inode == inode_no) this->bmap[i].inode = 0;
+	}
+	spin_unlock(this->bmap_lock);
+}
+
+/**
+ * ext2->read_block_pointer Read one entry of an indirect block.
+ *
+ * Looks at the cached block directly rather than copying all of it out.
+ */
+static uint32_t read_block_pointer(ext2_fs_t * this, uint32_t block_no, unsigned int index) {
+	if (!block_no) return 0;
+	struct bcache_buf * buf = bcache_get(this->block_device, block_no, this->block_size);
+	if (!buf) return 0;
+	uint32_t out = ((uint32_t *)buf->data)[index];
+	bcache_release(buf);
+	return out;
+}
+
+/**
+ * ext2->allocate_indirect_block Allocate a block of pointers for an inode.
+ *
+ * i_blocks counts these along with the data blocks, as Linux expects.
+ */
+static unsigned int allocate_indirect_block(ext2_fs_t * this, ext2_inodetable_t * inode) {
+	unsigned int block_no = allocate_block(this);
+	if (block_no) inode->blocks += this->block_size / 512;
+	return block_no;
+}
+
 /**
  * ext2->set_block_number Set the "real" block number for a given "inode" block number.
  *
@@ -314,10 +511,12 @@ static unsigned int set_block_number(ext2_fs_t * this, ext2_inodetable_t * inode
 	if (iblock < EXT2_DIRECT_BLOCKS) {
 		inode->block[iblock] = rblock;
 		return E_SUCCESS;
-	} else if (iblock < EXT2_DIRECT_BLOCKS + p) {
+	}
+
+	if (iblock < EXT2_DIRECT_BLOCKS + p) {
 		/* XXX what if inode->block[EXT2_DIRECT_BLOCKS] isn't set? */
 		if (!inode->block[EXT2_DIRECT_BLOCKS]) {
-			unsigned int block_no = allocate_block(this);
+			unsigned int block_no = allocate_indirect_block(this, inode);
 			if (!block_no) return E_NOSPACE;
 			inode->block[EXT2_DIRECT_BLOCKS] = block_no;
 			write_inode(this, inode, inode_no);
@@ -326,9 +525,10 @@ static unsigned int set_block_number(ext2_fs_t * this, ext2_inodetable_t * inode
 		read_block(this, inode->block[EXT2_DIRECT_BLOCKS], (uint8_t *)tmp);
 
 		((uint32_t *)tmp)[iblock - EXT2_DIRECT_BLOCKS] = rblock;
-		write_block(this, inode->block[EXT2_DIRECT_BLOCKS], (uint8_t *)tmp);
+		write_block(this, inode->block[EXT2_DIRECT_BLOCKS], (uint8_t *)tmp, EXT2_PASS_MAP);
 
 		free(tmp);
+		bmap_store(this, inode_no, iblock, rblock);
 		return E_SUCCESS;
 	} else if (iblock < EXT2_DIRECT_BLOCKS + p + p * p) {
 		a = iblock - EXT2_DIRECT_BLOCKS;
@@ -337,7 +537,7 @@ static unsigned int set_block_number(ext2_fs_t * this, ext2_inodetable_t * inode
 		d = b - c * p;
 
 		if (!inode->block[EXT2_DIRECT_BLOCKS+1]) {
-			unsigned int block_no = allocate_block(this);
+			unsigned int block_no = allocate_indirect_block(this, inode);
 			if (!block_no) return E_NOSPACE;
 			inode->block[EXT2_DIRECT_BLOCKS+1] = block_no;
 			write_inode(this, inode, inode_no);
@@ -347,19 +547,20 @@ static unsigned int set_block_number(ext2_fs_t * this, ext2_inodetable_t * inode
 		read_block(this, inode->block[EXT2_DIRECT_BLOCKS + 1], (uint8_t *)tmp);
 
 		if (!((uint32_t *)tmp)[c]) {
-			unsigned int block_no = allocate_block(this);
+			unsigned int block_no = allocate_indirect_block(this, inode);
 			if (!block_no) goto no_space_free;
 			((uint32_t *)tmp)[c] = block_no;
-			write_block(this, inode->block[EXT2_DIRECT_BLOCKS + 1], (uint8_t *)tmp);
+			write_block(this, inode->block[EXT2_DIRECT_BLOCKS + 1], (uint8_t *)tmp, EXT2_PASS_MAP);
 		}
 
 		uint32_t nblock = ((uint32_t *)tmp)[c];
 		read_block(this, nblock, (uint8_t *)tmp);
 
 		((uint32_t  *)tmp)[d] = rblock;
-		write_block(this, nblock, (uint8_t *)tmp);
+		write_block(this, nblock, (uint8_t *)tmp, EXT2_PASS_MAP);
 
 		free(tmp);
+		bmap_store(this, inode_no, iblock, rblock);
 		return E_SUCCESS;
 	} else if (iblock < EXT2_DIRECT_BLOCKS + p + p * p + p) {
 		a = iblock - EXT2_DIRECT_BLOCKS;
@@ -371,7 +572,7 @@ static unsigned int set_block_number(ext2_fs_t * this, ext2_inodetable_t * inode
 		g = e - f * p;
 
 		if (!inode->block[EXT2_DIRECT_BLOCKS+2]) {
-			unsigned int block_no = allocate_block(this);
+			unsigned int block_no = allocate_indirect_block(this, inode);
 			if (!block_no) return E_NOSPACE;
 			inode->block[EXT2_DIRECT_BLOCKS+2] = block_no;
 			write_inode(this, inode, inode_no);
@@ -381,29 +582,30 @@ static unsigned int set_block_number(ext2_fs_t * this, ext2_inodetable_t * inode
 		read_block(this, inode->block[EXT2_DIRECT_BLOCKS + 2], (uint8_t *)tmp);
 
 		if (!((uint32_t *)tmp)[d]) {
-			unsigned int block_no = allocate_block(this);
+			unsigned int block_no = allocate_indirect_block(this, inode);
 			if (!block_no) goto no_space_free;
 			((uint32_t *)tmp)[d] = block_no;
-			write_block(this, inode->block[EXT2_DIRECT_BLOCKS + 2], (uint8_t *)tmp);
+			write_block(this, inode->block[EXT2_DIRECT_BLOCKS + 2], (uint8_t *)tmp, EXT2_PASS_MAP);
 		}
 
 		uint32_t nblock = ((uint32_t *)tmp)[d];
 		read_block(this, nblock, (uint8_t *)tmp);
 
 		if (!((uint32_t *)tmp)[f]) {
-			unsigned int block_no = allocate_block(this);
+			unsigned int block_no = allocate_indirect_block(this, inode);
 			if (!block_no) goto no_space_free;
 			((uint32_t *)tmp)[f] = block_no;
-			write_block(this, nblock, (uint8_t *)tmp);
+			write_block(this, nblock, (uint8_t *)tmp, EXT2_PASS_MAP);
 		}
 
 		nblock = ((uint32_t *)tmp)[f];
 		read_block(this, nblock, (uint8_t *)tmp);
 
-		((uint32_t *)tmp)[g] = nblock;
-		write_block(this, nblock, (uint8_t *)tmp);
+		((uint32_t *)tmp)[g] = rblock;
+		write_block(this, nblock, (uint8_t *)tmp, EXT2_PASS_MAP);
 
 		free(tmp);
+		bmap_store(this, inode_no, iblock, rblock);
 		return E_SUCCESS;
 	}
 
@@ -417,44 +619,35 @@ no_space_free:
 /**
  * ext2->get_block_number Given an inode block number, get the real block number.
  *
- * @param inode   Inode to operate on
- * @param iblock  Block offset within the inode
+ * @param inode    Inode to operate on
+ * @param inode_no Number of the inode, for the block map cache
+ * @param iblock   Block offset within the inode
  * @returns Real block number
  */
-static unsigned int get_block_number(ext2_fs_t * this, ext2_inodetable_t * inode, unsigned int iblock) {
+static unsigned int get_block_number(ext2_fs_t * this, ext2_inodetable_t * inode, unsigned int inode_no, unsigned int iblock) {
 
 	unsigned int p = this->pointers_per_block;
 
 	/* We're going to do some crazy math in a bit... */
 	unsigned int a, b, c, d, e, f, g;
 
-	uint8_t * tmp;
-
 	if (iblock < EXT2_DIRECT_BLOCKS) {
 		return inode->block[iblock];
-	} else if (iblock < EXT2_DIRECT_BLOCKS + p) {
-		/* XXX what if inode->block[EXT2_DIRECT_BLOCKS] isn't set? */
-		tmp = malloc(this->block_size);
-		read_block(this, inode->block[EXT2_DIRECT_BLOCKS], (uint8_t *)tmp);
+	}
 
-		unsigned int out = ((uint32_t *)tmp)[iblock - EXT2_DIRECT_BLOCKS];
-		free(tmp);
-		return out;
+	unsigned int out = bmap_lookup(this, inode_no, iblock);
+	if (out) return out;
+
+	if (iblock < EXT2_DIRECT_BLOCKS + p) {
+		out = read_block_pointer(this, inode->block[EXT2_DIRECT_BLOCKS], iblock - EXT2_DIRECT_BLOCKS);
 	} else if (iblock < EXT2_DIRECT_BLOCKS + p + p * p) {
 		a = iblock - EXT2_DIRECT_BLOCKS;
 		b = a - p;
 		c = b / p;
 		d = b - c * p;
 
-		tmp = malloc(this->block_size);
-		read_block(this, inode->block[EXT2_DIRECT_BLOCKS + 1], (uint8_t *)tmp);
-
-		uint32_t nblock = ((uint32_t *)tmp)[c];
-		read_block(this, nblock, (uint8_t *)tmp);
-
-		unsigned int out = ((uint32_t  *)tmp)[d];
-		free(tmp);
-		return out;
+		uint32_t nblock = read_block_pointer(this, inode->block[EXT2_DIRECT_BLOCKS + 1], c);
+		out = read_block_pointer(this, nblock, d);
 	} else if (iblock < EXT2_DIRECT_BLOCKS + p + p * p + p) {
 		a = iblock - EXT2_DIRECT_BLOCKS;
 		b = a - p;
@@ -464,177 +657,1349 @@ static unsigned int get_block_number(ext2_fs_t * this, ext2_inodetable_t * inode
 		f = e / p;
 		g = e - f * p;
 
-		tmp = malloc(this->block_size);
-		read_block(this, inode->block[EXT2_DIRECT_BLOCKS + 2], (uint8_t *)tmp);
+		uint32_t nblock = read_block_pointer(this, inode->block[EXT2_DIRECT_BLOCKS + 2], d);
+		nblock = read_block_pointer(this, nblock, f);
+		out = read_block_pointer(this, nblock, g);
+	} else {
+		debug_print(CRITICAL, "EXT2 driver tried to read to a block number that was too high (%d)", iblock);
+		return 0;
+	}
 
-		uint32_t nblock = ((uint32_t *)tmp)[d];
-		read_block(this, nblock, (uint8_t *)tmp);
+	if (out) bmap_store(this, inode_no, iblock, out);
+	return out;
+}
 
-		nblock = ((uint32_t *)tmp)[f];
-		read_block(this, nblock, (uint8_t *)tmp);
+/**
+ * ext2->inode_location Find where an inode lives in the inode table.
+ *
+ * @param block  Set to the inode table block holding the inode
+ * @param offset Set to the byte offset of the inode within that block
+ * @returns Error code or E_SUCCESS
+ */
+static int inode_location(ext2_fs_t * this, uint32_t inode, uint32_t * block, size_t * offset) {
+	if (!inode) {
+		dprintf("ext2: Attempt to access inode 0\n");
+		return E_BADBLOCK;
+	}
+	inode--;
 
-		unsigned int out = ((uint32_t  *)tmp)[g];
-		free(tmp);
-		return out;
+	uint32_t group = inode / this->inodes_per_group;
+	if (group >= BGDS) {
+		return E_BADBLOCK;
 	}
 
-	debug_print(CRITICAL, "EXT2 driver tried to read to a block number that was too high (%d)", iblock);
+	inode -= group * this->inodes_per_group;
+	*block = BGD[group].inode_table + (inode * this->inode_size) / this->block_size;
+	*offset = (inode * this->inode_size) % this->block_size;
+	return E_SUCCESS;
+}
+
+static size_t icache_hash(uint32_t inode_no) {
+	return (inode_no * 2654435761U) % EXT2_ICACHE_BUCKETS;
+}
 
-	return 0;
+static struct ext2_icache_entry * icache_entry(ext2_inodetable_t * inode) {
+	return (struct ext2_icache_entry *)((uintptr_t)inode - offsetof(struct ext2_icache_entry, data));
 }
 
-static int write_inode(ext2_fs_t * this, ext2_inodetable_t *inode, size_t index) {
-	if (!index) {
+static void icache_lru_unlink(ext2_fs_t * this, struct ext2_icache_entry * entry) {
+	if (entry->lru_prev) entry->lru_prev->lru_next = entry->lru_next;
+	else this->icache_head = entry->lru_next;
+	if (entry->lru_next) entry->lru_next->lru_prev = entry->lru_prev;
+	else this->icache_tail = entry->lru_prev;
+	entry->lru_prev = NULL;
+	entry->lru_next = NULL;
+}
+
+static void icache_lru_push(ext2_fs_t * this, struct ext2_icache_entry * entry) {
+	entry->lru_prev = NULL;
+	entry->lru_next = this->icache_head;
+	if (this->icache_head) this->icache_head->lru_prev = entry;
+	this->icache_head = entry;
+	if (!this->icache_tail) this->icache_tail = entry;
+}
+
+/**
+ * ext2->icache_find Look up a cached inode and take a reference to it.
+ *
+ * The caller must hold icache_lock.
+ */
+static struct ext2_icache_entry * icache_find(ext2_fs_t * this, uint32_t inode_no) {
+	for (struct ext2_icache_entry * entry = this->icache[icache_hash(inode_no)]; entry; entry = entry->hash_next) {
+		if (entry->inode_no == inode_no) {
+			entry->refcount++;
+			icache_lru_unlink(this, entry);
+			icache_lru_push(this, entry);
+			return entry;
+		}
+	}
+	return NULL;
+}
+
+/**
+ * ext2->icache_evict Drop unused inodes while the cache is over its size.
+ *
+ * Inodes that are in use or still have changes to write back are kept,
+ * so the cache may grow past its size while many inodes are busy.
+ * The caller must hold icache_lock; evicted entries are returned in a
+ * list to be freed after it is released.
+ */
+static struct ext2_icache_entry * icache_evict(ext2_fs_t * this) {
+	struct ext2_icache_entry * freed = NULL;
+	struct ext2_icache_entry * entry = this->icache_tail;
+	while (entry && this->icache_count > EXT2_ICACHE_ENTRIES) {
+		struct ext2_icache_entry * prev = entry->lru_prev;
+		if (!entry->refcount && !entry->dirty) {
+			struct ext2_icache_entry ** link = &this->icache[icache_hash(entry->inode_no)];
+			while (*link != entry) link = &(*link)->hash_next;
+			*link = entry->hash_next;
+			icache_lru_unlink(this, entry);
+			this->icache_count--;
+			entry->hash_next = freed;
+			freed = entry;
+		}
+		entry = prev;
+	}
+	return freed;
+}
+
+/**
+ * ext2->read_inode Obtain an inode.
+ *
+ * The returned inode is shared with any other users of it; changes
+ * should be made through @ref write_inode, and it must be released
+ * with @ref release_inode when no longer needed.
+ *
+ * @returns The inode, or NULL if it could not be read.
+ */
+static ext2_inodetable_t * read_inode(ext2_fs_t * this, size_t inode) {
+	spin_lock(this->icache_lock);
+	struct ext2_icache_entry * entry = icache_find(this, inode);
+	spin_unlock(this->icache_lock);
+	if (entry) return (ext2_inodetable_t *)entry->data;
+
+	uint32_t block;
+	size_t offset;
+	if (inode_location(this, inode, &block, &offset) != E_SUCCESS) return NULL;
+
+	uint8_t * buf = malloc(this->block_size);
+	if (read_block(this, block, buf) != E_SUCCESS) {
+		free(buf);
+		return NULL;
+	}
+
+	struct ext2_icache_entry * fresh = malloc(sizeof(struct ext2_icache_entry) + this->inode_size);
+	memset(fresh, 0, sizeof(struct ext2_icache_entry));
+	fresh->inode_no = inode;
+	fresh->refcount = 1;
+	memcpy(fresh->data, buf + offset, this->inode_size);
+	free(buf);
+
+	spin_lock(this->icache_lock);
+	/* Someone else may have read it while we were */
+	entry = icache_find(this, inode);
+	struct ext2_icache_entry * freed = NULL;
+	if (!entry) {
+		size_t index = icache_hash(inode);
+		fresh->hash_next = this->icache[index];
+		this->icache[index] = fresh;
+		icache_lru_push(this, fresh);
+		this->icache_count++;
+		freed = icache_evict(this);
+		entry = fresh;
+		fresh = NULL;
+	}
+	spin_unlock(this->icache_lock);
+
+	if (fresh) free(fresh);
+	while (freed) {
+		struct ext2_icache_entry * next = freed->hash_next;
+		free(freed);
+		freed = next;
+	}
+
+	return (ext2_inodetable_t *)entry->data;
+}
+
+/**
+ * ext2->flush_inode Copy a cached inode back into the inode table.
+ *
+ * The caller must hold a reference to the entry.
+ */
+static int flush_inode(ext2_fs_t * this, struct ext2_icache_entry * entry) {
+	uint32_t block;
+	size_t offset;
+	if (inode_location(this, entry->inode_no, &block, &offset) != E_SUCCESS) return E_BADBLOCK;
+	if (bcache_update(this->block_device, block, this->block_size, offset, this->inode_size, entry->data, EXT2_PASS_INODE)) return E_BADBLOCK;
+	return E_SUCCESS;
+}
+
+/**
+ * ext2->mark_inode Flag a cached inode as changed.
+ *
+ * @param datasync Whether the change matters to fdatasync
+ */
+static int mark_inode(ext2_fs_t * this, ext2_inodetable_t *inode, size_t index, int datasync) {
+	if (!index || !inode) {
 		dprintf("ext2: Attempt to write inode 0\n");
 		return E_BADBLOCK;
 	}
-	index--;
 
-	size_t group = index / this->inodes_per_group;
-	if (group > BGDS) {
-		return E_BADBLOCK;
+	struct ext2_icache_entry * entry = icache_entry(inode);
+	if (entry->inode_no != index) {
+		dprintf("ext2: Inode %zu does not match cached inode %u\n", index, entry->inode_no);
+		return E_BADBLOCK;
+	}
+
+	entry->dirty = 1;
+	if (datasync) entry->datasync = 1;
+	return E_SUCCESS;
+}
+
+/**
+ * ext2->write_inode Note that an inode obtained from @ref read_inode has changed.
+ *
+ * The inode table is updated when the last reference to the inode is released,
+ * so several changes made during one operation are written together.
+ */
+static int write_inode(ext2_fs_t * this, ext2_inodetable_t *inode, size_t index) {
+	return mark_inode(this, inode, index, 1);
+}
+
+/**
+ * ext2->write_inode_attributes Like @ref write_inode, for changes that don't affect reading the data back.
+ *
+ * fdatasync doesn't need to write these out.
+ */
+static int write_inode_attributes(ext2_fs_t * this, ext2_inodetable_t *inode, size_t index) {
+	return mark_inode(this, inode, index, 0);
+}
+
+/**
+ * ext2->release_inode Release an inode obtained from @ref read_inode.
+ *
+ * If this was the last reference and the inode was changed, it is written back.
+ */
+static void release_inode(ext2_fs_t * this, ext2_inodetable_t * inode) {
+	if (!inode) return;
+	struct ext2_icache_entry * entry = icache_entry(inode);
+
+	spin_lock(this->icache_lock);
+	while (entry->refcount == 1 && entry->dirty) {
+		/* Keep our reference while writing so the entry can't be evicted under us */
+		entry->dirty = 0;
+		spin_unlock(this->icache_lock);
+		flush_inode(this, entry);
+		spin_lock(this->icache_lock);
+	}
+	entry->refcount--;
+	spin_unlock(this->icache_lock);
+}
+
+/**
+ * ext2->sync_inodes Write back every cached inode with outstanding changes.
+ */
+static void sync_inodes(ext2_fs_t * this) {
+	for (size_t i = 0; i < EXT2_ICACHE_BUCKETS; ++i) {
+		spin_lock(this->icache_lock);
+		for (struct ext2_icache_entry * entry = this->icache[i]; entry; entry = entry->hash_next) {
+			if (!entry->dirty) continue;
+			entry->refcount++;
+			entry->dirty = 0;
+			spin_unlock(this->icache_lock);
+			flush_inode(this, entry);
+			spin_lock(this->icache_lock);
+			entry->refcount--;
+		}
+		spin_unlock(this->icache_lock);
+	}
+}
+
+/**
+ * ext2->write_group_descriptor Write back the descriptor block holding one group.
+ */
+static void write_group_descriptor(ext2_fs_t * this, unsigned int group) {
+	unsigned int i = group / (this->block_size / sizeof(ext2_bgdescriptor_t));
+	write_block(this, this->bgd_offset + i, (uint8_t *)((uintptr_t)BGD + this->block_size * i), EXT2_PASS_ALLOC);
+}
+
+/**
+ * ext2->allocate_blocks_locked Allocate a run of contiguous blocks.
+ *
+ * Searches from `goal` (or the group of the last allocation if there is no goal),
+ * skipping groups whose descriptors say they are full and bitmap bytes that are
+ * fully used. The run never crosses a group boundary, so it may be shorter than
+ * asked for. The bitmap is modified in place in the block cache; it, the group
+ * descriptor, and the superblock are written back with everything else.
+ *
+ * The caller must hold this->mutex. The blocks are not cleared.
+ *
+ * @param goal Preferred first block, or 0 for no preference
+ * @param want Maximum number of blocks to allocate
+ * @param got  Set to the number of blocks allocated
+ * @returns First block of the run, or 0 if the disk is full.
+ */
+static unsigned int allocate_blocks_locked(ext2_fs_t * this, unsigned int goal, unsigned int want, unsigned int * got) {
+	unsigned int per_group = SB->blocks_per_group;
+	unsigned int first = SB->first_data_block;
+	unsigned int start_group = this->alloc_group % BGDS;
+	unsigned int start_bit = 0;
+
+	if (goal > first && goal < SB->blocks_count) {
+		start_group = (goal - first) / per_group;
+		start_bit = (goal - first) % per_group;
+	}
+
+	for (unsigned int n = 0; n <= BGDS; ++n) {
+		unsigned int group = (start_group + n) % BGDS;
+		if (!BGD[group].free_blocks_count) continue;
+
+		/* The last group may be short */
+		unsigned int limit = per_group;
+		if (first + group * per_group + limit > SB->blocks_count) {
+			limit = SB->blocks_count - first - group * per_group;
+		}
+
+		/* Revisiting the first group (n == BGDS) covers the part before the goal */
+		if (n == BGDS && !start_bit) break;
+		unsigned int bit = (n == 0) ? start_bit : 0;
+		if (bit >= limit) continue;
+
+		struct bcache_buf * bitmap = bcache_get(this->block_device, BGD[group].block_bitmap, this->block_size);
+		if (!bitmap) continue;
+
+		mutex_acquire(bitmap->lock);
+		uint8_t * bg_buffer = bitmap->data;
+
+		while (bit < limit && BLOCKBIT(bit)) {
+			/* Skip over fully-used bytes at a time */
+			if (!(bit % 8) && BLOCKBYTE(bit) == 0xFF) bit += 8;
+			else bit++;
+		}
+
+		unsigned int count = 0;
+		if (bit < limit) {
+			while (count < want && bit + count < limit && !BLOCKBIT(bit + count)) {
+				BLOCKBYTE(bit + count) |= SETBIT(bit + count);
+				count++;
+			}
+			bcache_dirty(bitmap, EXT2_PASS_ALLOC);
+		}
+
+		mutex_release(bitmap->lock);
+		bcache_release(bitmap);
+
+		if (!count) continue;
+
+		BGD[group].free_blocks_count -= count;
+		write_group_descriptor(this, group);
+
+		SB->free_blocks_count -= count;
+		rewrite_superblock(this);
+
+		this->alloc_group = group;
+		*got = count;
+
+		debug_print(WARNING, "allocated %u blocks at #%u (group %u)", count, first + group * per_group + bit, group);
+		return first + group * per_group + bit;
+	}
+
+	return 0;
+}
+
+/**
+ * ext2->free_blocks_locked Return a run of blocks to the free pool.
+ *
+ * The caller must hold this->mutex.
+ */
+static void free_blocks_locked(ext2_fs_t * this, unsigned int block, unsigned int count) {
+	unsigned int per_group = SB->blocks_per_group;
+
+	while (count) {
+		unsigned int group = (block - SB->first_data_block) / per_group;
+		unsigned int bit = (block - SB->first_data_block) % per_group;
+		unsigned int span = per_group - bit;
+		if (span > count) span = count;
+
+		struct bcache_buf * bitmap = bcache_get(this->block_device, BGD[group].block_bitmap, this->block_size);
+		if (!bitmap) return;
+
+		mutex_acquire(bitmap->lock);
+		uint8_t * bg_buffer = bitmap->data;
+		for (unsigned int i = 0; i < span; ++i) {
+			BLOCKBYTE(bit + i) &= ~SETBIT(bit + i);
+		}
+		bcache_dirty(bitmap, EXT2_PASS_ALLOC);
+		mutex_release(bitmap->lock);
+		bcache_release(bitmap);
+
+		BGD[group].free_blocks_count += span;
+		write_group_descriptor(this, group);
+		SB->free_blocks_count += span;
+
+		block += span;
+		count -= span;
+	}
+
+	rewrite_superblock(this);
+}
+
+/**
+ * ext2->prealloc_discard_locked Give back an inode's reserved blocks, if it has any.
+ *
+ * The caller must hold this->mutex.
+ */
+static void prealloc_discard_locked(ext2_fs_t * this, uint32_t inode_no) {
+	for (int i = 0; i < EXT2_PREALLOC_SLOTS; ++i) {
+		struct ext2_prealloc * slot = &this->prealloc[i];
+		if (slot->inode != inode_no) continue;
+		if (slot->count) free_blocks_locked(this, slot->block, slot->count);
+		memset(slot, 0, sizeof(struct ext2_prealloc));
+	}
+}
+
+/**
+ * ext2->allocate_inode_run Allocate disk blocks for a run of inode blocks.
+ *
+ * Takes blocks from the inode's preallocation window if it lines up with
+ * `iblock`, and otherwise allocates a fresh run near `goal`, reserving
+ * the remainder of the window for the next write.
+ *
+ * @param iblock   First inode block the run is for
+ * @param goal     Preferred first disk block, or 0
+ * @param want     Number of blocks needed
+ * @param prealloc Whether to reserve a window beyond them (for regular files)
+ * @param got      Set to the number of blocks allocated
+ * @returns First disk block of the run, or 0 if the disk is full.
+ */
+static unsigned int allocate_inode_run(ext2_fs_t * this, unsigned int inode_no, unsigned int iblock, unsigned int goal, unsigned int want, int prealloc, unsigned int * got) {
+	mutex_acquire(this->mutex);
+
+	struct ext2_prealloc * slot = NULL;
+	for (int i = 0; i < EXT2_PREALLOC_SLOTS; ++i) {
+		if (this->prealloc[i].inode == inode_no) {
+			slot = &this->prealloc[i];
+			break;
+		}
+	}
+
+	if (slot && slot->count && slot->iblock == iblock) {
+		unsigned int take = want < slot->count ? want : slot->count;
+		unsigned int out = slot->block;
+		slot->iblock += take;
+		slot->block  += take;
+		slot->count  -= take;
+		mutex_release(this->mutex);
+		*got = take;
+		return out;
+	}
+
+	/* The window doesn't match the write; drop it and start a new one */
+	if (slot) {
+		if (slot->count) free_blocks_locked(this, slot->block, slot->count);
+		slot->count = 0;
+	}
+
+	unsigned int count = 0;
+	unsigned int ask = (prealloc && want < EXT2_PREALLOC_BLOCKS) ? EXT2_PREALLOC_BLOCKS : want;
+	unsigned int out = allocate_blocks_locked(this, goal, ask, &count);
+	if (!out) {
+		mutex_release(this->mutex);
+		return 0;
+	}
+
+	unsigned int take = want < count ? want : count;
+	if (count > take) {
+		if (!slot) {
+			slot = &this->prealloc[this->prealloc_next];
+			this->prealloc_next = (this->prealloc_next + 1) % EXT2_PREALLOC_SLOTS;
+			if (slot->inode && slot->count) free_blocks_locked(this, slot->block, slot->count);
+		}
+		slot->inode  = inode_no;
+		slot->iblock = iblock + take;
+		slot->block  = out + take;
+		slot->count  = count - take;
+	}
+
+	mutex_release(this->mutex);
+	*got = take;
+	return out;
+}
+
+/**
+ * ext2->allocate_block Allocate a single cleared block, for metadata and directories.
+ */
+static size_t allocate_block(ext2_fs_t * this) {
+	unsigned int got;
+
+	mutex_acquire(this->mutex);
+	unsigned int block_no = allocate_blocks_locked(this, 0, 1, &got);
+	mutex_release(this->mutex);
+
+	if (!block_no) {
+		debug_print(CRITICAL, "No available blocks, disk is out of space!");
+		return 0;
+	}
+
+	write_block(this, block_no, this->zero_block, EXT2_PASS_DATA);
+
+	return block_no;
+}
+
+/**
+ * ext2->allocate_inode_block Allocate a block in an inode.
+ *
+ * @param inode Inode to operate on
+ * @param inode_no Number of the inode (this is not part of the struct)
+ * @param block Block within inode to allocate
+ * @returns Error code or E_SUCCESS
+ */
+static int allocate_inode_block(ext2_fs_t * this, ext2_inodetable_t * inode, unsigned int inode_no, unsigned int block) {
+	debug_print(NOTICE, "Allocating block #%d for inode #%d", block, inode_no);
+	unsigned int block_no = allocate_block(this);
+
+	if (!block_no) return E_NOSPACE;
+
+	set_block_number(this, inode, inode_no, block, block_no);
+	inode->blocks += this->block_size / 512;
+	write_inode(this, inode, inode_no);
+
+	return E_SUCCESS;
+}
+
+/**
+ * ext2->inode_read_block
+ *
+ * @param inode
+ * @param inode_no
+ * @param block
+ * @parma buf
+ * @returns Real block number for reference.
+ */
+static unsigned int inode_read_block(ext2_fs_t * this, ext2_inodetable_t * inode, unsigned int inode_no, unsigned int block, uint8_t * buf) {
+	unsigned int real_block = get_block_number(this, inode, inode_no, block);
+
+	if (!real_block) {
+		/* Unallocated blocks read as zeros */
+		memset(buf, 0x00, this->block_size);
+		return 0;
+	}
+
+	read_block(this, real_block, buf);
+
+	return real_block;
+}
+
+/**
+ * ext2->inode_data_blocks Count the data blocks allocated to an inode, up to the first hole.
+ *
+ * i_blocks also counts indirect blocks (and, on filesystems written by older
+ * versions of this driver, only data blocks), so it is only a starting point.
+ */
+static unsigned int inode_data_blocks(ext2_fs_t * this, ext2_inodetable_t * inode, unsigned int inode_no) {
+	unsigned int count = inode->blocks / (this->block_size / 512);
+	while (count && !get_block_number(this, inode, inode_no, count - 1)) count--;
+	return count;
+}
+
+/**
+ * ext2->inode_allocate_through Allocate blocks in an inode up to and including `block`.
+ *
+ * Blocks are allocated in contiguous runs following the last allocated block,
+ * and the inode is written once at the end. New blocks are cleared, except for
+ * those in [keep_start, keep_end), which the caller is about to overwrite entirely.
+ *
+ * @returns Error code or E_SUCCESS
+ */
+static int inode_allocate_through(ext2_fs_t * this, ext2_inodetable_t * inode, unsigned int inode_no, unsigned int block, unsigned int keep_start, unsigned int keep_end) {
+	unsigned int per_block = this->block_size / 512;
+	unsigned int next = inode_data_blocks(this, inode, inode_no);
+	int status = E_SUCCESS;
+
+	if (block < next) return E_SUCCESS;
+
+	while (block >= next) {
+		/* Files from elsewhere may be sparse; leave blocks past a hole alone */
+		if (get_block_number(this, inode, inode_no, next)) {
+			next++;
+			continue;
+		}
+		unsigned int want = 1;
+		while (next + want <= block && want < 1024 && !get_block_number(this, inode, inode_no, next + want)) want++;
+
+		unsigned int goal = next ? get_block_number(this, inode, inode_no, next - 1) + 1 : 0;
+		unsigned int got = 0;
+		unsigned int start = allocate_inode_run(this, inode_no, next, goal, want, (inode->mode & 0xF000) == EXT2_S_IFREG, &got);
+		if (!start) {
+			debug_print(CRITICAL, "No available blocks, disk is out of space!");
+			status = E_NOSPACE;
+			break;
+		}
+
+		debug_print(NOTICE, "Allocated blocks #%u-%u for inode #%u blocks %u-%u", start, start + got - 1, inode_no, next, next + got - 1);
+
+		for (unsigned int i = 0; i < got; ++i) {
+			if (next + i < keep_start || next + i >= keep_end) {
+				write_block(this, start + i, this->zero_block, EXT2_PASS_DATA);
+			}
+			if (set_block_number(this, inode, inode_no, next + i, start + i) != E_SUCCESS) {
+				status = E_NOSPACE;
+				got = i;
+				break;
+			}
+		}
+
+		next += got;
+		inode->blocks += got * per_block;
+		if (status != E_SUCCESS) break;
+	}
+
+	write_inode(this, inode, inode_no);
+	return status;
+}
+
+/**
+ * ext2->inode_write_block
+ */
+static unsigned int inode_write_block(ext2_fs_t * this, ext2_inodetable_t * inode, unsigned int inode_no, unsigned int block, uint8_t * buf) {
+	unsigned int real_block = get_block_number(this, inode, inode_no, block);
+	int pass = (real_block && (inode->mode & 0xF000) == EXT2_S_IFDIR) ? EXT2_PASS_DIR : EXT2_PASS_DATA;
+
+	if (!real_block) {
+		debug_print(WARNING, "clearing and allocating up to required blocks (block=%d, %d)", block, inode->blocks);
+		if (inode_allocate_through(this, inode, inode_no, block, 0, 0) != E_SUCCESS) {
+			return 0;
+		}
+		real_block = get_block_number(this, inode, inode_no, block);
+	}
+
+	if (!real_block) {
+		/* A hole before the end of the file */
+		if (allocate_inode_block(this, inode, inode_no, block) != E_SUCCESS) {
+			return 0;
+		}
+		real_block = get_block_number(this, inode, inode_no, block);
+	}
+
+	debug_print(WARNING, "Writing virtual block %d for inode %d maps to real block %d", block, inode_no, real_block);
+
+	write_block(this, real_block, buf, pass);
+	return real_block;
+}
+
+/**
+ * ext2->inode_map_run Find a run of inode blocks that are contiguous on disk.
+ *
+ * @param block Inode block the run starts at
+ * @param max   Longest run to look for
+ * @param run   Set to the length of the run found
+ * @returns Real block number of the start of the run, or 0 for a hole
+ */
+static unsigned int inode_map_run(ext2_fs_t * this, ext2_inodetable_t * inode, unsigned int inode_no, unsigned int block, unsigned int max, unsigned int * run) {
+	unsigned int start = get_block_number(this, inode, inode_no, block);
+	*run = 1;
+	if (!start) return 0;
+	while (*run < max &&
+		get_block_number(this, inode, inode_no, block + *run) == start + *run) {
+		(*run)++;
+	}
+	return start;
+}
+
+/*
+ * Hashed directory indexes (dir_index / htree), compatible with ext3.
+ *
+ * An indexed directory keeps a tree of (hash, block) pairs in its first
+ * block and, for larger directories, one further level of index blocks.
+ * Leaf blocks are ordinary directory blocks holding the entries whose name
+ * hashes fall in their range, and index blocks look like empty directory
+ * blocks, so code that scans a directory linearly still works on them.
+ */
+#define DX_ROL(x, s) (((x) << (s)) | ((x) >> (32 - (s))))
+
+#define DX_F(x, y, z) ((z) ^ ((x) & ((y) ^ (z))))
+#define DX_G(x, y, z) (((x) & (y)) + (((x) ^ (y)) & (z)))
+#define DX_H(x, y, z) ((x) ^ (y) ^ (z))
+#define DX_ROUND(f, a, b, c, d, x, s) (a += f(b, c, d) + (x), a = DX_ROL(a, s))
+#define DX_K2 013240474631U
+#define DX_K3 015666365641U
+
+static void dx_half_md4(uint32_t buf[4], const uint32_t in[8]) {
+	uint32_t a = buf[0], b = buf[1], c = buf[2], d = buf[3];
+
+	DX_ROUND(DX_F, a, b, c, d, in[0],  3);
+	DX_ROUND(DX_F, d, a, b, c, in[1],  7);
+	DX_ROUND(DX_F, c, d, a, b, in[2], 11);
+	DX_ROUND(DX_F, b, c, d, a, in[3], 19);
+	DX_ROUND(DX_F, a, b, c, d, in[4],  3);
+	DX_ROUND(DX_F, d, a, b, c, in[5],  7);
+	DX_ROUND(DX_F, c, d, a, b, in[6], 11);
+	DX_ROUND(DX_F, b, c, d, a, in[7], 19);
+
+	DX_ROUND(DX_G, a, b, c, d, in[1] + DX_K2,  3);
+	DX_ROUND(DX_G, d, a, b, c, in[3] + DX_K2,  5);
+	DX_ROUND(DX_G, c, d, a, b, in[5] + DX_K2,  9);
+	DX_ROUND(DX_G, b, c, d, a, in[7] + DX_K2, 13);
+	DX_ROUND(DX_G, a, b, c, d, in[0] + DX_K2,  3);
+	DX_ROUND(DX_G, d, a, b, c, in[2] + DX_K2,  5);
+	DX_ROUND(DX_G, c, d, a, b, in[4] + DX_K2,  9);
+	DX_ROUND(DX_G, b, c, d, a, in[6] + DX_K2, 13);
+
+	DX_ROUND(DX_H, a, b, c, d, in[3] + DX_K3,  3);
+	DX_ROUND(DX_H, d, a, b, c, in[7] + DX_K3,  9);
+	DX_ROUND(DX_H, c, d, a, b, in[2] + DX_K3, 11);
+	DX_ROUND(DX_H, b, c, d, a, in[6] + DX_K3, 15);
+	DX_ROUND(DX_H, a, b, c, d, in[1] + DX_K3,  3);
+	DX_ROUND(DX_H, d, a, b, c, in[5] + DX_K3,  9);
+	DX_ROUND(DX_H, c, d, a, b, in[0] + DX_K3, 11);
+	DX_ROUND(DX_H, b, c, d, a, in[4] + DX_K3, 15);
+
+	buf[0] += a;
+	buf[1] += b;
+	buf[2] += c;
+	buf[3] += d;
+}
+
+static void dx_tea(uint32_t buf[4], const uint32_t in[4]) {
+	uint32_t sum = 0;
+	uint32_t b0 = buf[0], b1 = buf[1];
+	uint32_t a = in[0], b = in[1], c = in[2], d = in[3];
+
+	for (int n = 0; n < 16; ++n) {
+		sum += 0x9E3779B9;
+		b0 += ((b1 << 4) + a) ^ (b1 + sum) ^ ((b1 >> 5) + b);
+		b1 += ((b0 << 4) + c) ^ (b0 + sum) ^ ((b0 >> 5) + d);
+	}
+
+	buf[0] += b0;
+	buf[1] += b1;
+}
+
+static int dx_char(const char * p, int is_unsigned) {
+	return is_unsigned ? (int)*(const unsigned char *)p : (int)*(const signed char *)p;
+}
+
+static uint32_t dx_legacy(const char * name, int len, int is_unsigned) {
+	uint32_t hash, hash0 = 0x12a3fe2d, hash1 = 0x37abe8f9;
+
+	for (int i = 0; i < len; ++i) {
+		hash = hash1 + (hash0 ^ (uint32_t)(dx_char(&name[i], is_unsigned) * 7152373));
+		if (hash & 0x80000000) hash -= 0x7fffffff;
+		hash1 = hash0;
+		hash0 = hash;
+	}
+
+	return hash0 << 1;
+}
+
+static void dx_str2hashbuf(const char * msg, int len, uint32_t * buf, int num, int is_unsigned) {
+	uint32_t pad = (uint32_t)len | ((uint32_t)len << 8);
+	pad |= pad << 16;
+
+	uint32_t val = pad;
+	if (len > num * 4) len = num * 4;
+	for (int i = 0; i < len; ++i) {
+		val = (uint32_t)dx_char(&msg[i], is_unsigned) + (val << 8);
+		if ((i % 4) == 3) {
+			*buf++ = val;
+			val = pad;
+			num--;
+		}
+	}
+	if (--num >= 0) *buf++ = val;
+	while (--num >= 0) *buf++ = pad;
+}
+
+/**
+ * ext2->dx_hash Hash a name the way Linux does for directory indexes.
+ *
+ * @param version One of the DX_HASH_ values, plus DX_HASH_UNSIGNED if applicable
+ * @returns The major hash, with the low (collision) bit clear.
+ */
+static uint32_t dx_hash(ext2_fs_t * this, const char * name, int len, int version) {
+	uint32_t buf[4] = { 0x67452301, 0xefcdab89, 0x98badcfe, 0x10325476 };
+	uint32_t in[8];
+	uint32_t hash;
+	int is_unsigned = version >= DX_HASH_UNSIGNED;
+
+	if (SB->hash_seed[0] || SB->hash_seed[1] || SB->hash_seed[2] || SB->hash_seed[3]) {
+		memcpy(buf, SB->hash_seed, sizeof(buf));
+	}
+
+	switch (version % DX_HASH_UNSIGNED) {
+		case DX_HASH_HALF_MD4:
+			for (const char * p = name; len > 0; len -= 32, p += 32) {
+				dx_str2hashbuf(p, len, in, 8, is_unsigned);
+				dx_half_md4(buf, in);
+			}
+			hash = buf[1];
+			break;
+		case DX_HASH_TEA:
+			for (const char * p = name; len > 0; len -= 16, p += 16) {
+				dx_str2hashbuf(p, len, in, 4, is_unsigned);
+				dx_tea(buf, in);
+			}
+			hash = buf[0];
+			break;
+		default:
+			hash = dx_legacy(name, len, is_unsigned);
+			break;
+	}
+
+	hash &= ~1;
+	if (hash == (0x7fffffffU << 1)) hash = (0x7fffffffU - 1) << 1;
+	return hash;
+}
+
+static int dx_version(ext2_fs_t * this, unsigned int hash_version) {
+	return hash_version + ((SB->flags & EXT2_FLAGS_UNSIGNED_HASH) ? DX_HASH_UNSIGNED : 0);
+}
+
+static unsigned int dir_rec_len(unsigned int name_len) {
+	return (sizeof(ext2_dir_t) + name_len + 3) & ~3;
+}
+
+static struct ext2_dx_countlimit * dx_countlimit(struct ext2_dx_entry * entries) {
+	return (struct ext2_dx_countlimit *)entries;
+}
+
+static unsigned int dx_root_limit(ext2_fs_t * this) {
+	return (this->block_size - 32) / sizeof(struct ext2_dx_entry);
+}
+
+static unsigned int dx_node_limit(ext2_fs_t * this) {
+	return (this->block_size - 8) / sizeof(struct ext2_dx_entry);
+}
+
+struct ext2_dx_frame {
+	unsigned int block;              /* Directory block holding this index node */
+	uint8_t * data;
+	struct ext2_dx_entry * entries;
+	struct ext2_dx_entry * at;       /* Entry that was followed */
+};
+
+struct ext2_dx_path {
+	int depth;
+	int version;
+	uint32_t hash;
+	struct ext2_dx_frame frames[DX_MAX_LEVELS];
+};
+
+static void dx_release(struct ext2_dx_path * path) {
+	for (int i = 0; i < path->depth; ++i) {
+		free(path->frames[i].data);
+	}
+	path->depth = 0;
+}
+
+/**
+ * ext2->dx_probe Walk a directory's index down to the leaf that should hold a name.
+ *
+ * On success the path holds a copy of each index node visited and must be
+ * released with @ref dx_release.
+ *
+ * @returns Directory block number of the leaf, or -1 if the index is unusable.
+ */
+static int dx_probe(ext2_fs_t * this, ext2_inodetable_t * inode, unsigned int inode_no, const char * name, struct ext2_dx_path * path) {
+	path->depth = 0;
+
+	uint8_t * data = malloc(this->block_size);
+	if (!inode_read_block(this, inode, inode_no, 0, data)) {
+		free(data);
+		return -1;
+	}
+
+	struct ext2_dx_root_info * info = (struct ext2_dx_root_info *)(data + 24);
+	if (info->reserved_zero || info->info_length != 8 ||
+		info->hash_version > DX_HASH_TEA || info->indirect_levels >= DX_MAX_LEVELS) {
+		debug_print(WARNING, "Directory %d has an index we don't understand", inode_no);
+		free(data);
+		return -1;
+	}
+
+	path->version = dx_version(this, info->hash_version);
+	path->hash = dx_hash(this, name, strlen(name), path->version);
+
+	unsigned int levels = info->indirect_levels;
+	unsigned int block = 0;
+	struct ext2_dx_entry * entries = (struct ext2_dx_entry *)(data + 24 + info->info_length);
+	unsigned int limit = dx_root_limit(this);
+
+	for (unsigned int level = 0; ; ++level) {
+		struct ext2_dx_countlimit * cl = dx_countlimit(entries);
+		if (!cl->count || cl->count > cl->limit || cl->limit != limit) {
+			debug_print(WARNING, "Directory %d has a corrupt index node at block %d", inode_no, block);
+			free(data);
+			dx_release(path);
+			return -1;
+		}
+
+		/* Find the last entry whose hash is not above ours; the first covers everything below the second */
+		unsigned int lo = 1, hi = cl->count;
+		while (lo < hi) {
+			unsigned int mid = (lo + hi) / 2;
+			if (entries[mid].hash > path->hash) hi = mid;
+			else lo = mid + 1;
+		}
+
+		struct ext2_dx_frame * frame = &path->frames[level];
+		frame->block = block;
+		frame->data = data;
+		frame->entries = entries;
+		frame->at = &entries[lo - 1];
+		path->depth = level + 1;
+
+		block = frame->at->block & 0x00FFFFFF;
+		if (level == levels) return block;
+
+		data = malloc(this->block_size);
+		if (!inode_read_block(this, inode, inode_no, block, data)) {
+			free(data);
+			dx_release(path);
+			return -1;
+		}
+		entries = (struct ext2_dx_entry *)(data + 8);
+		limit = dx_node_limit(this);
+	}
+}
+
+/**
+ * ext2->dx_next_leaf Move a path on to the next leaf, if names with our hash may continue there.
+ *
+ * @returns Directory block number of the next leaf, or -1 if there is nothing more to search.
+ */
+static int dx_next_leaf(ext2_fs_t * this, ext2_inodetable_t * inode, unsigned int inode_no, struct ext2_dx_path * path) {
+	int level = path->depth - 1;
+
+	while (1) {
+		struct ext2_dx_frame * frame = &path->frames[level];
+		if (frame->at + 1 < frame->entries + dx_countlimit(frame->entries)->count) {
+			frame->at++;
+			break;
+		}
+		if (!level) return -1;
+		level--;
+	}
+
+	if ((path->frames[level].at->hash & ~1) != path->hash) return -1;
+
+	for (; level + 1 < path->depth; ++level) {
+		struct ext2_dx_frame * child = &path->frames[level + 1];
+		child->block = path->frames[level].at->block & 0x00FFFFFF;
+		if (!inode_read_block(this, inode, inode_no, child->block, child->data)) return -1;
+		child->entries = (struct ext2_dx_entry *)(child->data + 8);
+		child->at = child->entries;
+	}
+
+	return path->frames[path->depth - 1].at->block & 0x00FFFFFF;
+}
+
+/**
+ * ext2->dir_block_find Look for a name in one directory block.
+ */
+static ext2_dir_t * dir_block_find(ext2_fs_t * this, uint8_t * block, const char * name) {
+	size_t name_len = strlen(name);
+	for (unsigned int offset = 0; offset < this->block_size; ) {
+		ext2_dir_t * d_ent = (ext2_dir_t *)(block + offset);
+		if (d_ent->rec_len < sizeof(ext2_dir_t)) break;
+		if (d_ent->inode && d_ent->name_len == name_len && !memcmp(d_ent->name, name, name_len)) {
+			return d_ent;
+		}
+		offset += d_ent->rec_len;
+	}
+	return NULL;
+}
+
+/**
+ * ext2->dir_block_insert Add an entry to a directory block if there is room for it.
+ *
+ * @returns 1 if the entry was added, 0 if the block is full.
+ */
+static int dir_block_insert(ext2_fs_t * this, uint8_t * block, const char * name, uint32_t inode) {
+	size_t name_len = strlen(name);
+	unsigned int needed = dir_rec_len(name_len);
+
+	for (unsigned int offset = 0; offset < this->block_size; ) {
+		ext2_dir_t * d_ent = (ext2_dir_t *)(block + offset);
+		if (d_ent->rec_len < sizeof(ext2_dir_t)) break;
+
+		unsigned int used = d_ent->inode ? dir_rec_len(d_ent->name_len) : 0;
+		if (d_ent->rec_len >= used + needed) {
+			if (used) {
+				ext2_dir_t * next = (ext2_dir_t *)(block + offset + used);
+				next->rec_len = d_ent->rec_len - used;
+				d_ent->rec_len = used;
+				d_ent = next;
+			}
+			d_ent->inode = inode;
+			d_ent->name_len = name_len;
+			d_ent->file_type = 0; /* This is unused */
+			memcpy(d_ent->name, name, name_len);
+			return 1;
+		}
+
+		offset += d_ent->rec_len;
 	}
 
-	size_t inode_table_block = BGD[group].inode_table;
-	index -= group * this->inodes_per_group;
-	size_t block_offset = (index * this->inode_size) / this->block_size;
-	size_t offset_in_block = index - block_offset * (this->block_size / this->inode_size);
-
-	ext2_inodetable_t *inodet = malloc(this->block_size);
-	/* Read the current table block */
-	read_block(this, inode_table_block + block_offset, (uint8_t *)inodet);
-	memcpy((uint8_t *)((uintptr_t)inodet + offset_in_block * this->inode_size), inode, this->inode_size);
-	write_block(this, inode_table_block + block_offset, (uint8_t *)inodet);
-	free(inodet);
-
-	return E_SUCCESS;
+	return 0;
 }
 
-static size_t allocate_block(ext2_fs_t * this) {
-	size_t block_no     = 0;
-	size_t block_offset = 0;
-	size_t group        = 0;
-	uint8_t * bg_buffer = malloc(this->block_size);
-
-	mutex_acquire(this->mutex);
-
-	for (unsigned int i = 0; i < BGDS; ++i) {
-		if (BGD[i].free_blocks_count > 0) {
-			read_block(this, BGD[i].block_bitmap, (uint8_t *)bg_buffer);
-			while (BLOCKBIT(block_offset)) {
-				++block_offset;
+/**
+ * ext2->dir_find Find a name in a directory, through its index if it has one.
+ *
+ * @param block    Buffer for directory blocks; the entry found points into it
+ * @param block_nr Set to the directory block the entry was found in
+ * @returns The entry, or NULL if the name was not found.
+ */
+static ext2_dir_t * dir_find(ext2_fs_t * this, ext2_inodetable_t * inode, unsigned int inode_no, const char * name, uint8_t * block, unsigned int * block_nr) {
+	if (inode->flags & EXT2_INDEX_FL) {
+		struct ext2_dx_path path;
+		int leaf = dx_probe(this, inode, inode_no, name, &path);
+		if (leaf >= 0) {
+			ext2_dir_t * out = NULL;
+			while (leaf >= 0) {
+				if (!inode_read_block(this, inode, inode_no, leaf, block)) break;
+				if ((out = dir_block_find(this, block, name))) {
+					*block_nr = leaf;
+					break;
+				}
+				leaf = dx_next_leaf(this, inode, inode_no, &path);
 			}
-			block_no = block_offset + SB->blocks_per_group * i;
-			group = i;
-			break;
+			dx_release(&path);
+			return out;
 		}
+		/* Fall back to searching every block */
 	}
 
-	if (!block_no) {
-		mutex_release(this->mutex);
-		debug_print(CRITICAL, "No available blocks, disk is out of space!");
-		free(bg_buffer);
-		return 0;
+	unsigned int blocks = (inode->size + this->block_size - 1) / this->block_size;
+	for (unsigned int i = 0; i < blocks; ++i) {
+		if (!inode_read_block(this, inode, inode_no, i, block)) continue;
+		ext2_dir_t * out = dir_block_find(this, block, name);
+		if (out) {
+			*block_nr = i;
+			return out;
+		}
 	}
 
-	debug_print(WARNING, "allocating block #%zu (group %zu)", block_no, group);
+	return NULL;
+}
 
-	BLOCKBYTE(block_offset) |= SETBIT(block_offset);
-	write_block(this, BGD[group].block_bitmap, (uint8_t *)bg_buffer);
+struct ext2_dx_map {
+	uint32_t hash;
+	uint16_t offset;
+	uint16_t size;
+};
 
-	BGD[group].free_blocks_count--;
-	for (int i = 0; i < this->bgd_block_span; ++i) {
-		write_block(this, this->bgd_offset + i, (uint8_t *)((uintptr_t)BGD + this->block_size * i));
+/**
+ * ext2->dx_sort_entries Collect the live entries of a block, plus one more, in hash order.
+ *
+ * The extra entry is built at `source + block_size`; `source` must have room for it.
+ *
+ * @param skip Number of leading entries to leave out (for "." and "..")
+ * @returns Number of entries in the map.
+ */
+static unsigned int dx_sort_entries(ext2_fs_t * this, int version, uint8_t * source, unsigned int skip, const char * name, uint32_t inode, struct ext2_dx_map * map) {
+	unsigned int count = 0;
+	unsigned int seen = 0;
+
+	for (unsigned int offset = 0; offset < this->block_size; ) {
+		ext2_dir_t * d_ent = (ext2_dir_t *)(source + offset);
+		if (d_ent->rec_len < sizeof(ext2_dir_t)) break;
+		if (seen++ >= skip && d_ent->inode) {
+			map[count].hash = dx_hash(this, d_ent->name, d_ent->name_len, version);
+			map[count].offset = offset;
+			map[count].size = dir_rec_len(d_ent->name_len);
+			count++;
+		}
+		offset += d_ent->rec_len;
+	}
+
+	ext2_dir_t * d_ent = (ext2_dir_t *)(source + this->block_size);
+	d_ent->inode = inode;
+	d_ent->name_len = strlen(name);
+	d_ent->rec_len = dir_rec_len(d_ent->name_len);
+	d_ent->file_type = 0;
+	memcpy(d_ent->name, name, d_ent->name_len);
+	map[count].hash = dx_hash(this, name, d_ent->name_len, version);
+	map[count].offset = this->block_size;
+	map[count].size = d_ent->rec_len;
+	count++;
+
+	for (unsigned int i = 1; i < count; ++i) {
+		struct ext2_dx_map tmp = map[i];
+		unsigned int j = i;
+		while (j > 0 && map[j-1].hash > tmp.hash) {
+			map[j] = map[j-1];
+			j--;
+		}
+		map[j] = tmp;
 	}
 
-	SB->free_blocks_count--;
-	rewrite_superblock(this);
-
-	memset(bg_buffer, 0x00, this->block_size);
-	write_block(this, block_no, bg_buffer);
+	return count;
+}
 
-	mutex_release(this->mutex);
+/**
+ * ext2->dx_split_point Pick where to divide sorted entries between two blocks, by size.
+ *
+ * @param split_hash Set to the hash for the index entry of the upper block
+ */
+static unsigned int dx_split_point(struct ext2_dx_map * map, unsigned int count, uint32_t * split_hash) {
+	unsigned int total = 0;
+	for (unsigned int i = 0; i < count; ++i) total += map[i].size;
 
-	free(bg_buffer);
+	unsigned int split = 1;
+	unsigned int size = map[0].size;
+	while (split < count - 1 && size + map[split].size <= total / 2) {
+		size += map[split].size;
+		split++;
+	}
 
-	return block_no;
+	/* The low bit marks names with this hash as continuing from the previous block */
+	*split_hash = map[split].hash | (map[split - 1].hash == map[split].hash);
+	return split;
+}
 
+/**
+ * ext2->dx_pack Write a range of sorted entries into an empty directory block.
+ */
+static void dx_pack(ext2_fs_t * this, uint8_t * dest, uint8_t * source, struct ext2_dx_map * map, unsigned int from, unsigned int to) {
+	unsigned int offset = 0;
+	memset(dest, 0, this->block_size);
+	for (unsigned int i = from; i < to; ++i) {
+		ext2_dir_t * d_ent = (ext2_dir_t *)(dest + offset);
+		memcpy(d_ent, source + map[i].offset, sizeof(ext2_dir_t) + ((ext2_dir_t *)(source + map[i].offset))->name_len);
+		d_ent->rec_len = (i == to - 1) ? this->block_size - offset : map[i].size;
+		offset += map[i].size;
+	}
 }
 
+/**
+ * ext2->dx_insert Add an index entry after the one a frame followed.
+ */
+static void dx_insert(struct ext2_dx_frame * frame, uint32_t hash, uint32_t block) {
+	struct ext2_dx_countlimit * cl = dx_countlimit(frame->entries);
+	struct ext2_dx_entry * end = frame->entries + cl->count;
+	memmove(frame->at + 2, frame->at + 1, (uintptr_t)end - (uintptr_t)(frame->at + 1));
+	frame->at[1].hash = hash;
+	frame->at[1].block = block;
+	cl->count++;
+}
 
 /**
- * ext2->allocate_inode_block Allocate a block in an inode.
+ * ext2->dx_make_room Ensure the bottom index node on a path can take another entry.
  *
- * @param inode Inode to operate on
- * @param inode_no Number of the inode (this is not part of the struct)
- * @param block Block within inode to allocate
- * @returns Error code or E_SUCCESS
+ * A full root is pushed down into a new index node, and a full index
+ * node is split in two if the root has room for the second half.
+ *
+ * @returns E_SUCCESS, or E_NOSPACE if the index can't grow any further.
  */
-static int allocate_inode_block(ext2_fs_t * this, ext2_inodetable_t * inode, unsigned int inode_no, unsigned int block) {
-	debug_print(NOTICE, "Allocating block #%d for inode #%d", block, inode_no);
-	unsigned int block_no = allocate_block(this);
-
-	if (!block_no) return E_NOSPACE;
-
-	set_block_number(this, inode, inode_no, block, block_no);
+static int dx_make_room(ext2_fs_t * this, ext2_inodetable_t * inode, unsigned int inode_no, struct ext2_dx_path * path) {
+	struct ext2_dx_frame * bottom = &path->frames[path->depth - 1];
+	struct ext2_dx_countlimit * cl = dx_countlimit(bottom->entries);
+	if (cl->count < cl->limit) return E_SUCCESS;
+
+	struct ext2_dx_frame * root = &path->frames[0];
+	unsigned int new_block = inode->size / this->block_size;
+	uint8_t * data = malloc(this->block_size);
+	memset(data, 0, this->block_size);
+	((ext2_dir_t *)data)->rec_len = this->block_size;
+	struct ext2_dx_entry * entries = (struct ext2_dx_entry *)(data + 8);
+
+	if (path->depth == 1) {
+		/* Move the root's entries into a new node beneath it */
+		unsigned int count = cl->count;
+		memcpy(entries, root->entries, count * sizeof(struct ext2_dx_entry));
+		dx_countlimit(entries)->limit = dx_node_limit(this);
+		dx_countlimit(entries)->count = count;
+
+		struct ext2_dx_frame * node = &path->frames[1];
+		node->block = new_block;
+		node->data = data;
+		node->entries = entries;
+		node->at = entries + (root->at - root->entries);
+		path->depth = 2;
+
+		cl->count = 1;
+		root->entries[0].block = new_block;
+		root->at = root->entries;
+		((struct ext2_dx_root_info *)(root->data + 24))->indirect_levels = 1;
+	} else {
+		struct ext2_dx_countlimit * rcl = dx_countlimit(root->entries);
+		if (rcl->count >= rcl->limit) {
+			free(data);
+			return E_NOSPACE;
+		}
 
-	unsigned int t = (block + 1) * (this->block_size / 512);
-	if (inode->blocks < t) {
-		debug_print(NOTICE, "Setting inode->blocks to %d = (%d fs blocks)", t, t / (this->block_size / 512));
-		inode->blocks = t;
+		/* Split the node, moving its upper half to a new one */
+		unsigned int count = cl->count;
+		unsigned int keep = count / 2;
+		uint32_t split_hash = bottom->entries[keep].hash;
+		memcpy(entries, bottom->entries + keep, (count - keep) * sizeof(struct ext2_dx_entry));
+		dx_countlimit(entries)->limit = dx_node_limit(this);
+		dx_countlimit(entries)->count = count - keep;
+		cl->count = keep;
+
+		dx_insert(root, split_hash, new_block);
+
+		if (bottom->at - bottom->entries >= (long)keep) {
+			/* Carry on in the new node; the old one only needs writing */
+			if (!inode_write_block(this, inode, inode_no, bottom->block, bottom->data)) {
+				free(data);
+				return E_NOSPACE;
+			}
+			bottom->at = entries + (bottom->at - bottom->entries - keep);
+			free(bottom->data);
+			bottom->block = new_block;
+			bottom->data = data;
+			bottom->entries = entries;
+			root->at++;
+		} else {
+			/* Carry on in the old node; the new one only needs writing */
+			int written = inode_write_block(this, inode, inode_no, new_block, data) != 0;
+			free(data);
+			if (!written) return E_NOSPACE;
+		}
 	}
-	write_inode(this, inode, inode_no);
 
+	/* Whatever is still on the path, including the root, is written by the caller */
+	inode->size += this->block_size;
+	write_inode(this, inode, inode_no);
 	return E_SUCCESS;
 }
 
 /**
- * ext2->inode_read_block
+ * ext2->dx_add_entry Add a name to an indexed directory.
  *
- * @param inode
- * @param no
- * @param block
- * @parma buf
- * @returns Real block number for reference.
+ * @returns E_SUCCESS, or E_NOSPACE if the index can't be used for this
+ *          directory any more and the entry should be added without it.
  */
-static unsigned int inode_read_block(ext2_fs_t * this, ext2_inodetable_t * inode, unsigned int block, uint8_t * buf) {
+static int dx_add_entry(ext2_fs_t * this, ext2_inodetable_t * inode, unsigned int inode_no, const char * name, uint32_t child) {
+	struct ext2_dx_path path;
+	int leaf = dx_probe(this, inode, inode_no, name, &path);
+	if (leaf < 0) return E_NOSPACE;
 
-	if (block >= inode->blocks / (this->block_size / 512)) {
-		memset(buf, 0x00, this->block_size);
-		debug_print(WARNING, "Tried to read an invalid block. Asked for %d (0-indexed), but inode only has %d!", block, inode->blocks / (this->block_size / 512));
-		return 0;
+	int status = E_NOSPACE;
+	uint8_t * block = malloc(this->block_size + 264);
+	struct ext2_dx_map * map = NULL;
+	uint8_t * upper = NULL;
+
+	if (!inode_read_block(this, inode, inode_no, leaf, block)) goto _done;
+
+	if (dir_block_insert(this, block, name, child)) {
+		if (inode_write_block(this, inode, inode_no, leaf, block)) status = E_SUCCESS;
+		goto _done;
 	}
 
-	unsigned int real_block = get_block_number(this, inode, block);
-	read_block(this, real_block, buf);
+	/* The leaf is full; split it in two by hash */
+	if (dx_make_room(this, inode, inode_no, &path) != E_SUCCESS) goto _done;
 
-	return real_block;
+	map = malloc(sizeof(struct ext2_dx_map) * (this->block_size / 12 + 2));
+	unsigned int count = dx_sort_entries(this, path.version, block, 0, name, child, map);
+	uint32_t split_hash;
+	unsigned int split = dx_split_point(map, count, &split_hash);
+
+	upper = malloc(this->block_size);
+	uint8_t * source = malloc(this->block_size + 264);
+	memcpy(source, block, this->block_size + 264);
+	dx_pack(this, block, source, map, 0, split);
+	dx_pack(this, upper, source, map, split, count);
+	free(source);
+
+	unsigned int new_block = inode->size / this->block_size;
+	if (!inode_write_block(this, inode, inode_no, new_block, upper)) goto _done;
+	inode->size += this->block_size;
+	write_inode(this, inode, inode_no);
+	inode_write_block(this, inode, inode_no, leaf, block);
+
+	dx_insert(&path.frames[path.depth - 1], split_hash, new_block);
+	for (int i = path.depth - 1; i >= 0; --i) {
+		inode_write_block(this, inode, inode_no, path.frames[i].block, path.frames[i].data);
+	}
+	status = E_SUCCESS;
+
+_done:
+	if (upper) free(upper);
+	if (map) free(map);
+	free(block);
+	dx_release(&path);
+	return status;
 }
 
 /**
- * ext2->inode_write_block
+ * ext2->dx_make_indexed Turn a full single-block directory into an indexed one.
+ *
+ * The entries of the first block and the new entry are sorted by hash and
+ * divided between two new leaf blocks, and the first block becomes the root
+ * of the index.
+ *
+ * @param block Contents of the directory's first block
+ * @returns E_SUCCESS, or an error if the directory was left as it was.
  */
-static unsigned int inode_write_block(ext2_fs_t * this, ext2_inodetable_t * inode, unsigned int inode_no, unsigned int block, uint8_t * buf) {
-	if (block >= inode->blocks / (this->block_size / 512)) {
-		debug_print(WARNING, "Attempting to write beyond the existing allocated blocks for this inode.");
-		debug_print(WARNING, "Inode %d, Block %d", inode_no, block);
+static int dx_make_indexed(ext2_fs_t * this, ext2_inodetable_t * inode, unsigned int inode_no, uint8_t * block, const char * name, uint32_t child) {
+	ext2_dir_t * dot = (ext2_dir_t *)block;
+	ext2_dir_t * dotdot = (ext2_dir_t *)(block + dot->rec_len);
+	if (dot->rec_len != 12 || dotdot->name_len != 2 || memcmp(dotdot->name, "..", 2)) return E_BADBLOCK;
+
+	unsigned int hash_version = SB->def_hash_version <= DX_HASH_TEA ? SB->def_hash_version : DX_HASH_HALF_MD4;
+	int version = dx_version(this, hash_version);
+
+	uint8_t * source = malloc(this->block_size + 264);
+	memcpy(source, block, this->block_size);
+	struct ext2_dx_map * map = malloc(sizeof(struct ext2_dx_map) * (this->block_size / 12 + 2));
+	unsigned int count = dx_sort_entries(this, version, source, 2, name, child, map);
+	if (count < 2) {
+		free(map);
+		free(source);
+		return E_BADBLOCK;
 	}
 
-	debug_print(WARNING, "clearing and allocating up to required blocks (block=%d, %d)", block, inode->blocks);
-	char * empty = NULL;
-
-	while (block >= inode->blocks / (this->block_size / 512)) {
-		allocate_inode_block(this, inode, inode_no, inode->blocks / (this->block_size / 512));
-		refresh_inode(this, inode, inode_no);
-	}
-	if (empty) free(empty);
-	debug_print(WARNING, "... done");
+	uint32_t split_hash;
+	unsigned int split = dx_split_point(map, count, &split_hash);
+
+	uint8_t * leaf = malloc(this->block_size);
+	int status = E_NOSPACE;
+	dx_pack(this, leaf, source, map, 0, split);
+	if (!inode_write_block(this, inode, inode_no, 1, leaf)) goto _done;
+	dx_pack(this, leaf, source, map, split, count);
+	if (!inode_write_block(this, inode, inode_no, 2, leaf)) goto _done;
+
+	uint32_t parent = dotdot->inode;
+	memset(leaf, 0, this->block_size);
+	dot = (ext2_dir_t *)leaf;
+	dot->inode = inode_no;
+	dot->rec_len = 12;
+	dot->name_len = 1;
+	dot->name[0] = '.';
+	dotdot = (ext2_dir_t *)(leaf + 12);
+	dotdot->inode = parent;
+	dotdot->rec_len = this->block_size - 12;
+	dotdot->name_len = 2;
+	dotdot->name[0] = '.';
+	dotdot->name[1] = '.';
+
+	struct ext2_dx_root_info * info = (struct ext2_dx_root_info *)(leaf + 24);
+	info->hash_version = hash_version;
+	info->info_length = 8;
+	struct ext2_dx_entry * entries = (struct ext2_dx_entry *)(leaf + 32);
+	dx_countlimit(entries)->limit = dx_root_limit(this);
+	dx_countlimit(entries)->count = 2;
+	entries[0].block = 1;
+	entries[1].hash = split_hash;
+	entries[1].block = 2;
+
+	inode->size = this->block_size * 3;
+	inode->flags |= EXT2_INDEX_FL;
+	write_inode(this, inode, inode_no);
+	inode_write_block(this, inode, inode_no, 0, leaf);
+	status = E_SUCCESS;
 
-	unsigned int real_block = get_block_number(this, inode, block);
-	debug_print(WARNING, "Writing virtual block %d for inode %d maps to real block %d", block, inode_no, real_block);
+	debug_print(NOTICE, "Indexed directory %d (%d entries)", inode_no, count);
 
-	write_block(this, real_block, buf);
-	return real_block;
+_done:
+	free(leaf);
+	free(map);
+	free(source);
+	return status;
 }
 
 /**
@@ -648,9 +2013,21 @@ static int create_entry(fs_node_t * parent, char * name, uint32_t inode) {
 	ext2_inodetable_t * pinode = read_inode(this,parent->inode);
 	if (((pinode->mode & EXT2_S_IFDIR) == 0) || (name == NULL)) {
 		debug_print(WARNING, "Attempted to allocate an inode in a parent that was not a directory.");
+		release_inode(this, pinode);
 		return E_BADPARENT;
 	}
 
+	if (pinode->flags & EXT2_INDEX_FL) {
+		if (dx_add_entry(this, pinode, parent->inode, name, inode) == E_SUCCESS) {
+			release_inode(this, pinode);
+			return E_SUCCESS;
+		}
+		/* The index is full or damaged; carry on with it as an ordinary directory */
+		debug_print(WARNING, "Dropping the index of directory %d", (int)parent->inode);
+		pinode->flags &= ~EXT2_INDEX_FL;
+		write_inode(this, pinode, parent->inode);
+	}
+
 	debug_print(WARNING, "Creating a directory entry for %s pointing to inode %d.", name, inode);
 
 	/* okay, how big is it... */
@@ -671,18 +2048,18 @@ static int create_entry(fs_node_t * parent, char * name, uint32_t inode) {
 	debug_print(WARNING, "Block size is %d", this->block_size);
 
 	uint8_t * block = malloc(this->block_size);
-	uint8_t block_nr = 0;
+	unsigned int block_nr = 0;
 	uint32_t dir_offset = 0;
 	uint32_t total_offset = 0;
 	int modify_or_replace = 0;
 	ext2_dir_t *previous;
 
-	inode_read_block(this, pinode, block_nr, block);
+	inode_read_block(this, pinode, parent->inode, block_nr, block);
 	while (total_offset < pinode->size) {
 		if (dir_offset >= this->block_size) {
 			block_nr++;
 			dir_offset -= this->block_size;
-			inode_read_block(this, pinode, block_nr, block);
+			inode_read_block(this, pinode, parent->inode, block_nr, block);
 		}
 		ext2_dir_t *d_ent = (ext2_dir_t *)((uintptr_t)block + dir_offset);
 
@@ -729,6 +2106,13 @@ static int create_entry(fs_node_t * parent, char * name, uint32_t inode) {
 		debug_print(WARNING, "The last node in the list is a real node, we need to modify it.");
 
 		if (dir_offset + rec_len >= this->block_size) {
+			if (block_nr == 0 && pinode->size == this->block_size &&
+				(SB->feature_compat & EXT2_FEATURE_COMPAT_DIR_INDEX) &&
+				dx_make_indexed(this, pinode, parent->inode, block, name, inode) == E_SUCCESS) {
+				free(block);
+				release_inode(this, pinode);
+				return E_SUCCESS;
+			}
 			block_nr++;
 			allocate_inode_block(this, pinode, parent->inode, block_nr);
 			memset(block, 0, this->block_size);
@@ -759,7 +2143,7 @@ static int create_entry(fs_node_t * parent, char * name, uint32_t inode) {
 	inode_write_block(this, pinode, parent->inode, block_nr, block);
 
 	free(block);
-	free(pinode);
+	release_inode(this, pinode);
 
 
 	return E_NOSPACE;
@@ -814,17 +2198,21 @@ static unsigned int allocate_inode(ext2_fs_t * this) {
 
 	BLOCKBYTE(node_offset) |= SETBIT(node_offset);
 
-	write_block(this, BGD[group].inode_bitmap, (uint8_t *)bg_buffer);
+	write_block(this, BGD[group].inode_bitmap, (uint8_t *)bg_buffer, EXT2_PASS_ALLOC);
 	free(bg_buffer);
 
 	BGD[group].free_inodes_count--;
 	for (int i = 0; i < this->bgd_block_span; ++i) {
-		write_block(this, this->bgd_offset + i, (uint8_t *)((uintptr_t)BGD + this->block_size * i));
+		write_block(this, this->bgd_offset + i, (uint8_t *)((uintptr_t)BGD + this->block_size * i), EXT2_PASS_ALLOC);
 	}
 
 	SB->free_inodes_count--;
 	rewrite_superblock(this);
 
+	/* Anything we remember about a previous user of this inode number is stale */
+	bmap_forget_inode(this, node_no);
+	prealloc_discard_locked(this, node_no);
+
 	mutex_release(this->mutex);
 
 	return node_no;
@@ -905,22 +2293,23 @@ static int mkdir_ext2(fs_node_t * parent, char * name, mode_t permission) {
 
 	inode_write_block(this, inode, inode_no, 0, tmp);
 
-	free(inode);
+	release_inode(this, inode);
 	free(tmp);
 
 	/* Update parent link count */
 	ext2_inodetable_t * pinode = read_inode(this, parent->inode);
 	pinode->links_count++;
 	write_inode(this, pinode, parent->inode);
-	free(pinode);
+	release_inode(this, pinode);
 
 	/* Update directory count in block group descriptor */
 	uint32_t group = inode_no / this->inodes_per_group;
 	BGD[group].used_dirs_count++;
 	for (int i = 0; i < this->bgd_block_span; ++i) {
-		write_block(this, this->bgd_offset + i, (uint8_t *)((uintptr_t)BGD + this->block_size * i));
+		write_block(this, this->bgd_offset + i, (uint8_t *)((uintptr_t)BGD + this->block_size * i), EXT2_PASS_ALLOC);
 	}
 
+	bcache_balance(this->block_device);
 	return 0;
 }
 
@@ -973,14 +2362,14 @@ static int create_ext2(fs_node_t * parent, char * name, mode_t permission) {
 	/* Write the osd blocks to 0 */
 	memset(inode->osd2, 0x00, sizeof(inode->osd2));
 
-	/* Write out inode changes */
+	/* Write out inode changes; they go into the block cache before the entry naming the inode does */
 	write_inode(this, inode, inode_no);
+	release_inode(this, inode);
 
 	/* Now append the entry to the parent */
 	create_entry(parent, name, inode_no);
 
-	free(inode);
-
+	bcache_balance(this->block_device);
 	return 0;
 }
 
@@ -992,7 +2381,8 @@ static int chmod_ext2(fs_node_t * node, mode_t mode) {
 
 	inode->mode = (inode->mode & 0xFFFFF000) | mode;
 
-	write_inode(this, inode, node->inode);
+	write_inode_attributes(this, inode, node->inode);
+	release_inode(this, inode);
 
 	return 0;
 }
@@ -1002,8 +2392,8 @@ static int chmod_ext2(fs_node_t * node, mode_t mode) {
  */
 static ext2_dir_t * direntry_ext2(ext2_fs_t * this, ext2_inodetable_t * inode, uint32_t no, uint32_t index) {
 	uint8_t *block = malloc(this->block_size);
-	uint8_t block_nr = 0;
-	inode_read_block(this, inode, block_nr, block);
+	unsigned int block_nr = 0;
+	inode_read_block(this, inode, no, block_nr, block);
 	uint32_t dir_offset = 0;
 	uint32_t total_offset = 0;
 	uint32_t dir_index = 0;
@@ -1028,7 +2418,7 @@ static ext2_dir_t * direntry_ext2(ext2_fs_t * this, ext2_inodetable_t * inode, u
 		if (dir_offset >= this->block_size) {
 			block_nr++;
 			dir_offset -= this->block_size;
-			inode_read_block(this, inode, block_nr, block);
+			inode_read_block(this, inode, no, block_nr, block);
 		}
 	}
 
@@ -1046,58 +2436,35 @@ static fs_node_t * finddir_ext2(fs_node_t *node, char *name) {
 	ext2_inodetable_t *inode = read_inode(this,node->inode);
 	//assert(inode->mode & EXT2_S_IFDIR);
 	uint8_t * block = malloc(this->block_size);
+	unsigned int block_nr;
 	ext2_dir_t *direntry = NULL;
-	uint8_t block_nr = 0;
-	inode_read_block(this, inode, block_nr, block);
-	uint32_t dir_offset = 0;
-	uint32_t total_offset = 0;
-
-	while (total_offset < inode->size) {
-		if (dir_offset >= this->block_size) {
-			block_nr++;
-			dir_offset -= this->block_size;
-			inode_read_block(this, inode, block_nr, block);
-		}
-		ext2_dir_t *d_ent = (ext2_dir_t *)((uintptr_t)block + dir_offset);
-
-		if (d_ent->inode == 0 || strlen(name) != d_ent->name_len) {
-			dir_offset += d_ent->rec_len;
-			total_offset += d_ent->rec_len;
-
-			continue;
-		}
-
-		char *dname = malloc(sizeof(char) * (d_ent->name_len + 1));
-		memcpy(dname, &(d_ent->name), d_ent->name_len);
-		dname[d_ent->name_len] = '\0';
-		if (!strcmp(dname, name)) {
-			free(dname);
-			direntry = malloc(d_ent->rec_len);
-			memcpy(direntry, d_ent, d_ent->rec_len);
-			break;
-		}
-		free(dname);
 
-		dir_offset += d_ent->rec_len;
-		total_offset += d_ent->rec_len;
+	ext2_dir_t *d_ent = dir_find(this, inode, node->inode, name, block, &block_nr);
+	if (d_ent) {
+		direntry = malloc(d_ent->rec_len);
+		memcpy(direntry, d_ent, d_ent->rec_len);
 	}
-	free(inode);
+	release_inode(this, inode);
+	free(block);
 	if (!direntry) {
-		free(block);
 		return NULL;
 	}
 	fs_node_t *outnode = malloc(sizeof(fs_node_t));
 	memset(outnode, 0, sizeof(fs_node_t));
 
 	inode = read_inode(this, direntry->inode);
+	if (!inode) {
+		free(outnode);
+		free(direntry);
+		return NULL;
+	}
 
 	if (!node_from_file(this, inode, direntry, outnode)) {
 		debug_print(CRITICAL, "Oh dear. Couldn't allocate the outnode?");
 	}
 
 	free(direntry);
-	free(inode);
-	free(block);
+	release_inode(this, inode);
 	return outnode;
 }
 
@@ -1109,42 +2476,11 @@ static int unlink_ext2(fs_node_t * node, char * name) {
 	ext2_inodetable_t *inode = read_inode(this,node->inode);
 	//assert(inode->mode & EXT2_S_IFDIR);
 	uint8_t * block = malloc(this->block_size);
-	ext2_dir_t *direntry = NULL;
-	uint8_t block_nr = 0;
-	inode_read_block(this, inode, block_nr, block);
-	uint32_t dir_offset = 0;
-	uint32_t total_offset = 0;
-
-	while (total_offset < inode->size) {
-		if (dir_offset >= this->block_size) {
-			block_nr++;
-			dir_offset -= this->block_size;
-			inode_read_block(this, inode, block_nr, block);
-		}
-		ext2_dir_t *d_ent = (ext2_dir_t *)((uintptr_t)block + dir_offset);
-
-		if (d_ent->inode == 0 || strlen(name) != d_ent->name_len) {
-			dir_offset += d_ent->rec_len;
-			total_offset += d_ent->rec_len;
-
-			continue;
-		}
-
-		char *dname = malloc(sizeof(char) * (d_ent->name_len + 1));
-		memcpy(dname, &(d_ent->name), d_ent->name_len);
-		dname[d_ent->name_len] = '\0';
-		if (!strcmp(dname, name)) {
-			free(dname);
-			direntry = d_ent;
-			break;
-		}
-		free(dname);
+	unsigned int block_nr;
 
-		dir_offset += d_ent->rec_len;
-		total_offset += d_ent->rec_len;
-	}
+	ext2_dir_t *direntry = dir_find(this, inode, node->inode, name, block, &block_nr);
 	if (!direntry) {
-		free(inode);
+		release_inode(this, inode);
 		free(block);
 		return -ENOENT;
 	}
@@ -1152,7 +2488,7 @@ static int unlink_ext2(fs_node_t * node, char * name) {
 	unsigned int new_inode = direntry->inode;
 	direntry->inode = 0;
 	inode_write_block(this, inode, node->inode, block_nr, block);
-	free(inode);
+	release_inode(this, inode);
 	free(block);
 
 	inode = read_inode(this, new_inode);
@@ -1167,133 +2503,151 @@ static int unlink_ext2(fs_node_t * node, char * name) {
 		write_inode(this, inode, new_inode);
 	}
 
-	free(inode);
+	release_inode(this, inode);
 
 	return 0;
 }
 
 
-static void refresh_inode(ext2_fs_t * this, ext2_inodetable_t * inodet,  size_t inode) {
-	if (!inode) {
-		dprintf("ext2: Attempt to read inode 0\n");
-		return;
+static ssize_t read_ext2(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
+	ext2_fs_t * this = (ext2_fs_t *)node->device;
+	ext2_inodetable_t * inode = read_inode(this, node->inode);
+	if (!inode) return -EIO;
+	if ((uint64_t)offset >= inode->size) {
+		release_inode(this, inode);
+		return 0;
 	}
-	inode--;
-
-	uint32_t group = inode / this->inodes_per_group;
-	if (group > BGDS) {
-		return;
+	uint64_t end = offset + size;
+	if (end > inode->size) {
+		end = inode->size;
 	}
-	uint32_t inode_table_block = BGD[group].inode_table;
-	inode -= group * this->inodes_per_group;	// adjust index within group
-	uint32_t block_offset		= (inode * this->inode_size) / this->block_size;
-	uint32_t offset_in_block    = inode - block_offset * (this->block_size / this->inode_size);
 
-	uint8_t * buf = malloc(this->block_size);
+	uint64_t pos = offset;
+	uint8_t * buf = NULL;
+	int error = 0;
 
-	read_block(this, inode_table_block + block_offset, buf);
+	while (pos < end) {
+		unsigned int block = pos / this->block_size;
+		size_t block_offset = pos % this->block_size;
+		uint8_t * out = buffer + (pos - offset);
 
-	ext2_inodetable_t *inodes = (ext2_inodetable_t *)buf;
+		if (block_offset || end - pos < this->block_size) {
+			/* Partial block; go through the block cache */
+			size_t length = this->block_size - block_offset;
+			if (length > end - pos) length = end - pos;
+			if (!buf) buf = malloc(this->block_size);
+			inode_read_block(this, inode, node->inode, block, buf);
+			memcpy(out, buf + block_offset, length);
+			pos += length;
+			continue;
+		}
 
-	memcpy(inodet, (uint8_t *)((uintptr_t)inodes + offset_in_block * this->inode_size), this->inode_size);
+		/* Whole blocks; read each contiguous run straight into the caller's buffer */
+		unsigned int run;
+		unsigned int real = inode_map_run(this, inode, node->inode, block, (end - pos) / this->block_size, &run);
+		if (real) {
+			error = bcache_read_run(this->block_device, real, run, this->block_size, out);
+			if (error) break;
+		} else {
+			memset(out, 0, this->block_size);
+		}
+		pos += (uint64_t)run * this->block_size;
+	}
 
-	free(buf);
+	if (buf) free(buf);
+	release_inode(this, inode);
+	if (pos == (uint64_t)offset && error) return error;
+	return pos - offset;
 }
 
 /**
- * read_inode
+ * ext2->readahead Bring the blocks behind part of a file into the block cache.
+ *
+ * Called from the VFS readahead thread; see readahead_fs.
  */
-static ext2_inodetable_t * read_inode(ext2_fs_t * this, size_t inode) {
-	ext2_inodetable_t *inodet   = malloc(this->inode_size);
-	refresh_inode(this, inodet, inode);
-	return inodet;
-}
-
-static ssize_t read_ext2(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
+static void readahead_ext2(fs_node_t *node, off_t offset, size_t size) {
 	ext2_fs_t * this = (ext2_fs_t *)node->device;
 	ext2_inodetable_t * inode = read_inode(this, node->inode);
-	uint32_t end;
-	if (inode->size == 0) return 0;
-	if (offset + size > inode->size) {
-		end = inode->size;
-	} else {
-		end = offset + size;
+	if (!inode) return;
+
+	uint64_t end = offset + size;
+	if (end > inode->size) end = inode->size;
+
+	unsigned int block = offset / this->block_size;
+	unsigned int last = (end + this->block_size - 1) / this->block_size;
+	while (block < last) {
+		unsigned int run;
+		unsigned int real = inode_map_run(this, inode, node->inode, block, last - block, &run);
+		if (real && bcache_prefetch(this->block_device, real, run, this->block_size)) break;
+		block += run;
 	}
-	uint32_t start_block  = offset / this->block_size;
-	uint32_t end_block    = end / this->block_size;
-	uint32_t end_size     = end - end_block * this->block_size;
-	uint32_t size_to_read = end - offset;
 
-	uint8_t * buf = malloc(this->block_size);
-	if (start_block == end_block) {
-		inode_read_block(this, inode, start_block, buf);
-		memcpy(buffer, (uint8_t *)(((uintptr_t)buf) + ((uintptr_t)offset % this->block_size)), size_to_read);
-	} else {
-		uint32_t block_offset;
-		uint32_t blocks_read = 0;
-		for (block_offset = start_block; block_offset < end_block; block_offset++, blocks_read++) {
-			if (block_offset == start_block) {
-				inode_read_block(this, inode, block_offset, buf);
-				memcpy(buffer, (uint8_t *)(((uintptr_t)buf) + ((uintptr_t)offset % this->block_size)), this->block_size - (offset % this->block_size));
-			} else {
-				inode_read_block(this, inode, block_offset, buf);
-				memcpy(buffer + this->block_size * blocks_read - (offset % this->block_size), buf, this->block_size);
+	release_inode(this, inode);
+}
+
+static ssize_t write_inode_buffer(ext2_fs_t * this, ext2_inodetable_t * inode, uint32_t inode_number, off_t offset, size_t size, uint8_t *buffer) {
+	if (!size) return 0;
+
+	uint64_t end = offset + size;
+
+	/* Allocate everything up front so runs can be found below; blocks we fill completely needn't be cleared */
+	unsigned int full_start = (offset + this->block_size - 1) / this->block_size;
+	unsigned int full_end = end / this->block_size;
+	if (inode_allocate_through(this, inode, inode_number, (end - 1) / this->block_size, full_start, full_end) != E_SUCCESS) {
+		return -ENOSPC;
+	}
+
+	uint64_t pos = offset;
+	uint8_t * buf = NULL;
+	int error = 0;
+
+	while (pos < end) {
+		unsigned int block = pos / this->block_size;
+		size_t block_offset = pos % this->block_size;
+		uint8_t * in = buffer + (pos - offset);
+
+		if (block_offset || end - pos < this->block_size) {
+			/* Partial block; read-modify-write through the block cache */
+			size_t length = this->block_size - block_offset;
+			if (length > end - pos) length = end - pos;
+			if (!buf) buf = malloc(this->block_size);
+			inode_read_block(this, inode, inode_number, block, buf);
+			memcpy(buf + block_offset, in, length);
+			if (!inode_write_block(this, inode, inode_number, block, buf)) {
+				error = -ENOSPC;
+				break;
 			}
+			pos += length;
+			continue;
 		}
-		if (end_size) {
-			inode_read_block(this, inode, end_block, buf);
-			memcpy(buffer + this->block_size * blocks_read - (offset % this->block_size), buf, end_size);
+
+		/* Whole blocks; write each contiguous run straight from the caller's buffer */
+		unsigned int run;
+		unsigned int real = inode_map_run(this, inode, inode_number, block, (end - pos) / this->block_size, &run);
+		if (!real) {
+			/* A hole before the end of the file */
+			if (!inode_write_block(this, inode, inode_number, block, in)) {
+				error = -ENOSPC;
+				break;
+			}
+			pos += this->block_size;
+			continue;
 		}
+		error = bcache_write_run(this->block_device, real, run, this->block_size, in);
+		if (error) break;
+		pos += (uint64_t)run * this->block_size;
 	}
-	free(inode);
-	free(buf);
-	return size_to_read;
-}
 
-static ssize_t write_inode_buffer(ext2_fs_t * this, ext2_inodetable_t * inode, uint32_t inode_number, off_t offset, size_t size, uint8_t *buffer) {
-	uint32_t end = offset + size;
-	if (end > inode->size) {
-		inode->size = end;
+	if (buf) free(buf);
+
+	/* Only grow the file over what actually made it in */
+	if (pos > inode->size) {
+		inode->size = pos;
 		write_inode(this, inode, inode_number);
 	}
 
-	uint32_t start_block  = offset / this->block_size;
-	uint32_t end_block    = end / this->block_size;
-	uint32_t end_size     = end - end_block * this->block_size;
-	uint32_t size_to_read = end - offset;
-	uint8_t * buf = malloc(this->block_size);
-	if (start_block == end_block) {
-		inode_read_block(this, inode, start_block, buf);
-		memcpy((uint8_t *)(((uintptr_t)buf) + ((uintptr_t)offset % this->block_size)), buffer, size_to_read);
-		inode_write_block(this, inode, inode_number, start_block, buf);
-	} else {
-		uint32_t block_offset;
-		uint32_t blocks_read = 0;
-		for (block_offset = start_block; block_offset < end_block; block_offset++, blocks_read++) {
-			if (block_offset == start_block) {
-				int b = inode_read_block(this, inode, block_offset, buf);
-				memcpy((uint8_t *)(((uintptr_t)buf) + ((uintptr_t)offset % this->block_size)), buffer, this->block_size - (offset % this->block_size));
-				inode_write_block(this, inode, inode_number, block_offset, buf);
-				if (!b) {
-					refresh_inode(this, inode, inode_number);
-				}
-			} else {
-				int b = inode_read_block(this, inode, block_offset, buf);
-				memcpy(buf, buffer + this->block_size * blocks_read - (offset % this->block_size), this->block_size);
-				inode_write_block(this, inode, inode_number, block_offset, buf);
-				if (!b) {
-					refresh_inode(this, inode, inode_number);
-				}
-			}
-		}
-		if (end_size) {
-			inode_read_block(this, inode, end_block, buf);
-			memcpy(buf, buffer + this->block_size * blocks_read - (offset % this->block_size), end_size);
-			inode_write_block(this, inode, inode_number, end_block, buf);
-		}
-	}
-	free(buf);
-	return size_to_read;
+	if (pos == (uint64_t)offset && error) return error;
+	return pos - offset;
 }
 
 static ssize_t write_ext2(fs_node_t *node, off_t offset, size_t size, uint8_t *buffer) {
@@ -1301,9 +2655,11 @@ static ssize_t write_ext2(fs_node_t *node, off_t offset, size_t size, uint8_t *b
 	if (!(this->flags & EXT2_FLAG_READWRITE)) return -EROFS;
 
 	ext2_inodetable_t * inode = read_inode(this, node->inode);
+	if (!inode) return -EIO;
 
 	ssize_t rv = write_inode_buffer(this, inode, node->inode, offset, size, buffer);
-	free(inode);
+	release_inode(this, inode);
+	bcache_balance(this->block_device);
 	return rv;
 }
 
@@ -1314,15 +2670,74 @@ static int truncate_ext2(fs_node_t * node) {
 	ext2_inodetable_t * inode = read_inode(this,node->inode);
 	inode->size = 0;
 	write_inode(this, inode, node->inode);
+	release_inode(this, inode);
 	return 0;
 }
 
 static void open_ext2(fs_node_t *node, unsigned int flags) {
-	/* Nothing to do here */
+	ext2_fs_t * this = node->device;
+	if (!(this->flags & EXT2_FLAG_READWRITE)) return;
+
+	/* A node is counted once, when it is first opened; close_ext2 is called once it has no users left */
+	if (node->refcount != 1) return;
+
+	mutex_acquire(this->mutex);
+	uintptr_t count = (uintptr_t)hashmap_get(this->open_counts, (void *)(uintptr_t)node->inode);
+	hashmap_set(this->open_counts, (void *)(uintptr_t)node->inode, (void *)(count + 1));
+	mutex_release(this->mutex);
 }
 
 static void close_ext2(fs_node_t *node) {
-	/* Nothing to do here */
+	ext2_fs_t * this = node->device;
+	if (!(this->flags & EXT2_FLAG_READWRITE)) return;
+
+	mutex_acquire(this->mutex);
+	uintptr_t count = (uintptr_t)hashmap_get(this->open_counts, (void *)(uintptr_t)node->inode);
+	if (count > 1) {
+		hashmap_set(this->open_counts, (void *)(uintptr_t)node->inode, (void *)(count - 1));
+	} else {
+		/* That was the last one; give back any blocks reserved for this file to grow into */
+		hashmap_remove(this->open_counts, (void *)(uintptr_t)node->inode);
+		prealloc_discard_locked(this, node->inode);
+	}
+	mutex_release(this->mutex);
+}
+
+/**
+ * ext2->fsync_ext2 Make sure a file's changes are on the disk.
+ *
+ * Write-back is ordered, so everything the file's inode could depend
+ * on in earlier passes is written along with it, for every file on
+ * this filesystem. fdatasync leaves the inode itself alone if only
+ * its attributes have changed since it was last synced.
+ *
+ * @param datasync Whether this is fdatasync
+ * @returns 0 on success, negative error code on failure.
+ */
+static int fsync_ext2(fs_node_t * node, int datasync) {
+	ext2_fs_t * this = node->device;
+	if (!(this->flags & EXT2_FLAG_READWRITE)) return 0;
+
+	ext2_inodetable_t * inode = read_inode(this, node->inode);
+	if (!inode) return -EIO;
+	struct ext2_icache_entry * entry = icache_entry(inode);
+
+	int last_pass = EXT2_PASS_MAP;
+	spin_lock(this->icache_lock);
+	int needed = !datasync || entry->datasync;
+	int dirty = needed && entry->dirty;
+	if (needed) entry->datasync = 0;
+	if (dirty) entry->dirty = 0;
+	spin_unlock(this->icache_lock);
+
+	if (needed) {
+		if (dirty) flush_inode(this, entry);
+		last_pass = EXT2_PASS_INODE;
+	}
+	release_inode(this, inode);
+
+	if (bcache_flush(this->block_device, last_pass)) return -EIO;
+	return ioctl_fs(this->block_device, IOCTLSYNC, NULL);
 }
 
 
@@ -1337,7 +2752,7 @@ static struct dirent * readdir_ext2(fs_node_t *node, unsigned long index) {
 	//assert(inode->mode & EXT2_S_IFDIR);
 	ext2_dir_t *direntry = direntry_ext2(this, inode, node->inode, index);
 	if (!direntry) {
-		free(inode);
+		release_inode(this, inode);
 		return NULL;
 	}
 	struct dirent *dirent = malloc(sizeof(struct dirent));
@@ -1345,10 +2760,59 @@ static struct dirent * readdir_ext2(fs_node_t *node, unsigned long index) {
 	dirent->d_name[direntry->name_len] = '\0';
 	dirent->d_ino = direntry->inode;
 	free(direntry);
-	free(inode);
+	release_inode(this, inode);
 	return dirent;
 }
 
+/**
+ * getdents_ext2
+ *
+ * The cursor is the byte offset of the next directory entry, so a
+ * scan picks up where the last one left off instead of walking the
+ * directory from the start for every entry.
+ */
+static ssize_t getdents_ext2(fs_node_t *node, uint64_t * cursor, struct dirent * out, size_t count) {
+	ext2_fs_t * this = (ext2_fs_t *)node->device;
+
+	ext2_inodetable_t *inode = read_inode(this, node->inode);
+	uint8_t * block = malloc(this->block_size);
+	uint64_t offset = *cursor;
+	unsigned int block_nr = offset / this->block_size;
+	size_t read = 0;
+
+	if (offset < inode->size) {
+		inode_read_block(this, inode, node->inode, block_nr, block);
+	}
+
+	while (offset < inode->size && read < count) {
+		if (offset / this->block_size != block_nr) {
+			block_nr = offset / this->block_size;
+			inode_read_block(this, inode, node->inode, block_nr, block);
+		}
+
+		ext2_dir_t *d_ent = (ext2_dir_t *)((uintptr_t)block + offset % this->block_size);
+		if (!d_ent->rec_len) {
+			/* Corrupt directory; don't spin on it */
+			offset = inode->size;
+			break;
+		}
+
+		if (d_ent->inode) {
+			memcpy(&out[read].d_name, &d_ent->name, d_ent->name_len);
+			out[read].d_name[d_ent->name_len] = '\0';
+			out[read].d_ino = d_ent->inode;
+			read++;
+		}
+
+		offset += d_ent->rec_len;
+	}
+
+	*cursor = offset;
+	free(block);
+	release_inode(this, inode);
+	return read;
+}
+
 static int symlink_ext2(fs_node_t * parent, char * target, char * name) {
 	if (!name) return -EINVAL;
 
@@ -1417,8 +2881,9 @@ static int symlink_ext2(fs_node_t * parent, char * target, char * name) {
 	if (!embedded) {
 		write_inode_buffer(parent->device, inode, inode_no, 0, target_len, (uint8_t *)target);
 	}
-	free(inode);
+	release_inode(this, inode);
 
+	bcache_balance(this->block_device);
 	return 0;
 }
 
@@ -1437,7 +2902,7 @@ static ssize_t readlink_ext2(fs_node_t * node, char * buf, size_t size) {
 		buf[read_size] = '\0';
 	}
 
-	free(inode);
+	release_inode(this, inode);
 	return read_size;
 }
 
@@ -1446,6 +2911,8 @@ static int ioctl_ext2(fs_node_t * node, unsigned long request, void * argp) {
 
 	switch (request) {
 		case IOCTLSYNC:
+			sync_inodes(this);
+			if (bcache_sync(this->block_device)) return -EIO;
 			return ioctl_fs(this->block_device, IOCTLSYNC, NULL);
 
 		default:
@@ -1474,6 +2941,7 @@ static int node_from_file(ext2_fs_t * this, ext2_inodetable_t *inode, ext2_dir_t
 	if ((inode->mode & EXT2_S_IFREG) == EXT2_S_IFREG) {
 		fnode->flags   |= FS_FILE;
 		fnode->read     = read_ext2;
+		fnode->readahead = readahead_ext2;
 		fnode->write    = write_ext2;
 		fnode->truncate = truncate_ext2;
 		fnode->create   = NULL;
@@ -1484,12 +2952,13 @@ static int node_from_file(ext2_fs_t * this, ext2_inodetable_t *inode, ext2_dir_t
 		fnode->readlink = NULL;
 	}
 	if ((inode->mode & EXT2_S_IFDIR) == EXT2_S_IFDIR) {
-		fnode->flags   |= FS_DIRECTORY;
+		fnode->flags   |= FS_DIRECTORY | FS_DCACHE;
 		fnode->create   = create_ext2;
 		fnode->mkdir    = mkdir_ext2;
 		fnode->unlink   = unlink_ext2;
 		fnode->symlink  = symlink_ext2;
 		fnode->readdir  = readdir_ext2;
+		fnode->getdents = getdents_ext2;
 		fnode->finddir  = finddir_ext2;
 		fnode->write    = NULL;
 		fnode->readlink = NULL;
@@ -1506,6 +2975,7 @@ static int node_from_file(ext2_fs_t * this, ext2_inodetable_t *inode, ext2_dir_t
 	if ((inode->mode & EXT2_S_IFLNK) == EXT2_S_IFLNK) {
 		fnode->flags   |= FS_SYMLINK;
 		fnode->read     = NULL;
+		fnode->readahead = NULL;
 		fnode->write    = NULL;
 		fnode->create   = NULL;
 		fnode->mkdir    = NULL;
@@ -1522,6 +2992,7 @@ static int node_from_file(ext2_fs_t * this, ext2_inodetable_t *inode, ext2_dir_t
 	fnode->open    = open_ext2;
 	fnode->close   = close_ext2;
 	fnode->ioctl = ioctl_ext2;
+	fnode->fsync   = fsync_ext2;
 	return 1;
 }
 
@@ -1578,21 +3049,42 @@ static int ext2_root(ext2_fs_t * this, ext2_inodetable_t *inode, fs_node_t *fnod
 	fnode->mtime   = inode->mtime;
 	fnode->ctime   = inode->ctime;
 
-	fnode->flags |= FS_DIRECTORY;
+	fnode->flags |= FS_DIRECTORY | FS_DCACHE;
 	fnode->read    = NULL;
 	fnode->write   = NULL;
 	fnode->chmod   = chmod_ext2;
 	fnode->open    = open_ext2;
 	fnode->close   = close_ext2;
 	fnode->readdir = readdir_ext2;
+	fnode->getdents = getdents_ext2;
 	fnode->finddir = finddir_ext2;
 	fnode->ioctl   = NULL;
+	fnode->fsync   = fsync_ext2;
 	fnode->create  = create_ext2;
 	fnode->mkdir   = mkdir_ext2;
 	fnode->unlink  = unlink_ext2;
 	return 1;
 }
 
+/**
+ * ext2->flusher Background write-back for one filesystem.
+ *
+ * Changes sit in the caches until they have aged a bit, so that a
+ * burst of small writes reaches the disk as a few block writes.
+ */
+static void ext2_flusher(void * argp) {
+	ext2_fs_t * this = argp;
+	while (1) {
+		unsigned long s, ss;
+		relative_time(EXT2_FLUSH_INTERVAL, 0, &s, &ss);
+		sleep_until((process_t *)this_core->current_process, s, ss);
+		switch_task(0);
+
+		sync_inodes(this);
+		bcache_flush_expired(this->block_device, EXT2_FLUSH_EXPIRE);
+	}
+}
+
 static fs_node_t * mount_ext2(fs_node_t * block_device, int flags) {
 
 	ext2_fs_t * this = malloc(sizeof(ext2_fs_t));
@@ -1607,11 +3099,17 @@ static fs_node_t * mount_ext2(fs_node_t * block_device, int flags) {
 	//vfs_lock(this->block_device);
 
 	this->mutex = mutex_init("ext2 fs");
+	this->open_counts = hashmap_create_int(64);
+	this->bmap = malloc(sizeof(struct ext2_bmap_entry) * EXT2_BMAP_ENTRIES);
+	memset(this->bmap, 0, sizeof(struct ext2_bmap_entry) * EXT2_BMAP_ENTRIES);
+	this->icache = malloc(sizeof(struct ext2_icache_entry *) * EXT2_ICACHE_BUCKETS);
+	memset(this->icache, 0, sizeof(struct ext2_icache_entry *) * EXT2_ICACHE_BUCKETS);
 
 	SB = malloc(this->block_size);
 
 	debug_print(INFO, "Reading superblock...");
-	read_block(this, 1, (uint8_t *)SB);
+	/* Read directly: we don't know the block size yet, so this can't go through the cache. */
+	read_fs(this->block_device, 1024, 1024, (uint8_t *)SB);
 	if (SB->magic != EXT2_SUPER_MAGIC) {
 		debug_print(ERROR, "... not an EXT2 filesystem? (magic didn't match, got 0x%x)", SB->magic);
 		return NULL;
@@ -1622,6 +3120,8 @@ static fs_node_t * mount_ext2(fs_node_t * block_device, int flags) {
 	}
 	this->block_size = 1024 << SB->log_block_size;
 	this->pointers_per_block = this->block_size / 4;
+	this->zero_block = malloc(this->block_size);
+	memset(this->zero_block, 0, this->block_size);
 	debug_print(INFO, "Log block size = %d -> %d", SB->log_block_size, this->block_size);
 	BGDS = SB->blocks_count / SB->blocks_per_group;
 	if (SB->blocks_per_group * BGDS < SB->blocks_count) {
@@ -1679,9 +3179,15 @@ static fs_node_t * mount_ext2(fs_node_t * block_device, int flags) {
 
 	ext2_inodetable_t *root_inode = read_inode(this, 2);
 	RN = (fs_node_t *)malloc(sizeof(fs_node_t));
+	memset(RN, 0, sizeof(fs_node_t));
 	if (!ext2_root(this, root_inode, RN)) {
 		return NULL;
 	}
+	release_inode(this, root_inode);
+
+	if (this->flags & EXT2_FLAG_READWRITE) {
+		spawn_worker_thread(ext2_flusher, "[ext2 flush]", this);
+	}
 	debug_print(NOTICE, "Mounted EXT2 disk, root VFS node is at %#zx", (uintptr_t)RN);
 	return RN;
 }
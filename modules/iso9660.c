@@ -16,8 +16,7 @@
 #include <kernel/args.h>
 #include <kernel/tokenize.h>
 #include <kernel/time.h>
-#include <kernel/list.h>
-#include <kernel/hashmap.h>
+#include <kernel/bcache.h>
 
 #define ISO_SECTOR_SIZE 2048
 
@@ -31,8 +30,7 @@
 typedef struct {
 	fs_node_t * block_device;
 	uint32_t block_size;
-	hashmap_t * cache;
-	list_t * lru;
+	int cache;
 } iso_9660_fs_t;
 
 typedef struct {
@@ -139,33 +137,9 @@ typedef struct {
 
 static void file_from_dir_entry(iso_9660_fs_t * this, size_t sector, iso_9660_directory_entry_t * dir, size_t offset, fs_node_t * fs);
 
-#define CACHE_SIZE 64
-
 static int read_sector(iso_9660_fs_t * this, uint32_t sector_id, char * buffer) {
 	if (this->cache) {
-		void * sector_id_v = (void *)(uintptr_t)sector_id;
-		if (hashmap_has(this->cache, sector_id_v)) {
-			memcpy(buffer,hashmap_get(this->cache, sector_id_v), this->block_size);
-			node_t * me = list_find(this->lru, sector_id_v);
-			list_delete(this->lru, me);
-			list_append(this->lru, me);
-			return 0;
-		} else {
-			if (this->lru->length > CACHE_SIZE) {
-				node_t * l = list_dequeue(this->lru);
-				free(hashmap_get(this->cache, l->value));
-				hashmap_remove(this->cache, l->value);
-				free(l);
-			}
-			int result = read_fs(this->block_device, sector_id * this->block_size, this->block_size, (uint8_t *)buffer);
-			if (result < 0) return result;
-			if (result == 0) return 1;
-			char * buf = malloc(this->block_size);
-			memcpy(buf, buffer, this->block_size);
-			hashmap_set(this->cache, sector_id_v, buf);
-			list_insert(this->lru, sector_id_v);
-			return 0;
-		}
+		return bcache_read(this->block_device, sector_id, this->block_size, (uint8_t *)buffer);
 	} else {
 		int result = read_fs(this->block_device, sector_id * this->block_size, this->block_size, (uint8_t *)buffer);
 		if (result < 0) return result;
@@ -273,22 +247,70 @@ static ssize_t read_iso(fs_node_t * node, off_t offset, size_t size, uint8_t * b
 	char * tmp = malloc(this->block_size);
 	read_sector(this, node->inode, tmp);
 	iso_9660_directory_entry_t * root_entry = (iso_9660_directory_entry_t *)(tmp + node->impl);
+	uint32_t extent = root_entry->extent_start_LSB;
+	uint32_t length = root_entry->extent_length_LSB;
+
+	if ((uint64_t)offset >= length) {
+		free(tmp);
+		return 0;
+	}
 
 	uint32_t end;
-	/* We can do this in a single underlying read to the filesystem */
-	if (offset + size > root_entry->extent_length_LSB) {
-		end = root_entry->extent_length_LSB;
+	if (offset + size > length) {
+		end = length;
 	} else {
 		end = offset + size;
 	}
 	uint32_t size_to_read = end - offset;
 
-	read_fs(this->block_device, root_entry->extent_start_LSB * this->block_size + offset, size_to_read, (uint8_t *)buffer);
+	if (!this->cache) {
+		/* We can do this in a single underlying read to the filesystem */
+		read_fs(this->block_device, extent * this->block_size + offset, size_to_read, (uint8_t *)buffer);
+		free(tmp);
+		return size_to_read;
+	}
+
+	/* Go through the block cache, so readahead can help */
+	uint32_t pos = offset;
+	while (pos < end) {
+		uint32_t sector = pos / this->block_size;
+		uint32_t sector_offset = pos % this->block_size;
+		uint8_t * out = buffer + (pos - offset);
+		if (sector_offset || end - pos < this->block_size) {
+			uint32_t chunk = this->block_size - sector_offset;
+			if (chunk > end - pos) chunk = end - pos;
+			read_sector(this, extent + sector, tmp);
+			memcpy(out, tmp + sector_offset, chunk);
+			pos += chunk;
+		} else {
+			uint32_t count = (end - pos) / this->block_size;
+			bcache_read_run(this->block_device, extent + sector, count, this->block_size, out);
+			pos += count * this->block_size;
+		}
+	}
 
 	free(tmp);
 	return size_to_read;
 }
 
+static void readahead_iso(fs_node_t * node, off_t offset, size_t size) {
+	iso_9660_fs_t * this = node->device;
+	if (!this->cache) return;
+
+	char * tmp = malloc(this->block_size);
+	read_sector(this, node->inode, tmp);
+	iso_9660_directory_entry_t * root_entry = (iso_9660_directory_entry_t *)(tmp + node->impl);
+	uint32_t extent = root_entry->extent_start_LSB;
+	uint64_t end = offset + size;
+	if (end > root_entry->extent_length_LSB) end = root_entry->extent_length_LSB;
+	free(tmp);
+
+	if ((uint64_t)offset >= end) return;
+	uint32_t first = offset / this->block_size;
+	uint32_t last = (end + this->block_size - 1) / this->block_size;
+	bcache_prefetch(this->block_device, extent + first, last - first, this->block_size);
+}
+
 static fs_node_t * finddir_iso(fs_node_t *node, char *name) {
 	iso_9660_fs_t * this = node->device;
 	char * buffer = malloc(this->block_size);
@@ -314,6 +336,7 @@ static fs_node_t * finddir_iso(fs_node_t *node, char *name) {
 	offset = root_data;
 
 	fs_node_t * out = malloc(sizeof(fs_node_t));
+	memset(out, 0, sizeof(fs_node_t));
 	while (1) {
 		iso_9660_directory_entry_t * dir = (iso_9660_directory_entry_t *)offset;
 		if (dir->length == 0) {
@@ -389,6 +412,7 @@ static void file_from_dir_entry(iso_9660_fs_t * this, size_t sector, iso_9660_di
 	} else {
 		fs->flags = FS_FILE;
 		fs->read = read_iso;
+		fs->readahead = readahead_iso;
 	}
 	/* Other things not supported */
 	/* TODO actually get these from the CD into Unix time */
@@ -426,14 +450,7 @@ static fs_node_t * iso_fs_mount(const char * device, const char * mount_path) {
 	iso_9660_fs_t * this = malloc(sizeof(iso_9660_fs_t));
 	this->block_device = dev;
 	this->block_size = ISO_SECTOR_SIZE;
-	if (cache) {
-		this->cache = hashmap_create_int(10);
-		this->lru = list_create("iso9660 lru cache", this);
-	} else {
-		this->cache = NULL;
-	}
-
-	/* Probably want to put a block cache on this like EXT2 driver does; or do that in the ATAPI layer... */
+	this->cache = cache;
 
 	/* Read the volume descriptors */
 	uint8_t * tmp = malloc(ISO_SECTOR_SIZE);
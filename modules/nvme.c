@@ -0,0 +1,665 @@
+/**
+ * @brief NVMe Block Device Driver
+ * @file modules/nvme.c
+ * @package x86_64
+ *
+ * Each CPU gets its own I/O submission and completion queue pair
+ * (as many as the controller will give us), and commands are
+ * submitted on the queue of the CPU that makes them, under that
+ * queue's lock only. Transfers larger than two pages are described
+ * with PRP lists, one page of which is set aside for each command
+ * slot; requests the block layer has merged share a command when
+ * their buffers meet on page boundaries.
+ *
+ * Every queue has its own MSI-X table entry. The kernel can only
+ * route one message per device at the moment, so they all arrive
+ * on the same vector; without MSI-X or MSI, the legacy interrupt
+ * line is used.
+ *
+ * Namespaces appear as /dev/nvmeXnY.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2021 K. Lange
+ */
+#include <errno.h>
+#include <kernel/types.h>
+#include <kernel/string.h>
+#include <kernel/syscall.h>
+#include <kernel/module.h>
+#include <kernel/printf.h>
+#include <kernel/process.h>
+#include <kernel/spinlock.h>
+#include <kernel/pci.h>
+#include <kernel/vfs.h>
+#include <kernel/mmu.h>
+#include <kernel/list.h>
+#include <kernel/time.h>
+#include <kernel/blkdev.h>
+
+#include <kernel/arch/x86_64/irq.h>
+
+#include <sys/ioctl.h>
+
+/* Controller registers */
+#define NVME_CAP     0x00
+#define NVME_VS      0x08
+#define NVME_CC      0x14
+#define NVME_CSTS    0x1C
+#define NVME_AQA     0x24
+#define NVME_ASQ     0x28
+#define NVME_ACQ     0x30
+#define NVME_DOORBELLS 0x1000
+
+#define NVME_CAP_MQES(cap)  (((cap) & 0xFFFF) + 1)
+#define NVME_CAP_TO(cap)    (((cap) >> 24) & 0xFF)  /* in 500ms units */
+#define NVME_CAP_DSTRD(cap) (((cap) >> 32) & 0xF)
+
+#define NVME_CC_EN          (1 << 0)
+#define NVME_CC_IOSQES      (6 << 16) /* 64-byte submission entries */
+#define NVME_CC_IOCQES      (4 << 20) /* 16-byte completion entries */
+
+#define NVME_CSTS_RDY       (1 << 0)
+#define NVME_CSTS_CFS       (1 << 1)
+
+/* Admin commands */
+#define NVME_ADMIN_CREATE_SQ    0x01
+#define NVME_ADMIN_CREATE_CQ    0x05
+#define NVME_ADMIN_IDENTIFY     0x06
+#define NVME_ADMIN_SET_FEATURES 0x09
+
+#define NVME_FEATURE_QUEUES     0x07
+
+/* I/O commands */
+#define NVME_CMD_FLUSH  0x00
+#define NVME_CMD_WRITE  0x01
+#define NVME_CMD_READ   0x02
+
+#define NVME_PAGE_SIZE    0x1000
+#define NVME_ADMIN_DEPTH  16
+#define NVME_IO_DEPTH     64
+#define NVME_MAX_PAGES    128    /* 512KiB per command, before MDTS */
+#define NVME_MAX_QUEUES   32
+#define NVME_MAX_NAMESPACES 16
+
+struct nvme_sqe {
+	uint32_t cdw0;  /* opcode, and command ID in the upper half */
+	uint32_t nsid;
+	uint64_t reserved;
+	uint64_t mptr;
+	uint64_t prp1;
+	uint64_t prp2;
+	uint32_t cdw10;
+	uint32_t cdw11;
+	uint32_t cdw12;
+	uint32_t cdw13;
+	uint32_t cdw14;
+	uint32_t cdw15;
+} __attribute__((packed));
+
+struct nvme_cqe {
+	uint32_t result;
+	uint32_t reserved;
+	uint16_t sq_head;
+	uint16_t sq_id;
+	uint16_t cid;
+	volatile uint16_t status; /* phase tag in bit 0 */
+} __attribute__((packed));
+
+struct nvme_slot {
+	list_t * waiter;
+	volatile int done;
+	uint16_t status;
+	uint32_t result;
+};
+
+struct nvme_queue {
+	struct nvme * dev;
+	int qid;
+	uint16_t size;
+	spin_lock_t lock;
+
+	struct nvme_sqe * sq;
+	uintptr_t sq_phys;
+	volatile struct nvme_cqe * cq;
+	uintptr_t cq_phys;
+	volatile uint32_t * sq_doorbell;
+	volatile uint32_t * cq_doorbell;
+	uint16_t sq_tail;
+	uint16_t cq_head;
+	uint16_t phase;
+
+	/* One slot per command ID; one fewer than the queue size, so a full queue is never mistaken for an empty one */
+	struct nvme_slot * slots;
+	uint64_t * prp_lists;
+	uintptr_t prp_phys;
+	uint16_t * free;
+	int free_count;
+	list_t * slot_waiter;
+};
+
+struct nvme {
+	uint32_t pcidev;
+	int index;
+	uintptr_t mmio;
+	uint64_t cap;
+	int irq;
+	int vectors;  /* MSI-X table entries in use, or 1 */
+	unsigned int max_pages;
+
+	struct nvme_queue admin;
+	int num_queues;
+	struct nvme_queue queues[NVME_MAX_QUEUES];
+};
+
+struct nvme_ns {
+	struct nvme * dev;
+	uint32_t nsid;
+	uint64_t blocks;
+	unsigned int block_shift;
+};
+
+static list_t * nvme_devices = NULL;
+static uint16_t nvme_irqs_installed = 0;
+static int nvme_count = 0;
+
+static uint32_t mmio_read4(uintptr_t mmiobase, intptr_t offset) {
+	volatile uint32_t * data = (volatile uint32_t *)(mmiobase + offset);
+	return *data;
+}
+
+static void mmio_write4(uintptr_t mmiobase, intptr_t offset, uint32_t value) {
+	volatile uint32_t * data = (volatile uint32_t *)(mmiobase + offset);
+	*data = value;
+}
+
+static uint64_t mmio_read8(uintptr_t mmiobase, intptr_t offset) {
+	return (uint64_t)mmio_read4(mmiobase, offset) | ((uint64_t)mmio_read4(mmiobase, offset + 4) << 32);
+}
+
+static void mmio_write8(uintptr_t mmiobase, intptr_t offset, uint64_t value) {
+	mmio_write4(mmiobase, offset, value & 0xFFFFFFFF);
+	mmio_write4(mmiobase, offset + 4, value >> 32);
+}
+
+static void * kvmalloc_p(size_t size, uintptr_t * outphys) {
+	uintptr_t index = mmu_allocate_n_frames((size + 0xFFF) / 0x1000) << 12;
+	*outphys = index;
+	void * out = mmu_map_from_physical(index);
+	memset(out, 0, size);
+	return out;
+}
+
+static void delay_yield(size_t subticks) {
+	unsigned long s, ss;
+	relative_time(0, subticks, &s, &ss);
+	sleep_until((process_t *)this_core->current_process, s, ss);
+	switch_task(0);
+}
+
+static int nvme_wait_ready(struct nvme * dev, int ready) {
+	/* CAP.TO is in 500ms units; poll every 10ms */
+	int tries = (NVME_CAP_TO(dev->cap) + 1) * 50;
+	for (int i = 0; i < tries; ++i) {
+		uint32_t csts = mmio_read4(dev->mmio, NVME_CSTS);
+		if (csts & NVME_CSTS_CFS) return -EIO;
+		if (!!(csts & NVME_CSTS_RDY) == ready) return 0;
+		delay_yield(10000);
+	}
+	return -ETIMEDOUT;
+}
+
+static void nvme_queue_init(struct nvme * dev, struct nvme_queue * q, int qid, uint16_t size) {
+	q->dev = dev;
+	q->qid = qid;
+	q->size = size;
+	spin_init(q->lock);
+
+	q->sq = kvmalloc_p(size * sizeof(struct nvme_sqe), &q->sq_phys);
+	q->cq = kvmalloc_p(size * sizeof(struct nvme_cqe), &q->cq_phys);
+	q->prp_lists = kvmalloc_p((size - 1) * NVME_PAGE_SIZE, &q->prp_phys);
+
+	uintptr_t stride = 4 << NVME_CAP_DSTRD(dev->cap);
+	q->sq_doorbell = (volatile uint32_t *)(dev->mmio + NVME_DOORBELLS + (2 * qid) * stride);
+	q->cq_doorbell = (volatile uint32_t *)(dev->mmio + NVME_DOORBELLS + (2 * qid + 1) * stride);
+	q->sq_tail = 0;
+	q->cq_head = 0;
+	q->phase = 1;
+
+	q->slots = calloc(sizeof(struct nvme_slot), size - 1);
+	q->free = malloc(sizeof(uint16_t) * (size - 1));
+	for (int i = 0; i < size - 1; ++i) {
+		q->slots[i].waiter = list_create("nvme command waiter", q);
+		q->free[i] = size - 2 - i;
+	}
+	q->free_count = size - 1;
+	q->slot_waiter = list_create("nvme slot waiters", q);
+}
+
+/**
+ * Collect completions from @p q. Called with the queue locked.
+ * Returns how many were found.
+ */
+static int nvme_queue_reap(struct nvme_queue * q) {
+	int found = 0;
+	while ((q->cq[q->cq_head].status & 1) == q->phase) {
+		asm volatile ("" ::: "memory");
+		volatile struct nvme_cqe * cqe = &q->cq[q->cq_head];
+		struct nvme_slot * slot = &q->slots[cqe->cid];
+		slot->status = cqe->status >> 1;
+		slot->result = cqe->result;
+		slot->done = 1;
+		wakeup_queue(slot->waiter);
+
+		if (++q->cq_head == q->size) {
+			q->cq_head = 0;
+			q->phase ^= 1;
+		}
+		found++;
+	}
+	if (found) *q->cq_doorbell = q->cq_head;
+	return found;
+}
+
+static int nvme_irq_handler(struct regs * r) {
+	int irq = r->int_no - 32;
+	int handled = 0;
+
+	foreach(node, nvme_devices) {
+		struct nvme * dev = node->value;
+		if (dev->irq != irq) continue;
+
+		for (int i = -1; i < dev->num_queues; ++i) {
+			struct nvme_queue * q = i < 0 ? &dev->admin : &dev->queues[i];
+			spin_lock(q->lock);
+			handled += nvme_queue_reap(q);
+			spin_unlock(q->lock);
+		}
+	}
+
+	if (!handled) return 0;
+	irq_ack(irq);
+	return 1;
+}
+
+/**
+ * Fill in the data pointer of @p cmd for the buffers of @p data and
+ * everything merged into it, whose counts are in units of 1 << @p shift
+ * bytes. Up to two pages fit in the command itself; beyond that, PRP2
+ * points to the slot's PRP list. Only the first buffer may start part
+ * way into a page, and only the last may end part way into one.
+ */
+static int nvme_prp_map(struct nvme_queue * q, int cid, struct nvme_sqe * cmd, struct blk_request * data, unsigned int shift) {
+	if (!data) return 0;
+
+	uint64_t * list = (uint64_t *)((uintptr_t)q->prp_lists + cid * NVME_PAGE_SIZE);
+	int pages = 0;
+	int first = 1;
+
+	for (struct blk_request * piece = data; piece; piece = piece->merged) {
+		uintptr_t virt = (uintptr_t)piece->buffer;
+		size_t bytes = (size_t)piece->count << shift;
+		if (virt & 3) return -EFAULT;
+		if (!first && (virt & (NVME_PAGE_SIZE - 1))) return -EINVAL;
+		if (piece->merged && ((virt + bytes) & (NVME_PAGE_SIZE - 1))) return -EINVAL;
+
+		while (bytes) {
+			uintptr_t phys = mmu_map_to_physical(this_core->current_pml, virt);
+			if (phys >= (uintptr_t)-4) return -EFAULT;
+
+			size_t chunk = NVME_PAGE_SIZE - (virt & (NVME_PAGE_SIZE - 1));
+			if (chunk > bytes) chunk = bytes;
+
+			if (first) {
+				cmd->prp1 = phys;
+				first = 0;
+			} else {
+				if (pages == NVME_PAGE_SIZE / sizeof(uint64_t)) return -EINVAL;
+				list[pages++] = phys;
+			}
+
+			virt += chunk;
+			bytes -= chunk;
+		}
+	}
+
+	if (pages) cmd->prp2 = pages == 1 ? list[0] : q->prp_phys + cid * NVME_PAGE_SIZE;
+	return 0;
+}
+
+/**
+ * Submit @p cmd on @p q and wait for it to complete. If @p poll
+ * is set, spin on the completion queue instead of waiting for an
+ * interrupt; that is only used while setting up the controller.
+ */
+static int nvme_submit(struct nvme_queue * q, struct nvme_sqe * cmd, struct blk_request * data, unsigned int shift, uint32_t * result, int poll) {
+	spin_lock(q->lock);
+	while (!q->free_count) {
+		sleep_on_unlocking(q->slot_waiter, &q->lock);
+		spin_lock(q->lock);
+	}
+	int cid = q->free[--q->free_count];
+	spin_unlock(q->lock);
+
+	struct nvme_slot * slot = &q->slots[cid];
+	cmd->cdw0 = (cmd->cdw0 & 0xFFFF) | (cid << 16);
+	int error = nvme_prp_map(q, cid, cmd, data, shift);
+
+	spin_lock(q->lock);
+	if (error) goto _release;
+
+	slot->done = 0;
+	q->sq[q->sq_tail] = *cmd;
+	if (++q->sq_tail == q->size) q->sq_tail = 0;
+	asm volatile ("" ::: "memory");
+	*q->sq_doorbell = q->sq_tail;
+
+	while (!slot->done) {
+		if (poll) {
+			spin_unlock(q->lock);
+			delay_yield(1000);
+			spin_lock(q->lock);
+			nvme_queue_reap(q);
+		} else {
+			/* The command can't be taken back, so signals just mean going back to sleep. */
+			sleep_on_unlocking(slot->waiter, &q->lock);
+			spin_lock(q->lock);
+		}
+	}
+
+	if (slot->status) {
+		dprintf("nvme: queue %d: command %#x failed with status %#x\n", q->qid, cmd->cdw0 & 0xFF, slot->status);
+		error = -EIO;
+	} else if (result) {
+		*result = slot->result;
+	}
+
+_release:
+	q->free[q->free_count++] = cid;
+	wakeup_queue(q->slot_waiter);
+	spin_unlock(q->lock);
+	return error;
+}
+
+static int nvme_admin(struct nvme * dev, struct nvme_sqe * cmd, uint8_t * buf, size_t bytes, uint32_t * result) {
+	struct blk_request data = { .buffer = buf, .count = bytes };
+	return nvme_submit(&dev->admin, cmd, buf ? &data : NULL, 0, result, 1);
+}
+
+/**
+ * Run an I/O command for @p count blocks at @p lba, with the data in
+ * the buffers of @p data. Commands go on the queue for the CPU we
+ * are running on.
+ */
+static int nvme_ns_command(struct nvme_ns * ns, uint8_t opcode, uint64_t lba, unsigned int count, struct blk_request * data) {
+	struct nvme * dev = ns->dev;
+	struct nvme_queue * q = &dev->queues[this_core->cpu_id % dev->num_queues];
+
+	struct nvme_sqe cmd = {0};
+	cmd.cdw0 = opcode;
+	cmd.nsid = ns->nsid;
+	if (count) {
+		cmd.cdw10 = lba & 0xFFFFFFFF;
+		cmd.cdw11 = lba >> 32;
+		cmd.cdw12 = count - 1;
+	}
+
+	return nvme_submit(q, &cmd, data, ns->block_shift, NULL, 0);
+}
+
+/**
+ * Carry out a request from the block layer. Merged requests share
+ * one command if their buffers can share a PRP list.
+ */
+static int nvme_ns_transfer(struct blkdev * blk, struct blk_request * req) {
+	struct nvme_ns * ns = blk->driver;
+	uint8_t opcode = req->write ? NVME_CMD_WRITE : NVME_CMD_READ;
+
+	int error = nvme_ns_command(ns, opcode, req->sector, req->span, req);
+	if (error != -EINVAL || !req->merged) return error;
+
+	/* The buffers don't meet on page boundaries; send them separately */
+	for (struct blk_request * piece = req; piece; piece = piece->merged) {
+		struct blk_request one = { .buffer = piece->buffer, .count = piece->count };
+		error = nvme_ns_command(ns, opcode, piece->sector, piece->count, &one);
+		if (error) return error;
+	}
+	return 0;
+}
+
+static int nvme_ns_ioctl(struct blkdev * blk, unsigned long request, void * argp) {
+	switch (request) {
+		case IOCTLSYNC:
+			/* Writes are not cached here, but the controller may have a write cache */
+			return nvme_ns_command(blk->driver, NVME_CMD_FLUSH, 0, 0, NULL);
+
+		default:
+			return -EINVAL;
+	}
+}
+
+/**
+ * Ask for one I/O queue pair per CPU and create as many as the
+ * controller agrees to. Each completion queue gets the MSI-X
+ * table entry matching its queue ID.
+ */
+static int nvme_create_io_queues(struct nvme * dev) {
+	int wanted = processor_count;
+	if (wanted > NVME_MAX_QUEUES) wanted = NVME_MAX_QUEUES;
+
+	struct nvme_sqe cmd = {0};
+	uint32_t result;
+	cmd.cdw0 = NVME_ADMIN_SET_FEATURES;
+	cmd.cdw10 = NVME_FEATURE_QUEUES;
+	cmd.cdw11 = ((wanted - 1) << 16) | (wanted - 1);
+	if (nvme_admin(dev, &cmd, NULL, 0, &result)) return -EIO;
+
+	int granted = (result & 0xFFFF) + 1;
+	if ((int)(result >> 16) + 1 < granted) granted = (result >> 16) + 1;
+	if (granted < wanted) wanted = granted;
+
+	uint16_t depth = NVME_CAP_MQES(dev->cap) < NVME_IO_DEPTH ? NVME_CAP_MQES(dev->cap) : NVME_IO_DEPTH;
+
+	for (int i = 0; i < wanted; ++i) {
+		struct nvme_queue * q = &dev->queues[i];
+		int qid = i + 1;
+		nvme_queue_init(dev, q, qid, depth);
+
+		memset(&cmd, 0, sizeof(cmd));
+		cmd.cdw0 = NVME_ADMIN_CREATE_CQ;
+		cmd.prp1 = q->cq_phys;
+		cmd.cdw10 = ((depth - 1) << 16) | qid;
+		cmd.cdw11 = ((qid < dev->vectors ? qid : 0) << 16) | (1 << 1) | (1 << 0); /* vector, interrupts enabled, contiguous */
+		if (nvme_admin(dev, &cmd, NULL, 0, NULL)) break;
+
+		memset(&cmd, 0, sizeof(cmd));
+		cmd.cdw0 = NVME_ADMIN_CREATE_SQ;
+		cmd.prp1 = q->sq_phys;
+		cmd.cdw10 = ((depth - 1) << 16) | qid;
+		cmd.cdw11 = (qid << 16) | (1 << 0); /* completion queue, contiguous */
+		if (nvme_admin(dev, &cmd, NULL, 0, NULL)) break;
+
+		dev->num_queues = i + 1;
+	}
+
+	return dev->num_queues ? 0 : -EIO;
+}
+
+static void nvme_probe_namespaces(fs_node_t * stderr, struct nvme * dev, uint32_t count) {
+	uintptr_t identify_phys;
+	uint8_t * identify = kvmalloc_p(NVME_PAGE_SIZE, &identify_phys);
+
+	if (count > NVME_MAX_NAMESPACES) count = NVME_MAX_NAMESPACES;
+	for (uint32_t nsid = 1; nsid <= count; ++nsid) {
+		struct nvme_sqe cmd = {0};
+		cmd.cdw0 = NVME_ADMIN_IDENTIFY;
+		cmd.nsid = nsid;
+		cmd.cdw10 = 0; /* namespace */
+		memset(identify, 0, NVME_PAGE_SIZE);
+		if (nvme_admin(dev, &cmd, identify, NVME_PAGE_SIZE, NULL)) continue;
+
+		uint64_t blocks = *(uint64_t *)&identify[0];
+		if (!blocks) continue;
+
+		int format = identify[26] & 0xF;
+		unsigned int shift = identify[128 + format * 4 + 2];
+		if (shift < 9 || shift > 12) {
+			fprintf(stderr, "nvme%d: namespace %u has unsupported block size 2^%u\n", dev->index, nsid, shift);
+			continue;
+		}
+
+		struct nvme_ns * ns = calloc(sizeof(struct nvme_ns), 1);
+		ns->dev = dev;
+		ns->nsid = nsid;
+		ns->blocks = blocks;
+		ns->block_shift = shift;
+
+		char name[20];
+		snprintf(name, 20, "nvme%dn%u", dev->index, nsid);
+		struct blkdev * blk = blkdev_create(name, 1U << shift, blocks);
+		blk->driver = ns;
+		blk->transfer = nvme_ns_transfer;
+		blk->ioctl = nvme_ns_ioctl;
+		/* A buffer that doesn't start on a page boundary touches one more page */
+		blk->max_sectors = ((dev->max_pages - 1) * NVME_PAGE_SIZE) >> shift;
+		blk->depth = dev->num_queues * (dev->queues[0].size - 1);
+		blk->align = 3;
+
+		char devname[30];
+		snprintf(devname, 30, "/dev/%s", name);
+		vfs_mount(devname, blkdev_register(blk));
+		fprintf(stderr, "nvme%d: %s: %lu blocks of %u bytes\n", dev->index, devname, blocks, 1U << shift);
+	}
+}
+
+static void find_nvme(uint32_t device, uint16_t vendorid, uint16_t deviceid, void * extra) {
+	if (pci_find_type(device) != 0x0108) return; /* Mass Storage, non-volatile memory controller */
+	if (pci_read_field(device, PCI_PROG_IF, 1) != 0x02) return; /* NVM Express */
+	fs_node_t * stderr = extra;
+
+	uint16_t command_reg = pci_read_field(device, PCI_COMMAND, 2);
+	command_reg |= (1 << 2) | (1 << 1);
+	command_reg &= ~PCI_COMMAND_INTX_DISABLE;
+	pci_write_field(device, PCI_COMMAND, 2, command_reg);
+
+	uint64_t bar = pci_read_field(device, PCI_BAR0, 4);
+	if ((bar & 0x6) == 0x4) bar |= (uint64_t)pci_read_field(device, PCI_BAR1, 4) << 32;
+	bar &= ~0xFUL;
+
+	struct nvme * dev = calloc(sizeof(struct nvme), 1);
+	dev->pcidev = device;
+	dev->index = nvme_count;
+	dev->irq = pci_get_interrupt(device);
+	dev->mmio = (uintptr_t)mmu_map_mmio_region(bar, 0x2000);
+	dev->cap = mmio_read8(dev->mmio, NVME_CAP);
+
+	uint32_t version = mmio_read4(dev->mmio, NVME_VS);
+	fprintf(stderr, "nvme%d: version %d.%d, up to %d entries per queue, irq %d\n", dev->index,
+		version >> 16, (version >> 8) & 0xFF, (int)NVME_CAP_MQES(dev->cap), dev->irq);
+
+	if (dev->irq >= 16) {
+		fprintf(stderr, "nvme%d: no usable interrupt line\n", dev->index);
+		free(dev);
+		return;
+	}
+
+	/* Reset, then bring up the admin queue */
+	mmio_write4(dev->mmio, NVME_CC, mmio_read4(dev->mmio, NVME_CC) & ~NVME_CC_EN);
+	if (nvme_wait_ready(dev, 0)) {
+		fprintf(stderr, "nvme%d: controller did not reset\n", dev->index);
+		free(dev);
+		return;
+	}
+
+	uint16_t admin_depth = NVME_CAP_MQES(dev->cap) < NVME_ADMIN_DEPTH ? NVME_CAP_MQES(dev->cap) : NVME_ADMIN_DEPTH;
+	nvme_queue_init(dev, &dev->admin, 0, admin_depth);
+	mmio_write4(dev->mmio, NVME_AQA, ((admin_depth - 1) << 16) | (admin_depth - 1));
+	mmio_write8(dev->mmio, NVME_ASQ, dev->admin.sq_phys);
+	mmio_write8(dev->mmio, NVME_ACQ, dev->admin.cq_phys);
+	mmio_write4(dev->mmio, NVME_CC, NVME_CC_EN | NVME_CC_IOSQES | NVME_CC_IOCQES);
+
+	if (nvme_wait_ready(dev, 1)) {
+		fprintf(stderr, "nvme%d: controller did not become ready\n", dev->index);
+		return;
+	}
+
+	uintptr_t identify_phys;
+	uint8_t * identify = kvmalloc_p(NVME_PAGE_SIZE, &identify_phys);
+	struct nvme_sqe cmd = {0};
+	cmd.cdw0 = NVME_ADMIN_IDENTIFY;
+	cmd.cdw10 = 1; /* controller */
+	if (nvme_admin(dev, &cmd, identify, NVME_PAGE_SIZE, NULL)) {
+		fprintf(stderr, "nvme%d: IDENTIFY failed\n", dev->index);
+		return;
+	}
+
+	char model[41];
+	memcpy(model, &identify[24], 40);
+	model[40] = '\0';
+	for (int i = 39; i >= 0 && model[i] == ' '; --i) model[i] = '\0';
+
+	/* MDTS is a power of two in units of the minimum page size, which we use */
+	dev->max_pages = NVME_MAX_PAGES;
+	if (identify[77] && identify[77] < 8 && (1U << identify[77]) < dev->max_pages) dev->max_pages = 1U << identify[77];
+	if (dev->max_pages < 2) dev->max_pages = 2;
+	uint32_t namespaces = *(uint32_t *)&identify[516];
+
+	/* Interrupts are set up before the I/O queues, which need to know their vectors */
+	uint64_t msi_address;
+	uint32_t msi_data;
+	const char * how = "legacy interrupt";
+	dev->vectors = 1;
+	if (!msi_message(dev->irq, &msi_address, &msi_data)) {
+		int vectors = pci_enable_msix(device, NVME_MAX_QUEUES + 1, msi_address, msi_data);
+		if (vectors <= 0) pci_enable_msi(device, msi_address, msi_data);
+
+		/* Only believe it if the device says so; otherwise we'd wait forever for completions */
+		switch (pci_msi_active(device)) {
+			case PCI_CAP_MSIX:
+				if (vectors > 0) {
+					dev->vectors = vectors;
+					how = "MSI-X";
+				}
+				break;
+			case PCI_CAP_MSI:
+				how = "MSI";
+				break;
+		}
+	}
+
+	list_insert(nvme_devices, dev);
+	if (!(nvme_irqs_installed & (1 << dev->irq))) {
+		nvme_irqs_installed |= (1 << dev->irq);
+		irq_install_handler(dev->irq, nvme_irq_handler, "nvme");
+	}
+
+	if (nvme_create_io_queues(dev)) {
+		fprintf(stderr, "nvme%d: could not create I/O queues\n", dev->index);
+		return;
+	}
+
+	fprintf(stderr, "nvme%d: %s, %d I/O queue%s of %d, %u KiB per command, %s\n", dev->index, model,
+		dev->num_queues, dev->num_queues == 1 ? "" : "s", dev->queues[0].size,
+		dev->max_pages * NVME_PAGE_SIZE / 1024, how);
+
+	nvme_count++;
+	nvme_probe_namespaces(stderr, dev, namespaces);
+}
+
+static int init(int argc, char * argv[]) {
+	fs_node_t * node = FD_ENTRY(1); /* Get the stdout for the process that loaded the module */
+	nvme_devices = list_create("nvme controllers", NULL);
+	pci_scan(find_nvme, -1, node);
+	return 0;
+}
+
+static int fini(void) {
+	return 0;
+}
+
+struct Module metadata = {
+	.name = "nvme",
+	.init = init,
+	.fini = fini,
+};
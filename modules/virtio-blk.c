@@ -0,0 +1,621 @@
+/**
+ * @brief virtio-blk PCI Block Device Driver
+ * @file modules/virtio-blk.c
+ * @package x86_64
+ *
+ * Paravirtualized disks, as provided by QEMU and other hypervisors.
+ * Each request is one indirect descriptor in a split virtqueue,
+ * pointing at a table with the request header, the data and the
+ * status byte, so a queue of N descriptors can have N requests in
+ * flight regardless of how scattered their buffers are.
+ *
+ * Devices offering several queues get one per CPU (up to what the
+ * device has), and requests go to the queue for the CPU that made
+ * them. Requests come from the block layer, and ones it has merged
+ * go to the device as one. With event indices, the device is only notified when it
+ * has said it is waiting for more work.
+ *
+ * Only the virtio 1.0 ("modern") PCI transport is supported.
+ *
+ * @copyright
+ * This file is part of ToaruOS and is released under the terms
+ * of the NCSA / University of Illinois License - see LICENSE.md
+ * Copyright (C) 2021 K. Lange
+ */
+#include <errno.h>
+#include <kernel/types.h>
+#include <kernel/string.h>
+#include <kernel/syscall.h>
+#include <kernel/module.h>
+#include <kernel/printf.h>
+#include <kernel/process.h>
+#include <kernel/spinlock.h>
+#include <kernel/pci.h>
+#include <kernel/vfs.h>
+#include <kernel/mmu.h>
+#include <kernel/list.h>
+#include <kernel/blkdev.h>
+#include <kernel/virtio.h>
+
+#include <kernel/arch/x86_64/irq.h>
+
+#include <sys/ioctl.h>
+
+#define VIRTIO_BLK_F_SIZE_MAX  1
+#define VIRTIO_BLK_F_SEG_MAX   2
+#define VIRTIO_BLK_F_RO        5
+#define VIRTIO_BLK_F_FLUSH     9
+#define VIRTIO_BLK_F_MQ        12
+
+#define VIRTIO_BLK_T_IN        0
+#define VIRTIO_BLK_T_OUT       1
+#define VIRTIO_BLK_T_FLUSH     4
+
+#define VIRTIO_BLK_S_OK        0
+
+#define VIRTIO_BLK_SECTOR_SIZE 512
+#define VIRTIO_BLK_MAX_SECTORS 256  /* 128KiB per request */
+#define VIRTIO_BLK_QUEUE_MAX   256
+#define VIRTIO_BLK_INDIRECT    48   /* descriptors per indirect table */
+#define VIRTIO_BLK_MAX_QUEUES  32
+
+struct virtio_blk_config {
+	uint64_t capacity;
+	uint32_t size_max;
+	uint32_t seg_max;
+	uint8_t  geometry[4];
+	uint32_t blk_size;
+	uint8_t  topology[8];
+	uint8_t  writeback;
+	uint8_t  unused0;
+	uint16_t num_queues;
+} __attribute__((packed));
+
+struct virtio_blk_req_header {
+	uint32_t type;
+	uint32_t reserved;
+	uint64_t sector;
+};
+
+/**
+ * Everything a request needs the device to see, other than the
+ * data itself, lives in one of these. There is one per descriptor,
+ * so the descriptor ID of a request also names its slot.
+ */
+struct virtio_blk_slot {
+	struct virtio_blk_req_header header;
+	volatile uint8_t status;
+	uint8_t pad[15]; /* descriptor tables are 16-byte aligned */
+	struct virtq_desc table[VIRTIO_BLK_INDIRECT];
+};
+
+struct virtio_blk_waiter {
+	list_t * queue;
+	volatile int done;
+};
+
+struct virtio_blk_queue {
+	struct virtio_blk * dev;
+	int index;
+	uint16_t size;
+	spin_lock_t lock;
+
+	struct virtq_desc * desc;
+	struct virtq_avail * avail;
+	struct virtq_used * used;
+	volatile uint16_t * notify;
+
+	struct virtio_blk_slot * slots;
+	uintptr_t slots_phys;
+	struct virtio_blk_waiter * waiters;
+
+	uint16_t free_head;
+	uint16_t num_free;
+	uint16_t last_used;
+	list_t * desc_waiter;
+};
+
+struct virtio_blk {
+	uint32_t pcidev;
+	int irq;
+	struct virtio_common_cfg * common;
+	volatile uint8_t * isr;
+	volatile struct virtio_blk_config * config;
+	uintptr_t notify_base;
+	uint32_t notify_mult;
+
+	uint64_t features;
+	uint64_t sectors;
+	unsigned int max_segments;
+
+	int num_queues;
+	struct virtio_blk_queue queues[VIRTIO_BLK_MAX_QUEUES];
+};
+
+static list_t * virtio_blk_devices = NULL;
+static uint16_t virtio_blk_irqs_installed = 0;
+static char virtio_blk_drive_char = 'a';
+
+static void * kvmalloc_p(size_t size, uintptr_t * outphys) {
+	uintptr_t index = mmu_allocate_n_frames((size + 0xFFF) / 0x1000) << 12;
+	*outphys = index;
+	void * out = mmu_map_from_physical(index);
+	memset(out, 0, size);
+	return out;
+}
+
+static int has_feature(struct virtio_blk * dev, int feature) {
+	return !!(dev->features & (1UL << feature));
+}
+
+static uint16_t * used_event(struct virtio_blk_queue * q) {
+	return (uint16_t *)&q->avail->ring[q->size];
+}
+
+static uint16_t * avail_event(struct virtio_blk_queue * q) {
+	return (uint16_t *)&q->used->ring[q->size];
+}
+
+/**
+ * Find one of the regions described by the device's vendor
+ * capabilities and map it.
+ */
+static void * virtio_map_cap(uint32_t device, int type, int * capoff) {
+	int offset = pci_read_field(device, PCI_CAPABILITIES, 1) & 0xFC;
+	for (int limit = 48; offset && limit; --limit) {
+		if (pci_read_field(device, offset, 1) == 0x09 &&
+		    (int)pci_read_field(device, offset + 3, 1) == type) {
+			int bar = pci_read_field(device, offset + VIRTIO_PCI_CAP_BAR, 1);
+			uint32_t off = pci_read_field(device, offset + VIRTIO_PCI_CAP_OFFSET, 4);
+			uint32_t len = pci_read_field(device, offset + VIRTIO_PCI_CAP_LENGTH, 4);
+
+			uint64_t base = pci_read_field(device, PCI_BAR0 + bar * 4, 4);
+			if (base & 1) return NULL; /* I/O BARs are for the legacy interface */
+			if ((base & 0x6) == 0x4) base |= (uint64_t)pci_read_field(device, PCI_BAR0 + bar * 4 + 4, 4) << 32;
+			base &= ~0xFUL;
+
+			uint64_t phys = base + off;
+			uint64_t page = phys & ~0xFFFUL;
+			size_t size = ((phys + len + 0xFFF) & ~0xFFFUL) - page;
+			if (capoff) *capoff = offset;
+			return (char *)mmu_map_mmio_region(page, size) + (phys - page);
+		}
+		offset = pci_read_field(device, offset + 1, 1) & 0xFC;
+	}
+	return NULL;
+}
+
+/**
+ * Collect whatever the device has finished on @p q. Called with
+ * the queue locked.
+ */
+static void virtio_blk_queue_reap(struct virtio_blk_queue * q) {
+	while (1) {
+		while (q->last_used != q->used->idx) {
+			asm volatile ("" ::: "memory");
+			uint16_t id = q->used->ring[q->last_used % q->size].id;
+
+			/* Put the chain back on the free list */
+			uint16_t tail = id;
+			uint16_t count = 1;
+			while (q->desc[tail].flags & VIRTQ_DESC_F_NEXT) {
+				tail = q->desc[tail].next;
+				count++;
+			}
+			q->desc[tail].next = q->free_head;
+			q->free_head = id;
+			q->num_free += count;
+
+			q->waiters[id].done = 1;
+			wakeup_queue(q->waiters[id].queue);
+			q->last_used++;
+		}
+
+		if (!has_feature(q->dev, VIRTIO_F_RING_EVENT_IDX)) break;
+
+		/* Interrupt us for the next one that finishes */
+		*used_event(q) = q->last_used;
+		asm volatile ("mfence" ::: "memory");
+
+		/* Anything that finished before the device could see that won't interrupt us */
+		if (q->used->idx == q->last_used) break;
+	}
+
+	wakeup_queue(q->desc_waiter);
+}
+
+static int virtio_blk_irq_handler(struct regs * r) {
+	int irq = r->int_no - 32;
+	int handled = 0;
+
+	foreach(node, virtio_blk_devices) {
+		struct virtio_blk * dev = node->value;
+		if (dev->irq != irq) continue;
+
+		/* Reading the ISR acknowledges it */
+		uint8_t isr = *dev->isr;
+		if (!(isr & 1)) continue;
+
+		for (int i = 0; i < dev->num_queues; ++i) {
+			struct virtio_blk_queue * q = &dev->queues[i];
+			spin_lock(q->lock);
+			virtio_blk_queue_reap(q);
+			spin_unlock(q->lock);
+		}
+		handled = 1;
+	}
+
+	if (!handled) return 0;
+	irq_ack(irq);
+	return 1;
+}
+
+/**
+ * Describe @p buf in @p table starting at entry @p first, merging
+ * physically adjacent pages. Returns the number of entries used,
+ * or 0 if it didn't fit.
+ */
+static int virtio_blk_map(struct virtio_blk * dev, struct virtq_desc * table, int first, int max, uint8_t * buf, size_t bytes, uint16_t flags) {
+	int entries = first;
+	while (bytes) {
+		uintptr_t virt = (uintptr_t)buf;
+		uintptr_t phys = mmu_map_to_physical(this_core->current_pml, virt);
+		if (phys >= (uintptr_t)-4) return 0;
+
+		size_t chunk = 0x1000 - (virt & 0xFFF);
+		if (chunk > bytes) chunk = bytes;
+
+		if (entries > first && table[entries-1].addr + table[entries-1].len == phys) {
+			table[entries-1].len += chunk;
+		} else {
+			if (entries == max) return 0;
+			table[entries].addr = phys;
+			table[entries].len = chunk;
+			table[entries].flags = flags;
+			entries++;
+		}
+
+		buf += chunk;
+		bytes -= chunk;
+	}
+	return entries - first;
+}
+
+/**
+ * Put a descriptor chain on the available ring and tell the device,
+ * if it wants to be told. Called with the queue locked.
+ */
+static void virtio_blk_queue_kick(struct virtio_blk_queue * q, uint16_t head) {
+	uint16_t old = q->avail->idx;
+	q->avail->ring[old % q->size] = head;
+	asm volatile ("" ::: "memory");
+	q->avail->idx = old + 1;
+	asm volatile ("mfence" ::: "memory");
+
+	int notify;
+	if (has_feature(q->dev, VIRTIO_F_RING_EVENT_IDX)) {
+		notify = virtq_need_event(*avail_event(q), old + 1, old);
+	} else {
+		notify = !(q->used->flags & VIRTQ_USED_F_NO_NOTIFY);
+	}
+
+	if (notify) *q->notify = q->index;
+}
+
+/**
+ * Take @p count descriptors off the free list, waiting for them if
+ * need be, and return the head. Called with the queue locked.
+ */
+static uint16_t virtio_blk_queue_alloc(struct virtio_blk_queue * q, int count) {
+	while (q->num_free < count) {
+		sleep_on_unlocking(q->desc_waiter, &q->lock);
+		spin_lock(q->lock);
+	}
+	uint16_t head = q->free_head;
+	uint16_t tail = head;
+	for (int i = 1; i < count; ++i) tail = q->desc[tail].next;
+	q->free_head = q->desc[tail].next;
+	q->num_free -= count;
+	return head;
+}
+
+/**
+ * Run one request, with the data described by the @p segments entries
+ * of @p scratch, and wait for it. Requests are placed on the queue of
+ * the CPU that made them.
+ */
+static int virtio_blk_request(struct virtio_blk * dev, uint32_t type, uint64_t sector, struct virtq_desc * scratch, int segments) {
+	struct virtio_blk_queue * q = &dev->queues[this_core->cpu_id % dev->num_queues];
+	int indirect = has_feature(dev, VIRTIO_F_RING_INDIRECT_DESC);
+
+	spin_lock(q->lock);
+	uint16_t head = virtio_blk_queue_alloc(q, indirect ? 1 : segments + 2);
+	struct virtio_blk_slot * slot = &q->slots[head];
+	uintptr_t slot_phys = q->slots_phys + head * sizeof(struct virtio_blk_slot);
+
+	slot->header.type = type;
+	slot->header.reserved = 0;
+	slot->header.sector = sector;
+	slot->status = 0xFF;
+
+	struct virtq_desc header = {
+		slot_phys + offsetof(struct virtio_blk_slot, header),
+		sizeof(struct virtio_blk_req_header), VIRTQ_DESC_F_NEXT, 0 };
+	struct virtq_desc status = {
+		slot_phys + offsetof(struct virtio_blk_slot, status),
+		1, VIRTQ_DESC_F_WRITE, 0 };
+
+	if (indirect) {
+		slot->table[0] = header;
+		slot->table[0].next = 1;
+		for (int i = 0; i < segments; ++i) {
+			slot->table[i+1] = scratch[i];
+			slot->table[i+1].flags |= VIRTQ_DESC_F_NEXT;
+			slot->table[i+1].next = i + 2;
+		}
+		slot->table[segments+1] = status;
+
+		q->desc[head].addr = slot_phys + offsetof(struct virtio_blk_slot, table);
+		q->desc[head].len = (segments + 2) * sizeof(struct virtq_desc);
+		q->desc[head].flags = VIRTQ_DESC_F_INDIRECT;
+	} else {
+		uint16_t d = head;
+		uint16_t next = q->desc[d].next;
+		q->desc[d] = header;
+		q->desc[d].next = next;
+		for (int i = 0; i < segments; ++i) {
+			d = next;
+			next = q->desc[d].next;
+			q->desc[d] = scratch[i];
+			q->desc[d].flags |= VIRTQ_DESC_F_NEXT;
+			q->desc[d].next = next;
+		}
+		d = next;
+		q->desc[d] = status;
+	}
+
+	q->waiters[head].done = 0;
+	virtio_blk_queue_kick(q, head);
+
+	while (!q->waiters[head].done) {
+		/* The request can't be taken back, so signals just mean going back to sleep. */
+		sleep_on_unlocking(q->waiters[head].queue, &q->lock);
+		spin_lock(q->lock);
+	}
+	uint8_t result = slot->status;
+	spin_unlock(q->lock);
+
+	return result == VIRTIO_BLK_S_OK ? 0 : -EIO;
+}
+
+/**
+ * Carry out a request from the block layer, along with everything
+ * merged into it. The pieces are laid out in a scratch table, which
+ * is used in place if indirect; if together they are too scattered
+ * for one request, they are sent one at a time.
+ */
+static int virtio_blk_transfer(struct blkdev * blk, struct blk_request * req) {
+	struct virtio_blk * dev = blk->driver;
+	if (req->write && has_feature(dev, VIRTIO_BLK_F_RO)) return -EROFS;
+
+	uint32_t type = req->write ? VIRTIO_BLK_T_OUT : VIRTIO_BLK_T_IN;
+	uint16_t data_flags = req->write ? 0 : VIRTQ_DESC_F_WRITE;
+	struct virtq_desc scratch[VIRTIO_BLK_INDIRECT];
+
+	int segments = 0;
+	for (struct blk_request * piece = req; piece; piece = piece->merged) {
+		int used = virtio_blk_map(dev, scratch, segments, dev->max_segments,
+			piece->buffer, piece->count * VIRTIO_BLK_SECTOR_SIZE, data_flags);
+		if (!used) {
+			segments = 0;
+			break;
+		}
+		segments += used;
+	}
+	if (segments) return virtio_blk_request(dev, type, req->sector, scratch, segments);
+
+	for (struct blk_request * piece = req; piece; piece = piece->merged) {
+		segments = virtio_blk_map(dev, scratch, 0, dev->max_segments,
+			piece->buffer, piece->count * VIRTIO_BLK_SECTOR_SIZE, data_flags);
+		if (!segments) return -EFAULT;
+		int error = virtio_blk_request(dev, type, piece->sector, scratch, segments);
+		if (error) return error;
+	}
+	return 0;
+}
+
+static int virtio_blk_ioctl(struct blkdev * blk, unsigned long request, void * argp) {
+	struct virtio_blk * dev = blk->driver;
+	switch (request) {
+		case IOCTLSYNC:
+			/* Writes are not cached here, but the host may have a write cache */
+			if (!has_feature(dev, VIRTIO_BLK_F_FLUSH)) return 0;
+			return virtio_blk_request(dev, VIRTIO_BLK_T_FLUSH, 0, NULL, 0);
+
+		default:
+			return -EINVAL;
+	}
+}
+
+static int virtio_blk_queue_init(struct virtio_blk * dev, int index) {
+	struct virtio_blk_queue * q = &dev->queues[index];
+	struct virtio_common_cfg * common = dev->common;
+
+	common->queue_select = index;
+	uint16_t size = common->queue_size;
+	if (!size) return -ENODEV;
+	if (size > VIRTIO_BLK_QUEUE_MAX) size = VIRTIO_BLK_QUEUE_MAX;
+	common->queue_size = size;
+
+	q->dev = dev;
+	q->index = index;
+	q->size = size;
+	spin_init(q->lock);
+	q->desc_waiter = list_create("virtio-blk descriptor waiters", q);
+
+	uintptr_t desc_phys, avail_phys, used_phys;
+	q->desc = kvmalloc_p(size * sizeof(struct virtq_desc), &desc_phys);
+	q->avail = kvmalloc_p(sizeof(struct virtq_avail) + (size + 1) * sizeof(uint16_t), &avail_phys);
+	q->used = kvmalloc_p(sizeof(struct virtq_used) + size * sizeof(struct virtq_used_elem) + sizeof(uint16_t), &used_phys);
+	q->slots = kvmalloc_p(size * sizeof(struct virtio_blk_slot), &q->slots_phys);
+	q->waiters = calloc(sizeof(struct virtio_blk_waiter), size);
+
+	for (int i = 0; i < size; ++i) {
+		q->desc[i].next = (i + 1) % size;
+		q->waiters[i].queue = list_create("virtio-blk request waiter", q);
+	}
+	q->free_head = 0;
+	q->num_free = size;
+	q->last_used = 0;
+
+	q->notify = (volatile uint16_t *)(dev->notify_base + common->queue_notify_off * dev->notify_mult);
+
+	common->queue_desc = desc_phys;
+	common->queue_avail = avail_phys;
+	common->queue_used = used_phys;
+	common->queue_enable = 1;
+	return 0;
+}
+
+static void find_virtio_blk(uint32_t device, uint16_t vendorid, uint16_t deviceid, void * extra) {
+	/* Transitional (0x1001) and modern (0x1042) block devices */
+	if (vendorid != 0x1AF4 || (deviceid != 0x1001 && deviceid != 0x1042)) return;
+	fs_node_t * stderr = extra;
+
+	uint16_t command_reg = pci_read_field(device, PCI_COMMAND, 2);
+	command_reg |= (1 << 2) | (1 << 1);
+	command_reg &= ~PCI_COMMAND_INTX_DISABLE;
+	pci_write_field(device, PCI_COMMAND, 2, command_reg);
+
+	struct virtio_blk * dev = calloc(sizeof(struct virtio_blk), 1);
+	dev->pcidev = device;
+	dev->irq = pci_get_interrupt(device);
+
+	int notify_cap = 0;
+	dev->common = virtio_map_cap(device, VIRTIO_PCI_CAP_COMMON_CFG, NULL);
+	dev->isr = virtio_map_cap(device, VIRTIO_PCI_CAP_ISR_CFG, NULL);
+	dev->config = virtio_map_cap(device, VIRTIO_PCI_CAP_DEVICE_CFG, NULL);
+	dev->notify_base = (uintptr_t)virtio_map_cap(device, VIRTIO_PCI_CAP_NOTIFY_CFG, &notify_cap);
+
+	if (!dev->common || !dev->isr || !dev->config || !dev->notify_base) {
+		fprintf(stderr, "virtio-blk: %#x has no modern interface\n", device);
+		free(dev);
+		return;
+	}
+	if (dev->irq >= 16) {
+		fprintf(stderr, "virtio-blk: %#x has no usable interrupt line (%d)\n", device, dev->irq);
+		free(dev);
+		return;
+	}
+	dev->notify_mult = pci_read_field(device, notify_cap + VIRTIO_PCI_CAP_NOTIFY_MULT, 4);
+
+	struct virtio_common_cfg * common = dev->common;
+	common->device_status = 0;
+	while (common->device_status) asm volatile ("pause");
+	common->device_status = VIRTIO_STATUS_ACKNOWLEDGE;
+	common->device_status |= VIRTIO_STATUS_DRIVER;
+
+	common->dev_feature_select = 0;
+	uint64_t offered = common->dev_feature;
+	common->dev_feature_select = 1;
+	offered |= (uint64_t)common->dev_feature << 32;
+
+	uint64_t wanted = (1UL << VIRTIO_F_VERSION_1) | (1UL << VIRTIO_F_RING_INDIRECT_DESC) |
+		(1UL << VIRTIO_F_RING_EVENT_IDX) | (1UL << VIRTIO_BLK_F_SEG_MAX) |
+		(1UL << VIRTIO_BLK_F_RO) | (1UL << VIRTIO_BLK_F_FLUSH) | (1UL << VIRTIO_BLK_F_MQ);
+	dev->features = offered & wanted;
+
+	if (!has_feature(dev, VIRTIO_F_VERSION_1)) {
+		fprintf(stderr, "virtio-blk: %#x is a legacy-only device\n", device);
+		common->device_status |= VIRTIO_STATUS_FAILED;
+		free(dev);
+		return;
+	}
+
+	common->guest_feature_select = 0;
+	common->guest_feature = dev->features & 0xFFFFFFFF;
+	common->guest_feature_select = 1;
+	common->guest_feature = dev->features >> 32;
+	common->device_status |= VIRTIO_STATUS_FEATURES_OK;
+	if (!(common->device_status & VIRTIO_STATUS_FEATURES_OK)) {
+		fprintf(stderr, "virtio-blk: %#x did not accept our features\n", device);
+		common->device_status |= VIRTIO_STATUS_FAILED;
+		free(dev);
+		return;
+	}
+
+	dev->sectors = dev->config->capacity;
+
+	/* Two descriptors are always needed for the header and status */
+	dev->max_segments = VIRTIO_BLK_INDIRECT - 2;
+	if (has_feature(dev, VIRTIO_BLK_F_SEG_MAX) && dev->config->seg_max && dev->config->seg_max < dev->max_segments) {
+		dev->max_segments = dev->config->seg_max;
+	}
+
+	int queues = has_feature(dev, VIRTIO_BLK_F_MQ) ? dev->config->num_queues : 1;
+	if (queues > processor_count) queues = processor_count;
+	if (queues > VIRTIO_BLK_MAX_QUEUES) queues = VIRTIO_BLK_MAX_QUEUES;
+	if (queues < 1) queues = 1;
+
+	for (int i = 0; i < queues; ++i) {
+		if (virtio_blk_queue_init(dev, i)) break;
+		dev->num_queues = i + 1;
+	}
+
+	if (!dev->num_queues) {
+		fprintf(stderr, "virtio-blk: %#x has no usable queues\n", device);
+		common->device_status |= VIRTIO_STATUS_FAILED;
+		return;
+	}
+
+	/* Without indirect descriptors, a request also has to fit in the ring */
+	if (!has_feature(dev, VIRTIO_F_RING_INDIRECT_DESC) && dev->max_segments > dev->queues[0].size - 2u) {
+		dev->max_segments = dev->queues[0].size - 2;
+	}
+
+	list_insert(virtio_blk_devices, dev);
+	if (!(virtio_blk_irqs_installed & (1 << dev->irq))) {
+		virtio_blk_irqs_installed |= (1 << dev->irq);
+		irq_install_handler(dev->irq, virtio_blk_irq_handler, "virtio-blk");
+	}
+
+	common->device_status |= VIRTIO_STATUS_DRIVER_OK;
+
+	char devname[20];
+	snprintf(devname, 20, "vd%c", virtio_blk_drive_char);
+	struct blkdev * blk = blkdev_create(devname, VIRTIO_BLK_SECTOR_SIZE, dev->sectors);
+	blk->driver = dev;
+	blk->transfer = virtio_blk_transfer;
+	blk->ioctl = virtio_blk_ioctl;
+	blk->max_sectors = VIRTIO_BLK_MAX_SECTORS;
+	blk->depth = dev->num_queues * dev->queues[0].size;
+	fs_node_t * fnode = blkdev_register(blk);
+	if (has_feature(dev, VIRTIO_BLK_F_RO)) fnode->mask = 0440;
+
+	snprintf(devname, 20, "/dev/vd%c", virtio_blk_drive_char);
+	vfs_mount(devname, fnode);
+	virtio_blk_drive_char++;
+
+	fprintf(stderr, "virtio-blk: %s: %lu sectors, %d queue%s, %u segments%s%s%s\n", devname,
+		dev->sectors, dev->num_queues, dev->num_queues == 1 ? "" : "s", dev->max_segments,
+		has_feature(dev, VIRTIO_F_RING_INDIRECT_DESC) ? ", indirect" : "",
+		has_feature(dev, VIRTIO_F_RING_EVENT_IDX) ? ", event index" : "",
+		has_feature(dev, VIRTIO_BLK_F_RO) ? ", read-only" : "");
+}
+
+static int init(int argc, char * argv[]) {
+	fs_node_t * node = FD_ENTRY(1); /* Get the stdout for the process that loaded the module */
+	virtio_blk_devices = list_create("virtio-blk devices", NULL);
+	pci_scan(find_virtio_blk, -1, node);
+	return 0;
+}
+
+static int fini(void) {
+	return 0;
+}
+
+struct Module metadata = {
+	.name = "virtio-blk",
+	.init = init,
+	.fini = fini,
+};